@@ -0,0 +1,2017 @@
+// Null Direct3D 11 device
+// A headless stand-in for ID3D11Device, its immediate ID3D11DeviceContext1 and an
+// IDXGISwapChain, so the CPU side of a frame can run and be profiled without a GPU.
+// Nothing is drawn. Resources are their descriptions plus, for buffers the CPU writes
+// through Map and for constant buffers, their bytes. The context keeps its bindings (holding references, as D3D
+// does) and checks every call the way the debug layer would: bind flags, usages, Map
+// types, byte ranges against the buffer and texture descs, draws missing state they
+// need, resources bound for reading and writing at once. Each problem is counted and
+// passed to the message callback.
+// The project's subset is implemented; the rest of the interfaces return E_NOTIMPL or do
+// nothing. Only objects this device created may be passed back to it.
+// Needs nothing but the D3D11/DXGI interface declarations and the standard library.
+#pragma once
+
+#include <d3d11_1.h>
+#include <dxgi.h>
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+class NullD3D11Device;
+
+typedef void (*NullD3D11MessageFunc)(const char* message);
+
+// Work the context was given, per frame (between Presents) and in total
+struct NullD3D11Counters
+{
+    UINT64 drawCalls = 0;
+    UINT64 instances = 0;
+    UINT64 vertices = 0;     // indices or vertices, times instances
+    UINT64 stateCalls = 0;   // Set and Clear calls on the context
+    UINT64 maps = 0;
+    UINT64 updateBytes = 0;  // bytes UpdateSubresource copied
+    UINT64 copies = 0;
+
+    void Add(const NullD3D11Counters& other)
+    {
+        drawCalls += other.drawCalls;
+        instances += other.instances;
+        vertices += other.vertices;
+        stateCalls += other.stateCalls;
+        maps += other.maps;
+        updateBytes += other.updateBytes;
+        copies += other.copies;
+    }
+};
+
+// Bytes per element of the formats vertex, index and uncompressed texture data use;
+// 0 for block-compressed and other formats the checks skip
+inline UINT NullFormatBytes(DXGI_FORMAT format)
+{
+    switch (format)
+    {
+    case DXGI_FORMAT_R32G32B32A32_TYPELESS:
+    case DXGI_FORMAT_R32G32B32A32_FLOAT:
+    case DXGI_FORMAT_R32G32B32A32_UINT:
+    case DXGI_FORMAT_R32G32B32A32_SINT:
+        return 16;
+    case DXGI_FORMAT_R32G32B32_TYPELESS:
+    case DXGI_FORMAT_R32G32B32_FLOAT:
+    case DXGI_FORMAT_R32G32B32_UINT:
+    case DXGI_FORMAT_R32G32B32_SINT:
+        return 12;
+    case DXGI_FORMAT_R16G16B16A16_TYPELESS:
+    case DXGI_FORMAT_R16G16B16A16_FLOAT:
+    case DXGI_FORMAT_R16G16B16A16_UNORM:
+    case DXGI_FORMAT_R16G16B16A16_UINT:
+    case DXGI_FORMAT_R16G16B16A16_SNORM:
+    case DXGI_FORMAT_R16G16B16A16_SINT:
+    case DXGI_FORMAT_R32G32_TYPELESS:
+    case DXGI_FORMAT_R32G32_FLOAT:
+    case DXGI_FORMAT_R32G32_UINT:
+    case DXGI_FORMAT_R32G32_SINT:
+        return 8;
+    case DXGI_FORMAT_R10G10B10A2_UNORM:
+    case DXGI_FORMAT_R10G10B10A2_UINT:
+    case DXGI_FORMAT_R11G11B10_FLOAT:
+    case DXGI_FORMAT_R8G8B8A8_TYPELESS:
+    case DXGI_FORMAT_R8G8B8A8_UNORM:
+    case DXGI_FORMAT_R8G8B8A8_UNORM_SRGB:
+    case DXGI_FORMAT_R8G8B8A8_UINT:
+    case DXGI_FORMAT_R8G8B8A8_SNORM:
+    case DXGI_FORMAT_R8G8B8A8_SINT:
+    case DXGI_FORMAT_R16G16_TYPELESS:
+    case DXGI_FORMAT_R16G16_FLOAT:
+    case DXGI_FORMAT_R16G16_UNORM:
+    case DXGI_FORMAT_R16G16_UINT:
+    case DXGI_FORMAT_R16G16_SNORM:
+    case DXGI_FORMAT_R16G16_SINT:
+    case DXGI_FORMAT_R32_TYPELESS:
+    case DXGI_FORMAT_D32_FLOAT:
+    case DXGI_FORMAT_R32_FLOAT:
+    case DXGI_FORMAT_R32_UINT:
+    case DXGI_FORMAT_R32_SINT:
+    case DXGI_FORMAT_D24_UNORM_S8_UINT:
+    case DXGI_FORMAT_B8G8R8A8_UNORM:
+    case DXGI_FORMAT_B8G8R8X8_UNORM:
+    case DXGI_FORMAT_B8G8R8A8_UNORM_SRGB:
+        return 4;
+    case DXGI_FORMAT_R8G8_UNORM:
+    case DXGI_FORMAT_R8G8_UINT:
+    case DXGI_FORMAT_R16_FLOAT:
+    case DXGI_FORMAT_D16_UNORM:
+    case DXGI_FORMAT_R16_UNORM:
+    case DXGI_FORMAT_R16_UINT:
+    case DXGI_FORMAT_R16_SNORM:
+    case DXGI_FORMAT_R16_SINT:
+        return 2;
+    case DXGI_FORMAT_R8_UNORM:
+    case DXGI_FORMAT_R8_UINT:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+inline bool NullIsDepthFormat(DXGI_FORMAT format)
+{
+    return format == DXGI_FORMAT_D32_FLOAT || format == DXGI_FORMAT_D24_UNORM_S8_UINT || format == DXGI_FORMAT_D16_UNORM;
+}
+
+inline bool NullGuidEqual(REFGUID a, REFGUID b)
+{
+    return memcmp(&a, &b, sizeof(GUID)) == 0;
+}
+
+// Adds a reference to the new object before dropping the old one, like a COM smart pointer
+template <class T>
+void NullBind(T*& slot, T* object)
+{
+    if (object)
+        object->AddRef();
+    if (slot)
+        slot->Release();
+    slot = object;
+}
+
+// Error count, work counters and the live objects of one device
+class NullD3D11Tracker
+{
+public:
+    // Objects register here to be listed by ReportLiveObjects
+    struct Object
+    {
+        const char* kind = "";
+        std::string name;  // WKPDID_D3DDebugObjectName
+        size_t index = 0;
+    };
+
+    explicit NullD3D11Tracker(NullD3D11MessageFunc messages) : m_Messages(messages) {}
+
+    void Error(const char* format, ...)
+    {
+        ++m_ErrorCount;
+        if (!m_Messages)
+            return;
+
+        char message[512] = "NullD3D11: ";
+        size_t used = strlen(message);
+        va_list args;
+        va_start(args, format);
+        vsnprintf(message + used, sizeof(message) - used - 1, format, args);
+        va_end(args);
+        strcat(message, "\n");
+        m_Messages(message);
+    }
+
+    void Register(Object* object)
+    {
+        object->index = m_Objects.size();
+        m_Objects.push_back(object);
+    }
+
+    void Unregister(Object* object)
+    {
+        m_Objects[object->index] = m_Objects.back();
+        m_Objects[object->index]->index = object->index;
+        m_Objects.pop_back();
+    }
+
+    // Present closes a frame
+    void EndFrame()
+    {
+        m_LastFrame = m_Frame;
+        m_Total.Add(m_Frame);
+        m_Frame = NullD3D11Counters();
+        ++m_FrameCount;
+    }
+
+    void ReportLiveObjects() const
+    {
+        if (!m_Messages)
+            return;
+        char message[256];
+        snprintf(message, sizeof(message), "NullD3D11: %u live objects\n", (UINT)m_Objects.size());
+        m_Messages(message);
+        for (const Object* object : m_Objects)
+        {
+            snprintf(message, sizeof(message), "NullD3D11:   %s '%s'\n", object->kind, object->name.c_str());
+            m_Messages(message);
+        }
+    }
+
+    NullD3D11Counters& Frame() { return m_Frame; }
+    const NullD3D11Counters& GetLastFrame() const { return m_LastFrame; }
+    const NullD3D11Counters& GetTotal() const { return m_Total; }
+    UINT64 GetFrameCount() const { return m_FrameCount; }
+    UINT GetErrorCount() const { return m_ErrorCount; }
+    UINT GetLiveObjectCount() const { return (UINT)m_Objects.size(); }
+
+private:
+    NullD3D11MessageFunc m_Messages;
+    std::vector<Object*> m_Objects;
+    NullD3D11Counters m_Frame;
+    NullD3D11Counters m_LastFrame;
+    NullD3D11Counters m_Total;
+    UINT64 m_FrameCount = 0;
+    UINT m_ErrorCount = 0;
+};
+
+// Reference counting, QueryInterface over Interface and its bases, the device link and
+// private data of every device child. Children hold a reference on the device.
+template <class Interface, class... Bases>
+class NullChild : public Interface
+{
+public:
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** object) override
+    {
+        if (!object)
+            return E_POINTER;
+        bool match = NullGuidEqual(riid, __uuidof(IUnknown)) || NullGuidEqual(riid, __uuidof(ID3D11DeviceChild)) ||
+            NullGuidEqual(riid, __uuidof(Interface));
+        int unused[] = { 0, (match = match || NullGuidEqual(riid, __uuidof(Bases)), 0)... };
+        (void)unused;
+        if (!match)
+        {
+            *object = nullptr;
+            return E_NOINTERFACE;
+        }
+        AddRef();
+        *object = static_cast<Interface*>(this);
+        return S_OK;
+    }
+
+    ULONG STDMETHODCALLTYPE AddRef() override { return ++m_RefCount; }
+
+    ULONG STDMETHODCALLTYPE Release() override
+    {
+        ULONG count = --m_RefCount;
+        if (count == 0)
+            delete this;
+        return count;
+    }
+
+    void STDMETHODCALLTYPE GetDevice(ID3D11Device** device) override
+    {
+        m_Device->AddRef();
+        *device = m_Device;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetPrivateData(REFGUID guid, UINT* dataSize, void* data) override
+    {
+        if (!dataSize)
+            return E_INVALIDARG;
+        for (const PrivateData& entry : m_PrivateData)
+        {
+            if (!NullGuidEqual(entry.guid, guid))
+                continue;
+            if (data && *dataSize < entry.bytes.size())
+            {
+                *dataSize = (UINT)entry.bytes.size();
+                return DXGI_ERROR_MORE_DATA;
+            }
+            *dataSize = (UINT)entry.bytes.size();
+            if (data && !entry.bytes.empty())
+                memcpy(data, entry.bytes.data(), entry.bytes.size());
+            return S_OK;
+        }
+        *dataSize = 0;
+        return DXGI_ERROR_NOT_FOUND;
+    }
+
+    HRESULT STDMETHODCALLTYPE SetPrivateData(REFGUID guid, UINT dataSize, const void* data) override
+    {
+        if (NullGuidEqual(guid, WKPDID_D3DDebugObjectName))
+            m_Info.name = data ? std::string(static_cast<const char*>(data), dataSize) : std::string();
+
+        for (size_t i = 0; i < m_PrivateData.size(); ++i)
+        {
+            if (NullGuidEqual(m_PrivateData[i].guid, guid))
+            {
+                m_PrivateData.erase(m_PrivateData.begin() + i);
+                break;
+            }
+        }
+        if (data)
+        {
+            PrivateData entry;
+            entry.guid = guid;
+            entry.bytes.assign(static_cast<const BYTE*>(data), static_cast<const BYTE*>(data) + dataSize);
+            m_PrivateData.push_back(entry);
+        }
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE SetPrivateDataInterface(REFGUID, const IUnknown*) override { return E_NOTIMPL; }
+
+    ULONG GetRefCount() const { return m_RefCount; }
+
+protected:
+    NullChild(ID3D11Device* device, NullD3D11Tracker* tracker, const char* kind)
+        : m_Device(device), m_Tracker(tracker)
+    {
+        m_Device->AddRef();
+        m_Info.kind = kind;
+        m_Tracker->Register(&m_Info);
+    }
+
+    virtual ~NullChild()
+    {
+        m_Tracker->Unregister(&m_Info);
+        m_Device->Release();
+    }
+
+    ID3D11Device* m_Device;
+    NullD3D11Tracker* m_Tracker;
+
+private:
+    struct PrivateData
+    {
+        GUID guid;
+        std::vector<BYTE> bytes;
+    };
+
+    ULONG m_RefCount = 1;
+    NullD3D11Tracker::Object m_Info;
+    std::vector<PrivateData> m_PrivateData;
+};
+
+// Resources
+// Buffers the CPU can write (dynamic, staging) keep their bytes for Map; the rest only
+// their desc
+class NullBuffer : public NullChild<ID3D11Buffer, ID3D11Resource>
+{
+public:
+    NullBuffer(ID3D11Device* device, NullD3D11Tracker* tracker, const D3D11_BUFFER_DESC& desc, const D3D11_SUBRESOURCE_DATA* initialData)
+        : NullChild(device, tracker, "buffer"), m_Desc(desc)
+    {
+        // Constant buffers keep theirs too, so checks can read what a shader would see
+        if (desc.Usage == D3D11_USAGE_DYNAMIC || desc.Usage == D3D11_USAGE_STAGING || (desc.BindFlags & D3D11_BIND_CONSTANT_BUFFER))
+        {
+            m_Bytes.resize(desc.ByteWidth);
+            if (initialData && initialData->pSysMem)
+                memcpy(m_Bytes.data(), initialData->pSysMem, desc.ByteWidth);
+        }
+    }
+
+    void STDMETHODCALLTYPE GetType(D3D11_RESOURCE_DIMENSION* dimension) override { *dimension = D3D11_RESOURCE_DIMENSION_BUFFER; }
+    void STDMETHODCALLTYPE SetEvictionPriority(UINT) override {}
+    UINT STDMETHODCALLTYPE GetEvictionPriority() override { return 0; }
+    void STDMETHODCALLTYPE GetDesc(D3D11_BUFFER_DESC* desc) override { *desc = m_Desc; }
+
+    const D3D11_BUFFER_DESC& Desc() const { return m_Desc; }
+    BYTE* Bytes() { return m_Bytes.data(); }
+    const BYTE* Bytes() const { return m_Bytes.data(); }
+    bool HasBytes() const { return !m_Bytes.empty(); }
+
+    bool mapped = false;
+
+private:
+    D3D11_BUFFER_DESC m_Desc;
+    std::vector<BYTE> m_Bytes;
+};
+
+class NullTexture2D : public NullChild<ID3D11Texture2D, ID3D11Resource>
+{
+public:
+    NullTexture2D(ID3D11Device* device, NullD3D11Tracker* tracker, const D3D11_TEXTURE2D_DESC& desc)
+        : NullChild(device, tracker, "texture 2D"), m_Desc(desc)
+    {
+    }
+
+    void STDMETHODCALLTYPE GetType(D3D11_RESOURCE_DIMENSION* dimension) override { *dimension = D3D11_RESOURCE_DIMENSION_TEXTURE2D; }
+    void STDMETHODCALLTYPE SetEvictionPriority(UINT) override {}
+    UINT STDMETHODCALLTYPE GetEvictionPriority() override { return 0; }
+    void STDMETHODCALLTYPE GetDesc(D3D11_TEXTURE2D_DESC* desc) override { *desc = m_Desc; }
+
+    const D3D11_TEXTURE2D_DESC& Desc() const { return m_Desc; }
+
+private:
+    D3D11_TEXTURE2D_DESC m_Desc;
+};
+
+inline NullBuffer* NullAsBuffer(ID3D11Resource* resource)
+{
+    D3D11_RESOURCE_DIMENSION dimension = D3D11_RESOURCE_DIMENSION_UNKNOWN;
+    if (resource)
+        resource->GetType(&dimension);
+    return dimension == D3D11_RESOURCE_DIMENSION_BUFFER ? static_cast<NullBuffer*>(static_cast<ID3D11Buffer*>(resource)) : nullptr;
+}
+
+inline NullTexture2D* NullAsTexture2D(ID3D11Resource* resource)
+{
+    D3D11_RESOURCE_DIMENSION dimension = D3D11_RESOURCE_DIMENSION_UNKNOWN;
+    if (resource)
+        resource->GetType(&dimension);
+    return dimension == D3D11_RESOURCE_DIMENSION_TEXTURE2D ? static_cast<NullTexture2D*>(static_cast<ID3D11Texture2D*>(resource)) : nullptr;
+}
+
+// Views hold a reference on their resource
+template <class Interface, class Desc>
+class NullView : public NullChild<Interface, ID3D11View>
+{
+public:
+    NullView(ID3D11Device* device, NullD3D11Tracker* tracker, const char* kind, ID3D11Resource* resource, const Desc& desc)
+        : NullChild<Interface, ID3D11View>(device, tracker, kind), m_Resource(resource), m_Desc(desc)
+    {
+        m_Resource->AddRef();
+    }
+
+    ~NullView() { m_Resource->Release(); }
+
+    void STDMETHODCALLTYPE GetResource(ID3D11Resource** resource) override
+    {
+        m_Resource->AddRef();
+        *resource = m_Resource;
+    }
+
+    void STDMETHODCALLTYPE GetDesc(Desc* desc) override { *desc = m_Desc; }
+
+    ID3D11Resource* Resource() const { return m_Resource; }
+
+private:
+    ID3D11Resource* m_Resource;
+    Desc m_Desc;
+};
+
+typedef NullView<ID3D11ShaderResourceView, D3D11_SHADER_RESOURCE_VIEW_DESC> NullShaderResourceView;
+typedef NullView<ID3D11RenderTargetView, D3D11_RENDER_TARGET_VIEW_DESC> NullRenderTargetView;
+typedef NullView<ID3D11DepthStencilView, D3D11_DEPTH_STENCIL_VIEW_DESC> NullDepthStencilView;
+
+// Pipeline objects
+template <class Interface>
+class NullShader : public NullChild<Interface>
+{
+public:
+    NullShader(ID3D11Device* device, NullD3D11Tracker* tracker, const char* kind, SIZE_T bytecodeLength)
+        : NullChild<Interface>(device, tracker, kind), m_BytecodeLength(bytecodeLength)
+    {
+    }
+
+private:
+    SIZE_T m_BytecodeLength;
+};
+
+// The bytes each vertex buffer slot must provide per vertex, from the element offsets
+class NullInputLayout : public NullChild<ID3D11InputLayout>
+{
+public:
+    NullInputLayout(ID3D11Device* device, NullD3D11Tracker* tracker, const D3D11_INPUT_ELEMENT_DESC* elements, UINT count)
+        : NullChild(device, tracker, "input layout")
+    {
+        UINT appendOffset[D3D11_IA_VERTEX_INPUT_RESOURCE_SLOT_COUNT] = {};
+        for (UINT i = 0; i < count; ++i)
+        {
+            const D3D11_INPUT_ELEMENT_DESC& e = elements[i];
+            UINT offset = e.AlignedByteOffset == D3D11_APPEND_ALIGNED_ELEMENT ? appendOffset[e.InputSlot] : e.AlignedByteOffset;
+            appendOffset[e.InputSlot] = offset + NullFormatBytes(e.Format);
+            slotBytes[e.InputSlot] = appendOffset[e.InputSlot] > slotBytes[e.InputSlot] ? appendOffset[e.InputSlot] : slotBytes[e.InputSlot];
+            slotMask |= 1u << e.InputSlot;
+        }
+    }
+
+    UINT slotBytes[D3D11_IA_VERTEX_INPUT_RESOURCE_SLOT_COUNT] = {};
+    UINT slotMask = 0;
+};
+
+// State objects
+template <class Interface, class Desc>
+class NullState : public NullChild<Interface>
+{
+public:
+    NullState(ID3D11Device* device, NullD3D11Tracker* tracker, const char* kind, const Desc& desc)
+        : NullChild<Interface>(device, tracker, kind), m_Desc(desc)
+    {
+    }
+
+    void STDMETHODCALLTYPE GetDesc(Desc* desc) override { *desc = m_Desc; }
+
+private:
+    Desc m_Desc;
+};
+
+typedef NullState<ID3D11BlendState, D3D11_BLEND_DESC> NullBlendState;
+typedef NullState<ID3D11DepthStencilState, D3D11_DEPTH_STENCIL_DESC> NullDepthStencilState;
+typedef NullState<ID3D11RasterizerState, D3D11_RASTERIZER_DESC> NullRasterizerState;
+typedef NullState<ID3D11SamplerState, D3D11_SAMPLER_DESC> NullSamplerState;
+
+// Queries complete as soon as they end: events signal, timestamps count up
+class NullQuery : public NullChild<ID3D11Query, ID3D11Asynchronous>
+{
+public:
+    NullQuery(ID3D11Device* device, NullD3D11Tracker* tracker, const D3D11_QUERY_DESC& desc)
+        : NullChild(device, tracker, "query"), m_Desc(desc)
+    {
+    }
+
+    UINT STDMETHODCALLTYPE GetDataSize() override
+    {
+        switch (m_Desc.Query)
+        {
+        case D3D11_QUERY_EVENT: return sizeof(BOOL);
+        case D3D11_QUERY_OCCLUSION: return sizeof(UINT64);
+        case D3D11_QUERY_TIMESTAMP: return sizeof(UINT64);
+        case D3D11_QUERY_TIMESTAMP_DISJOINT: return sizeof(D3D11_QUERY_DATA_TIMESTAMP_DISJOINT);
+        default: return 0;
+        }
+    }
+
+    void STDMETHODCALLTYPE GetDesc(D3D11_QUERY_DESC* desc) override { *desc = m_Desc; }
+
+    const D3D11_QUERY_DESC& Desc() const { return m_Desc; }
+
+    bool issued = false;
+    UINT64 timestamp = 0;
+
+private:
+    D3D11_QUERY_DESC m_Desc;
+};
+
+// Immediate context
+class NullDeviceContext : public NullChild<ID3D11DeviceContext1, ID3D11DeviceContext>
+{
+public:
+    NullDeviceContext(ID3D11Device* device, NullD3D11Tracker* tracker)
+        : NullChild(device, tracker, "immediate context")
+    {
+    }
+
+    ~NullDeviceContext() { ClearState(); }
+
+    // Once only the device's own reference is left, drop the bindings: the objects they
+    // hold reference the device and would keep it alive
+    ULONG STDMETHODCALLTYPE Release() override
+    {
+        ULONG count = NullChild::Release();
+        if (count == 1)
+            ClearState();
+        return count;
+    }
+
+    // Stage bindings
+    void STDMETHODCALLTYPE VSSetConstantBuffers(UINT start, UINT count, ID3D11Buffer* const* buffers) override { SetConstantBuffers(m_VS, "VS", start, count, buffers, nullptr, nullptr); }
+    void STDMETHODCALLTYPE PSSetConstantBuffers(UINT start, UINT count, ID3D11Buffer* const* buffers) override { SetConstantBuffers(m_PS, "PS", start, count, buffers, nullptr, nullptr); }
+    void STDMETHODCALLTYPE VSSetConstantBuffers1(UINT start, UINT count, ID3D11Buffer* const* buffers, const UINT* first, const UINT* constants) override
+    {
+        SetConstantBuffers(m_VS, "VS", start, count, buffers, first, constants);
+    }
+    void STDMETHODCALLTYPE PSSetConstantBuffers1(UINT start, UINT count, ID3D11Buffer* const* buffers, const UINT* first, const UINT* constants) override
+    {
+        SetConstantBuffers(m_PS, "PS", start, count, buffers, first, constants);
+    }
+    void STDMETHODCALLTYPE VSSetShaderResources(UINT start, UINT count, ID3D11ShaderResourceView* const* views) override { SetShaderResources(m_VS, "VS", start, count, views); }
+    void STDMETHODCALLTYPE PSSetShaderResources(UINT start, UINT count, ID3D11ShaderResourceView* const* views) override { SetShaderResources(m_PS, "PS", start, count, views); }
+    void STDMETHODCALLTYPE VSSetSamplers(UINT start, UINT count, ID3D11SamplerState* const* samplers) override { SetSamplers(m_VS, "VS", start, count, samplers); }
+    void STDMETHODCALLTYPE PSSetSamplers(UINT start, UINT count, ID3D11SamplerState* const* samplers) override { SetSamplers(m_PS, "PS", start, count, samplers); }
+
+    void STDMETHODCALLTYPE VSSetShader(ID3D11VertexShader* shader, ID3D11ClassInstance* const*, UINT classInstances) override
+    {
+        ++m_Tracker->Frame().stateCalls;
+        if (classInstances != 0)
+            m_Tracker->Error("VSSetShader: class instances are not supported");
+        NullBind(m_VertexShader, shader);
+    }
+
+    void STDMETHODCALLTYPE PSSetShader(ID3D11PixelShader* shader, ID3D11ClassInstance* const*, UINT classInstances) override
+    {
+        ++m_Tracker->Frame().stateCalls;
+        if (classInstances != 0)
+            m_Tracker->Error("PSSetShader: class instances are not supported");
+        NullBind(m_PixelShader, shader);
+    }
+
+    // Input assembler
+    void STDMETHODCALLTYPE IASetInputLayout(ID3D11InputLayout* layout) override
+    {
+        ++m_Tracker->Frame().stateCalls;
+        NullBind(m_InputLayout, layout);
+    }
+
+    void STDMETHODCALLTYPE IASetVertexBuffers(UINT start, UINT count, ID3D11Buffer* const* buffers, const UINT* strides, const UINT* offsets) override
+    {
+        ++m_Tracker->Frame().stateCalls;
+        if (start + count > D3D11_IA_VERTEX_INPUT_RESOURCE_SLOT_COUNT)
+        {
+            m_Tracker->Error("IASetVertexBuffers: slots %u..%u out of range", start, start + count);
+            return;
+        }
+        for (UINT i = 0; i < count; ++i)
+        {
+            ID3D11Buffer* buffer = buffers ? buffers[i] : nullptr;
+            if (buffer && !(static_cast<NullBuffer*>(buffer)->Desc().BindFlags & D3D11_BIND_VERTEX_BUFFER))
+                m_Tracker->Error("IASetVertexBuffers: buffer in slot %u lacks D3D11_BIND_VERTEX_BUFFER", start + i);
+            NullBind(m_VertexBuffers[start + i], buffer);
+            m_VertexStrides[start + i] = buffer && strides ? strides[i] : 0;
+            m_VertexOffsets[start + i] = buffer && offsets ? offsets[i] : 0;
+        }
+    }
+
+    void STDMETHODCALLTYPE IASetIndexBuffer(ID3D11Buffer* buffer, DXGI_FORMAT format, UINT offset) override
+    {
+        ++m_Tracker->Frame().stateCalls;
+        if (buffer)
+        {
+            if (!(static_cast<NullBuffer*>(buffer)->Desc().BindFlags & D3D11_BIND_INDEX_BUFFER))
+                m_Tracker->Error("IASetIndexBuffer: buffer lacks D3D11_BIND_INDEX_BUFFER");
+            if (format != DXGI_FORMAT_R16_UINT && format != DXGI_FORMAT_R32_UINT)
+                m_Tracker->Error("IASetIndexBuffer: format %u is not R16_UINT or R32_UINT", (UINT)format);
+        }
+        NullBind(m_IndexBuffer, buffer);
+        m_IndexFormat = format;
+        m_IndexOffset = offset;
+    }
+
+    void STDMETHODCALLTYPE IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY topology) override
+    {
+        ++m_Tracker->Frame().stateCalls;
+        m_Topology = topology;
+    }
+
+    // Rasterizer and output merger
+    void STDMETHODCALLTYPE RSSetState(ID3D11RasterizerState* state) override
+    {
+        ++m_Tracker->Frame().stateCalls;
+        NullBind(m_RasterizerState, state);
+    }
+
+    void STDMETHODCALLTYPE RSSetViewports(UINT count, const D3D11_VIEWPORT* viewports) override
+    {
+        ++m_Tracker->Frame().stateCalls;
+        if (count > D3D11_VIEWPORT_AND_SCISSORRECT_OBJECT_COUNT_PER_PIPELINE)
+        {
+            m_Tracker->Error("RSSetViewports: %u viewports", count);
+            return;
+        }
+        m_ViewportCount = count;
+        for (UINT i = 0; i < count; ++i)
+        {
+            m_Viewports[i] = viewports[i];
+            if (viewports[i].Width <= 0.0f || viewports[i].Height <= 0.0f)
+                m_Tracker->Error("RSSetViewports: viewport %u is empty", i);
+        }
+    }
+
+    void STDMETHODCALLTYPE RSSetScissorRects(UINT, const D3D11_RECT*) override { ++m_Tracker->Frame().stateCalls; }
+
+    void STDMETHODCALLTYPE OMSetRenderTargets(UINT count, ID3D11RenderTargetView* const* views, ID3D11DepthStencilView* depthView) override
+    {
+        ++m_Tracker->Frame().stateCalls;
+        if (count > D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT)
+        {
+            m_Tracker->Error("OMSetRenderTargets: %u render targets", count);
+            return;
+        }
+        for (UINT i = 0; i < D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT; ++i)
+            NullBind(m_RenderTargets[i], i < count && views ? views[i] : nullptr);
+        NullBind(m_DepthStencilView, depthView);
+    }
+
+    void STDMETHODCALLTYPE OMSetBlendState(ID3D11BlendState* state, const FLOAT[4], UINT) override
+    {
+        ++m_Tracker->Frame().stateCalls;
+        NullBind(m_BlendState, state);
+    }
+
+    void STDMETHODCALLTYPE OMSetDepthStencilState(ID3D11DepthStencilState* state, UINT) override
+    {
+        ++m_Tracker->Frame().stateCalls;
+        NullBind(m_DepthStencilState, state);
+    }
+
+    // Draws
+    void STDMETHODCALLTYPE Draw(UINT vertexCount, UINT startVertex) override
+    {
+        if (ValidateDraw("Draw", false, vertexCount, startVertex, 1))
+            CountDraw(vertexCount, 1);
+    }
+
+    void STDMETHODCALLTYPE DrawIndexed(UINT indexCount, UINT startIndex, INT) override
+    {
+        if (ValidateDraw("DrawIndexed", true, indexCount, startIndex, 1))
+            CountDraw(indexCount, 1);
+    }
+
+    void STDMETHODCALLTYPE DrawInstanced(UINT vertexCount, UINT instanceCount, UINT startVertex, UINT) override
+    {
+        if (ValidateDraw("DrawInstanced", false, vertexCount, startVertex, instanceCount))
+            CountDraw(vertexCount, instanceCount);
+    }
+
+    void STDMETHODCALLTYPE DrawIndexedInstanced(UINT indexCount, UINT instanceCount, UINT startIndex, INT, UINT) override
+    {
+        if (ValidateDraw("DrawIndexedInstanced", true, indexCount, startIndex, instanceCount))
+            CountDraw(indexCount, instanceCount);
+    }
+
+    // Resource updates
+    HRESULT STDMETHODCALLTYPE Map(ID3D11Resource* resource, UINT subresource, D3D11_MAP mapType, UINT, D3D11_MAPPED_SUBRESOURCE* mapped) override
+    {
+        NullBuffer* buffer = NullAsBuffer(resource);
+        if (!buffer)
+        {
+            m_Tracker->Error("Map: only buffers can be mapped on the null device");
+            return E_INVALIDARG;
+        }
+        const D3D11_BUFFER_DESC& desc = buffer->Desc();
+        const char* problem = nullptr;
+        if (subresource != 0)
+            problem = "subresource of a buffer is not 0";
+        else if (buffer->mapped)
+            problem = "buffer is already mapped";
+        else if (!mapped)
+            problem = "no D3D11_MAPPED_SUBRESOURCE";
+        else if (mapType == D3D11_MAP_WRITE_DISCARD && (desc.Usage != D3D11_USAGE_DYNAMIC || !(desc.CPUAccessFlags & D3D11_CPU_ACCESS_WRITE)))
+            problem = "WRITE_DISCARD needs a dynamic buffer with CPU write access";
+        else if (mapType == D3D11_MAP_WRITE_NO_OVERWRITE && desc.Usage != D3D11_USAGE_DYNAMIC)
+            problem = "WRITE_NO_OVERWRITE needs a dynamic buffer";
+        else if (mapType == D3D11_MAP_WRITE_NO_OVERWRITE && (desc.BindFlags & D3D11_BIND_CONSTANT_BUFFER) && !options.MapNoOverwriteOnDynamicConstantBuffer)
+            problem = "WRITE_NO_OVERWRITE on a constant buffer is not supported";
+        else if (mapType == D3D11_MAP_WRITE_NO_OVERWRITE && (desc.BindFlags & D3D11_BIND_SHADER_RESOURCE) && !options.MapNoOverwriteOnDynamicBufferSRV)
+            problem = "WRITE_NO_OVERWRITE on a shader resource buffer is not supported";
+        else if ((mapType == D3D11_MAP_READ || mapType == D3D11_MAP_WRITE || mapType == D3D11_MAP_READ_WRITE) && desc.Usage != D3D11_USAGE_STAGING)
+            problem = "READ and WRITE maps need a staging buffer";
+        if (problem)
+        {
+            m_Tracker->Error("Map: %s", problem);
+            return E_INVALIDARG;
+        }
+
+        ++m_Tracker->Frame().maps;
+        buffer->mapped = true;
+        mapped->pData = buffer->Bytes();
+        mapped->RowPitch = desc.ByteWidth;
+        mapped->DepthPitch = desc.ByteWidth;
+        return S_OK;
+    }
+
+    void STDMETHODCALLTYPE Unmap(ID3D11Resource* resource, UINT) override
+    {
+        NullBuffer* buffer = NullAsBuffer(resource);
+        if (!buffer || !buffer->mapped)
+        {
+            m_Tracker->Error("Unmap: resource is not mapped");
+            return;
+        }
+        buffer->mapped = false;
+    }
+
+    void STDMETHODCALLTYPE UpdateSubresource(ID3D11Resource* resource, UINT subresource, const D3D11_BOX* box, const void* data, UINT rowPitch, UINT) override
+    {
+        if (!data)
+        {
+            m_Tracker->Error("UpdateSubresource: no source data");
+            return;
+        }
+
+        if (NullBuffer* buffer = NullAsBuffer(resource))
+        {
+            const D3D11_BUFFER_DESC& desc = buffer->Desc();
+            if (desc.Usage == D3D11_USAGE_DYNAMIC || desc.Usage == D3D11_USAGE_IMMUTABLE)
+            {
+                m_Tracker->Error("UpdateSubresource: buffer is dynamic or immutable");
+                return;
+            }
+            if (subresource != 0)
+            {
+                m_Tracker->Error("UpdateSubresource: subresource of a buffer is not 0");
+                return;
+            }
+            if (box && (desc.BindFlags & D3D11_BIND_CONSTANT_BUFFER))
+            {
+                m_Tracker->Error("UpdateSubresource: constant buffers are updated whole, without a box");
+                return;
+            }
+            if (box && (box->left >= box->right || box->right > desc.ByteWidth || box->top != 0 || box->bottom != 1 || box->front != 0 || box->back != 1))
+            {
+                m_Tracker->Error("UpdateSubresource: box [%u, %u) outside the %u byte buffer", box->left, box->right, desc.ByteWidth);
+                return;
+            }
+            UINT begin = box ? box->left : 0;
+            UINT end = box ? box->right : desc.ByteWidth;
+            if (buffer->HasBytes())
+                memcpy(buffer->Bytes() + begin, data, end - begin);
+            m_Tracker->Frame().updateBytes += end - begin;
+            return;
+        }
+
+        if (NullTexture2D* texture = NullAsTexture2D(resource))
+        {
+            const D3D11_TEXTURE2D_DESC& desc = texture->Desc();
+            if (desc.Usage == D3D11_USAGE_DYNAMIC || desc.Usage == D3D11_USAGE_IMMUTABLE)
+            {
+                m_Tracker->Error("UpdateSubresource: texture is dynamic or immutable");
+                return;
+            }
+            if (subresource >= desc.MipLevels * desc.ArraySize)
+            {
+                m_Tracker->Error("UpdateSubresource: subresource %u of %u", subresource, desc.MipLevels * desc.ArraySize);
+                return;
+            }
+            UINT mip = subresource % desc.MipLevels;
+            UINT width = (desc.Width >> mip) ? (desc.Width >> mip) : 1;
+            UINT height = (desc.Height >> mip) ? (desc.Height >> mip) : 1;
+            if (box && (box->left >= box->right || box->right > width || box->top >= box->bottom || box->bottom > height))
+            {
+                m_Tracker->Error("UpdateSubresource: box outside the %ux%u mip", width, height);
+                return;
+            }
+            UINT rowBytes = (box ? box->right - box->left : width) * NullFormatBytes(desc.Format);
+            if (rowPitch < rowBytes)
+            {
+                m_Tracker->Error("UpdateSubresource: row pitch %u under the %u bytes of a row", rowPitch, rowBytes);
+                return;
+            }
+            m_Tracker->Frame().updateBytes += (UINT64)rowPitch * (box ? box->bottom - box->top : height);
+            return;
+        }
+
+        m_Tracker->Error("UpdateSubresource: unsupported resource");
+    }
+
+    void STDMETHODCALLTYPE CopySubresourceRegion(ID3D11Resource* destination, UINT, UINT x, UINT, UINT, ID3D11Resource* source, UINT, const D3D11_BOX* box) override
+    {
+        ++m_Tracker->Frame().copies;
+        NullBuffer* to = NullAsBuffer(destination);
+        NullBuffer* from = NullAsBuffer(source);
+        if (to && from)
+        {
+            UINT begin = box ? box->left : 0;
+            UINT end = box ? box->right : from->Desc().ByteWidth;
+            if (begin >= end || end > from->Desc().ByteWidth || x + (end - begin) > to->Desc().ByteWidth)
+                m_Tracker->Error("CopySubresourceRegion: [%u, %u) to offset %u is out of range", begin, end, x);
+            else if (to->Desc().Usage == D3D11_USAGE_IMMUTABLE)
+                m_Tracker->Error("CopySubresourceRegion: destination is immutable");
+            else if (to->HasBytes() && from->HasBytes())
+                memmove(to->Bytes() + x, from->Bytes() + begin, end - begin);
+        }
+        else if (!NullAsTexture2D(destination) || !NullAsTexture2D(source))
+        {
+            m_Tracker->Error("CopySubresourceRegion: source and destination differ in type");
+        }
+    }
+
+    void STDMETHODCALLTYPE CopyResource(ID3D11Resource* destination, ID3D11Resource* source) override
+    {
+        ++m_Tracker->Frame().copies;
+        NullBuffer* to = NullAsBuffer(destination);
+        NullBuffer* from = NullAsBuffer(source);
+        if (to && from && to->Desc().ByteWidth != from->Desc().ByteWidth)
+            m_Tracker->Error("CopyResource: buffers of %u and %u bytes", to->Desc().ByteWidth, from->Desc().ByteWidth);
+        else if (to && from && to->HasBytes() && from->HasBytes())
+            memcpy(to->Bytes(), from->Bytes(), to->Desc().ByteWidth);
+    }
+
+    // The 11.1 copy flags and discards are hints, which the null device has no use for
+    void STDMETHODCALLTYPE CopySubresourceRegion1(ID3D11Resource* destination, UINT destinationSubresource, UINT x, UINT y, UINT z,
+        ID3D11Resource* source, UINT sourceSubresource, const D3D11_BOX* box, UINT) override
+    {
+        CopySubresourceRegion(destination, destinationSubresource, x, y, z, source, sourceSubresource, box);
+    }
+
+    void STDMETHODCALLTYPE UpdateSubresource1(ID3D11Resource* resource, UINT subresource, const D3D11_BOX* box, const void* data,
+        UINT rowPitch, UINT depthPitch, UINT) override
+    {
+        UpdateSubresource(resource, subresource, box, data, rowPitch, depthPitch);
+    }
+
+    void STDMETHODCALLTYPE DiscardResource(ID3D11Resource*) override {}
+    void STDMETHODCALLTYPE DiscardView(ID3D11View*) override {}
+    void STDMETHODCALLTYPE DiscardView1(ID3D11View*, const D3D11_RECT*, UINT) override {}
+
+    void STDMETHODCALLTYPE ClearRenderTargetView(ID3D11RenderTargetView* view, const FLOAT[4]) override
+    {
+        ++m_Tracker->Frame().stateCalls;
+        if (!view)
+            m_Tracker->Error("ClearRenderTargetView: no view");
+    }
+
+    void STDMETHODCALLTYPE ClearDepthStencilView(ID3D11DepthStencilView* view, UINT flags, FLOAT depth, UINT8) override
+    {
+        ++m_Tracker->Frame().stateCalls;
+        if (!view || flags == 0 || depth < 0.0f || depth > 1.0f)
+            m_Tracker->Error("ClearDepthStencilView: no view, no flags or depth outside [0, 1]");
+    }
+
+    // Queries
+    void STDMETHODCALLTYPE Begin(ID3D11Asynchronous* async) override
+    {
+        NullQuery* query = static_cast<NullQuery*>(static_cast<ID3D11Query*>(async));
+        if (query->Desc().Query == D3D11_QUERY_EVENT || query->Desc().Query == D3D11_QUERY_TIMESTAMP)
+            m_Tracker->Error("Begin: event and timestamp queries only End");
+    }
+
+    void STDMETHODCALLTYPE End(ID3D11Asynchronous* async) override
+    {
+        NullQuery* query = static_cast<NullQuery*>(static_cast<ID3D11Query*>(async));
+        query->issued = true;
+        query->timestamp = ++m_Timestamp;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetData(ID3D11Asynchronous* async, void* data, UINT dataSize, UINT) override
+    {
+        NullQuery* query = static_cast<NullQuery*>(static_cast<ID3D11Query*>(async));
+        if (!query->issued)
+        {
+            m_Tracker->Error("GetData: query was never issued");
+            return DXGI_ERROR_INVALID_CALL;
+        }
+        if (!data)
+            return S_OK;
+        if (dataSize != query->GetDataSize())
+        {
+            m_Tracker->Error("GetData: %u bytes for a query of %u", dataSize, query->GetDataSize());
+            return E_INVALIDARG;
+        }
+        switch (query->Desc().Query)
+        {
+        case D3D11_QUERY_EVENT:
+            *static_cast<BOOL*>(data) = TRUE;
+            break;
+        case D3D11_QUERY_OCCLUSION:
+            *static_cast<UINT64*>(data) = 0;
+            break;
+        case D3D11_QUERY_TIMESTAMP:
+            *static_cast<UINT64*>(data) = query->timestamp;
+            break;
+        case D3D11_QUERY_TIMESTAMP_DISJOINT:
+        {
+            D3D11_QUERY_DATA_TIMESTAMP_DISJOINT disjoint = { 1000000, FALSE };
+            memcpy(data, &disjoint, sizeof(disjoint));
+            break;
+        }
+        default:
+            break;
+        }
+        return S_OK;
+    }
+
+    void STDMETHODCALLTYPE ClearState() override
+    {
+        for (Stage* stage : { &m_VS, &m_PS })
+        {
+            for (ID3D11Buffer*& buffer : stage->constantBuffers)
+                NullBind(buffer, (ID3D11Buffer*)nullptr);
+            memset(stage->constantFirst, 0, sizeof(stage->constantFirst));
+            memset(stage->constantCount, 0, sizeof(stage->constantCount));
+            for (ID3D11ShaderResourceView*& view : stage->shaderResources)
+                NullBind(view, (ID3D11ShaderResourceView*)nullptr);
+            for (ID3D11SamplerState*& sampler : stage->samplers)
+                NullBind(sampler, (ID3D11SamplerState*)nullptr);
+        }
+        NullBind(m_VertexShader, (ID3D11VertexShader*)nullptr);
+        NullBind(m_PixelShader, (ID3D11PixelShader*)nullptr);
+        NullBind(m_InputLayout, (ID3D11InputLayout*)nullptr);
+        for (UINT i = 0; i < D3D11_IA_VERTEX_INPUT_RESOURCE_SLOT_COUNT; ++i)
+        {
+            NullBind(m_VertexBuffers[i], (ID3D11Buffer*)nullptr);
+            m_VertexStrides[i] = m_VertexOffsets[i] = 0;
+        }
+        NullBind(m_IndexBuffer, (ID3D11Buffer*)nullptr);
+        m_IndexFormat = DXGI_FORMAT_UNKNOWN;
+        m_IndexOffset = 0;
+        m_Topology = D3D11_PRIMITIVE_TOPOLOGY_UNDEFINED;
+        NullBind(m_RasterizerState, (ID3D11RasterizerState*)nullptr);
+        m_ViewportCount = 0;
+        for (ID3D11RenderTargetView*& view : m_RenderTargets)
+            NullBind(view, (ID3D11RenderTargetView*)nullptr);
+        NullBind(m_DepthStencilView, (ID3D11DepthStencilView*)nullptr);
+        NullBind(m_BlendState, (ID3D11BlendState*)nullptr);
+        NullBind(m_DepthStencilState, (ID3D11DepthStencilState*)nullptr);
+    }
+
+    void STDMETHODCALLTYPE Flush() override {}
+    D3D11_DEVICE_CONTEXT_TYPE STDMETHODCALLTYPE GetType() override { return D3D11_DEVICE_CONTEXT_IMMEDIATE; }
+    UINT STDMETHODCALLTYPE GetContextFlags() override { return 0; }
+
+    // Reported like an 11.1 runtime on a feature level 11_0 driver
+    D3D11_FEATURE_DATA_D3D11_OPTIONS options = {};
+
+    // The bytes a vertex shader reads from constant buffer `slot`: the bound range, or the
+    // whole buffer, cut off at its end. nullptr when nothing is bound.
+    const BYTE* GetVSConstants(UINT slot, UINT* bytes) const
+    {
+        const NullBuffer* buffer = static_cast<const NullBuffer*>(m_VS.constantBuffers[slot]);
+        *bytes = 0;
+        if (!buffer)
+            return nullptr;
+        UINT width = buffer->Desc().ByteWidth;
+        UINT begin = (std::min)(m_VS.constantFirst[slot] * 16, width);
+        UINT end = m_VS.constantCount[slot] ? (std::min)(begin + m_VS.constantCount[slot] * 16, width) : width;
+        *bytes = end - begin;
+        return buffer->Bytes() + begin;
+    }
+
+    // Stages the project does not use: unbinding is fine, binding is reported
+    void STDMETHODCALLTYPE GSSetConstantBuffers(UINT, UINT count, ID3D11Buffer* const* buffers) override { Unused("GSSetConstantBuffers", count, buffers); }
+    void STDMETHODCALLTYPE GSSetShader(ID3D11GeometryShader* shader, ID3D11ClassInstance* const*, UINT) override { Unused("GSSetShader", shader ? 1 : 0, &shader); }
+    void STDMETHODCALLTYPE GSSetShaderResources(UINT, UINT count, ID3D11ShaderResourceView* const* views) override { Unused("GSSetShaderResources", count, views); }
+    void STDMETHODCALLTYPE GSSetSamplers(UINT, UINT count, ID3D11SamplerState* const* samplers) override { Unused("GSSetSamplers", count, samplers); }
+    void STDMETHODCALLTYPE HSSetShaderResources(UINT, UINT count, ID3D11ShaderResourceView* const* views) override { Unused("HSSetShaderResources", count, views); }
+    void STDMETHODCALLTYPE HSSetShader(ID3D11HullShader* shader, ID3D11ClassInstance* const*, UINT) override { Unused("HSSetShader", shader ? 1 : 0, &shader); }
+    void STDMETHODCALLTYPE HSSetSamplers(UINT, UINT count, ID3D11SamplerState* const* samplers) override { Unused("HSSetSamplers", count, samplers); }
+    void STDMETHODCALLTYPE HSSetConstantBuffers(UINT, UINT count, ID3D11Buffer* const* buffers) override { Unused("HSSetConstantBuffers", count, buffers); }
+    void STDMETHODCALLTYPE DSSetShaderResources(UINT, UINT count, ID3D11ShaderResourceView* const* views) override { Unused("DSSetShaderResources", count, views); }
+    void STDMETHODCALLTYPE DSSetShader(ID3D11DomainShader* shader, ID3D11ClassInstance* const*, UINT) override { Unused("DSSetShader", shader ? 1 : 0, &shader); }
+    void STDMETHODCALLTYPE DSSetSamplers(UINT, UINT count, ID3D11SamplerState* const* samplers) override { Unused("DSSetSamplers", count, samplers); }
+    void STDMETHODCALLTYPE DSSetConstantBuffers(UINT, UINT count, ID3D11Buffer* const* buffers) override { Unused("DSSetConstantBuffers", count, buffers); }
+    void STDMETHODCALLTYPE CSSetShaderResources(UINT, UINT count, ID3D11ShaderResourceView* const* views) override { Unused("CSSetShaderResources", count, views); }
+    void STDMETHODCALLTYPE CSSetUnorderedAccessViews(UINT, UINT count, ID3D11UnorderedAccessView* const* views, const UINT*) override { Unused("CSSetUnorderedAccessViews", count, views); }
+    void STDMETHODCALLTYPE CSSetShader(ID3D11ComputeShader* shader, ID3D11ClassInstance* const*, UINT) override { Unused("CSSetShader", shader ? 1 : 0, &shader); }
+    void STDMETHODCALLTYPE CSSetSamplers(UINT, UINT count, ID3D11SamplerState* const* samplers) override { Unused("CSSetSamplers", count, samplers); }
+    void STDMETHODCALLTYPE CSSetConstantBuffers(UINT, UINT count, ID3D11Buffer* const* buffers) override { Unused("CSSetConstantBuffers", count, buffers); }
+    void STDMETHODCALLTYPE GSSetConstantBuffers1(UINT, UINT count, ID3D11Buffer* const* buffers, const UINT*, const UINT*) override { Unused("GSSetConstantBuffers1", count, buffers); }
+    void STDMETHODCALLTYPE HSSetConstantBuffers1(UINT, UINT count, ID3D11Buffer* const* buffers, const UINT*, const UINT*) override { Unused("HSSetConstantBuffers1", count, buffers); }
+    void STDMETHODCALLTYPE DSSetConstantBuffers1(UINT, UINT count, ID3D11Buffer* const* buffers, const UINT*, const UINT*) override { Unused("DSSetConstantBuffers1", count, buffers); }
+    void STDMETHODCALLTYPE CSSetConstantBuffers1(UINT, UINT count, ID3D11Buffer* const* buffers, const UINT*, const UINT*) override { Unused("CSSetConstantBuffers1", count, buffers); }
+    void STDMETHODCALLTYPE SOSetTargets(UINT count, ID3D11Buffer* const* buffers, const UINT*) override { Unused("SOSetTargets", count, buffers); }
+
+    void STDMETHODCALLTYPE OMSetRenderTargetsAndUnorderedAccessViews(UINT count, ID3D11RenderTargetView* const* views, ID3D11DepthStencilView* depthView,
+        UINT, UINT uavCount, ID3D11UnorderedAccessView* const* uavs, const UINT*) override
+    {
+        if (count != D3D11_KEEP_RENDER_TARGETS_AND_DEPTH_STENCIL)
+            OMSetRenderTargets(count, views, depthView);
+        if (uavCount != D3D11_KEEP_UNORDERED_ACCESS_VIEWS)
+            Unused("OMSetRenderTargetsAndUnorderedAccessViews", uavCount, uavs);
+    }
+
+    void STDMETHODCALLTYPE SetPredication(ID3D11Predicate* predicate, BOOL) override { Unused("SetPredication", predicate ? 1 : 0, &predicate); }
+    void STDMETHODCALLTYPE DrawAuto() override { m_Tracker->Error("DrawAuto is not supported"); }
+    void STDMETHODCALLTYPE DrawIndexedInstancedIndirect(ID3D11Buffer*, UINT) override { m_Tracker->Error("DrawIndexedInstancedIndirect is not supported"); }
+    void STDMETHODCALLTYPE DrawInstancedIndirect(ID3D11Buffer*, UINT) override { m_Tracker->Error("DrawInstancedIndirect is not supported"); }
+    void STDMETHODCALLTYPE Dispatch(UINT, UINT, UINT) override { m_Tracker->Error("Dispatch is not supported"); }
+    void STDMETHODCALLTYPE DispatchIndirect(ID3D11Buffer*, UINT) override { m_Tracker->Error("DispatchIndirect is not supported"); }
+    void STDMETHODCALLTYPE CopyStructureCount(ID3D11Buffer*, UINT, ID3D11UnorderedAccessView*) override { m_Tracker->Error("CopyStructureCount is not supported"); }
+    void STDMETHODCALLTYPE ClearUnorderedAccessViewUint(ID3D11UnorderedAccessView*, const UINT[4]) override { m_Tracker->Error("ClearUnorderedAccessViewUint is not supported"); }
+    void STDMETHODCALLTYPE ClearUnorderedAccessViewFloat(ID3D11UnorderedAccessView*, const FLOAT[4]) override { m_Tracker->Error("ClearUnorderedAccessViewFloat is not supported"); }
+    void STDMETHODCALLTYPE GenerateMips(ID3D11ShaderResourceView*) override {}
+    void STDMETHODCALLTYPE SetResourceMinLOD(ID3D11Resource*, FLOAT) override {}
+    FLOAT STDMETHODCALLTYPE GetResourceMinLOD(ID3D11Resource*) override { return 0.0f; }
+    void STDMETHODCALLTYPE ResolveSubresource(ID3D11Resource*, UINT, ID3D11Resource*, UINT, DXGI_FORMAT) override { ++m_Tracker->Frame().copies; }
+    void STDMETHODCALLTYPE ExecuteCommandList(ID3D11CommandList*, BOOL) override { m_Tracker->Error("ExecuteCommandList is not supported"); }
+    void STDMETHODCALLTYPE ClearView(ID3D11View*, const FLOAT[4], const D3D11_RECT*, UINT) override { m_Tracker->Error("ClearView is not supported"); }
+
+    void STDMETHODCALLTYPE SwapDeviceContextState(ID3DDeviceContextState*, ID3DDeviceContextState** previousState) override
+    {
+        m_Tracker->Error("SwapDeviceContextState is not supported");
+        ZeroOut(1, previousState);
+    }
+    HRESULT STDMETHODCALLTYPE FinishCommandList(BOOL, ID3D11CommandList**) override { return DXGI_ERROR_INVALID_CALL; }
+
+    // Getters, which the project does not use
+    void STDMETHODCALLTYPE VSGetConstantBuffers(UINT, UINT count, ID3D11Buffer** buffers) override { ZeroOut(count, buffers); }
+    void STDMETHODCALLTYPE PSGetShaderResources(UINT, UINT count, ID3D11ShaderResourceView** views) override { ZeroOut(count, views); }
+    void STDMETHODCALLTYPE PSGetShader(ID3D11PixelShader** shader, ID3D11ClassInstance**, UINT* count) override { ZeroOut(1, shader); ZeroCount(count); }
+    void STDMETHODCALLTYPE PSGetSamplers(UINT, UINT count, ID3D11SamplerState** samplers) override { ZeroOut(count, samplers); }
+    void STDMETHODCALLTYPE VSGetShader(ID3D11VertexShader** shader, ID3D11ClassInstance**, UINT* count) override { ZeroOut(1, shader); ZeroCount(count); }
+    void STDMETHODCALLTYPE PSGetConstantBuffers(UINT, UINT count, ID3D11Buffer** buffers) override { ZeroOut(count, buffers); }
+    void STDMETHODCALLTYPE IAGetInputLayout(ID3D11InputLayout** layout) override { ZeroOut(1, layout); }
+    void STDMETHODCALLTYPE IAGetVertexBuffers(UINT, UINT count, ID3D11Buffer** buffers, UINT*, UINT*) override { ZeroOut(count, buffers); }
+    void STDMETHODCALLTYPE IAGetIndexBuffer(ID3D11Buffer** buffer, DXGI_FORMAT*, UINT*) override { ZeroOut(1, buffer); }
+    void STDMETHODCALLTYPE GSGetConstantBuffers(UINT, UINT count, ID3D11Buffer** buffers) override { ZeroOut(count, buffers); }
+    void STDMETHODCALLTYPE GSGetShader(ID3D11GeometryShader** shader, ID3D11ClassInstance**, UINT* count) override { ZeroOut(1, shader); ZeroCount(count); }
+    void STDMETHODCALLTYPE IAGetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY* topology) override { *topology = m_Topology; }
+    void STDMETHODCALLTYPE VSGetShaderResources(UINT, UINT count, ID3D11ShaderResourceView** views) override { ZeroOut(count, views); }
+    void STDMETHODCALLTYPE VSGetSamplers(UINT, UINT count, ID3D11SamplerState** samplers) override { ZeroOut(count, samplers); }
+    void STDMETHODCALLTYPE GetPredication(ID3D11Predicate** predicate, BOOL* value) override { ZeroOut(1, predicate); if (value) *value = FALSE; }
+    void STDMETHODCALLTYPE GSGetShaderResources(UINT, UINT count, ID3D11ShaderResourceView** views) override { ZeroOut(count, views); }
+    void STDMETHODCALLTYPE GSGetSamplers(UINT, UINT count, ID3D11SamplerState** samplers) override { ZeroOut(count, samplers); }
+    void STDMETHODCALLTYPE OMGetRenderTargets(UINT count, ID3D11RenderTargetView** views, ID3D11DepthStencilView** depthView) override { ZeroOut(count, views); ZeroOut(1, depthView); }
+    void STDMETHODCALLTYPE OMGetRenderTargetsAndUnorderedAccessViews(UINT count, ID3D11RenderTargetView** views, ID3D11DepthStencilView** depthView,
+        UINT, UINT uavCount, ID3D11UnorderedAccessView** uavs) override
+    {
+        ZeroOut(count, views);
+        ZeroOut(1, depthView);
+        ZeroOut(uavCount, uavs);
+    }
+    void STDMETHODCALLTYPE OMGetBlendState(ID3D11BlendState** state, FLOAT[4], UINT*) override { ZeroOut(1, state); }
+    void STDMETHODCALLTYPE OMGetDepthStencilState(ID3D11DepthStencilState** state, UINT*) override { ZeroOut(1, state); }
+    void STDMETHODCALLTYPE SOGetTargets(UINT count, ID3D11Buffer** buffers) override { ZeroOut(count, buffers); }
+    void STDMETHODCALLTYPE RSGetState(ID3D11RasterizerState** state) override { ZeroOut(1, state); }
+    void STDMETHODCALLTYPE RSGetViewports(UINT* count, D3D11_VIEWPORT*) override { ZeroCount(count); }
+    void STDMETHODCALLTYPE RSGetScissorRects(UINT* count, D3D11_RECT*) override { ZeroCount(count); }
+    void STDMETHODCALLTYPE HSGetShaderResources(UINT, UINT count, ID3D11ShaderResourceView** views) override { ZeroOut(count, views); }
+    void STDMETHODCALLTYPE HSGetShader(ID3D11HullShader** shader, ID3D11ClassInstance**, UINT* count) override { ZeroOut(1, shader); ZeroCount(count); }
+    void STDMETHODCALLTYPE HSGetSamplers(UINT, UINT count, ID3D11SamplerState** samplers) override { ZeroOut(count, samplers); }
+    void STDMETHODCALLTYPE HSGetConstantBuffers(UINT, UINT count, ID3D11Buffer** buffers) override { ZeroOut(count, buffers); }
+    void STDMETHODCALLTYPE DSGetShaderResources(UINT, UINT count, ID3D11ShaderResourceView** views) override { ZeroOut(count, views); }
+    void STDMETHODCALLTYPE DSGetShader(ID3D11DomainShader** shader, ID3D11ClassInstance**, UINT* count) override { ZeroOut(1, shader); ZeroCount(count); }
+    void STDMETHODCALLTYPE DSGetSamplers(UINT, UINT count, ID3D11SamplerState** samplers) override { ZeroOut(count, samplers); }
+    void STDMETHODCALLTYPE DSGetConstantBuffers(UINT, UINT count, ID3D11Buffer** buffers) override { ZeroOut(count, buffers); }
+    void STDMETHODCALLTYPE CSGetShaderResources(UINT, UINT count, ID3D11ShaderResourceView** views) override { ZeroOut(count, views); }
+    void STDMETHODCALLTYPE CSGetUnorderedAccessViews(UINT, UINT count, ID3D11UnorderedAccessView** views) override { ZeroOut(count, views); }
+    void STDMETHODCALLTYPE CSGetShader(ID3D11ComputeShader** shader, ID3D11ClassInstance**, UINT* count) override { ZeroOut(1, shader); ZeroCount(count); }
+    void STDMETHODCALLTYPE CSGetSamplers(UINT, UINT count, ID3D11SamplerState** samplers) override { ZeroOut(count, samplers); }
+    void STDMETHODCALLTYPE CSGetConstantBuffers(UINT, UINT count, ID3D11Buffer** buffers) override { ZeroOut(count, buffers); }
+    void STDMETHODCALLTYPE VSGetConstantBuffers1(UINT, UINT count, ID3D11Buffer** buffers, UINT*, UINT*) override { ZeroOut(count, buffers); }
+    void STDMETHODCALLTYPE HSGetConstantBuffers1(UINT, UINT count, ID3D11Buffer** buffers, UINT*, UINT*) override { ZeroOut(count, buffers); }
+    void STDMETHODCALLTYPE DSGetConstantBuffers1(UINT, UINT count, ID3D11Buffer** buffers, UINT*, UINT*) override { ZeroOut(count, buffers); }
+    void STDMETHODCALLTYPE GSGetConstantBuffers1(UINT, UINT count, ID3D11Buffer** buffers, UINT*, UINT*) override { ZeroOut(count, buffers); }
+    void STDMETHODCALLTYPE PSGetConstantBuffers1(UINT, UINT count, ID3D11Buffer** buffers, UINT*, UINT*) override { ZeroOut(count, buffers); }
+    void STDMETHODCALLTYPE CSGetConstantBuffers1(UINT, UINT count, ID3D11Buffer** buffers, UINT*, UINT*) override { ZeroOut(count, buffers); }
+
+private:
+    struct Stage
+    {
+        ID3D11Buffer* constantBuffers[D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT] = {};
+        // 11.1 ranges in 16-byte constants; a count of 0 is the whole buffer
+        UINT constantFirst[D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT] = {};
+        UINT constantCount[D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT] = {};
+        ID3D11ShaderResourceView* shaderResources[D3D11_COMMONSHADER_INPUT_RESOURCE_SLOT_COUNT] = {};
+        ID3D11SamplerState* samplers[D3D11_COMMONSHADER_SAMPLER_SLOT_COUNT] = {};
+    };
+
+    // `first` and `constants` are the 11.1 ranges, both null for the whole buffers
+    void SetConstantBuffers(Stage& stage, const char* name, UINT start, UINT count, ID3D11Buffer* const* buffers,
+        const UINT* first, const UINT* constants)
+    {
+        ++m_Tracker->Frame().stateCalls;
+        const char* suffix = first || constants ? "1" : "";
+        if (start + count > D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT)
+        {
+            m_Tracker->Error("%sSetConstantBuffers%s: slots %u..%u out of range", name, suffix, start, start + count);
+            return;
+        }
+        if ((first || constants) && !options.ConstantBufferOffsetting)
+        {
+            m_Tracker->Error("%sSetConstantBuffers1: constant buffer offsetting is not supported", name);
+            return;
+        }
+        if (!first != !constants)
+        {
+            m_Tracker->Error("%sSetConstantBuffers1: first constants without counts, or counts without first constants", name);
+            return;
+        }
+        for (UINT i = 0; i < count; ++i)
+        {
+            ID3D11Buffer* buffer = buffers ? buffers[i] : nullptr;
+            if (buffer && !(static_cast<NullBuffer*>(buffer)->Desc().BindFlags & D3D11_BIND_CONSTANT_BUFFER))
+                m_Tracker->Error("%sSetConstantBuffers%s: buffer in slot %u lacks D3D11_BIND_CONSTANT_BUFFER", name, suffix, start + i);
+            if (buffer && first && (first[i] % 16 != 0 || constants[i] % 16 != 0 || constants[i] == 0 ||
+                constants[i] > D3D11_REQ_CONSTANT_BUFFER_ELEMENT_COUNT))
+            {
+                m_Tracker->Error("%sSetConstantBuffers1: %u constants from %u in slot %u, not a multiple of 16 up to %u", name,
+                    constants[i], first[i], start + i, D3D11_REQ_CONSTANT_BUFFER_ELEMENT_COUNT);
+            }
+            NullBind(stage.constantBuffers[start + i], buffer);
+            stage.constantFirst[start + i] = buffer && first ? first[i] : 0;
+            stage.constantCount[start + i] = buffer && first ? constants[i] : 0;
+        }
+    }
+
+    void SetShaderResources(Stage& stage, const char* name, UINT start, UINT count, ID3D11ShaderResourceView* const* views)
+    {
+        ++m_Tracker->Frame().stateCalls;
+        if (start + count > D3D11_COMMONSHADER_INPUT_RESOURCE_SLOT_COUNT)
+        {
+            m_Tracker->Error("%sSetShaderResources: slots %u..%u out of range", name, start, start + count);
+            return;
+        }
+        for (UINT i = 0; i < count; ++i)
+            NullBind(stage.shaderResources[start + i], views ? views[i] : nullptr);
+    }
+
+    void SetSamplers(Stage& stage, const char* name, UINT start, UINT count, ID3D11SamplerState* const* samplers)
+    {
+        ++m_Tracker->Frame().stateCalls;
+        if (start + count > D3D11_COMMONSHADER_SAMPLER_SLOT_COUNT)
+        {
+            m_Tracker->Error("%sSetSamplers: slots %u..%u out of range", name, start, start + count);
+            return;
+        }
+        for (UINT i = 0; i < count; ++i)
+            NullBind(stage.samplers[start + i], samplers ? samplers[i] : nullptr);
+    }
+
+    template <class T>
+    void Unused(const char* call, UINT count, T* const* objects)
+    {
+        ++m_Tracker->Frame().stateCalls;
+        for (UINT i = 0; objects && i < count; ++i)
+        {
+            if (objects[i])
+            {
+                m_Tracker->Error("%s: the stage is not supported by the null device", call);
+                return;
+            }
+        }
+    }
+
+    template <class T>
+    static void ZeroOut(UINT count, T** objects)
+    {
+        for (UINT i = 0; objects && i < count; ++i)
+            objects[i] = nullptr;
+    }
+
+    static void ZeroCount(UINT* count)
+    {
+        if (count)
+            *count = 0;
+    }
+
+    bool IsRenderTargetBound(ID3D11Resource* resource) const
+    {
+        for (ID3D11RenderTargetView* view : m_RenderTargets)
+        {
+            if (view && static_cast<NullRenderTargetView*>(view)->Resource() == resource)
+                return true;
+        }
+        return false;
+    }
+
+    bool IsBoundForOutput(ID3D11Resource* resource) const
+    {
+        if (m_DepthStencilView && static_cast<NullDepthStencilView*>(m_DepthStencilView)->Resource() == resource)
+            return true;
+        return IsRenderTargetBound(resource);
+    }
+
+    // What the debug layer would complain about at a draw
+    bool ValidateDraw(const char* call, bool indexed, UINT count, UINT start, UINT instanceCount)
+    {
+        bool valid = true;
+        auto fail = [&](const char* problem)
+            {
+                m_Tracker->Error("%s: %s", call, problem);
+                valid = false;
+            };
+
+        if (!m_VertexShader)
+            fail("no vertex shader");
+        if (m_Topology == D3D11_PRIMITIVE_TOPOLOGY_UNDEFINED)
+            fail("no primitive topology");
+        if (m_ViewportCount == 0)
+            fail("no viewport");
+        if (instanceCount == 0 || count == 0)
+            fail("nothing to draw");
+
+        if (indexed)
+        {
+            if (!m_IndexBuffer)
+            {
+                fail("no index buffer");
+            }
+            else
+            {
+                UINT indexBytes = m_IndexFormat == DXGI_FORMAT_R32_UINT ? 4 : 2;
+                UINT64 end = m_IndexOffset + ((UINT64)start + count) * indexBytes;
+                if (end > static_cast<NullBuffer*>(m_IndexBuffer)->Desc().ByteWidth)
+                    fail("indices past the end of the index buffer");
+                if (static_cast<NullBuffer*>(m_IndexBuffer)->mapped)
+                    fail("index buffer is mapped");
+            }
+        }
+
+        if (m_InputLayout)
+        {
+            const NullInputLayout* layout = static_cast<NullInputLayout*>(m_InputLayout);
+            for (UINT slot = 0; slot < D3D11_IA_VERTEX_INPUT_RESOURCE_SLOT_COUNT; ++slot)
+            {
+                if (!(layout->slotMask & (1u << slot)))
+                    continue;
+                if (!m_VertexBuffers[slot])
+                    fail("input layout reads a vertex buffer slot with nothing bound");
+                else if (m_VertexStrides[slot] < layout->slotBytes[slot])
+                    fail("vertex stride smaller than the input layout's elements");
+                else if (static_cast<NullBuffer*>(m_VertexBuffers[slot])->mapped)
+                    fail("vertex buffer is mapped");
+            }
+        }
+
+        for (const Stage* stage : { &m_VS, &m_PS })
+        {
+            for (ID3D11Buffer* buffer : stage->constantBuffers)
+            {
+                if (buffer && static_cast<NullBuffer*>(buffer)->mapped)
+                    fail("constant buffer is mapped");
+            }
+            for (ID3D11ShaderResourceView* view : stage->shaderResources)
+            {
+                if (!view)
+                    continue;
+                ID3D11Resource* resource = static_cast<NullShaderResourceView*>(view)->Resource();
+                if (IsBoundForOutput(resource))
+                    fail("resource bound as a shader resource and as an output");
+                NullBuffer* buffer = NullAsBuffer(resource);
+                if (buffer && buffer->mapped)
+                    fail("shader resource buffer is mapped");
+            }
+        }
+        return valid;
+    }
+
+    void CountDraw(UINT count, UINT instanceCount)
+    {
+        NullD3D11Counters& frame = m_Tracker->Frame();
+        ++frame.drawCalls;
+        frame.instances += instanceCount;
+        frame.vertices += (UINT64)count * instanceCount;
+    }
+
+    Stage m_VS;
+    Stage m_PS;
+    ID3D11VertexShader* m_VertexShader = nullptr;
+    ID3D11PixelShader* m_PixelShader = nullptr;
+    ID3D11InputLayout* m_InputLayout = nullptr;
+    ID3D11Buffer* m_VertexBuffers[D3D11_IA_VERTEX_INPUT_RESOURCE_SLOT_COUNT] = {};
+    UINT m_VertexStrides[D3D11_IA_VERTEX_INPUT_RESOURCE_SLOT_COUNT] = {};
+    UINT m_VertexOffsets[D3D11_IA_VERTEX_INPUT_RESOURCE_SLOT_COUNT] = {};
+    ID3D11Buffer* m_IndexBuffer = nullptr;
+    DXGI_FORMAT m_IndexFormat = DXGI_FORMAT_UNKNOWN;
+    UINT m_IndexOffset = 0;
+    D3D11_PRIMITIVE_TOPOLOGY m_Topology = D3D11_PRIMITIVE_TOPOLOGY_UNDEFINED;
+    ID3D11RasterizerState* m_RasterizerState = nullptr;
+    D3D11_VIEWPORT m_Viewports[D3D11_VIEWPORT_AND_SCISSORRECT_OBJECT_COUNT_PER_PIPELINE] = {};
+    UINT m_ViewportCount = 0;
+    ID3D11RenderTargetView* m_RenderTargets[D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT] = {};
+    ID3D11DepthStencilView* m_DepthStencilView = nullptr;
+    ID3D11BlendState* m_BlendState = nullptr;
+    ID3D11DepthStencilState* m_DepthStencilState = nullptr;
+    UINT64 m_Timestamp = 0;
+};
+
+// Device
+// Owns the tracker and the immediate context, which lives as long as the device does.
+class NullD3D11Device final : public ID3D11Device
+{
+public:
+    NullD3D11Device(UINT creationFlags, NullD3D11MessageFunc messages)
+        : m_Tracker(messages), m_CreationFlags(creationFlags)
+    {
+        m_Context = new NullDeviceContext(this, &m_Tracker);
+        m_Context->options.MapNoOverwriteOnDynamicBufferSRV = TRUE;
+        m_Context->options.ConstantBufferOffsetting = TRUE;
+        m_Context->options.MapNoOverwriteOnDynamicConstantBuffer = TRUE;
+        // The context's reference on the device would keep it alive forever
+        Release();
+    }
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** object) override
+    {
+        if (!object)
+            return E_POINTER;
+        if (!NullGuidEqual(riid, __uuidof(IUnknown)) && !NullGuidEqual(riid, __uuidof(ID3D11Device)))
+        {
+            *object = nullptr;
+            return E_NOINTERFACE;
+        }
+        AddRef();
+        *object = static_cast<ID3D11Device*>(this);
+        return S_OK;
+    }
+
+    ULONG STDMETHODCALLTYPE AddRef() override { return ++m_RefCount; }
+
+    ULONG STDMETHODCALLTYPE Release() override
+    {
+        ULONG count = --m_RefCount;
+        if (count == 0 && !m_Destroying)
+        {
+            // The context releases its reference on the way out; keep it from recursing
+            m_Destroying = true;
+            m_RefCount = 1;
+            m_Context->ClearState();
+            m_Context->Release();
+            delete this;
+        }
+        return count;
+    }
+
+    // Resources
+    HRESULT STDMETHODCALLTYPE CreateBuffer(const D3D11_BUFFER_DESC* desc, const D3D11_SUBRESOURCE_DATA* initialData, ID3D11Buffer** buffer) override
+    {
+        const char* problem = nullptr;
+        if (!desc || desc->ByteWidth == 0)
+            problem = "no desc or zero ByteWidth";
+        else if ((desc->BindFlags & D3D11_BIND_CONSTANT_BUFFER) && (desc->ByteWidth % 16 != 0 || desc->ByteWidth > D3D11_REQ_CONSTANT_BUFFER_ELEMENT_COUNT * 16))
+            problem = "constant buffer size not a multiple of 16 or over 64 KB";
+        else if ((desc->BindFlags & D3D11_BIND_CONSTANT_BUFFER) && desc->BindFlags != D3D11_BIND_CONSTANT_BUFFER)
+            problem = "constant buffers take no other bind flags";
+        else if (desc->Usage == D3D11_USAGE_DYNAMIC && desc->CPUAccessFlags != D3D11_CPU_ACCESS_WRITE)
+            problem = "dynamic buffers need exactly CPU write access";
+        else if (desc->Usage == D3D11_USAGE_IMMUTABLE && (!initialData || !initialData->pSysMem))
+            problem = "immutable buffer without initial data";
+        else if ((desc->Usage == D3D11_USAGE_DEFAULT || desc->Usage == D3D11_USAGE_IMMUTABLE) && desc->CPUAccessFlags != 0)
+            problem = "only dynamic and staging buffers take CPU access flags";
+        else if (desc->Usage == D3D11_USAGE_STAGING && desc->BindFlags != 0)
+            problem = "staging buffers cannot be bound";
+        else if ((desc->MiscFlags & D3D11_RESOURCE_MISC_BUFFER_STRUCTURED) && (desc->StructureByteStride == 0 || desc->ByteWidth % desc->StructureByteStride != 0))
+            problem = "structured buffer size not a multiple of its stride";
+        else if ((desc->MiscFlags & D3D11_RESOURCE_MISC_BUFFER_ALLOW_RAW_VIEWS) && desc->ByteWidth % 4 != 0)
+            problem = "raw buffer size not a multiple of 4";
+        if (problem)
+        {
+            m_Tracker.Error("CreateBuffer: %s", problem);
+            return E_INVALIDARG;
+        }
+        if (!buffer)
+            return S_FALSE;
+        *buffer = new NullBuffer(this, &m_Tracker, *desc, initialData);
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE CreateTexture2D(const D3D11_TEXTURE2D_DESC* desc, const D3D11_SUBRESOURCE_DATA* initialData, ID3D11Texture2D** texture) override
+    {
+        if (!desc)
+        {
+            m_Tracker.Error("CreateTexture2D: no desc");
+            return E_INVALIDARG;
+        }
+
+        D3D11_TEXTURE2D_DESC full = *desc;
+        UINT maxMips = 1;
+        while ((full.Width | full.Height) >> maxMips)
+            ++maxMips;
+        if (full.MipLevels == 0)
+            full.MipLevels = maxMips;
+
+        const char* problem = nullptr;
+        if (full.Width == 0 || full.Height == 0 || full.Width > D3D11_REQ_TEXTURE2D_U_OR_V_DIMENSION || full.Height > D3D11_REQ_TEXTURE2D_U_OR_V_DIMENSION)
+            problem = "size out of range";
+        else if (full.ArraySize == 0 || full.MipLevels > maxMips || full.SampleDesc.Count == 0)
+            problem = "no array slices, too many mips or no samples";
+        else if ((full.MiscFlags & D3D11_RESOURCE_MISC_TEXTURECUBE) && full.ArraySize % 6 != 0)
+            problem = "cube texture array size not a multiple of 6";
+        else if ((full.BindFlags & D3D11_BIND_SHADER_RESOURCE) && NullIsDepthFormat(full.Format))
+            problem = "depth formats cannot be read by shaders, use a typeless format";
+        else if ((full.BindFlags & D3D11_BIND_DEPTH_STENCIL) && (full.BindFlags & D3D11_BIND_RENDER_TARGET))
+            problem = "render target and depth stencil at once";
+        else if (full.Usage == D3D11_USAGE_IMMUTABLE && (!initialData || !initialData->pSysMem))
+            problem = "immutable texture without initial data";
+        else if (full.Usage == D3D11_USAGE_DYNAMIC && (full.MipLevels != 1 || full.ArraySize != 1 || full.CPUAccessFlags != D3D11_CPU_ACCESS_WRITE))
+            problem = "dynamic textures need one mip, one slice and CPU write access";
+        if (!problem && initialData)
+        {
+            for (UINT slice = 0; slice < full.ArraySize && !problem; ++slice)
+            {
+                for (UINT mip = 0; mip < full.MipLevels && !problem; ++mip)
+                {
+                    const D3D11_SUBRESOURCE_DATA& data = initialData[slice * full.MipLevels + mip];
+                    UINT width = (full.Width >> mip) ? (full.Width >> mip) : 1;
+                    if (!data.pSysMem || data.SysMemPitch < width * NullFormatBytes(full.Format))
+                        problem = "initial data missing or with a row pitch under a row";
+                }
+            }
+        }
+        if (problem)
+        {
+            m_Tracker.Error("CreateTexture2D: %s", problem);
+            return E_INVALIDARG;
+        }
+        if (!texture)
+            return S_FALSE;
+        *texture = new NullTexture2D(this, &m_Tracker, full);
+        return S_OK;
+    }
+
+    // Views
+    HRESULT STDMETHODCALLTYPE CreateShaderResourceView(ID3D11Resource* resource, const D3D11_SHADER_RESOURCE_VIEW_DESC* desc, ID3D11ShaderResourceView** view) override
+    {
+        D3D11_SHADER_RESOURCE_VIEW_DESC full = {};
+        const char* problem = nullptr;
+        if (NullBuffer* buffer = NullAsBuffer(resource))
+        {
+            const D3D11_BUFFER_DESC& b = buffer->Desc();
+            bool structured = (b.MiscFlags & D3D11_RESOURCE_MISC_BUFFER_STRUCTURED) != 0;
+            if (desc)
+            {
+                full = *desc;
+            }
+            else if (structured)
+            {
+                full.ViewDimension = D3D11_SRV_DIMENSION_BUFFER;
+                full.Buffer.FirstElement = 0;
+                full.Buffer.NumElements = b.ByteWidth / b.StructureByteStride;
+            }
+            bool raw = full.ViewDimension == D3D11_SRV_DIMENSION_BUFFEREX && (full.BufferEx.Flags & D3D11_BUFFEREX_SRV_FLAG_RAW);
+            UINT elementBytes = structured ? b.StructureByteStride : raw ? 4 : NullFormatBytes(full.Format);
+            UINT first = full.ViewDimension == D3D11_SRV_DIMENSION_BUFFEREX ? full.BufferEx.FirstElement : full.Buffer.FirstElement;
+            UINT count = full.ViewDimension == D3D11_SRV_DIMENSION_BUFFEREX ? full.BufferEx.NumElements : full.Buffer.NumElements;
+            if (!(b.BindFlags & D3D11_BIND_SHADER_RESOURCE))
+                problem = "buffer lacks D3D11_BIND_SHADER_RESOURCE";
+            else if (full.ViewDimension != D3D11_SRV_DIMENSION_BUFFER && full.ViewDimension != D3D11_SRV_DIMENSION_BUFFEREX)
+                problem = "buffer views need a buffer dimension, or a desc unless the buffer is structured";
+            else if (raw && (!(b.MiscFlags & D3D11_RESOURCE_MISC_BUFFER_ALLOW_RAW_VIEWS) || full.Format != DXGI_FORMAT_R32_TYPELESS))
+                problem = "raw views need D3D11_RESOURCE_MISC_BUFFER_ALLOW_RAW_VIEWS and R32_TYPELESS";
+            else if (count == 0 || (elementBytes != 0 && ((UINT64)first + count) * elementBytes > b.ByteWidth))
+                problem = "elements past the end of the buffer";
+        }
+        else if (NullTexture2D* texture = NullAsTexture2D(resource))
+        {
+            const D3D11_TEXTURE2D_DESC& t = texture->Desc();
+            bool cube = (t.MiscFlags & D3D11_RESOURCE_MISC_TEXTURECUBE) != 0;
+            if (desc)
+            {
+                full = *desc;
+            }
+            else
+            {
+                full.Format = t.Format;
+                if (cube)
+                {
+                    full.ViewDimension = D3D11_SRV_DIMENSION_TEXTURECUBE;
+                    full.TextureCube.MipLevels = t.MipLevels;
+                }
+                else if (t.ArraySize > 1)
+                {
+                    full.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2DARRAY;
+                    full.Texture2DArray.MipLevels = t.MipLevels;
+                    full.Texture2DArray.ArraySize = t.ArraySize;
+                }
+                else
+                {
+                    full.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2D;
+                    full.Texture2D.MipLevels = t.MipLevels;
+                }
+            }
+            if (!(t.BindFlags & D3D11_BIND_SHADER_RESOURCE))
+                problem = "texture lacks D3D11_BIND_SHADER_RESOURCE";
+            else if (full.ViewDimension == D3D11_SRV_DIMENSION_TEXTURECUBE && !cube)
+                problem = "cube view of a texture created without D3D11_RESOURCE_MISC_TEXTURECUBE";
+            else if (full.ViewDimension != D3D11_SRV_DIMENSION_TEXTURE2D && full.ViewDimension != D3D11_SRV_DIMENSION_TEXTURE2DARRAY &&
+                full.ViewDimension != D3D11_SRV_DIMENSION_TEXTURECUBE)
+                problem = "view dimension does not fit a 2D texture";
+        }
+        else
+        {
+            problem = "no resource";
+        }
+        if (problem)
+        {
+            m_Tracker.Error("CreateShaderResourceView: %s", problem);
+            return E_INVALIDARG;
+        }
+        if (!view)
+            return S_FALSE;
+        *view = new NullShaderResourceView(this, &m_Tracker, "shader resource view", resource, full);
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE CreateRenderTargetView(ID3D11Resource* resource, const D3D11_RENDER_TARGET_VIEW_DESC* desc, ID3D11RenderTargetView** view) override
+    {
+        NullTexture2D* texture = NullAsTexture2D(resource);
+        if (!texture || !(texture->Desc().BindFlags & D3D11_BIND_RENDER_TARGET))
+        {
+            m_Tracker.Error("CreateRenderTargetView: resource is not a 2D texture with D3D11_BIND_RENDER_TARGET");
+            return E_INVALIDARG;
+        }
+        D3D11_RENDER_TARGET_VIEW_DESC full = {};
+        if (desc)
+        {
+            full = *desc;
+        }
+        else
+        {
+            full.Format = texture->Desc().Format;
+            full.ViewDimension = texture->Desc().ArraySize > 1 ? D3D11_RTV_DIMENSION_TEXTURE2DARRAY : D3D11_RTV_DIMENSION_TEXTURE2D;
+            full.Texture2DArray.ArraySize = texture->Desc().ArraySize;
+        }
+        if (!view)
+            return S_FALSE;
+        *view = new NullRenderTargetView(this, &m_Tracker, "render target view", resource, full);
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE CreateDepthStencilView(ID3D11Resource* resource, const D3D11_DEPTH_STENCIL_VIEW_DESC* desc, ID3D11DepthStencilView** view) override
+    {
+        NullTexture2D* texture = NullAsTexture2D(resource);
+        if (!texture || !(texture->Desc().BindFlags & D3D11_BIND_DEPTH_STENCIL))
+        {
+            m_Tracker.Error("CreateDepthStencilView: resource is not a 2D texture with D3D11_BIND_DEPTH_STENCIL");
+            return E_INVALIDARG;
+        }
+        D3D11_DEPTH_STENCIL_VIEW_DESC full = {};
+        if (desc)
+        {
+            full = *desc;
+        }
+        else
+        {
+            full.Format = texture->Desc().Format;
+            full.ViewDimension = texture->Desc().ArraySize > 1 ? D3D11_DSV_DIMENSION_TEXTURE2DARRAY : D3D11_DSV_DIMENSION_TEXTURE2D;
+            full.Texture2DArray.ArraySize = texture->Desc().ArraySize;
+        }
+        if (!NullIsDepthFormat(full.Format))
+        {
+            m_Tracker.Error("CreateDepthStencilView: format %u is not a depth format", (UINT)full.Format);
+            return E_INVALIDARG;
+        }
+        if (!view)
+            return S_FALSE;
+        *view = new NullDepthStencilView(this, &m_Tracker, "depth stencil view", resource, full);
+        return S_OK;
+    }
+
+    // Shaders and input layouts; the bytecode is only checked for presence
+    HRESULT STDMETHODCALLTYPE CreateInputLayout(const D3D11_INPUT_ELEMENT_DESC* elements, UINT count, const void* bytecode, SIZE_T bytecodeLength, ID3D11InputLayout** layout) override
+    {
+        const char* problem = nullptr;
+        if (!elements || count == 0 || count > D3D11_IA_VERTEX_INPUT_STRUCTURE_ELEMENT_COUNT)
+            problem = "no elements or too many";
+        else if (!bytecode || bytecodeLength == 0)
+            problem = "no shader bytecode";
+        for (UINT i = 0; i < count && !problem; ++i)
+        {
+            if (elements[i].InputSlot >= D3D11_IA_VERTEX_INPUT_RESOURCE_SLOT_COUNT || NullFormatBytes(elements[i].Format) == 0)
+                problem = "element slot out of range or format unknown";
+        }
+        if (problem)
+        {
+            m_Tracker.Error("CreateInputLayout: %s", problem);
+            return E_INVALIDARG;
+        }
+        if (!layout)
+            return S_FALSE;
+        *layout = new NullInputLayout(this, &m_Tracker, elements, count);
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE CreateVertexShader(const void* bytecode, SIZE_T length, ID3D11ClassLinkage* linkage, ID3D11VertexShader** shader) override
+    {
+        return CreateShader("CreateVertexShader", "vertex shader", bytecode, length, linkage, shader);
+    }
+
+    HRESULT STDMETHODCALLTYPE CreatePixelShader(const void* bytecode, SIZE_T length, ID3D11ClassLinkage* linkage, ID3D11PixelShader** shader) override
+    {
+        return CreateShader("CreatePixelShader", "pixel shader", bytecode, length, linkage, shader);
+    }
+
+    // States
+    HRESULT STDMETHODCALLTYPE CreateBlendState(const D3D11_BLEND_DESC* desc, ID3D11BlendState** state) override
+    {
+        return CreateState<NullBlendState>("CreateBlendState", "blend state", desc, state);
+    }
+
+    HRESULT STDMETHODCALLTYPE CreateDepthStencilState(const D3D11_DEPTH_STENCIL_DESC* desc, ID3D11DepthStencilState** state) override
+    {
+        return CreateState<NullDepthStencilState>("CreateDepthStencilState", "depth stencil state", desc, state);
+    }
+
+    HRESULT STDMETHODCALLTYPE CreateRasterizerState(const D3D11_RASTERIZER_DESC* desc, ID3D11RasterizerState** state) override
+    {
+        return CreateState<NullRasterizerState>("CreateRasterizerState", "rasterizer state", desc, state);
+    }
+
+    HRESULT STDMETHODCALLTYPE CreateSamplerState(const D3D11_SAMPLER_DESC* desc, ID3D11SamplerState** state) override
+    {
+        return CreateState<NullSamplerState>("CreateSamplerState", "sampler state", desc, state);
+    }
+
+    HRESULT STDMETHODCALLTYPE CreateQuery(const D3D11_QUERY_DESC* desc, ID3D11Query** query) override
+    {
+        if (!desc || (desc->Query != D3D11_QUERY_EVENT && desc->Query != D3D11_QUERY_OCCLUSION &&
+            desc->Query != D3D11_QUERY_TIMESTAMP && desc->Query != D3D11_QUERY_TIMESTAMP_DISJOINT))
+        {
+            m_Tracker.Error("CreateQuery: only event, occlusion and timestamp queries are supported");
+            return E_INVALIDARG;
+        }
+        if (!query)
+            return S_FALSE;
+        *query = new NullQuery(this, &m_Tracker, *desc);
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE CheckFeatureSupport(D3D11_FEATURE feature, void* data, UINT dataSize) override
+    {
+        if (feature == D3D11_FEATURE_D3D11_OPTIONS && data && dataSize == sizeof(D3D11_FEATURE_DATA_D3D11_OPTIONS))
+        {
+            memcpy(data, &m_Context->options, sizeof(D3D11_FEATURE_DATA_D3D11_OPTIONS));
+            return S_OK;
+        }
+        if (feature == D3D11_FEATURE_THREADING && data && dataSize == sizeof(D3D11_FEATURE_DATA_THREADING))
+        {
+            D3D11_FEATURE_DATA_THREADING threading = { TRUE, FALSE };
+            memcpy(data, &threading, sizeof(threading));
+            return S_OK;
+        }
+        return E_INVALIDARG;
+    }
+
+    HRESULT STDMETHODCALLTYPE CheckMultisampleQualityLevels(DXGI_FORMAT, UINT sampleCount, UINT* levels) override
+    {
+        *levels = sampleCount == 1 ? 1 : 0;
+        return S_OK;
+    }
+
+    D3D_FEATURE_LEVEL STDMETHODCALLTYPE GetFeatureLevel() override { return D3D_FEATURE_LEVEL_11_0; }
+    UINT STDMETHODCALLTYPE GetCreationFlags() override { return m_CreationFlags; }
+    HRESULT STDMETHODCALLTYPE GetDeviceRemovedReason() override { return S_OK; }
+
+    void STDMETHODCALLTYPE GetImmediateContext(ID3D11DeviceContext** context) override
+    {
+        m_Context->AddRef();
+        *context = m_Context;
+    }
+
+    HRESULT STDMETHODCALLTYPE SetExceptionMode(UINT flags) override
+    {
+        m_ExceptionMode = flags;
+        return S_OK;
+    }
+
+    UINT STDMETHODCALLTYPE GetExceptionMode() override { return m_ExceptionMode; }
+
+    HRESULT STDMETHODCALLTYPE GetPrivateData(REFGUID, UINT* dataSize, void*) override
+    {
+        if (dataSize)
+            *dataSize = 0;
+        return DXGI_ERROR_NOT_FOUND;
+    }
+
+    HRESULT STDMETHODCALLTYPE SetPrivateData(REFGUID, UINT, const void*) override { return S_OK; }
+    HRESULT STDMETHODCALLTYPE SetPrivateDataInterface(REFGUID, const IUnknown*) override { return S_OK; }
+
+    // Parts of the device the project does not use
+    HRESULT STDMETHODCALLTYPE CreateTexture1D(const D3D11_TEXTURE1D_DESC*, const D3D11_SUBRESOURCE_DATA*, ID3D11Texture1D**) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE CreateTexture3D(const D3D11_TEXTURE3D_DESC*, const D3D11_SUBRESOURCE_DATA*, ID3D11Texture3D**) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE CreateUnorderedAccessView(ID3D11Resource*, const D3D11_UNORDERED_ACCESS_VIEW_DESC*, ID3D11UnorderedAccessView**) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE CreateGeometryShader(const void*, SIZE_T, ID3D11ClassLinkage*, ID3D11GeometryShader**) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE CreateGeometryShaderWithStreamOutput(const void*, SIZE_T, const D3D11_SO_DECLARATION_ENTRY*, UINT, const UINT*, UINT, UINT,
+        ID3D11ClassLinkage*, ID3D11GeometryShader**) override
+    {
+        return E_NOTIMPL;
+    }
+    HRESULT STDMETHODCALLTYPE CreateHullShader(const void*, SIZE_T, ID3D11ClassLinkage*, ID3D11HullShader**) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE CreateDomainShader(const void*, SIZE_T, ID3D11ClassLinkage*, ID3D11DomainShader**) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE CreateComputeShader(const void*, SIZE_T, ID3D11ClassLinkage*, ID3D11ComputeShader**) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE CreateClassLinkage(ID3D11ClassLinkage**) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE CreatePredicate(const D3D11_QUERY_DESC*, ID3D11Predicate**) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE CreateCounter(const D3D11_COUNTER_DESC*, ID3D11Counter**) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE CreateDeferredContext(UINT, ID3D11DeviceContext**) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE OpenSharedResource(HANDLE, REFIID, void**) override { return E_NOTIMPL; }
+    HRESULT STDMETHODCALLTYPE CheckFormatSupport(DXGI_FORMAT, UINT*) override { return E_NOTIMPL; }
+    void STDMETHODCALLTYPE CheckCounterInfo(D3D11_COUNTER_INFO* info) override { memset(info, 0, sizeof(*info)); }
+    HRESULT STDMETHODCALLTYPE CheckCounter(const D3D11_COUNTER_DESC*, D3D11_COUNTER_TYPE*, UINT*, LPSTR, UINT*, LPSTR, UINT*, LPSTR, UINT*) override { return E_NOTIMPL; }
+
+    // Validation results and work counters
+    UINT GetErrorCount() const { return m_Tracker.GetErrorCount(); }
+    UINT GetLiveObjectCount() const { return m_Tracker.GetLiveObjectCount(); }  // the context included
+    const NullD3D11Counters& GetLastFrameCounters() const { return m_Tracker.GetLastFrame(); }
+
+    // What CheckFeatureSupport reports for D3D11_FEATURE_D3D11_OPTIONS; the context checks
+    // NO_OVERWRITE maps and 11.1 constant buffer ranges against it
+    void SetOptions(const D3D11_FEATURE_DATA_D3D11_OPTIONS& options) { m_Context->options = options; }
+    const D3D11_FEATURE_DATA_D3D11_OPTIONS& GetOptions() const { return m_Context->options; }
+    const NullD3D11Counters& GetTotalCounters() const { return m_Tracker.GetTotal(); }
+    UINT64 GetFrameCount() const { return m_Tracker.GetFrameCount(); }
+    void ReportLiveObjects() const { m_Tracker.ReportLiveObjects(); }
+
+    NullD3D11Tracker& Tracker() { return m_Tracker; }
+
+private:
+    template <class Interface>
+    HRESULT CreateShader(const char* call, const char* kind, const void* bytecode, SIZE_T length, ID3D11ClassLinkage* linkage, Interface** shader)
+    {
+        if (!bytecode || length == 0 || linkage)
+        {
+            m_Tracker.Error("%s: no bytecode, or a class linkage", call);
+            return E_INVALIDARG;
+        }
+        if (!shader)
+            return S_FALSE;
+        *shader = new NullShader<Interface>(this, &m_Tracker, kind, length);
+        return S_OK;
+    }
+
+    template <class State, class Interface, class Desc>
+    HRESULT CreateState(const char* call, const char* kind, const Desc* desc, Interface** state)
+    {
+        if (!desc)
+        {
+            m_Tracker.Error("%s: no desc", call);
+            return E_INVALIDARG;
+        }
+        if (!state)
+            return S_FALSE;
+        *state = new State(this, &m_Tracker, kind, *desc);
+        return S_OK;
+    }
+
+    NullD3D11Tracker m_Tracker;
+    NullDeviceContext* m_Context = nullptr;
+    ULONG m_RefCount = 1;
+    UINT m_CreationFlags = 0;
+    UINT m_ExceptionMode = 0;
+    bool m_Destroying = false;
+};
+
+// Swap chain
+// Present closes the device's frame. The back buffer is an ordinary texture, so resizing
+// fails, as in DXGI, while anything still references it.
+class NullSwapChain final : public IDXGISwapChain
+{
+public:
+    NullSwapChain(NullD3D11Device* device, const DXGI_SWAP_CHAIN_DESC& desc)
+        : m_Device(device), m_Desc(desc)
+    {
+        m_Device->AddRef();
+        CreateBackBuffer();
+    }
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** object) override
+    {
+        if (!object)
+            return E_POINTER;
+        if (!NullGuidEqual(riid, __uuidof(IUnknown)) && !NullGuidEqual(riid, __uuidof(IDXGIObject)) &&
+            !NullGuidEqual(riid, __uuidof(IDXGIDeviceSubObject)) && !NullGuidEqual(riid, __uuidof(IDXGISwapChain)))
+        {
+            *object = nullptr;
+            return E_NOINTERFACE;
+        }
+        AddRef();
+        *object = static_cast<IDXGISwapChain*>(this);
+        return S_OK;
+    }
+
+    ULONG STDMETHODCALLTYPE AddRef() override { return ++m_RefCount; }
+
+    ULONG STDMETHODCALLTYPE Release() override
+    {
+        ULONG count = --m_RefCount;
+        if (count == 0)
+        {
+            m_BackBuffer->Release();
+            m_Device->Release();
+            delete this;
+        }
+        return count;
+    }
+
+    HRESULT STDMETHODCALLTYPE Present(UINT syncInterval, UINT) override
+    {
+        if (syncInterval > 4)
+            m_Device->Tracker().Error("Present: sync interval %u", syncInterval);
+        m_Device->Tracker().EndFrame();
+        ++m_PresentCount;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetBuffer(UINT buffer, REFIID riid, void** surface) override
+    {
+        if (buffer >= m_Desc.BufferCount)
+        {
+            m_Device->Tracker().Error("GetBuffer: buffer %u of %u", buffer, m_Desc.BufferCount);
+            return DXGI_ERROR_INVALID_CALL;
+        }
+        return m_BackBuffer->QueryInterface(riid, surface);
+    }
+
+    HRESULT STDMETHODCALLTYPE ResizeBuffers(UINT bufferCount, UINT width, UINT height, DXGI_FORMAT format, UINT flags) override
+    {
+        if (m_BackBuffer->GetRefCount() > 1)
+        {
+            m_Device->Tracker().Error("ResizeBuffers: the back buffer is still referenced");
+            return DXGI_ERROR_INVALID_CALL;
+        }
+        if (bufferCount != 0)
+            m_Desc.BufferCount = bufferCount;
+        if (width != 0)
+            m_Desc.BufferDesc.Width = width;
+        if (height != 0)
+            m_Desc.BufferDesc.Height = height;
+        if (format != DXGI_FORMAT_UNKNOWN)
+            m_Desc.BufferDesc.Format = format;
+        m_Desc.Flags = flags;
+        m_BackBuffer->Release();
+        CreateBackBuffer();
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetDesc(DXGI_SWAP_CHAIN_DESC* desc) override
+    {
+        *desc = m_Desc;
+        return S_OK;
+    }
+
+    HRESULT STDMETHODCALLTYPE GetDevice(REFIID riid, void** device) override { return m_Device->QueryInterface(riid, device); }
+    HRESULT STDMETHODCALLTYPE GetParent(REFIID, void** parent) override
+    {
+        *parent = nullptr;
+        return E_NOINTERFACE;
+    }
+    HRESULT STDMETHODCALLTYPE SetPrivateData(REFGUID, UINT, const void*) override { return S_OK; }
+    HRESULT STDMETHODCALLTYPE SetPrivateDataInterface(REFGUID, const IUnknown*) override { return S_OK; }
+    HRESULT STDMETHODCALLTYPE GetPrivateData(REFGUID, UINT* dataSize, void*) override
+    {
+        if (dataSize)
+            *dataSize = 0;
+        return DXGI_ERROR_NOT_FOUND;
+    }
+    HRESULT STDMETHODCALLTYPE SetFullscreenState(BOOL fullscreen, IDXGIOutput*) override
+    {
+        m_Fullscreen = fullscreen;
+        return S_OK;
+    }
+    HRESULT STDMETHODCALLTYPE GetFullscreenState(BOOL* fullscreen, IDXGIOutput** target) override
+    {
+        if (fullscreen)
+            *fullscreen = m_Fullscreen;
+        if (target)
+            *target = nullptr;
+        return S_OK;
+    }
+    HRESULT STDMETHODCALLTYPE ResizeTarget(const DXGI_MODE_DESC*) override { return S_OK; }
+    HRESULT STDMETHODCALLTYPE GetContainingOutput(IDXGIOutput** output) override
+    {
+        *output = nullptr;
+        return DXGI_ERROR_UNSUPPORTED;
+    }
+    HRESULT STDMETHODCALLTYPE GetFrameStatistics(DXGI_FRAME_STATISTICS*) override { return DXGI_ERROR_UNSUPPORTED; }
+    HRESULT STDMETHODCALLTYPE GetLastPresentCount(UINT* count) override
+    {
+        *count = m_PresentCount;
+        return S_OK;
+    }
+
+private:
+    void CreateBackBuffer()
+    {
+        D3D11_TEXTURE2D_DESC desc = {};
+        desc.Width = m_Desc.BufferDesc.Width;
+        desc.Height = m_Desc.BufferDesc.Height;
+        desc.MipLevels = 1;
+        desc.ArraySize = 1;
+        desc.Format = m_Desc.BufferDesc.Format;
+        desc.SampleDesc = m_Desc.SampleDesc;
+        desc.Usage = D3D11_USAGE_DEFAULT;
+        desc.BindFlags = D3D11_BIND_RENDER_TARGET;
+        m_BackBuffer = new NullTexture2D(m_Device, &m_Device->Tracker(), desc);
+        m_BackBuffer->SetPrivateData(WKPDID_D3DDebugObjectName, 11, "back buffer");
+    }
+
+    NullD3D11Device* m_Device;
+    DXGI_SWAP_CHAIN_DESC m_Desc;
+    NullTexture2D* m_BackBuffer = nullptr;
+    ULONG m_RefCount = 1;
+    UINT m_PresentCount = 0;
+    BOOL m_Fullscreen = FALSE;
+};
+
+// Stands in for D3DCompile: the "bytecode" is the source itself, so shaders and input
+// layouts can be created without the compiler
+class NullBlob final : public ID3DBlob
+{
+public:
+    NullBlob(const void* data, SIZE_T size) : m_Bytes(static_cast<const BYTE*>(data), static_cast<const BYTE*>(data) + size) {}
+
+    HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** object) override
+    {
+        if (!NullGuidEqual(riid, __uuidof(IUnknown)) && !NullGuidEqual(riid, __uuidof(ID3DBlob)))
+        {
+            *object = nullptr;
+            return E_NOINTERFACE;
+        }
+        AddRef();
+        *object = static_cast<ID3DBlob*>(this);
+        return S_OK;
+    }
+
+    ULONG STDMETHODCALLTYPE AddRef() override { return ++m_RefCount; }
+
+    ULONG STDMETHODCALLTYPE Release() override
+    {
+        ULONG count = --m_RefCount;
+        if (count == 0)
+            delete this;
+        return count;
+    }
+
+    LPVOID STDMETHODCALLTYPE GetBufferPointer() override { return m_Bytes.data(); }
+    SIZE_T STDMETHODCALLTYPE GetBufferSize() override { return m_Bytes.size(); }
+
+private:
+    std::vector<BYTE> m_Bytes;
+    ULONG m_RefCount = 1;
+};
+
+inline HRESULT NullCompileShader(const void* source, SIZE_T sourceSize, ID3DBlob** code, ID3DBlob** errors)
+{
+    if (errors)
+        *errors = nullptr;
+    if (!source || sourceSize == 0 || !code)
+        return E_INVALIDARG;
+    *code = new NullBlob(source, sourceSize);
+    return S_OK;
+}
+
+// The device, its immediate context and a swap chain over `swapChainDesc`, as
+// D3D11CreateDeviceAndSwapChain would return them; `messages` receives every problem the
+// validation finds
+inline HRESULT CreateNullD3D11Device(const DXGI_SWAP_CHAIN_DESC& swapChainDesc, UINT creationFlags, NullD3D11MessageFunc messages,
+    NullD3D11Device** device, ID3D11DeviceContext** context, IDXGISwapChain** swapChain)
+{
+    if (!device || !context || !swapChain || swapChainDesc.BufferCount == 0 ||
+        swapChainDesc.BufferDesc.Width == 0 || swapChainDesc.BufferDesc.Height == 0)
+    {
+        return E_INVALIDARG;
+    }
+    NullD3D11Device* created = new NullD3D11Device(creationFlags, messages);
+    created->GetImmediateContext(context);
+    *swapChain = new NullSwapChain(created, swapChainDesc);
+    *device = created;
+    return S_OK;
+}
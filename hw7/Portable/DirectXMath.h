@@ -0,0 +1,503 @@
+// Portable stand-in for the subset of DirectXMath hw7 uses, on SSE. The conventions match
+// the library: row vectors, row-major matrices, left-handed views, and XMScalarSinCos's
+// polynomial, so the headless build culls and sorts like the Windows build.
+#pragma once
+
+#include <immintrin.h>
+#include <cmath>
+#include <cstdint>
+
+#define XM_CALLCONV
+
+namespace DirectX
+{
+
+const float XM_PI = 3.141592654f;
+const float XM_2PI = 6.283185307f;
+const float XM_1DIVPI = 0.318309886f;
+const float XM_1DIV2PI = 0.159154943f;
+const float XM_PIDIV2 = 1.570796327f;
+const float XM_PIDIV4 = 0.785398163f;
+
+typedef __m128 XMVECTOR;
+typedef const XMVECTOR FXMVECTOR;
+typedef const XMVECTOR GXMVECTOR;
+typedef const XMVECTOR HXMVECTOR;
+typedef const XMVECTOR& CXMVECTOR;
+
+// Storage types
+struct XMFLOAT2
+{
+    float x, y;
+
+    XMFLOAT2() = default;
+    XMFLOAT2(float _x, float _y) : x(_x), y(_y) {}
+};
+
+struct XMFLOAT3
+{
+    float x, y, z;
+
+    XMFLOAT3() = default;
+    XMFLOAT3(float _x, float _y, float _z) : x(_x), y(_y), z(_z) {}
+};
+
+struct alignas(16) XMFLOAT3A : XMFLOAT3
+{
+    using XMFLOAT3::XMFLOAT3;
+    XMFLOAT3A() = default;
+};
+
+struct XMFLOAT4
+{
+    float x, y, z, w;
+
+    XMFLOAT4() = default;
+    XMFLOAT4(float _x, float _y, float _z, float _w) : x(_x), y(_y), z(_z), w(_w) {}
+};
+
+struct alignas(16) XMFLOAT4A : XMFLOAT4
+{
+    using XMFLOAT4::XMFLOAT4;
+    XMFLOAT4A() = default;
+};
+
+struct XMINT4
+{
+    int32_t x, y, z, w;
+
+    XMINT4() = default;
+    XMINT4(int32_t _x, int32_t _y, int32_t _z, int32_t _w) : x(_x), y(_y), z(_z), w(_w) {}
+};
+
+struct XMUINT4
+{
+    uint32_t x, y, z, w;
+
+    XMUINT4() = default;
+    XMUINT4(uint32_t _x, uint32_t _y, uint32_t _z, uint32_t _w) : x(_x), y(_y), z(_z), w(_w) {}
+};
+
+struct XMFLOAT3X4
+{
+    union
+    {
+        struct
+        {
+            float _11, _12, _13, _14;
+            float _21, _22, _23, _24;
+            float _31, _32, _33, _34;
+        };
+        float m[3][4];
+    };
+};
+
+struct XMFLOAT4X4
+{
+    union
+    {
+        struct
+        {
+            float _11, _12, _13, _14;
+            float _21, _22, _23, _24;
+            float _31, _32, _33, _34;
+            float _41, _42, _43, _44;
+        };
+        float m[4][4];
+    };
+};
+
+struct alignas(16) XMFLOAT4X4A : XMFLOAT4X4
+{
+};
+
+struct alignas(16) XMMATRIX
+{
+    XMVECTOR r[4];
+
+    XMMATRIX() = default;
+    XMMATRIX(float m00, float m01, float m02, float m03,
+             float m10, float m11, float m12, float m13,
+             float m20, float m21, float m22, float m23,
+             float m30, float m31, float m32, float m33)
+    {
+        r[0] = _mm_setr_ps(m00, m01, m02, m03);
+        r[1] = _mm_setr_ps(m10, m11, m12, m13);
+        r[2] = _mm_setr_ps(m20, m21, m22, m23);
+        r[3] = _mm_setr_ps(m30, m31, m32, m33);
+    }
+};
+
+typedef const XMMATRIX& FXMMATRIX;
+typedef const XMMATRIX& CXMMATRIX;
+
+// Scalars
+inline void XMScalarSinCos(float* pSin, float* pCos, float value)
+{
+    // Map value to y in [-pi, pi], then reflect into [-pi/2, pi/2].
+    float quotient = XM_1DIV2PI * value;
+    quotient = value >= 0.0f ? (float)(int)(quotient + 0.5f) : (float)(int)(quotient - 0.5f);
+    float y = value - XM_2PI * quotient;
+
+    float sign;
+    if (y > XM_PIDIV2)
+    {
+        y = XM_PI - y;
+        sign = -1.0f;
+    }
+    else if (y < -XM_PIDIV2)
+    {
+        y = -XM_PI - y;
+        sign = -1.0f;
+    }
+    else
+    {
+        sign = 1.0f;
+    }
+
+    float y2 = y * y;
+    *pSin = (((((-2.3889859e-08f * y2 + 2.7525562e-06f) * y2 - 0.00019840874f) * y2 + 0.0083333310f) * y2 - 0.16666667f) * y2 + 1.0f) * y;
+    float p = ((((-2.6051615e-07f * y2 + 2.4760495e-05f) * y2 - 0.0013888378f) * y2 + 0.041666638f) * y2 - 0.5f) * y2 + 1.0f;
+    *pCos = sign * p;
+}
+
+// Vectors
+inline float XMVectorGetX(FXMVECTOR v) { return _mm_cvtss_f32(v); }
+inline float XMVectorGetY(FXMVECTOR v) { return _mm_cvtss_f32(_mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1))); }
+inline float XMVectorGetZ(FXMVECTOR v) { return _mm_cvtss_f32(_mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2))); }
+inline float XMVectorGetW(FXMVECTOR v) { return _mm_cvtss_f32(_mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3))); }
+
+inline XMVECTOR XMVectorSet(float x, float y, float z, float w) { return _mm_setr_ps(x, y, z, w); }
+inline XMVECTOR XMVectorReplicate(float value) { return _mm_set1_ps(value); }
+inline XMVECTOR XMVectorZero() { return _mm_setzero_ps(); }
+
+inline XMVECTOR XMVectorSetW(FXMVECTOR v, float w)
+{
+    alignas(16) float f[4];
+    _mm_store_ps(f, v);
+    f[3] = w;
+    return _mm_load_ps(f);
+}
+
+inline XMVECTOR XMVectorSplatX(FXMVECTOR v) { return _mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 0, 0, 0)); }
+inline XMVECTOR XMVectorSplatY(FXMVECTOR v) { return _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1)); }
+inline XMVECTOR XMVectorSplatZ(FXMVECTOR v) { return _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2)); }
+inline XMVECTOR XMVectorSplatW(FXMVECTOR v) { return _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3)); }
+
+inline XMVECTOR XMVectorAdd(FXMVECTOR a, FXMVECTOR b) { return _mm_add_ps(a, b); }
+inline XMVECTOR XMVectorSubtract(FXMVECTOR a, FXMVECTOR b) { return _mm_sub_ps(a, b); }
+inline XMVECTOR XMVectorMultiply(FXMVECTOR a, FXMVECTOR b) { return _mm_mul_ps(a, b); }
+inline XMVECTOR XMVectorMultiplyAdd(FXMVECTOR a, FXMVECTOR b, FXMVECTOR c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+inline XMVECTOR XMVectorScale(FXMVECTOR v, float s) { return _mm_mul_ps(v, _mm_set1_ps(s)); }
+inline XMVECTOR XMVectorMin(FXMVECTOR a, FXMVECTOR b) { return _mm_min_ps(a, b); }
+inline XMVECTOR XMVectorMax(FXMVECTOR a, FXMVECTOR b) { return _mm_max_ps(a, b); }
+inline XMVECTOR XMVectorAbs(FXMVECTOR v) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), v); }
+
+inline XMVECTOR XMVectorSinCos(XMVECTOR* pSin, XMVECTOR* pCos, FXMVECTOR v)
+{
+    alignas(16) float f[4], s[4], c[4];
+    _mm_store_ps(f, v);
+    for (int i = 0; i < 4; ++i)
+        XMScalarSinCos(&s[i], &c[i], f[i]);
+    *pSin = _mm_load_ps(s);
+    *pCos = _mm_load_ps(c);
+    return *pSin;
+}
+
+inline XMVECTOR XMVector3Dot(FXMVECTOR a, FXMVECTOR b)
+{
+    XMVECTOR p = _mm_mul_ps(a, b);
+    float dot = XMVectorGetX(p) + XMVectorGetY(p) + XMVectorGetZ(p);
+    return _mm_set1_ps(dot);
+}
+
+inline XMVECTOR XMVector4Dot(FXMVECTOR a, FXMVECTOR b)
+{
+    XMVECTOR p = _mm_mul_ps(a, b);
+    float dot = XMVectorGetX(p) + XMVectorGetY(p) + XMVectorGetZ(p) + XMVectorGetW(p);
+    return _mm_set1_ps(dot);
+}
+
+inline XMVECTOR XMVector3LengthSq(FXMVECTOR v) { return XMVector3Dot(v, v); }
+inline XMVECTOR XMVector3Length(FXMVECTOR v) { return _mm_sqrt_ps(XMVector3Dot(v, v)); }
+
+inline XMVECTOR XMVector3Normalize(FXMVECTOR v)
+{
+    float length = XMVectorGetX(XMVector3Length(v));
+    return length > 0.0f ? _mm_div_ps(v, _mm_set1_ps(length)) : _mm_setzero_ps();
+}
+
+inline XMVECTOR XMVector4Normalize(FXMVECTOR v)
+{
+    float length = std::sqrt(XMVectorGetX(XMVector4Dot(v, v)));
+    return length > 0.0f ? _mm_div_ps(v, _mm_set1_ps(length)) : _mm_setzero_ps();
+}
+
+inline XMVECTOR XMVector3Cross(FXMVECTOR a, FXMVECTOR b)
+{
+    XMVECTOR aYZX = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 0, 2, 1));
+    XMVECTOR bZXY = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 1, 0, 2));
+    XMVECTOR aZXY = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 1, 0, 2));
+    XMVECTOR bYZX = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3, 0, 2, 1));
+    XMVECTOR cross = _mm_sub_ps(_mm_mul_ps(aYZX, bZXY), _mm_mul_ps(aZXY, bYZX));
+    return XMVectorSetW(cross, 0.0f);
+}
+
+inline XMVECTOR XMVector4Transform(FXMVECTOR v, FXMMATRIX m)
+{
+    XMVECTOR result = _mm_mul_ps(XMVectorSplatX(v), m.r[0]);
+    result = _mm_add_ps(result, _mm_mul_ps(XMVectorSplatY(v), m.r[1]));
+    result = _mm_add_ps(result, _mm_mul_ps(XMVectorSplatZ(v), m.r[2]));
+    return _mm_add_ps(result, _mm_mul_ps(XMVectorSplatW(v), m.r[3]));
+}
+
+inline XMVECTOR XMVector3Transform(FXMVECTOR v, FXMMATRIX m)
+{
+    XMVECTOR result = _mm_mul_ps(XMVectorSplatX(v), m.r[0]);
+    result = _mm_add_ps(result, _mm_mul_ps(XMVectorSplatY(v), m.r[1]));
+    result = _mm_add_ps(result, _mm_mul_ps(XMVectorSplatZ(v), m.r[2]));
+    return _mm_add_ps(result, m.r[3]);
+}
+
+inline XMVECTOR XMVector3TransformCoord(FXMVECTOR v, FXMMATRIX m)
+{
+    XMVECTOR result = XMVector3Transform(v, m);
+    return _mm_div_ps(result, XMVectorSplatW(result));
+}
+
+inline XMVECTOR XMVector3TransformNormal(FXMVECTOR v, FXMMATRIX m)
+{
+    XMVECTOR result = _mm_mul_ps(XMVectorSplatX(v), m.r[0]);
+    result = _mm_add_ps(result, _mm_mul_ps(XMVectorSplatY(v), m.r[1]));
+    return _mm_add_ps(result, _mm_mul_ps(XMVectorSplatZ(v), m.r[2]));
+}
+
+// Loads and stores
+inline XMVECTOR XMLoadFloat3(const XMFLOAT3* p) { return _mm_setr_ps(p->x, p->y, p->z, 0.0f); }
+inline XMVECTOR XMLoadFloat4(const XMFLOAT4* p) { return _mm_loadu_ps(&p->x); }
+
+inline void XMStoreFloat3(XMFLOAT3* p, FXMVECTOR v)
+{
+    p->x = XMVectorGetX(v);
+    p->y = XMVectorGetY(v);
+    p->z = XMVectorGetZ(v);
+}
+
+inline void XMStoreFloat4(XMFLOAT4* p, FXMVECTOR v) { _mm_storeu_ps(&p->x, v); }
+
+inline XMMATRIX XMLoadFloat4x4(const XMFLOAT4X4* p)
+{
+    XMMATRIX m;
+    for (int i = 0; i < 4; ++i)
+        m.r[i] = _mm_loadu_ps(p->m[i]);
+    return m;
+}
+
+inline void XMStoreFloat4x4(XMFLOAT4X4* p, FXMMATRIX m)
+{
+    for (int i = 0; i < 4; ++i)
+        _mm_storeu_ps(p->m[i], m.r[i]);
+}
+
+// Stores the transpose's first three rows, as the library does for 3x4 shader matrices.
+inline void XMStoreFloat3x4(XMFLOAT3X4* p, FXMMATRIX m)
+{
+    XMFLOAT4X4 t;
+    XMStoreFloat4x4(&t, m);
+    for (int i = 0; i < 3; ++i)
+        for (int j = 0; j < 4; ++j)
+            p->m[i][j] = t.m[j][i];
+}
+
+// Matrices
+inline XMMATRIX XMMatrixIdentity()
+{
+    return XMMATRIX(1.0f, 0.0f, 0.0f, 0.0f,
+                    0.0f, 1.0f, 0.0f, 0.0f,
+                    0.0f, 0.0f, 1.0f, 0.0f,
+                    0.0f, 0.0f, 0.0f, 1.0f);
+}
+
+inline XMMATRIX XMMatrixMultiply(FXMMATRIX a, CXMMATRIX b)
+{
+    XMMATRIX result;
+    for (int i = 0; i < 4; ++i)
+        result.r[i] = XMVector4Transform(a.r[i], b);
+    return result;
+}
+
+inline XMMATRIX operator*(FXMMATRIX a, CXMMATRIX b) { return XMMatrixMultiply(a, b); }
+
+inline XMMATRIX XMMatrixTranspose(FXMMATRIX m)
+{
+    XMMATRIX result = m;
+    _MM_TRANSPOSE4_PS(result.r[0], result.r[1], result.r[2], result.r[3]);
+    return result;
+}
+
+inline XMMATRIX XMMatrixScaling(float x, float y, float z)
+{
+    return XMMATRIX(x, 0.0f, 0.0f, 0.0f,
+                    0.0f, y, 0.0f, 0.0f,
+                    0.0f, 0.0f, z, 0.0f,
+                    0.0f, 0.0f, 0.0f, 1.0f);
+}
+
+inline XMMATRIX XMMatrixTranslation(float x, float y, float z)
+{
+    return XMMATRIX(1.0f, 0.0f, 0.0f, 0.0f,
+                    0.0f, 1.0f, 0.0f, 0.0f,
+                    0.0f, 0.0f, 1.0f, 0.0f,
+                    x, y, z, 1.0f);
+}
+
+inline XMMATRIX XMMatrixRotationX(float angle)
+{
+    float s, c;
+    XMScalarSinCos(&s, &c, angle);
+    return XMMATRIX(1.0f, 0.0f, 0.0f, 0.0f,
+                    0.0f, c, s, 0.0f,
+                    0.0f, -s, c, 0.0f,
+                    0.0f, 0.0f, 0.0f, 1.0f);
+}
+
+inline XMMATRIX XMMatrixRotationY(float angle)
+{
+    float s, c;
+    XMScalarSinCos(&s, &c, angle);
+    return XMMATRIX(c, 0.0f, -s, 0.0f,
+                    0.0f, 1.0f, 0.0f, 0.0f,
+                    s, 0.0f, c, 0.0f,
+                    0.0f, 0.0f, 0.0f, 1.0f);
+}
+
+inline XMMATRIX XMMatrixRotationZ(float angle)
+{
+    float s, c;
+    XMScalarSinCos(&s, &c, angle);
+    return XMMATRIX(c, s, 0.0f, 0.0f,
+                    -s, c, 0.0f, 0.0f,
+                    0.0f, 0.0f, 1.0f, 0.0f,
+                    0.0f, 0.0f, 0.0f, 1.0f);
+}
+
+inline XMMATRIX XMMatrixRotationQuaternion(FXMVECTOR q)
+{
+    float x = XMVectorGetX(q), y = XMVectorGetY(q), z = XMVectorGetZ(q), w = XMVectorGetW(q);
+    return XMMATRIX(1.0f - 2.0f * (y * y + z * z), 2.0f * (x * y + z * w), 2.0f * (x * z - y * w), 0.0f,
+                    2.0f * (x * y - z * w), 1.0f - 2.0f * (x * x + z * z), 2.0f * (y * z + x * w), 0.0f,
+                    2.0f * (x * z + y * w), 2.0f * (y * z - x * w), 1.0f - 2.0f * (x * x + y * y), 0.0f,
+                    0.0f, 0.0f, 0.0f, 1.0f);
+}
+
+inline XMMATRIX XMMatrixInverse(XMVECTOR* pDeterminant, FXMMATRIX m)
+{
+    XMFLOAT4X4 a;
+    XMStoreFloat4x4(&a, m);
+    const float* s = &a.m[0][0];
+
+    // Cofactor expansion; inv is the adjugate, transposed into place.
+    float inv[16];
+    inv[0] = s[5] * s[10] * s[15] - s[5] * s[11] * s[14] - s[9] * s[6] * s[15] + s[9] * s[7] * s[14] + s[13] * s[6] * s[11] - s[13] * s[7] * s[10];
+    inv[4] = -s[4] * s[10] * s[15] + s[4] * s[11] * s[14] + s[8] * s[6] * s[15] - s[8] * s[7] * s[14] - s[12] * s[6] * s[11] + s[12] * s[7] * s[10];
+    inv[8] = s[4] * s[9] * s[15] - s[4] * s[11] * s[13] - s[8] * s[5] * s[15] + s[8] * s[7] * s[13] + s[12] * s[5] * s[11] - s[12] * s[7] * s[9];
+    inv[12] = -s[4] * s[9] * s[14] + s[4] * s[10] * s[13] + s[8] * s[5] * s[14] - s[8] * s[6] * s[13] - s[12] * s[5] * s[10] + s[12] * s[6] * s[9];
+    inv[1] = -s[1] * s[10] * s[15] + s[1] * s[11] * s[14] + s[9] * s[2] * s[15] - s[9] * s[3] * s[14] - s[13] * s[2] * s[11] + s[13] * s[3] * s[10];
+    inv[5] = s[0] * s[10] * s[15] - s[0] * s[11] * s[14] - s[8] * s[2] * s[15] + s[8] * s[3] * s[14] + s[12] * s[2] * s[11] - s[12] * s[3] * s[10];
+    inv[9] = -s[0] * s[9] * s[15] + s[0] * s[11] * s[13] + s[8] * s[1] * s[15] - s[8] * s[3] * s[13] - s[12] * s[1] * s[11] + s[12] * s[3] * s[9];
+    inv[13] = s[0] * s[9] * s[14] - s[0] * s[10] * s[13] - s[8] * s[1] * s[14] + s[8] * s[2] * s[13] + s[12] * s[1] * s[10] - s[12] * s[2] * s[9];
+    inv[2] = s[1] * s[6] * s[15] - s[1] * s[7] * s[14] - s[5] * s[2] * s[15] + s[5] * s[3] * s[14] + s[13] * s[2] * s[7] - s[13] * s[3] * s[6];
+    inv[6] = -s[0] * s[6] * s[15] + s[0] * s[7] * s[14] + s[4] * s[2] * s[15] - s[4] * s[3] * s[14] - s[12] * s[2] * s[7] + s[12] * s[3] * s[6];
+    inv[10] = s[0] * s[5] * s[15] - s[0] * s[7] * s[13] - s[4] * s[1] * s[15] + s[4] * s[3] * s[13] + s[12] * s[1] * s[7] - s[12] * s[3] * s[5];
+    inv[14] = -s[0] * s[5] * s[14] + s[0] * s[6] * s[13] + s[4] * s[1] * s[14] - s[4] * s[2] * s[13] - s[12] * s[1] * s[6] + s[12] * s[2] * s[5];
+    inv[3] = -s[1] * s[6] * s[11] + s[1] * s[7] * s[10] + s[5] * s[2] * s[11] - s[5] * s[3] * s[10] - s[9] * s[2] * s[7] + s[9] * s[3] * s[6];
+    inv[7] = s[0] * s[6] * s[11] - s[0] * s[7] * s[10] - s[4] * s[2] * s[11] + s[4] * s[3] * s[10] + s[8] * s[2] * s[7] - s[8] * s[3] * s[6];
+    inv[11] = -s[0] * s[5] * s[11] + s[0] * s[7] * s[9] + s[4] * s[1] * s[11] - s[4] * s[3] * s[9] - s[8] * s[1] * s[7] + s[8] * s[3] * s[5];
+    inv[15] = s[0] * s[5] * s[10] - s[0] * s[6] * s[9] - s[4] * s[1] * s[10] + s[4] * s[2] * s[9] + s[8] * s[1] * s[6] - s[8] * s[2] * s[5];
+
+    float determinant = s[0] * inv[0] + s[1] * inv[4] + s[2] * inv[8] + s[3] * inv[12];
+    if (pDeterminant)
+        *pDeterminant = _mm_set1_ps(determinant);
+
+    XMFLOAT4X4 result;
+    for (int i = 0; i < 16; ++i)
+        (&result.m[0][0])[i] = inv[i] / determinant;
+    return XMLoadFloat4x4(&result);
+}
+
+inline XMMATRIX XMMatrixLookToLH(FXMVECTOR eye, FXMVECTOR direction, FXMVECTOR up)
+{
+    XMVECTOR zAxis = XMVector3Normalize(direction);
+    XMVECTOR xAxis = XMVector3Normalize(XMVector3Cross(up, zAxis));
+    XMVECTOR yAxis = XMVector3Cross(zAxis, xAxis);
+
+    XMFLOAT3 x, y, z;
+    XMStoreFloat3(&x, xAxis);
+    XMStoreFloat3(&y, yAxis);
+    XMStoreFloat3(&z, zAxis);
+    return XMMATRIX(x.x, y.x, z.x, 0.0f,
+                    x.y, y.y, z.y, 0.0f,
+                    x.z, y.z, z.z, 0.0f,
+                    -XMVectorGetX(XMVector3Dot(xAxis, eye)),
+                    -XMVectorGetX(XMVector3Dot(yAxis, eye)),
+                    -XMVectorGetX(XMVector3Dot(zAxis, eye)), 1.0f);
+}
+
+inline XMMATRIX XMMatrixLookAtLH(FXMVECTOR eye, FXMVECTOR focus, FXMVECTOR up)
+{
+    return XMMatrixLookToLH(eye, _mm_sub_ps(focus, eye), up);
+}
+
+inline XMMATRIX XMMatrixPerspectiveFovLH(float fovAngleY, float aspectRatio, float nearZ, float farZ)
+{
+    float sinFov, cosFov;
+    XMScalarSinCos(&sinFov, &cosFov, 0.5f * fovAngleY);
+    float height = cosFov / sinFov;
+    float width = height / aspectRatio;
+    float range = farZ / (farZ - nearZ);
+    return XMMATRIX(width, 0.0f, 0.0f, 0.0f,
+                    0.0f, height, 0.0f, 0.0f,
+                    0.0f, 0.0f, range, 1.0f,
+                    0.0f, 0.0f, -range * nearZ, 0.0f);
+}
+
+// Quaternions
+inline XMVECTOR XMQuaternionNormalize(FXMVECTOR q) { return XMVector4Normalize(q); }
+
+// Returns q1 followed by q2 (q2 * q1 in Hamilton order), as the library does.
+inline XMVECTOR XMQuaternionMultiply(FXMVECTOR q1, FXMVECTOR q2)
+{
+    float ax = XMVectorGetX(q1), ay = XMVectorGetY(q1), az = XMVectorGetZ(q1), aw = XMVectorGetW(q1);
+    float bx = XMVectorGetX(q2), by = XMVectorGetY(q2), bz = XMVectorGetZ(q2), bw = XMVectorGetW(q2);
+    return _mm_setr_ps(bw * ax + bx * aw + by * az - bz * ay,
+                       bw * ay - bx * az + by * aw + bz * ax,
+                       bw * az + bx * ay - by * ax + bz * aw,
+                       bw * aw - bx * ax - by * ay - bz * az);
+}
+
+inline XMVECTOR XMQuaternionRotationNormal(FXMVECTOR normalAxis, float angle)
+{
+    float s, c;
+    XMScalarSinCos(&s, &c, 0.5f * angle);
+    return XMVectorSetW(XMVectorScale(normalAxis, s), c);
+}
+
+inline XMVECTOR XMQuaternionRotationAxis(FXMVECTOR axis, float angle)
+{
+    return XMQuaternionRotationNormal(XMVector3Normalize(axis), angle);
+}
+
+// Roll about Z, then pitch about X, then yaw about Y.
+inline XMVECTOR XMQuaternionRotationRollPitchYaw(float pitch, float yaw, float roll)
+{
+    float sp, cp, sy, cy, sr, cr;
+    XMScalarSinCos(&sp, &cp, 0.5f * pitch);
+    XMScalarSinCos(&sy, &cy, 0.5f * yaw);
+    XMScalarSinCos(&sr, &cr, 0.5f * roll);
+    return _mm_setr_ps(sp * cy * cr + cp * sy * sr,
+                       cp * sy * cr - sp * cy * sr,
+                       cp * cy * sr - sp * sy * cr,
+                       cp * cy * cr + sp * sy * sr);
+}
+
+} // namespace DirectX
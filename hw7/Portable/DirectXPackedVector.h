@@ -0,0 +1,104 @@
+// Portable stand-in for the half-precision part of DirectXPackedVector. The conversions are
+// the library's scalar code (round to nearest even), so they match F16C bit for bit.
+#pragma once
+
+#include <DirectXMath.h>
+#include <cstring>
+
+namespace DirectX
+{
+namespace PackedVector
+{
+
+typedef uint16_t HALF;
+
+inline HALF XMConvertFloatToHalf(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint32_t sign = (bits & 0x80000000U) >> 16U;
+    bits &= 0x7FFFFFFFU;
+
+    uint32_t result;
+    if (bits >= 0x47800000U)
+    {
+        // Too large for a half: infinity, or NaN with the top mantissa bits kept.
+        result = 0x7C00U | ((bits > 0x7F800000U) ? (0x200U | ((bits >> 13U) & 0x3FFU)) : 0U);
+    }
+    else if (bits <= 0x33000000U)
+    {
+        result = 0;
+    }
+    else if (bits < 0x38800000U)
+    {
+        // Too small for a normalized half: produce a denormal.
+        uint32_t shift = 125U - (bits >> 23U);
+        bits = 0x800000U | (bits & 0x7FFFFFU);
+        result = bits >> (shift + 1);
+        uint32_t sticky = (bits & ((1U << shift) - 1)) != 0;
+        result += (result | sticky) & ((bits >> shift) & 1U);
+    }
+    else
+    {
+        // Rebias the exponent and round the mantissa to nearest even.
+        bits += 0xC8000000U;
+        result = ((bits + 0x0FFFU + ((bits >> 13U) & 1U)) >> 13U) & 0x7FFFU;
+    }
+    return (HALF)(result | sign);
+}
+
+inline float XMConvertHalfToFloat(HALF value)
+{
+    uint32_t mantissa = value & 0x03FFU;
+    uint32_t exponent = value & 0x7C00U;
+    if (exponent == 0x7C00U)
+    {
+        exponent = 0x8FU;  // infinity or NaN
+    }
+    else if (exponent != 0)
+    {
+        exponent = (value >> 10) & 0x1FU;
+    }
+    else if (mantissa != 0)
+    {
+        // Denormal: normalize it.
+        exponent = 1;
+        do
+        {
+            exponent--;
+            mantissa <<= 1;
+        } while ((mantissa & 0x0400U) == 0);
+        mantissa &= 0x03FFU;
+    }
+    else
+    {
+        exponent = (uint32_t)-112;
+    }
+
+    uint32_t bits = ((value & 0x8000U) << 16) | ((exponent + 112) << 23) | (mantissa << 13);
+    float result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+struct XMHALF2
+{
+    HALF x, y;
+
+    XMHALF2() = default;
+    XMHALF2(float _x, float _y) : x(XMConvertFloatToHalf(_x)), y(XMConvertFloatToHalf(_y)) {}
+};
+
+struct XMHALF4
+{
+    HALF x, y, z, w;
+
+    XMHALF4() = default;
+    XMHALF4(float _x, float _y, float _z, float _w)
+        : x(XMConvertFloatToHalf(_x)), y(XMConvertFloatToHalf(_y)), z(XMConvertFloatToHalf(_z)), w(XMConvertFloatToHalf(_w))
+    {
+    }
+};
+
+} // namespace PackedVector
+} // namespace DirectX
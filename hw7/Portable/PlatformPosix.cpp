@@ -0,0 +1,279 @@
+// POSIX implementation of the Win32 calls hw7 makes, for the headless null-device build.
+// Files, mappings and timers work; windows, COM, WIC, DXGI and the HLSL compiler report
+// failure, so only -nulldevice, -mathbench and -selftest runs get past initialization.
+#include <windows.h>
+#include <d3d11.h>
+#include <d3dcompiler.h>
+#include <dxgi.h>
+#include <wincodec.h>
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const GUID WKPDID_D3DDebugObjectName = { 0x429b8c22, 0x9188, 0x4b0c, { 0x87, 0x42, 0xac, 0xb0, 0xbf, 0x85, 0xc2, 0x00 } };
+const GUID CLSID_WICImagingFactory = { 0xcacaf262, 0x9370, 0x4615, { 0xa1, 0x3b, 0x9f, 0x55, 0x39, 0xda, 0x4c, 0x0a } };
+const GUID GUID_WICPixelFormat32bppBGRA = { 0x6fddc324, 0x4e03, 0x4bfe, { 0xb1, 0x85, 0x3d, 0x77, 0x76, 0x8d, 0xc9, 0x0f } };
+
+// Files
+
+// File and mapping handles share CloseHandle, so both are the same heap object
+struct PosixHandle
+{
+    int fd;
+};
+
+static std::mutex g_MappedViewsMutex;
+static std::map<const void*, size_t> g_MappedViews;
+
+static std::string NarrowPath(LPCWSTR path)
+{
+    // wchar_t is UTF-32 here; encode it as UTF-8 for open()
+    std::string result;
+    for (; *path; ++path)
+    {
+        uint32_t c = (uint32_t)*path;
+        if (c < 0x80)
+        {
+            result += (char)c;
+        }
+        else if (c < 0x800)
+        {
+            result += (char)(0xC0 | (c >> 6));
+            result += (char)(0x80 | (c & 0x3F));
+        }
+        else if (c < 0x10000)
+        {
+            result += (char)(0xE0 | (c >> 12));
+            result += (char)(0x80 | ((c >> 6) & 0x3F));
+            result += (char)(0x80 | (c & 0x3F));
+        }
+        else
+        {
+            result += (char)(0xF0 | (c >> 18));
+            result += (char)(0x80 | ((c >> 12) & 0x3F));
+            result += (char)(0x80 | ((c >> 6) & 0x3F));
+            result += (char)(0x80 | (c & 0x3F));
+        }
+    }
+    return result;
+}
+
+HANDLE CreateFileW(LPCWSTR fileName, DWORD access, DWORD, void*, DWORD disposition, DWORD, HANDLE)
+{
+    int flags = (access & GENERIC_WRITE) ? ((access & GENERIC_READ) ? O_RDWR : O_WRONLY) : O_RDONLY;
+    if (disposition == CREATE_ALWAYS)
+        flags |= O_CREAT | O_TRUNC;
+
+    int fd = open(NarrowPath(fileName).c_str(), flags | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return INVALID_HANDLE_VALUE;
+    return new PosixHandle{ fd };
+}
+
+BOOL ReadFile(HANDLE file, void* buffer, DWORD bytesToRead, DWORD* bytesRead, void*)
+{
+    PosixHandle* handle = static_cast<PosixHandle*>(file);
+    DWORD total = 0;
+    ssize_t n = 1;
+    while (total < bytesToRead && n > 0)
+    {
+        n = read(handle->fd, static_cast<char*>(buffer) + total, bytesToRead - total);
+        if (n > 0)
+            total += (DWORD)n;
+    }
+    if (bytesRead)
+        *bytesRead = total;
+    return n >= 0;  // a short read at end of file still succeeds, as on Windows
+}
+
+BOOL WriteFile(HANDLE file, const void* buffer, DWORD bytesToWrite, DWORD* bytesWritten, void*)
+{
+    PosixHandle* handle = static_cast<PosixHandle*>(file);
+    DWORD total = 0;
+    while (total < bytesToWrite)
+    {
+        ssize_t n = write(handle->fd, static_cast<const char*>(buffer) + total, bytesToWrite - total);
+        if (n <= 0)
+            break;
+        total += (DWORD)n;
+    }
+    if (bytesWritten)
+        *bytesWritten = total;
+    return total == bytesToWrite;
+}
+
+BOOL GetFileSizeEx(HANDLE file, LARGE_INTEGER* size)
+{
+    struct stat info;
+    if (fstat(static_cast<PosixHandle*>(file)->fd, &info) != 0)
+        return FALSE;
+    size->QuadPart = info.st_size;
+    return TRUE;
+}
+
+BOOL CloseHandle(HANDLE handle)
+{
+    if (!handle || handle == INVALID_HANDLE_VALUE)
+        return FALSE;
+    PosixHandle* posix = static_cast<PosixHandle*>(handle);
+    BOOL closed = close(posix->fd) == 0;
+    delete posix;
+    return closed;
+}
+
+// The mapping keeps its own descriptor so the file handle can be closed first, as on Windows
+HANDLE CreateFileMappingW(HANDLE file, void*, DWORD, DWORD, DWORD, LPCWSTR)
+{
+    int fd = dup(static_cast<PosixHandle*>(file)->fd);
+    if (fd < 0)
+        return nullptr;
+    return new PosixHandle{ fd };
+}
+
+void* MapViewOfFile(HANDLE mapping, DWORD, DWORD, DWORD, SIZE_T bytes)
+{
+    PosixHandle* handle = static_cast<PosixHandle*>(mapping);
+    if (bytes == 0)
+    {
+        struct stat info;
+        if (fstat(handle->fd, &info) != 0 || info.st_size == 0)
+            return nullptr;
+        bytes = (SIZE_T)info.st_size;
+    }
+
+    void* view = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, handle->fd, 0);
+    if (view == MAP_FAILED)
+        return nullptr;
+
+    std::lock_guard<std::mutex> lock(g_MappedViewsMutex);
+    g_MappedViews[view] = bytes;
+    return view;
+}
+
+BOOL UnmapViewOfFile(const void* view)
+{
+    size_t bytes = 0;
+    {
+        std::lock_guard<std::mutex> lock(g_MappedViewsMutex);
+        auto it = g_MappedViews.find(view);
+        if (it == g_MappedViews.end())
+            return FALSE;
+        bytes = it->second;
+        g_MappedViews.erase(it);
+    }
+    return munmap(const_cast<void*>(view), bytes) == 0;
+}
+
+// Timing and debugging
+
+ULONGLONG GetTickCount64()
+{
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return (ULONGLONG)std::chrono::duration_cast<std::chrono::milliseconds>(now).count();
+}
+
+BOOL QueryPerformanceCounter(LARGE_INTEGER* counter)
+{
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    counter->QuadPart = (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+    return TRUE;
+}
+
+BOOL QueryPerformanceFrequency(LARGE_INTEGER* frequency)
+{
+    frequency->QuadPart = 1000000000;
+    return TRUE;
+}
+
+void OutputDebugStringA(const char* text)
+{
+    fputs(text, stderr);
+}
+
+// Windows and messages
+
+HCURSOR LoadCursor(HINSTANCE, LPCWSTR) { return nullptr; }
+WORD RegisterClassExW(const WNDCLASSEXW*) { return 0; }
+BOOL AdjustWindowRect(RECT*, DWORD, BOOL) { return FALSE; }
+HWND CreateWindowW(LPCWSTR, LPCWSTR, DWORD, int, int, int, int, HWND, void*, HINSTANCE, void*) { return nullptr; }
+BOOL ShowWindow(HWND, int) { return FALSE; }
+BOOL UpdateWindow(HWND) { return FALSE; }
+BOOL DestroyWindow(HWND) { return FALSE; }
+BOOL SetWindowTextW(HWND, LPCWSTR) { return FALSE; }
+BOOL PeekMessageW(MSG*, HWND, UINT, UINT, UINT) { return FALSE; }
+BOOL TranslateMessage(const MSG*) { return FALSE; }
+LRESULT DispatchMessageW(const MSG*) { return 0; }
+void PostQuitMessage(int) {}
+LRESULT DefWindowProcW(HWND, UINT, WPARAM, LPARAM) { return 0; }
+
+int MessageBoxA(HWND, const char* text, const char* caption, UINT)
+{
+    fprintf(stderr, "%s: %s\n", caption ? caption : "", text ? text : "");
+    return 0;
+}
+
+int MessageBoxW(HWND, LPCWSTR text, LPCWSTR caption, UINT)
+{
+    fprintf(stderr, "%ls: %ls\n", caption ? caption : L"", text ? text : L"");
+    return 0;
+}
+
+// COM, DXGI, Direct3D
+
+HRESULT CoInitializeEx(void*, DWORD) { return S_OK; }
+void CoUninitialize() {}
+HRESULT CoCreateInstance(REFGUID, IUnknown*, DWORD, REFIID, void** object)
+{
+    *object = nullptr;
+    return E_NOTIMPL;
+}
+
+HRESULT WINAPI CreateDXGIFactory(REFIID, void** factory)
+{
+    *factory = nullptr;
+    return E_NOTIMPL;
+}
+
+HRESULT WINAPI D3D11CreateDevice(IDXGIAdapter*, D3D_DRIVER_TYPE, HMODULE, UINT, const D3D_FEATURE_LEVEL*, UINT, UINT,
+    ID3D11Device** device, D3D_FEATURE_LEVEL*, ID3D11DeviceContext** immediateContext)
+{
+    if (device)
+        *device = nullptr;
+    if (immediateContext)
+        *immediateContext = nullptr;
+    return E_NOTIMPL;
+}
+
+HRESULT WINAPI D3DCompile(const void*, SIZE_T, const char*, const D3D_SHADER_MACRO*, ID3DInclude*, const char*, const char*,
+    UINT, UINT, ID3DBlob** code, ID3DBlob** errorMsgs)
+{
+    if (code)
+        *code = nullptr;
+    if (errorMsgs)
+        *errorMsgs = nullptr;
+    return E_NOTIMPL;
+}
+
+// Entry point
+
+int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE, LPWSTR lpCmdLine, int nCmdShow);
+
+// There is no window here, so every run is headless: -nulldevice goes first and the rest
+// of argv follows, joined the way the Windows command line would be.
+int main(int argc, char** argv)
+{
+    std::wstring commandLine = L"-nulldevice";
+    for (int i = 1; i < argc; ++i)
+    {
+        commandLine += L' ';
+        for (const char* c = argv[i]; *c; ++c)
+            commandLine += (wchar_t)(unsigned char)*c;
+    }
+    return wWinMain(nullptr, nullptr, &commandLine[0], 0);
+}
@@ -0,0 +1,51 @@
+// Portable stand-in for <d3d11_1.h>: the Direct3D 11.1 immediate-context interface.
+#pragma once
+
+#include <d3d11.h>
+
+enum D3D11_COPY_FLAGS
+{
+    D3D11_COPY_NO_OVERWRITE = 0x00000001,
+    D3D11_COPY_DISCARD = 0x00000002,
+};
+
+struct ID3DDeviceContextState : ID3D11DeviceChild
+{
+};
+
+struct ID3D11DeviceContext1 : ID3D11DeviceContext
+{
+    virtual void STDMETHODCALLTYPE CopySubresourceRegion1(ID3D11Resource* dst, UINT dstSubresource, UINT dstX, UINT dstY, UINT dstZ,
+        ID3D11Resource* src, UINT srcSubresource, const D3D11_BOX* srcBox, UINT copyFlags) = 0;
+    virtual void STDMETHODCALLTYPE UpdateSubresource1(ID3D11Resource* dst, UINT dstSubresource, const D3D11_BOX* dstBox,
+        const void* srcData, UINT srcRowPitch, UINT srcDepthPitch, UINT copyFlags) = 0;
+    virtual void STDMETHODCALLTYPE DiscardResource(ID3D11Resource* resource) = 0;
+    virtual void STDMETHODCALLTYPE DiscardView(ID3D11View* view) = 0;
+    virtual void STDMETHODCALLTYPE VSSetConstantBuffers1(UINT startSlot, UINT numBuffers, ID3D11Buffer* const* buffers,
+        const UINT* firstConstant, const UINT* numConstants) = 0;
+    virtual void STDMETHODCALLTYPE HSSetConstantBuffers1(UINT startSlot, UINT numBuffers, ID3D11Buffer* const* buffers,
+        const UINT* firstConstant, const UINT* numConstants) = 0;
+    virtual void STDMETHODCALLTYPE DSSetConstantBuffers1(UINT startSlot, UINT numBuffers, ID3D11Buffer* const* buffers,
+        const UINT* firstConstant, const UINT* numConstants) = 0;
+    virtual void STDMETHODCALLTYPE GSSetConstantBuffers1(UINT startSlot, UINT numBuffers, ID3D11Buffer* const* buffers,
+        const UINT* firstConstant, const UINT* numConstants) = 0;
+    virtual void STDMETHODCALLTYPE PSSetConstantBuffers1(UINT startSlot, UINT numBuffers, ID3D11Buffer* const* buffers,
+        const UINT* firstConstant, const UINT* numConstants) = 0;
+    virtual void STDMETHODCALLTYPE CSSetConstantBuffers1(UINT startSlot, UINT numBuffers, ID3D11Buffer* const* buffers,
+        const UINT* firstConstant, const UINT* numConstants) = 0;
+    virtual void STDMETHODCALLTYPE VSGetConstantBuffers1(UINT startSlot, UINT numBuffers, ID3D11Buffer** buffers,
+        UINT* firstConstant, UINT* numConstants) = 0;
+    virtual void STDMETHODCALLTYPE HSGetConstantBuffers1(UINT startSlot, UINT numBuffers, ID3D11Buffer** buffers,
+        UINT* firstConstant, UINT* numConstants) = 0;
+    virtual void STDMETHODCALLTYPE DSGetConstantBuffers1(UINT startSlot, UINT numBuffers, ID3D11Buffer** buffers,
+        UINT* firstConstant, UINT* numConstants) = 0;
+    virtual void STDMETHODCALLTYPE GSGetConstantBuffers1(UINT startSlot, UINT numBuffers, ID3D11Buffer** buffers,
+        UINT* firstConstant, UINT* numConstants) = 0;
+    virtual void STDMETHODCALLTYPE PSGetConstantBuffers1(UINT startSlot, UINT numBuffers, ID3D11Buffer** buffers,
+        UINT* firstConstant, UINT* numConstants) = 0;
+    virtual void STDMETHODCALLTYPE CSGetConstantBuffers1(UINT startSlot, UINT numBuffers, ID3D11Buffer** buffers,
+        UINT* firstConstant, UINT* numConstants) = 0;
+    virtual void STDMETHODCALLTYPE SwapDeviceContextState(ID3DDeviceContextState* state, ID3DDeviceContextState** previousState) = 0;
+    virtual void STDMETHODCALLTYPE ClearView(ID3D11View* view, const FLOAT color[4], const D3D11_RECT* rects, UINT numRects) = 0;
+    virtual void STDMETHODCALLTYPE DiscardView1(ID3D11View* view, const D3D11_RECT* rects, UINT numRects) = 0;
+};
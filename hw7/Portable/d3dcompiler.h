@@ -0,0 +1,12 @@
+// Portable stand-in for <d3dcompiler.h>. There is no HLSL compiler off Windows, so
+// D3DCompile always fails (PlatformPosix.cpp); the null device accepts any bytecode.
+#pragma once
+
+#include <d3d11.h>
+
+#define D3DCOMPILE_DEBUG (1 << 0)
+#define D3DCOMPILE_SKIP_OPTIMIZATION (1 << 2)
+#define D3DCOMPILE_ENABLE_STRICTNESS (1 << 11)
+
+HRESULT WINAPI D3DCompile(const void* srcData, SIZE_T srcDataSize, const char* sourceName, const D3D_SHADER_MACRO* defines,
+    ID3DInclude* include, const char* entrypoint, const char* target, UINT flags1, UINT flags2, ID3DBlob** code, ID3DBlob** errorMsgs);
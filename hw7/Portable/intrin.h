@@ -0,0 +1,20 @@
+// Portable stand-in for <intrin.h>: the MSVC CPUID and XGETBV intrinsics on GCC/Clang.
+#pragma once
+
+#include <immintrin.h>
+#include <cpuid.h>
+
+#undef __cpuid
+#define __cpuidex(info, leaf, subleaf) \
+    __cpuid_count((leaf), (subleaf), (info)[0], (info)[1], (info)[2], (info)[3])
+#define __cpuid(info, leaf) __cpuidex(info, leaf, 0)
+
+// XGETBV through inline asm so the translation unit needs no -mxsave; callers only reach
+// it after CPUID reported OSXSAVE.
+inline unsigned long long PortableXgetbv(unsigned int index)
+{
+    unsigned int eax, edx;
+    __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(index));
+    return ((unsigned long long)edx << 32) | eax;
+}
+#define _xgetbv PortableXgetbv
@@ -0,0 +1,66 @@
+// Portable stand-in for <wincodec.h>: the WIC interfaces the texture loader uses. No WIC
+// factory exists off Windows (CoCreateInstance fails), so these are never instantiated.
+#pragma once
+
+#include <windows.h>
+
+enum WICDecodeOptions
+{
+    WICDecodeMetadataCacheOnDemand = 0,
+    WICDecodeMetadataCacheOnLoad = 1,
+};
+
+enum WICBitmapDitherType
+{
+    WICBitmapDitherTypeNone = 0,
+};
+
+enum WICBitmapPaletteType
+{
+    WICBitmapPaletteTypeCustom = 0,
+};
+
+struct WICRect
+{
+    INT X;
+    INT Y;
+    INT Width;
+    INT Height;
+};
+
+typedef GUID WICPixelFormatGUID;
+struct IWICPalette;
+
+struct IWICBitmapSource : IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE GetSize(UINT* width, UINT* height) = 0;
+    virtual HRESULT STDMETHODCALLTYPE GetPixelFormat(WICPixelFormatGUID* pixelFormat) = 0;
+    virtual HRESULT STDMETHODCALLTYPE GetResolution(double* dpiX, double* dpiY) = 0;
+    virtual HRESULT STDMETHODCALLTYPE CopyPalette(IWICPalette* palette) = 0;
+    virtual HRESULT STDMETHODCALLTYPE CopyPixels(const WICRect* rect, UINT stride, UINT bufferSize, BYTE* buffer) = 0;
+};
+
+struct IWICBitmapFrameDecode : IWICBitmapSource
+{
+};
+
+struct IWICBitmapDecoder : IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE GetFrame(UINT index, IWICBitmapFrameDecode** frame) = 0;
+};
+
+struct IWICFormatConverter : IWICBitmapSource
+{
+    virtual HRESULT STDMETHODCALLTYPE Initialize(IWICBitmapSource* source, REFGUID dstFormat, WICBitmapDitherType dither,
+        IWICPalette* palette, double alphaThresholdPercent, WICBitmapPaletteType paletteTranslate) = 0;
+};
+
+struct IWICImagingFactory : IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE CreateDecoderFromFilename(LPCWSTR filename, const GUID* vendor, DWORD desiredAccess,
+        WICDecodeOptions metadataOptions, IWICBitmapDecoder** decoder) = 0;
+    virtual HRESULT STDMETHODCALLTYPE CreateFormatConverter(IWICFormatConverter** converter) = 0;
+};
+
+extern const GUID CLSID_WICImagingFactory;
+extern const GUID GUID_WICPixelFormat32bppBGRA;
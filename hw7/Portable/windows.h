@@ -0,0 +1,250 @@
+// Portable stand-in for the parts of <windows.h> hw7 uses, so the headless null-device
+// build compiles without the Windows SDK. Only the include path of that build sees this
+// directory; Windows builds use the SDK. The functions are implemented in
+// PlatformPosix.cpp: files and timing work, windows and COM report failure.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cwchar>
+#include <cwctype>
+#include <type_traits>
+#include <intrin.h>
+
+// Types
+typedef int BOOL;
+typedef int INT;
+typedef unsigned int UINT;
+typedef int32_t INT32;
+typedef uint32_t UINT32;
+typedef int64_t INT64;
+typedef uint64_t UINT64;
+typedef uint16_t UINT16;
+typedef uint8_t UINT8;
+typedef uint8_t BYTE;
+typedef uint16_t WORD;
+typedef uint16_t USHORT;
+typedef uint32_t DWORD;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef uint64_t ULONGLONG;
+typedef float FLOAT;
+typedef size_t SIZE_T;
+typedef int32_t HRESULT;
+typedef void* HANDLE;
+typedef void* HWND;
+typedef void* HINSTANCE;
+typedef void* HMODULE;
+typedef void* HCURSOR;
+typedef void* LPVOID;
+typedef char* LPSTR;
+typedef wchar_t* LPWSTR;
+typedef const wchar_t* LPCWSTR;
+typedef intptr_t LPARAM;
+typedef uintptr_t WPARAM;
+typedef intptr_t LRESULT;
+
+union LARGE_INTEGER
+{
+    int64_t QuadPart;
+};
+
+struct RECT
+{
+    LONG left;
+    LONG top;
+    LONG right;
+    LONG bottom;
+};
+
+struct MSG
+{
+    HWND hwnd;
+    UINT message;
+    WPARAM wParam;
+    LPARAM lParam;
+};
+
+typedef LRESULT (*WNDPROC)(HWND, UINT, WPARAM, LPARAM);
+
+struct WNDCLASSEXW
+{
+    UINT cbSize;
+    UINT style;
+    WNDPROC lpfnWndProc;
+    int cbClsExtra;
+    int cbWndExtra;
+    HINSTANCE hInstance;
+    void* hIcon;
+    HCURSOR hCursor;
+    void* hbrBackground;
+    LPCWSTR lpszMenuName;
+    LPCWSTR lpszClassName;
+    void* hIconSm;
+};
+
+struct GUID
+{
+    uint32_t Data1;
+    uint16_t Data2;
+    uint16_t Data3;
+    uint8_t Data4[8];
+};
+typedef GUID IID;
+typedef const GUID& REFGUID;
+typedef const IID& REFIID;
+
+// Calling conventions and annotations
+#define WINAPI
+#define CALLBACK
+#define STDMETHODCALLTYPE
+#define _In_
+#define _In_opt_
+
+// Results
+#define S_OK ((HRESULT)0)
+#define S_FALSE ((HRESULT)1)
+#define E_NOTIMPL ((HRESULT)0x80004001L)
+#define E_NOINTERFACE ((HRESULT)0x80004002L)
+#define E_POINTER ((HRESULT)0x80004003L)
+#define E_FAIL ((HRESULT)0x80004005L)
+#define E_OUTOFMEMORY ((HRESULT)0x8007000EL)
+#define E_INVALIDARG ((HRESULT)0x80070057L)
+#define SUCCEEDED(hr) (((HRESULT)(hr)) >= 0)
+#define FAILED(hr) (((HRESULT)(hr)) < 0)
+
+#define TRUE 1
+#define FALSE 0
+
+// Files and mappings
+#define INVALID_HANDLE_VALUE ((HANDLE)(intptr_t)-1)
+#define GENERIC_READ 0x80000000
+#define GENERIC_WRITE 0x40000000
+#define FILE_SHARE_READ 0x00000001
+#define CREATE_ALWAYS 2
+#define OPEN_EXISTING 3
+#define FILE_ATTRIBUTE_NORMAL 0x00000080
+#define PAGE_READONLY 0x02
+#define FILE_MAP_READ 0x0004
+
+HANDLE CreateFileW(LPCWSTR fileName, DWORD access, DWORD shareMode, void* security, DWORD disposition, DWORD flags, HANDLE templateFile);
+BOOL ReadFile(HANDLE file, void* buffer, DWORD bytesToRead, DWORD* bytesRead, void* overlapped);
+BOOL WriteFile(HANDLE file, const void* buffer, DWORD bytesToWrite, DWORD* bytesWritten, void* overlapped);
+BOOL GetFileSizeEx(HANDLE file, LARGE_INTEGER* size);
+BOOL CloseHandle(HANDLE handle);
+HANDLE CreateFileMappingW(HANDLE file, void* security, DWORD protect, DWORD sizeHigh, DWORD sizeLow, LPCWSTR name);
+void* MapViewOfFile(HANDLE mapping, DWORD access, DWORD offsetHigh, DWORD offsetLow, SIZE_T bytes);
+BOOL UnmapViewOfFile(const void* view);
+
+// Timing and debugging
+ULONGLONG GetTickCount64();
+BOOL QueryPerformanceCounter(LARGE_INTEGER* counter);
+BOOL QueryPerformanceFrequency(LARGE_INTEGER* frequency);
+void OutputDebugStringA(const char* text);
+
+// Windows and messages
+#define CS_VREDRAW 0x0001
+#define CS_HREDRAW 0x0002
+#define WS_OVERLAPPEDWINDOW 0x00CF0000L
+#define CW_USEDEFAULT ((int)0x80000000)
+#define IDC_ARROW ((LPCWSTR)(uintptr_t)32512)
+#define MB_OK 0x00000000L
+#define MB_ICONERROR 0x00000010L
+#define PM_REMOVE 0x0001
+#define SIZE_MINIMIZED 1
+
+#define WM_DESTROY 0x0002
+#define WM_SIZE 0x0005
+#define WM_QUIT 0x0012
+#define WM_KEYDOWN 0x0100
+#define WM_KEYUP 0x0101
+
+#define VK_LEFT 0x25
+#define VK_UP 0x26
+#define VK_RIGHT 0x27
+#define VK_DOWN 0x28
+#define VK_F1 0x70
+#define VK_F2 0x71
+#define VK_F3 0x72
+#define VK_F4 0x73
+#define VK_F5 0x74
+#define VK_F6 0x75
+#define VK_F7 0x76
+#define VK_F8 0x77
+#define VK_F9 0x78
+#define VK_OEM_PLUS 0xBB
+#define VK_OEM_MINUS 0xBD
+
+#define LOWORD(l) ((WORD)(((uintptr_t)(l)) & 0xFFFF))
+#define HIWORD(l) ((WORD)((((uintptr_t)(l)) >> 16) & 0xFFFF))
+
+HCURSOR LoadCursor(HINSTANCE instance, LPCWSTR name);
+WORD RegisterClassExW(const WNDCLASSEXW* windowClass);
+BOOL AdjustWindowRect(RECT* rect, DWORD style, BOOL menu);
+HWND CreateWindowW(LPCWSTR className, LPCWSTR title, DWORD style, int x, int y, int width, int height,
+    HWND parent, void* menu, HINSTANCE instance, void* param);
+BOOL ShowWindow(HWND window, int command);
+BOOL UpdateWindow(HWND window);
+BOOL DestroyWindow(HWND window);
+BOOL SetWindowTextW(HWND window, LPCWSTR text);
+int MessageBoxA(HWND window, const char* text, const char* caption, UINT type);
+int MessageBoxW(HWND window, LPCWSTR text, LPCWSTR caption, UINT type);
+BOOL PeekMessageW(MSG* message, HWND window, UINT filterMin, UINT filterMax, UINT remove);
+BOOL TranslateMessage(const MSG* message);
+LRESULT DispatchMessageW(const MSG* message);
+void PostQuitMessage(int exitCode);
+LRESULT DefWindowProcW(HWND window, UINT message, WPARAM wParam, LPARAM lParam);
+
+// COM
+#define COINIT_MULTITHREADED 0x0
+#define CLSCTX_INPROC_SERVER 0x1
+
+struct IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** object) = 0;
+    virtual ULONG STDMETHODCALLTYPE AddRef() = 0;
+    virtual ULONG STDMETHODCALLTYPE Release() = 0;
+};
+
+HRESULT CoInitializeEx(void* reserved, DWORD coInit);
+void CoUninitialize();
+HRESULT CoCreateInstance(REFGUID clsid, IUnknown* outer, DWORD context, REFIID riid, void** object);
+
+// Interface IDs: one distinct GUID per interface type, handed out on first use. Nothing
+// here talks to a COM runtime, so the values only have to differ from each other.
+inline GUID PortableNextInterfaceId()
+{
+    static std::atomic<uint32_t> s_Next(0);
+    GUID id = {};
+    id.Data1 = ++s_Next;
+    return id;
+}
+
+template <class Interface>
+const GUID& PortableInterfaceId()
+{
+    static const GUID s_Id = PortableNextInterfaceId();
+    return s_Id;
+}
+
+#define __uuidof(type) PortableInterfaceId<type>()
+#define IID_PPV_ARGS(pp) PortableInterfaceId<typename std::remove_reference<decltype(**(pp))>::type>(), reinterpret_cast<void**>(pp)
+
+// CRT
+#define _countof(a) (sizeof(a) / sizeof((a)[0]))
+
+inline int _wcsicmp(const wchar_t* a, const wchar_t* b)
+{
+    for (;; ++a, ++b)
+    {
+        wint_t ca = towlower((wint_t)*a);
+        wint_t cb = towlower((wint_t)*b);
+        if (ca != cb)
+            return ca < cb ? -1 : 1;
+        if (ca == 0)
+            return 0;
+    }
+}
@@ -1,19 +1,33 @@
 ﻿#define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <d3d11.h>
+#include <d3d11_1.h>
 #include <dxgi.h>
 #include <d3dcompiler.h>
 #include <DirectXMath.h>
+#include <DirectXPackedVector.h>
 #include <wincodec.h>
 #include <cassert>
 #include <cstdio>
 #include <string>
 #include <vector>
 #include <cfloat>
+#include <limits>
 #include <cmath>
 #include <algorithm>
 #include <cstdint>
 #include <cstring>
+#include <cwchar>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <intrin.h>
+#include <immintrin.h>
+
+#include "NullD3D11.h"
 
 #ifndef MAKEFOURCC
 #define MAKEFOURCC(ch0, ch1, ch2, ch3)  \
@@ -430,1729 +444,11104 @@ bool CreateTextureFromDesc(ID3D11Device* device, const TextureDesc& texDesc, ID3
     return true;
 }
 
-// Global resources
-HWND g_hWnd = nullptr;
-
-ID3D11Device* g_pDevice = nullptr;
-ID3D11DeviceContext* g_pDeviceContext = nullptr;
-IDXGISwapChain* g_pSwapChain = nullptr;
-ID3D11RenderTargetView* g_pBackBufferRTV = nullptr;
-ID3D11DepthStencilView* g_pDepthStencilView = nullptr;
-ID3D11Texture2D* g_pDepthStencilTexture = nullptr;
-
-UINT g_ClientWidth = 1280;
-UINT g_ClientHeight = 720;
-
-struct LitVertex
-{
-    float px, py, pz;
-    float nx, ny, nz;
-    float tx, ty, tz;
-    float u, v;
-};
-
-struct SkyboxVertex
+// Timing
+double GetTimeMs()
 {
-    float x, y, z;
-    float u, v;
-};
+    static LARGE_INTEGER frequency = {};
+    if (frequency.QuadPart == 0)
+        QueryPerformanceFrequency(&frequency);
 
-ID3D11Buffer* g_pVertexBuffer = nullptr;
-ID3D11Buffer* g_pIndexBuffer = nullptr;
-ID3D11Buffer* g_pSkyboxVertexBuffer = nullptr;
-ID3D11Buffer* g_pSkyboxIndexBuffer = nullptr;
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart * 1000.0 / (double)frequency.QuadPart;
+}
 
-// Main lit instanced shaders
-ID3D11VertexShader* g_pVertexShader = nullptr;
-ID3D11PixelShader* g_pPixelShader = nullptr;
-ID3D11InputLayout* g_pInputLayout = nullptr;
+// Job system
+// Persistent worker threads; ParallelFor splits [0, count) into chunks of `grain`
+// and the calling thread works on chunks too until everything is done.
+// Threads are numbered for per-thread data: 0 is the thread calling ParallelFor, workers
+// are 1..MAX_JOB_WORKERS.
+static const UINT MAX_JOB_WORKERS = 7;
+static thread_local UINT t_JobThreadIndex = 0;
 
-// Skybox shaders
-ID3D11VertexShader* g_pSkyboxVS = nullptr;
-ID3D11PixelShader* g_pSkyboxPS = nullptr;
-ID3D11InputLayout* g_pSkyboxInputLayout = nullptr;
+class JobSystem
+{
+public:
+    // Non-owning reference to the caller's callable, which outlives the ParallelFor call;
+    // unlike std::function it never allocates
+    class RangeFunc
+    {
+    public:
+        template <class Fn>
+        RangeFunc(const Fn& fn)
+            : m_Object(&fn), m_Invoke([](const void* object, UINT begin, UINT end) { (*static_cast<const Fn*>(object))(begin, end); })
+        {
+        }
 
-// Transparent shaders
-ID3D11VertexShader* g_pTransparentVS = nullptr;
-ID3D11PixelShader* g_pTransparentPS = nullptr;
-ID3D11InputLayout* g_pTransparentInputLayout = nullptr;
+        void operator()(UINT begin, UINT end) const { m_Invoke(m_Object, begin, end); }
 
-// Post-process shaders
-ID3D11VertexShader* g_pPostVS = nullptr;
-ID3D11PixelShader* g_pPostPS = nullptr;
+    private:
+        const void* m_Object;
+        void (*m_Invoke)(const void*, UINT, UINT);
+    };
 
-struct ViewProjBuffer
-{
-    XMMATRIX vp;
-};
+    void Init(UINT workerCount)
+    {
+        assert(workerCount <= MAX_JOB_WORKERS);
+        m_Quit = false;
+        for (UINT i = 0; i < workerCount; ++i)
+            m_Workers.emplace_back(&JobSystem::WorkerLoop, this, i + 1);
+    }
 
-struct LightData
-{
-    XMFLOAT4 position;
-    XMFLOAT4 color;
-};
+    UINT GetThreadCount() const { return (UINT)m_Workers.size() + 1; }
+    static UINT GetThreadIndex() { return t_JobThreadIndex; }
 
-struct SceneBuffer
-{
-    XMFLOAT4 cameraPos;
-    XMFLOAT4 ambientColor;
-    LightData lights[4];
-    XMINT4 lightCount;
-};
+    void Shutdown()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Quit = true;
+        }
+        m_WakeCV.notify_all();
+        for (auto& worker : m_Workers)
+            worker.join();
+        m_Workers.clear();
+    }
 
-struct TransparentBuffer
-{
-    XMMATRIX model;
-    XMFLOAT4 color;
-};
+    UINT GetWorkerCount() const
+    {
+        return (UINT)m_Workers.size();
+    }
 
-struct PostProcessBuffer
-{
-    XMINT4 mode; // x = effect mode: 0=normal, 1=grayscale, 2=sepia, 3=brightness
-};
+    void ParallelFor(UINT count, UINT grain, const RangeFunc& fn)
+    {
+        if (count == 0)
+            return;
+        if (grain == 0)
+            grain = 1;
 
-static const UINT MAX_INSTANCES = 256;
-static const UINT MAX_VISIBLE_INSTANCES = 256;
+        if (m_Workers.empty() || count <= grain)
+        {
+            fn(0, count);
+            return;
+        }
 
-struct InstanceDataGPU
-{
-    XMMATRIX model;
-    XMMATRIX normalMatrix;
-    XMFLOAT4 params;    // x = shininess, y = rotation speed, z = textureId, w = hasNormalMap
-    XMFLOAT4 posAngle;  // xyz = center, w = current angle
-};
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_pTask = &fn;
+            m_Count = count;
+            m_Grain = grain;
+            m_ChunkCount = DivUp(count, grain);
+            m_NextChunk = 0;
+            ++m_Generation;
+        }
+        m_WakeCV.notify_all();
 
-struct VisibleIdGPU
-{
-    UINT id;
-    UINT pad0;
-    UINT pad1;
-    UINT pad2;
-};
+        RunChunks(fn, count, grain, m_ChunkCount);
 
-struct CubeInstanceCPU
-{
-    XMFLOAT3 basePos;
-    float scale;
-    float rotSpeed;
-    UINT textureId;
-    bool hasNormalMap;
-};
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_DoneCV.wait(lock, [this]() { return m_ActiveWorkers == 0; });
+        m_pTask = nullptr;
+    }
 
-ID3D11Buffer* g_pViewProjBuffer = nullptr;
-ID3D11Buffer* g_pSceneBuffer = nullptr;
-ID3D11Buffer* g_pTransparentBuffer = nullptr;
-ID3D11Buffer* g_pPostProcessBuffer = nullptr;
-ID3D11Buffer* g_pInstanceBuffer = nullptr;
-ID3D11Buffer* g_pVisibleIdsBuffer = nullptr;
+private:
+    void RunChunks(const RangeFunc& fn, UINT count, UINT grain, UINT chunkCount)
+    {
+        for (;;)
+        {
+            UINT chunk = m_NextChunk.fetch_add(1);
+            if (chunk >= chunkCount)
+                break;
 
-// Textures
-ID3D11Texture2D* g_pNormalTexture = nullptr;
-ID3D11ShaderResourceView* g_pNormalTextureView = nullptr;
+            UINT begin = chunk * grain;
+            UINT end = (std::min)(begin + grain, count);
+            fn(begin, end);
+        }
+    }
 
-ID3D11Texture2D* g_pTextureArray = nullptr;
-ID3D11ShaderResourceView* g_pTextureArrayView = nullptr;
+    void WorkerLoop(UINT threadIndex)
+    {
+        t_JobThreadIndex = threadIndex;
+        UINT64 seenGeneration = 0;
+        for (;;)
+        {
+            const RangeFunc* pTask = nullptr;
+            UINT count = 0, grain = 0, chunkCount = 0;
+            {
+                std::unique_lock<std::mutex> lock(m_Mutex);
+                m_WakeCV.wait(lock, [&]() { return m_Quit || m_Generation != seenGeneration; });
+                if (m_Quit)
+                    return;
+
+                seenGeneration = m_Generation;
+                if (!m_pTask)
+                    continue;
+
+                pTask = m_pTask;
+                count = m_Count;
+                grain = m_Grain;
+                chunkCount = m_ChunkCount;
+                ++m_ActiveWorkers;
+            }
 
-ID3D11Texture2D* g_pCubemapTexture = nullptr;
-ID3D11ShaderResourceView* g_pCubemapView = nullptr;
+            RunChunks(*pTask, count, grain, chunkCount);
 
-ID3D11SamplerState* g_pSampler = nullptr;
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            if (--m_ActiveWorkers == 0)
+                m_DoneCV.notify_all();
+        }
+    }
 
-ID3D11BlendState* g_pTransparentBlendState = nullptr;
-ID3D11DepthStencilState* g_pTransparentDepthState = nullptr;
-ID3D11DepthStencilState* g_pOpaqueDepthState = nullptr;
-ID3D11DepthStencilState* g_pSkyboxDepthState = nullptr;
-ID3D11RasterizerState* g_pCullBackRS = nullptr;
-ID3D11RasterizerState* g_pCullNoneRS = nullptr;
+    std::vector<std::thread> m_Workers;
+    std::mutex m_Mutex;
+    std::condition_variable m_WakeCV;
+    std::condition_variable m_DoneCV;
+    const RangeFunc* m_pTask = nullptr;
+    UINT m_Count = 0;
+    UINT m_Grain = 1;
+    UINT m_ChunkCount = 0;
+    std::atomic<UINT> m_NextChunk{ 0 };
+    UINT m_ActiveWorkers = 0;
+    UINT64 m_Generation = 0;
+    bool m_Quit = false;
+};
 
-// Post-process render target
-ID3D11Texture2D* g_pSceneColorTex = nullptr;
-ID3D11RenderTargetView* g_pSceneColorRTV = nullptr;
-ID3D11ShaderResourceView* g_pSceneColorSRV = nullptr;
+// Frame arenas
+// Transient per-frame data (visible lists, sort scratch, draw lists) is bump-allocated
+// instead of coming from the heap: an allocation moves a pointer, freeing is a no-op and
+// Reset drops everything at once. Each job system thread has its own arena per frame, so
+// jobs allocate without locking, and the frames rotate over FRAME_ARENA_BUFFERS sets so
+// the frame packets still waiting to be submitted stay readable while the next one is built.
+// An arena that runs out takes overflow blocks from the heap and grows past its high-water
+// mark at the next reset, so after a few frames the steady state allocates nothing.
+static const UINT FRAME_ARENA_BUFFERS = 3;  // one per frame packet, see FRAME_PACKET_COUNT
+static const size_t FRAME_ARENA_INITIAL_BYTES = 256 * 1024;
+static const size_t FRAME_ARENA_GRANULARITY = 64 * 1024;
+static const size_t FRAME_ARENA_ALIGNMENT = 16;  // enough for XMMATRIX and SSE loads
+static const UINT FRAME_ARENA_WARMUP_FRAMES = 8;
+
+class FrameArena
+{
+public:
+    FrameArena() = default;
+    FrameArena(const FrameArena&) = delete;
+    FrameArena& operator=(const FrameArena&) = delete;
+    ~FrameArena() { Release(); }
+
+    // `alignment` is a power of two no larger than 64
+    void* Allocate(size_t bytes, size_t alignment = FRAME_ARENA_ALIGNMENT)
+    {
+        assert(alignment <= 64 && (alignment & (alignment - 1)) == 0);
+        size_t offset = (m_Offset + alignment - 1) & ~(alignment - 1);
+        if (offset + bytes > m_Capacity)
+            return AllocateOverflow(bytes);
+        m_Offset = offset + bytes;
+        m_HighWater = (std::max)(m_HighWater, m_Offset + m_OverflowBytes);
+        return m_Data + offset;
+    }
 
-float g_CameraYaw = 0.0f;
-float g_CameraPitch = 0.3f;
-float g_CameraDist = 10.0f;
-bool g_KeyLeft = false, g_KeyRight = false, g_KeyUp = false, g_KeyDown = false;
+    // Frees everything allocated since the last reset. O(1) unless the arena overflowed,
+    // in which case it first grows to hold all of it.
+    void Reset()
+    {
+        m_Offset = 0;
+        m_OverflowBytes = 0;
+        if (!m_Overflow.empty())
+        {
+            for (void* block : m_Overflow)
+                _mm_free(block);
+            m_Overflow.clear();
+            Reserve(m_HighWater + m_HighWater / 2);
+        }
+    }
 
-double g_LastTime = 0.0;
-int g_PostEffectMode = 2; // 0=normal, 1=grayscale, 2=sepia, 3=brightness
+    void Reserve(size_t bytes)
+    {
+        assert(m_Offset == 0 && m_Overflow.empty());
+        bytes = (bytes + FRAME_ARENA_GRANULARITY - 1) / FRAME_ARENA_GRANULARITY * FRAME_ARENA_GRANULARITY;
+        if (bytes <= m_Capacity)
+            return;
+        _mm_free(m_Data);
+        m_Data = static_cast<BYTE*>(_mm_malloc(bytes, 64));
+        m_Capacity = bytes;
+    }
 
-struct TransparentObject
-{
-    XMMATRIX model;
-    XMFLOAT4 color;
-    XMFLOAT3 center;
-    float distanceToCamera;
-};
+    void Release()
+    {
+        for (void* block : m_Overflow)
+            _mm_free(block);
+        m_Overflow.clear();
+        _mm_free(m_Data);
+        m_Data = nullptr;
+        m_Capacity = m_Offset = m_OverflowBytes = 0;
+    }
 
-std::vector<CubeInstanceCPU> g_OpaqueCubes;
+    size_t GetUsed() const { return m_Offset + m_OverflowBytes; }
+    size_t GetCapacity() const { return m_Capacity; }
+    size_t GetHighWater() const { return m_HighWater; }  // most bytes in use since creation
+    UINT GetOverflowCount() const { return (UINT)m_Overflow.size(); }
 
-// Prototypes
-LRESULT CALLBACK WndProc(HWND, UINT, WPARAM, LPARAM);
-bool InitDirectX();
-void CreateCubeResources();
-bool CompileShaders();
-bool LoadTextures();
-bool CreateRenderStates();
-bool CreatePostProcessResources(UINT width, UINT height);
-bool CreateConstantBuffers();
-void CreateOpaqueInstances();
-void CleanupDirectX();
-void RenderFrame();
-void OnResize(UINT newWidth, UINT newHeight);
-void UpdateCamera(double deltaTime);
+private:
+    void* AllocateOverflow(size_t bytes)
+    {
+        void* block = _mm_malloc((std::max)(bytes, (size_t)1), 64);
+        m_Overflow.push_back(block);
+        m_OverflowBytes += bytes;
+        m_HighWater = (std::max)(m_HighWater, m_Offset + m_OverflowBytes);
+        return block;
+    }
 
-struct Plane
-{
-    XMFLOAT4 p;
+    BYTE* m_Data = nullptr;
+    size_t m_Capacity = 0;
+    size_t m_Offset = 0;
+    size_t m_OverflowBytes = 0;
+    size_t m_HighWater = 0;
+    std::vector<void*> m_Overflow;
 };
 
-Plane NormalizePlane(const Plane& in);
-void ExtractFrustumPlanes(Plane planes[6], const XMMATRIX& vp);
-bool IsSphereInsideFrustum(const Plane planes[6], const XMFLOAT3& center, float radius);
-
-// WinMain
-int WINAPI wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE, _In_ LPWSTR, _In_ int nCmdShow)
+// STL allocator over a frame arena; deallocation is a no-op, the memory goes with the reset
+template <class T>
+class ArenaAllocator
 {
-    CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+public:
+    typedef T value_type;
 
-    WNDCLASSEXW wc = {};
-    wc.cbSize = sizeof(WNDCLASSEXW);
-    wc.style = CS_HREDRAW | CS_VREDRAW;
-    wc.lpfnWndProc = WndProc;
-    wc.hInstance = hInstance;
-    wc.hCursor = LoadCursor(nullptr, IDC_ARROW);
-    wc.lpszClassName = L"DX11";
+    explicit ArenaAllocator(FrameArena& arena) : m_Arena(&arena) {}
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : m_Arena(other.GetArena()) {}
 
-    if (!RegisterClassExW(&wc))
+    T* allocate(size_t count)
     {
-        MessageBoxW(nullptr, L"RegisterClassEx failed", L"Error", MB_OK | MB_ICONERROR);
-        CoUninitialize();
-        return 0;
+        return static_cast<T*>(m_Arena->Allocate(count * sizeof(T), (std::max)(alignof(T), FRAME_ARENA_ALIGNMENT)));
     }
+    void deallocate(T*, size_t) {}
 
-    RECT rc = { 0, 0, (LONG)g_ClientWidth, (LONG)g_ClientHeight };
-    AdjustWindowRect(&rc, WS_OVERLAPPEDWINDOW, FALSE);
-    int winWidth = rc.right - rc.left;
-    int winHeight = rc.bottom - rc.top;
+    FrameArena* GetArena() const { return m_Arena; }
 
-    g_hWnd = CreateWindowW(
-        wc.lpszClassName,
-        L"Thu Hoai - Instancing + Frustum Culling + Post Process",
-        WS_OVERLAPPEDWINDOW,
-        CW_USEDEFAULT, CW_USEDEFAULT,
-        winWidth, winHeight,
-        nullptr, nullptr, hInstance, nullptr);
+private:
+    FrameArena* m_Arena;
+};
 
-    if (!g_hWnd)
-    {
-        MessageBoxW(nullptr, L"CreateWindow failed", L"Error", MB_OK | MB_ICONERROR);
-        CoUninitialize();
-        return 0;
-    }
+template <class T, class U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.GetArena() == b.GetArena(); }
+template <class T, class U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) { return a.GetArena() != b.GetArena(); }
 
-    ShowWindow(g_hWnd, nCmdShow);
-    UpdateWindow(g_hWnd);
+template <class T>
+using FrameVector = std::vector<T, ArenaAllocator<T>>;
 
-    if (!InitDirectX())
+// One arena per job system thread for each of the rotating frames
+class FrameArenas
+{
+public:
+    void Init(UINT threadCount, size_t initialBytes = FRAME_ARENA_INITIAL_BYTES)
     {
-        CleanupDirectX();
-        DestroyWindow(g_hWnd);
-        CoUninitialize();
-        return -1;
+        m_ThreadCount = threadCount;
+        m_Arenas.reset(new FrameArena[FRAME_ARENA_BUFFERS * threadCount]);
+        for (UINT i = 0; i < FRAME_ARENA_BUFFERS * threadCount; ++i)
+            m_Arenas[i].Reserve(initialBytes);
+        m_Buffer = 0;
+        m_FrameBytes = 0;
+        m_HighWater = 0;
     }
 
-    CreateCubeResources();
-
-    if (!CompileShaders())
+    // Moves on to the next set of arenas and resets it; what the frame before allocated
+    // stays valid until FRAME_ARENA_BUFFERS more frames have begun
+    void BeginFrame()
     {
-        CleanupDirectX();
-        DestroyWindow(g_hWnd);
-        CoUninitialize();
-        return -1;
+        m_FrameBytes = GetUsed();
+        m_HighWater = (std::max)(m_HighWater, m_FrameBytes);
+        m_Buffer = (m_Buffer + 1) % FRAME_ARENA_BUFFERS;
+        for (UINT t = 0; t < m_ThreadCount; ++t)
+            m_Arenas[m_Buffer * m_ThreadCount + t].Reset();
     }
 
-    if (!LoadTextures())
+    // The calling thread's arena for the current frame
+    FrameArena& Get()
     {
-        CleanupDirectX();
-        DestroyWindow(g_hWnd);
-        CoUninitialize();
-        return -1;
+        UINT thread = JobSystem::GetThreadIndex();
+        assert(thread < m_ThreadCount);
+        return m_Arenas[m_Buffer * m_ThreadCount + thread];
     }
 
-    if (!CreateRenderStates())
+    // Bytes the current frame has allocated so far, over all threads
+    size_t GetUsed() const
     {
-        CleanupDirectX();
-        DestroyWindow(g_hWnd);
-        CoUninitialize();
-        return -1;
+        size_t used = 0;
+        for (UINT t = 0; t < m_ThreadCount; ++t)
+            used += m_Arenas[m_Buffer * m_ThreadCount + t].GetUsed();
+        return used;
     }
 
-    if (!CreateConstantBuffers())
-    {
-        CleanupDirectX();
-        DestroyWindow(g_hWnd);
-        CoUninitialize();
-        return -1;
-    }
+    size_t GetFrameBytes() const { return m_FrameBytes; }  // what the last finished frame used
+    size_t GetHighWater() const { return m_HighWater; }    // the most any frame used
 
-    if (!CreatePostProcessResources(g_ClientWidth, g_ClientHeight))
-    {
-        CleanupDirectX();
-        DestroyWindow(g_hWnd);
-        CoUninitialize();
-        return -1;
-    }
+private:
+    std::unique_ptr<FrameArena[]> m_Arenas;
+    UINT m_ThreadCount = 0;
+    UINT m_Buffer = 0;
+    size_t m_FrameBytes = 0;
+    size_t m_HighWater = 0;
+};
 
-    CreateOpaqueInstances();
+#ifdef _DEBUG
+// While the self-checks run (-selftest), every operator new of the program is counted, so
+// ValidateFrameArenas and ValidateHeadlessFrames can tell that steady-state frames leave
+// the heap alone. Other runs don't count. Every new form is replaced along with its delete, so no block is freed by
+// another allocator than the one that made it.
+static std::atomic<bool> g_CountHeapAllocations(false);
+static std::atomic<UINT64> g_HeapAllocationCount(0);
+
+static void* CountedHeapAllocate(size_t size)
+{
+    if (g_CountHeapAllocations.load(std::memory_order_relaxed))
+        ++g_HeapAllocationCount;
+    return malloc(size ? size : 1);
+}
 
-    g_LastTime = (double)GetTickCount64() / 1000.0;
+void* operator new(size_t size)
+{
+    if (void* p = CountedHeapAllocate(size))
+        return p;
+    throw std::bad_alloc();
+}
 
-    MSG msg = {};
-    bool done = false;
-    while (!done)
-    {
-        while (PeekMessageW(&msg, nullptr, 0, 0, PM_REMOVE))
-        {
-            if (msg.message == WM_QUIT)
-                done = true;
-            TranslateMessage(&msg);
-            DispatchMessageW(&msg);
-        }
+void* operator new[](size_t size)
+{
+    if (void* p = CountedHeapAllocate(size))
+        return p;
+    throw std::bad_alloc();
+}
 
-        if (!done)
-            RenderFrame();
-    }
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    return CountedHeapAllocate(size);
+}
 
-    CleanupDirectX();
-    CoUninitialize();
-    return (int)msg.wParam;
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    return CountedHeapAllocate(size);
 }
 
-// WndProc
-LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { free(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { free(p); }
+
+#ifdef __cpp_aligned_new
+// Over-aligned types (C++17 and later)
+static void* CountedAlignedHeapAllocate(size_t size, std::align_val_t alignment)
 {
-    switch (message)
-    {
-    case WM_SIZE:
+    if (g_CountHeapAllocations.load(std::memory_order_relaxed))
+        ++g_HeapAllocationCount;
+    return _mm_malloc(size ? size : 1, (size_t)alignment);
+}
+
+void* operator new(size_t size, std::align_val_t alignment)
+{
+    if (void* p = CountedAlignedHeapAllocate(size, alignment))
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size, std::align_val_t alignment)
+{
+    if (void* p = CountedAlignedHeapAllocate(size, alignment))
+        return p;
+    throw std::bad_alloc();
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return CountedAlignedHeapAllocate(size, alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return CountedAlignedHeapAllocate(size, alignment);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept { _mm_free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { _mm_free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { _mm_free(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { _mm_free(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { _mm_free(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { _mm_free(p); }
+#endif
+#endif
+
+// Dirty ranges
+// Changed element ranges of an array. Marks may come in any order; Coalesce sorts
+// them and joins ranges that overlap or are less than `gap` elements apart, since
+// revisiting a few clean elements is cheaper than another pass.
+struct DirtyRange
+{
+    UINT begin;
+    UINT end;
+};
+
+class DirtyRanges
+{
+public:
+    void Mark(UINT begin, UINT end)
+    {
+        if (begin >= end)
+            return;
+
+        // Marks mostly arrive in order; extend the last range when they touch
+        if (!m_Ranges.empty() && begin >= m_Ranges.back().begin && begin <= m_Ranges.back().end)
+            m_Ranges.back().end = (std::max)(m_Ranges.back().end, end);
+        else
+            m_Ranges.push_back({ begin, end });
+    }
+
+    const std::vector<DirtyRange>& Coalesce(UINT gap)
+    {
+        if (m_Ranges.size() < 2)
+            return m_Ranges;
+
+        std::sort(m_Ranges.begin(), m_Ranges.end(), [](const DirtyRange& a, const DirtyRange& b) { return a.begin < b.begin; });
+        size_t last = 0;
+        for (size_t i = 1; i < m_Ranges.size(); ++i)
+        {
+            if (m_Ranges[i].begin <= m_Ranges[last].end + gap)
+                m_Ranges[last].end = (std::max)(m_Ranges[last].end, m_Ranges[i].end);
+            else
+                m_Ranges[++last] = m_Ranges[i];
+        }
+        m_Ranges.resize(last + 1);
+        return m_Ranges;
+    }
+
+    const std::vector<DirtyRange>& GetRanges() const { return m_Ranges; }
+    bool IsEmpty() const { return m_Ranges.empty(); }
+    void Clear() { m_Ranges.clear(); }
+
+private:
+    std::vector<DirtyRange> m_Ranges;
+};
+
+// Entities
+// Scene objects are entities whose data lives in archetype chunks: all entities with the
+// same set of components share 16 KB chunks, and every component is a column of the chunk
+// (structure of arrays), so a system streams only the columns it reads. Removing an entity
+// moves the archetype's last one into the hole, which keeps the rows of an archetype dense
+// and every chunk but the last one full: row r lives in chunk r / capacity. Component
+// types are small integers with sizes given to Init; a mask has bit t for type t.
+typedef UINT Entity;
+typedef UINT ComponentMask;
+
+static const UINT ENTITY_CHUNK_BYTES = 16 * 1024;
+static const UINT MAX_COMPONENT_TYPES = 32;
+static const UINT ENTITY_COLUMN_ALIGNMENT = 64;
+
+struct EntityArchetype;
+
+struct EntityChunk
+{
+    BYTE* data = nullptr;
+    UINT count = 0;
+    UINT firstRow = 0;  // archetype row of the chunk's first entity
+    const EntityArchetype* archetype = nullptr;
+
+    template <class T> T* Column(UINT type) const;
+    Entity* Entities() const;
+};
+
+struct EntityArchetype
+{
+    ComponentMask mask = 0;
+    UINT capacity = 0;  // entities per chunk, a multiple of 8 so SIMD groups never straddle chunks
+    UINT columnOffset[MAX_COMPONENT_TYPES] = {};
+    UINT entityOffset = 0;
+    std::vector<EntityChunk> chunks;
+    UINT count = 0;
+};
+
+template <class T>
+T* EntityChunk::Column(UINT type) const
+{
+    assert(archetype->mask & (1u << type));
+    return reinterpret_cast<T*>(data + archetype->columnOffset[type]);
+}
+
+inline Entity* EntityChunk::Entities() const
+{
+    return reinterpret_cast<Entity*>(data + archetype->entityOffset);
+}
+
+class EntityWorld
+{
+public:
+    ~EntityWorld() { Clear(); }
+
+    void Init(const UINT* componentSizes, UINT typeCount)
+    {
+        assert(typeCount <= MAX_COMPONENT_TYPES);
+        Clear();
+        std::fill(m_ComponentSizes, m_ComponentSizes + MAX_COMPONENT_TYPES, 0u);
+        std::copy(componentSizes, componentSizes + typeCount, m_ComponentSizes);
+    }
+
+    // Destroys every entity and frees all chunks
+    void Clear()
+    {
+        for (EntityArchetype* archetype : m_Archetypes)
+        {
+            for (EntityChunk& chunk : archetype->chunks)
+                _mm_free(chunk.data);
+            delete archetype;
+        }
+        m_Archetypes.clear();
+        m_Locations.clear();
+        m_FreeIds.clear();
+    }
+
+    EntityArchetype* GetArchetype(ComponentMask mask)
+    {
+        for (EntityArchetype* archetype : m_Archetypes)
+        {
+            if (archetype->mask == mask)
+                return archetype;
+        }
+
+        EntityArchetype* archetype = new EntityArchetype();
+        archetype->mask = mask;
+        UINT bytesPerEntity = sizeof(Entity);
+        for (UINT t = 0; t < MAX_COMPONENT_TYPES; ++t)
+            bytesPerEntity += (mask & (1u << t)) ? m_ComponentSizes[t] : 0;
+
+        // Largest multiple of 8 whose aligned columns fit in a chunk
+        for (UINT capacity = ENTITY_CHUNK_BYTES / bytesPerEntity / 8 * 8; capacity > 0; capacity -= 8)
+        {
+            UINT offset = 0;
+            for (UINT t = 0; t < MAX_COMPONENT_TYPES; ++t)
+            {
+                if (!(mask & (1u << t)))
+                    continue;
+                archetype->columnOffset[t] = offset;
+                offset = DivUp(offset + capacity * m_ComponentSizes[t], ENTITY_COLUMN_ALIGNMENT) * ENTITY_COLUMN_ALIGNMENT;
+            }
+            archetype->entityOffset = offset;
+            if (offset + capacity * (UINT)sizeof(Entity) <= ENTITY_CHUNK_BYTES)
+            {
+                archetype->capacity = capacity;
+                break;
+            }
+        }
+        assert(archetype->capacity > 0);
+
+        m_Archetypes.push_back(archetype);
+        return archetype;
+    }
+
+    // New entity at the end of its archetype; its components are left uninitialised
+    Entity Create(ComponentMask mask)
+    {
+        EntityArchetype* archetype = GetArchetype(mask);
+        UINT row = CreateRows(archetype, 1);
+        return archetype->chunks.back().Entities()[row % archetype->capacity];
+    }
+
+    // `count` new entities at the end of the archetype, filling whole chunks at a time for
+    // bulk loads; returns the row of the first. Components are left uninitialised.
+    UINT CreateMany(ComponentMask mask, UINT count)
+    {
+        EntityArchetype* archetype = GetArchetype(mask);
+        m_Locations.reserve(m_Locations.size() + count);
+        return CreateRows(archetype, count);
+    }
+
+    // Moves the archetype's last entity into the freed row
+    void Destroy(Entity entity)
+    {
+        EntityLocation location = m_Locations[entity];
+        EntityArchetype* archetype = location.archetype;
+        assert(archetype);
+        UINT last = archetype->count - 1;
+        EntityChunk& to = archetype->chunks[location.row / archetype->capacity];
+        EntityChunk& from = archetype->chunks.back();
+        if (location.row != last)
+        {
+            UINT toIndex = location.row % archetype->capacity;
+            UINT fromIndex = last % archetype->capacity;
+            for (UINT t = 0; t < MAX_COMPONENT_TYPES; ++t)
+            {
+                if (!(archetype->mask & (1u << t)))
+                    continue;
+                UINT size = m_ComponentSizes[t];
+                memcpy(to.data + archetype->columnOffset[t] + toIndex * size, from.data + archetype->columnOffset[t] + fromIndex * size, size);
+            }
+            Entity moved = from.Entities()[fromIndex];
+            to.Entities()[toIndex] = moved;
+            m_Locations[moved].row = location.row;
+        }
+
+        --archetype->count;
+        if (--from.count == 0)
+        {
+            _mm_free(from.data);
+            archetype->chunks.pop_back();
+        }
+        m_Locations[entity] = {};
+        m_FreeIds.push_back(entity);
+    }
+
+    template <class T>
+    T& Get(Entity entity, UINT type)
+    {
+        const EntityLocation& location = m_Locations[entity];
+        const EntityChunk& chunk = location.archetype->chunks[location.row / location.archetype->capacity];
+        return chunk.Column<T>(type)[location.row % location.archetype->capacity];
+    }
+
+    // Row of the entity within its archetype
+    UINT GetRow(Entity entity) const { return m_Locations[entity].row; }
+
+    // Every chunk of the archetypes having at least the `required` components
+    template <class Fn>
+    void ForEachChunk(ComponentMask required, Fn fn)
+    {
+        for (EntityArchetype* archetype : m_Archetypes)
+        {
+            if ((archetype->mask & required) != required)
+                continue;
+            for (EntityChunk& chunk : archetype->chunks)
+                fn(chunk);
+        }
+    }
+
+    // Same, with the chunks handed out `chunksPerJob` at a time to the job system
+    template <class Fn>
+    void ParallelForEachChunk(JobSystem& jobs, ComponentMask required, UINT chunksPerJob, Fn fn)
+    {
+        m_ScheduledChunks.clear();
+        ForEachChunk(required, [&](EntityChunk& chunk) { m_ScheduledChunks.push_back(&chunk); });
+        jobs.ParallelFor((UINT)m_ScheduledChunks.size(), chunksPerJob, [&](UINT begin, UINT end)
+            {
+                for (UINT c = begin; c < end; ++c)
+                    fn(*m_ScheduledChunks[c]);
+            });
+    }
+
+private:
+    struct EntityLocation
+    {
+        EntityArchetype* archetype;
+        UINT row;
+    };
+
+    UINT CreateRows(EntityArchetype* archetype, UINT count)
+    {
+        UINT first = archetype->count;
+        UINT end = first + count;
+        for (UINT row = first; row < end; )
+        {
+            if (row == archetype->chunks.size() * archetype->capacity)
+            {
+                EntityChunk chunk;
+                chunk.data = static_cast<BYTE*>(_mm_malloc(ENTITY_CHUNK_BYTES, ENTITY_COLUMN_ALIGNMENT));
+                memset(chunk.data, 0, ENTITY_CHUNK_BYTES);
+                chunk.firstRow = row;
+                chunk.archetype = archetype;
+                archetype->chunks.push_back(chunk);
+            }
+            EntityChunk& chunk = archetype->chunks.back();
+            UINT rows = (std::min)(end - row, archetype->capacity - chunk.count);
+            Entity* entities = chunk.Entities() + chunk.count;
+            for (UINT i = 0; i < rows; ++i)
+            {
+                Entity entity;
+                if (!m_FreeIds.empty())
+                {
+                    entity = m_FreeIds.back();
+                    m_FreeIds.pop_back();
+                }
+                else
+                {
+                    entity = (Entity)m_Locations.size();
+                    m_Locations.push_back({});
+                }
+                m_Locations[entity] = { archetype, row + i };
+                entities[i] = entity;
+            }
+            chunk.count += rows;
+            row += rows;
+        }
+        archetype->count = end;
+        return first;
+    }
+
+    UINT m_ComponentSizes[MAX_COMPONENT_TYPES] = {};
+    std::vector<EntityArchetype*> m_Archetypes;
+    std::vector<EntityLocation> m_Locations;  // by entity id
+    std::vector<Entity> m_FreeIds;
+    std::vector<EntityChunk*> m_ScheduledChunks;
+};
+
+// Upload ring
+// Per-frame GPU data is suballocated from one dynamic buffer used as a ring, so the CPU
+// writes each byte once, straight into mapped memory. Allocations map the buffer with
+// WRITE_NO_OVERWRITE, which is only safe for bytes the GPU is done with: every frame's
+// allocations are tagged with the frame number and retired once its fence has passed.
+// When the GPU is too far behind for a request to fit (or NO_OVERWRITE is not supported
+// for this kind of buffer), the buffer is mapped with WRITE_DISCARD instead; the driver
+// hands out fresh memory and everything still in flight keeps the old copy. That is only
+// possible before the frame's first allocation, as a discard would also drop the bytes
+// already written for this frame; one frame's allocations must fit in the ring.
+// The mapping goes through IUploadTarget so the allocator runs without a device.
+class IUploadTarget
+{
+public:
+    virtual ~IUploadTarget() {}
+    virtual void* Map(bool discard) = 0;
+    virtual void Unmap() = 0;
+};
+
+class UploadRing
+{
+public:
+    void Init(IUploadTarget* target, UINT capacity, UINT alignment, bool noOverwriteSupported)
+    {
+        m_Target = target;
+        m_Capacity = capacity;
+        m_Alignment = alignment;
+        m_NoOverwriteSupported = noOverwriteSupported;
+        m_Head = 0;
+        m_Tail = 0;
+        m_Frame = 1;
+        m_InFlight.clear();
+        m_NeedDiscard = true;
+        m_FrameAllocated = false;
+        m_Mapped = nullptr;
+        m_Discards = 0;
+    }
+
+    // Frees the space of every frame up to and including `completedFrame`
+    void BeginFrame(UINT64 completedFrame)
+    {
+        while (!m_InFlight.empty() && m_InFlight.front().frame <= completedFrame)
+        {
+            m_Tail = m_InFlight.front().end;
+            m_InFlight.erase(m_InFlight.begin());
+        }
+        if (!m_NoOverwriteSupported)
+            m_NeedDiscard = true;
+        m_FrameAllocated = false;
+    }
+
+    // `size` writable bytes at byte `offset` of the buffer; nullptr if it can never fit
+    void* Allocate(UINT size, UINT& offset)
+    {
+        if (size == 0 || size > m_Capacity)
+            return nullptr;
+
+        UINT64 start = (m_Head + m_Alignment - 1) / m_Alignment * m_Alignment;
+        if (start % m_Capacity + size > m_Capacity)
+            start = (start / m_Capacity + 1) * m_Capacity;  // no room before the end, wrap
+
+        if (m_NeedDiscard || start + size - m_Tail > m_Capacity)
+        {
+            if (m_FrameAllocated)
+                return nullptr;
+
+            // Fresh memory: begin a new lap with nothing in flight
+            start = (m_Head + m_Capacity - 1) / m_Capacity * m_Capacity;
+            m_Tail = start;
+            m_InFlight.clear();
+            if (m_Mapped)
+                m_Target->Unmap();
+            m_Mapped = static_cast<BYTE*>(m_Target->Map(true));
+            m_NeedDiscard = false;
+            ++m_Discards;
+        }
+        else if (!m_Mapped)
+        {
+            m_Mapped = static_cast<BYTE*>(m_Target->Map(false));
+        }
+
+        if (!m_Mapped)
+            return nullptr;
+
+        m_Head = start + size;
+        m_FrameAllocated = true;
+        offset = (UINT)(start % m_Capacity);
+        return m_Mapped + offset;
+    }
+
+    // Unmaps (before the draws that read the data) and returns the frame number to signal
+    // once the GPU has consumed this frame
+    UINT64 EndFrame()
+    {
+        if (m_Mapped)
+        {
+            m_Target->Unmap();
+            m_Mapped = nullptr;
+        }
+        m_InFlight.push_back({ m_Frame, m_Head });
+        return m_Frame++;
+    }
+
+    // Moves to a new, larger buffer between frames. None of it is in flight, so the first
+    // allocation maps it with a discard; frame numbers carry on, keeping the fences valid.
+    void Resize(UINT capacity)
+    {
+        assert(!m_Mapped);
+        m_Capacity = capacity;
+        m_Head = 0;
+        m_Tail = 0;
+        m_InFlight.clear();
+        m_NeedDiscard = true;
+    }
+
+    UINT GetDiscardCount() const { return m_Discards; }
+    UINT64 GetBytesInFlight() const { return m_Head - m_Tail; }
+
+private:
+    struct FrameEnd
+    {
+        UINT64 frame;
+        UINT64 end;  // head position after the frame's last allocation
+    };
+
+    // Positions grow forever; the byte offset is position % capacity
+    IUploadTarget* m_Target = nullptr;
+    UINT m_Capacity = 0;
+    UINT m_Alignment = 1;
+    bool m_NoOverwriteSupported = false;
+    UINT64 m_Head = 0;
+    UINT64 m_Tail = 0;
+    UINT64 m_Frame = 1;
+    std::vector<FrameEnd> m_InFlight;
+    bool m_NeedDiscard = true;
+    bool m_FrameAllocated = false;
+    BYTE* m_Mapped = nullptr;
+    UINT m_Discards = 0;
+};
+
+// Dynamic buffer behind an upload ring
+class D3D11UploadTarget : public IUploadTarget
+{
+public:
+    void Init(ID3D11DeviceContext* context, ID3D11Buffer* buffer)
+    {
+        m_Context = context;
+        m_Buffer = buffer;
+    }
+
+    void* Map(bool discard) override
+    {
+        D3D11_MAPPED_SUBRESOURCE mapped = {};
+        HRESULT hr = m_Context->Map(m_Buffer, 0, discard ? D3D11_MAP_WRITE_DISCARD : D3D11_MAP_WRITE_NO_OVERWRITE, 0, &mapped);
+        return SUCCEEDED(hr) ? mapped.pData : nullptr;
+    }
+
+    void Unmap() override
+    {
+        m_Context->Unmap(m_Buffer, 0);
+    }
+
+private:
+    ID3D11DeviceContext* m_Context = nullptr;
+    ID3D11Buffer* m_Buffer = nullptr;
+};
+
+// Event queries marking the end of each frame's GPU work
+static const UINT FRAME_FENCE_COUNT = 4;
+
+class FrameFences
+{
+public:
+    bool Init(ID3D11Device* device)
+    {
+        D3D11_QUERY_DESC desc = {};
+        desc.Query = D3D11_QUERY_EVENT;
+        for (UINT i = 0; i < FRAME_FENCE_COUNT; ++i)
+        {
+            if (FAILED(device->CreateQuery(&desc, &m_Queries[i])))
+                return false;
+        }
+        return true;
+    }
+
+    void Release()
+    {
+        for (UINT i = 0; i < FRAME_FENCE_COUNT; ++i)
+            SAFE_RELEASE(m_Queries[i]);
+        m_First = 0;
+        m_Pending = 0;
+    }
+
+    // Issued after the frame's commands; waits for the oldest fence when all are in use
+    void Signal(ID3D11DeviceContext* context, UINT64 frame)
+    {
+        if (m_Pending == FRAME_FENCE_COUNT)
+        {
+            while (context->GetData(m_Queries[m_First], nullptr, 0, 0) != S_OK)
+                std::this_thread::yield();
+            Retire();
+        }
+
+        UINT slot = (m_First + m_Pending) % FRAME_FENCE_COUNT;
+        context->End(m_Queries[slot]);
+        m_Frames[slot] = frame;
+        ++m_Pending;
+    }
+
+    // Newest frame the GPU has finished, without waiting
+    UINT64 PollCompleted(ID3D11DeviceContext* context)
+    {
+        while (m_Pending > 0 && context->GetData(m_Queries[m_First], nullptr, 0, D3D11_ASYNC_GETDATA_DONOTFLUSH) == S_OK)
+            Retire();
+        return m_Completed;
+    }
+
+private:
+    void Retire()
+    {
+        m_Completed = m_Frames[m_First];
+        m_First = (m_First + 1) % FRAME_FENCE_COUNT;
+        --m_Pending;
+    }
+
+    ID3D11Query* m_Queries[FRAME_FENCE_COUNT] = {};
+    UINT64 m_Frames[FRAME_FENCE_COUNT] = {};
+    UINT m_First = 0;
+    UINT m_Pending = 0;
+    UINT64 m_Completed = 0;
+};
+
+// State cache
+// The renderer binds through D3D11StateCache, which keeps a shadow copy of the pipeline
+// state and drops the calls that would not change it; slot ranges are trimmed to the
+// slots that differ. The shadow is only right while every bind goes through the cache:
+// Reset clears the context and the shadow together, and Present forgets the render
+// targets, as flip model swap chains unbind the back buffer. The runtime also unbinds an
+// SRV whose resource is bound for output behind the cache's back, so views must be
+// unbound through the cache before their resource is rendered to. The shadow holds no
+// references; the context does, so a bound object's address is never reused while the
+// shadow still has it. Constant buffers bound with a range (11.1) are shadowed with the
+// range, so a whole-buffer bind of the same buffer is not taken for a repeat.
+// Issued calls can be recorded, so the binds of a frame can be checked without a GPU.
+enum StateCallType
+{
+    STATE_CALL_VS_SHADER,
+    STATE_CALL_PS_SHADER,
+    STATE_CALL_INPUT_LAYOUT,
+    STATE_CALL_VERTEX_BUFFERS,
+    STATE_CALL_INDEX_BUFFER,
+    STATE_CALL_TOPOLOGY,
+    STATE_CALL_VS_CONSTANT_BUFFERS,
+    STATE_CALL_PS_CONSTANT_BUFFERS,
+    STATE_CALL_VS_RESOURCES,
+    STATE_CALL_PS_RESOURCES,
+    STATE_CALL_PS_SAMPLERS,
+    STATE_CALL_RENDER_TARGETS,
+    STATE_CALL_VIEWPORT,
+    STATE_CALL_DEPTH_STENCIL_STATE,
+    STATE_CALL_RASTERIZER_STATE,
+    STATE_CALL_BLEND_STATE,
+};
+
+struct StateCall
+{
+    StateCallType type;
+    UINT startSlot;  // slotted calls: the range actually set
+    UINT count;
+};
+
+class D3D11StateCache
+{
+public:
+    void Init(ID3D11DeviceContext* context)
+    {
+        m_Context = context;
+        if (FAILED(context->QueryInterface(__uuidof(ID3D11DeviceContext1), (void**)&m_Context1)))
+            m_Context1 = nullptr;
+        Reset();
+    }
+
+    void Release()
+    {
+        SAFE_RELEASE(m_Context1);
+    }
+
+    // VSSetConstantBufferRange needs the 11.1 context
+    bool SupportsConstantBufferRanges() const { return m_Context1 != nullptr; }
+
+    // Back to the default state, on the context and in the shadow
+    void Reset()
+    {
+        m_Context->ClearState();
+        m_VS = nullptr;
+        m_PS = nullptr;
+        m_InputLayout = nullptr;
+        m_VertexBuffer = nullptr;
+        m_VertexStride = 0;
+        m_VertexOffset = 0;
+        m_IndexBuffer = nullptr;
+        m_IndexFormat = DXGI_FORMAT_UNKNOWN;
+        m_IndexOffset = 0;
+        m_Topology = D3D11_PRIMITIVE_TOPOLOGY_UNDEFINED;
+        std::fill(std::begin(m_VSConstantBuffers), std::end(m_VSConstantBuffers), nullptr);
+        std::fill(std::begin(m_VSConstantFirst), std::end(m_VSConstantFirst), 0);
+        std::fill(std::begin(m_VSConstantCount), std::end(m_VSConstantCount), 0);
+        std::fill(std::begin(m_PSConstantBuffers), std::end(m_PSConstantBuffers), nullptr);
+        std::fill(std::begin(m_VSResources), std::end(m_VSResources), nullptr);
+        std::fill(std::begin(m_PSResources), std::end(m_PSResources), nullptr);
+        std::fill(std::begin(m_PSSamplers), std::end(m_PSSamplers), nullptr);
+        m_RenderTargetsKnown = true;
+        m_RenderTargetCount = 0;
+        std::fill(std::begin(m_RenderTargets), std::end(m_RenderTargets), nullptr);
+        m_DepthStencilView = nullptr;
+        m_HasViewport = false;
+        m_Viewport = {};
+        m_DepthStencilState = nullptr;
+        m_StencilRef = 0;
+        m_RasterizerState = nullptr;
+        m_BlendState = nullptr;
+        std::fill(std::begin(m_BlendFactor), std::end(m_BlendFactor), 1.0f);
+        m_SampleMask = 0xFFFFFFFF;
+    }
+
+    void OnPresent() { m_RenderTargetsKnown = false; }
+
+    // Issued calls are appended to `log` until it is set back to nullptr
+    void SetCallLog(std::vector<StateCall>* log) { m_Log = log; }
+
+    // Calls issued and dropped since the last call
+    void TakeCounts(UINT& issued, UINT& skipped)
+    {
+        issued = m_Issued;
+        skipped = m_Skipped;
+        m_Issued = 0;
+        m_Skipped = 0;
+    }
+
+    void VSSetShader(ID3D11VertexShader* shader)
+    {
+        if (Changed(m_VS, shader, STATE_CALL_VS_SHADER))
+            m_Context->VSSetShader(shader, nullptr, 0);
+    }
+
+    void PSSetShader(ID3D11PixelShader* shader)
+    {
+        if (Changed(m_PS, shader, STATE_CALL_PS_SHADER))
+            m_Context->PSSetShader(shader, nullptr, 0);
+    }
+
+    void IASetInputLayout(ID3D11InputLayout* layout)
+    {
+        if (Changed(m_InputLayout, layout, STATE_CALL_INPUT_LAYOUT))
+            m_Context->IASetInputLayout(layout);
+    }
+
+    // Every draw here reads one vertex stream, from slot 0
+    void IASetVertexBuffer(ID3D11Buffer* buffer, UINT stride, UINT offset)
+    {
+        if (buffer == m_VertexBuffer && stride == m_VertexStride && offset == m_VertexOffset)
+        {
+            ++m_Skipped;
+            return;
+        }
+        m_VertexBuffer = buffer;
+        m_VertexStride = stride;
+        m_VertexOffset = offset;
+        Issue(STATE_CALL_VERTEX_BUFFERS, 0, 1);
+        m_Context->IASetVertexBuffers(0, 1, &buffer, &stride, &offset);
+    }
+
+    void IASetIndexBuffer(ID3D11Buffer* buffer, DXGI_FORMAT format, UINT offset)
+    {
+        if (buffer == m_IndexBuffer && format == m_IndexFormat && offset == m_IndexOffset)
+        {
+            ++m_Skipped;
+            return;
+        }
+        m_IndexBuffer = buffer;
+        m_IndexFormat = format;
+        m_IndexOffset = offset;
+        Issue(STATE_CALL_INDEX_BUFFER, 0, 1);
+        m_Context->IASetIndexBuffer(buffer, format, offset);
+    }
+
+    void IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY topology)
+    {
+        if (Changed(m_Topology, topology, STATE_CALL_TOPOLOGY))
+            m_Context->IASetPrimitiveTopology(topology);
+    }
+
+    void VSSetConstantBuffers(UINT startSlot, UINT count, ID3D11Buffer* const* buffers)
+    {
+        // A slot bound with a range differs from a whole-buffer bind whatever its buffer
+        bool ranged = false;
+        for (UINT i = 0; i < count; ++i)
+        {
+            ranged = ranged || m_VSConstantCount[startSlot + i] != 0;
+            m_VSConstantFirst[startSlot + i] = 0;
+            m_VSConstantCount[startSlot + i] = 0;
+        }
+        if (ranged)
+        {
+            std::copy(buffers, buffers + count, m_VSConstantBuffers + startSlot);
+            Issue(STATE_CALL_VS_CONSTANT_BUFFERS, startSlot, count);
+            m_Context->VSSetConstantBuffers(startSlot, count, buffers);
+            return;
+        }
+        if (ChangedSlots(m_VSConstantBuffers, startSlot, count, buffers, STATE_CALL_VS_CONSTANT_BUFFERS))
+            m_Context->VSSetConstantBuffers(startSlot, count, buffers);
+    }
+
+    // 11.1: `constantCount` 16-byte constants from `firstConstant` of `buffer`, both
+    // multiples of 16
+    void VSSetConstantBufferRange(UINT slot, ID3D11Buffer* buffer, UINT firstConstant, UINT constantCount)
+    {
+        assert(m_Context1 && constantCount > 0 && firstConstant % 16 == 0 && constantCount % 16 == 0);
+        if (buffer == m_VSConstantBuffers[slot] && firstConstant == m_VSConstantFirst[slot] && constantCount == m_VSConstantCount[slot])
+        {
+            ++m_Skipped;
+            return;
+        }
+        m_VSConstantBuffers[slot] = buffer;
+        m_VSConstantFirst[slot] = firstConstant;
+        m_VSConstantCount[slot] = constantCount;
+        Issue(STATE_CALL_VS_CONSTANT_BUFFERS, slot, 1);
+        m_Context1->VSSetConstantBuffers1(slot, 1, &buffer, &firstConstant, &constantCount);
+    }
+
+    void PSSetConstantBuffers(UINT startSlot, UINT count, ID3D11Buffer* const* buffers)
+    {
+        if (ChangedSlots(m_PSConstantBuffers, startSlot, count, buffers, STATE_CALL_PS_CONSTANT_BUFFERS))
+            m_Context->PSSetConstantBuffers(startSlot, count, buffers);
+    }
+
+    void VSSetShaderResources(UINT startSlot, UINT count, ID3D11ShaderResourceView* const* views)
+    {
+        if (ChangedSlots(m_VSResources, startSlot, count, views, STATE_CALL_VS_RESOURCES))
+            m_Context->VSSetShaderResources(startSlot, count, views);
+    }
+
+    void PSSetShaderResources(UINT startSlot, UINT count, ID3D11ShaderResourceView* const* views)
+    {
+        if (ChangedSlots(m_PSResources, startSlot, count, views, STATE_CALL_PS_RESOURCES))
+            m_Context->PSSetShaderResources(startSlot, count, views);
+    }
+
+    // Unbinds `view` from the slot if it is still there
+    void PSUnbindShaderResource(UINT slot, ID3D11ShaderResourceView* view)
+    {
+        ID3D11ShaderResourceView* none = nullptr;
+        if (view && m_PSResources[slot] == view)
+            PSSetShaderResources(slot, 1, &none);
+    }
+
+    void PSSetSamplers(UINT startSlot, UINT count, ID3D11SamplerState* const* samplers)
+    {
+        if (ChangedSlots(m_PSSamplers, startSlot, count, samplers, STATE_CALL_PS_SAMPLERS))
+            m_Context->PSSetSamplers(startSlot, count, samplers);
+    }
+
+    void OMSetRenderTargets(UINT count, ID3D11RenderTargetView* const* views, ID3D11DepthStencilView* depthStencil)
+    {
+        assert(count <= D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT);
+        bool same = m_RenderTargetsKnown && count == m_RenderTargetCount && depthStencil == m_DepthStencilView;
+        for (UINT i = 0; same && i < count; ++i)
+            same = views[i] == m_RenderTargets[i];
+        if (same)
+        {
+            ++m_Skipped;
+            return;
+        }
+        m_RenderTargetsKnown = true;
+        m_RenderTargetCount = count;
+        for (UINT i = 0; i < D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT; ++i)
+            m_RenderTargets[i] = i < count ? views[i] : nullptr;
+        m_DepthStencilView = depthStencil;
+        Issue(STATE_CALL_RENDER_TARGETS, 0, count);
+        m_Context->OMSetRenderTargets(count, views, depthStencil);
+    }
+
+    void RSSetViewport(const D3D11_VIEWPORT& viewport)
+    {
+        if (m_HasViewport && memcmp(&viewport, &m_Viewport, sizeof(viewport)) == 0)
+        {
+            ++m_Skipped;
+            return;
+        }
+        m_HasViewport = true;
+        m_Viewport = viewport;
+        Issue(STATE_CALL_VIEWPORT, 0, 1);
+        m_Context->RSSetViewports(1, &viewport);
+    }
+
+    void OMSetDepthStencilState(ID3D11DepthStencilState* state, UINT stencilRef)
+    {
+        if (state == m_DepthStencilState && stencilRef == m_StencilRef)
+        {
+            ++m_Skipped;
+            return;
+        }
+        m_DepthStencilState = state;
+        m_StencilRef = stencilRef;
+        Issue(STATE_CALL_DEPTH_STENCIL_STATE, 0, 1);
+        m_Context->OMSetDepthStencilState(state, stencilRef);
+    }
+
+    void RSSetState(ID3D11RasterizerState* state)
+    {
+        if (Changed(m_RasterizerState, state, STATE_CALL_RASTERIZER_STATE))
+            m_Context->RSSetState(state);
+    }
+
+    // A null blend factor is the default, all ones
+    void OMSetBlendState(ID3D11BlendState* state, const FLOAT* blendFactor, UINT sampleMask)
+    {
+        static const FLOAT ones[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+        const FLOAT* factor = blendFactor ? blendFactor : ones;
+        if (state == m_BlendState && sampleMask == m_SampleMask && memcmp(factor, m_BlendFactor, sizeof(m_BlendFactor)) == 0)
+        {
+            ++m_Skipped;
+            return;
+        }
+        m_BlendState = state;
+        m_SampleMask = sampleMask;
+        memcpy(m_BlendFactor, factor, sizeof(m_BlendFactor));
+        Issue(STATE_CALL_BLEND_STATE, 0, 1);
+        m_Context->OMSetBlendState(state, factor, sampleMask);
+    }
+
+private:
+    void Issue(StateCallType type, UINT startSlot, UINT count)
+    {
+        ++m_Issued;
+        if (m_Log)
+            m_Log->push_back({ type, startSlot, count });
+    }
+
+    template<typename T>
+    bool Changed(T& current, T value, StateCallType type)
+    {
+        if (current == value)
+        {
+            ++m_Skipped;
+            return false;
+        }
+        current = value;
+        Issue(type, 0, 1);
+        return true;
+    }
+
+    // Narrows [startSlot, startSlot + count) to the slots that differ from the shadow
+    template<typename T, size_t N>
+    bool ChangedSlots(T* (&shadow)[N], UINT& startSlot, UINT& count, T* const*& objects, StateCallType type)
+    {
+        assert(startSlot + count <= N);
+        UINT first = 0;
+        while (first < count && objects[first] == shadow[startSlot + first])
+            ++first;
+        if (first == count)
+        {
+            ++m_Skipped;
+            return false;
+        }
+        UINT last = count;
+        while (objects[last - 1] == shadow[startSlot + last - 1])
+            --last;
+
+        for (UINT i = first; i < last; ++i)
+            shadow[startSlot + i] = objects[i];
+        startSlot += first;
+        count = last - first;
+        objects += first;
+        Issue(type, startSlot, count);
+        return true;
+    }
+
+    ID3D11DeviceContext* m_Context = nullptr;
+    ID3D11DeviceContext1* m_Context1 = nullptr;  // the one reference the cache holds
+    std::vector<StateCall>* m_Log = nullptr;
+    UINT m_Issued = 0;
+    UINT m_Skipped = 0;
+
+    ID3D11VertexShader* m_VS = nullptr;
+    ID3D11PixelShader* m_PS = nullptr;
+    ID3D11InputLayout* m_InputLayout = nullptr;
+    ID3D11Buffer* m_VertexBuffer = nullptr;
+    UINT m_VertexStride = 0;
+    UINT m_VertexOffset = 0;
+    ID3D11Buffer* m_IndexBuffer = nullptr;
+    DXGI_FORMAT m_IndexFormat = DXGI_FORMAT_UNKNOWN;
+    UINT m_IndexOffset = 0;
+    D3D11_PRIMITIVE_TOPOLOGY m_Topology = D3D11_PRIMITIVE_TOPOLOGY_UNDEFINED;
+    ID3D11Buffer* m_VSConstantBuffers[D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT] = {};
+    UINT m_VSConstantFirst[D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT] = {};
+    UINT m_VSConstantCount[D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT] = {};  // 0: the whole buffer
+    ID3D11Buffer* m_PSConstantBuffers[D3D11_COMMONSHADER_CONSTANT_BUFFER_API_SLOT_COUNT] = {};
+    ID3D11ShaderResourceView* m_VSResources[D3D11_COMMONSHADER_INPUT_RESOURCE_SLOT_COUNT] = {};
+    ID3D11ShaderResourceView* m_PSResources[D3D11_COMMONSHADER_INPUT_RESOURCE_SLOT_COUNT] = {};
+    ID3D11SamplerState* m_PSSamplers[D3D11_COMMONSHADER_SAMPLER_SLOT_COUNT] = {};
+    bool m_RenderTargetsKnown = true;
+    UINT m_RenderTargetCount = 0;
+    ID3D11RenderTargetView* m_RenderTargets[D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT] = {};
+    ID3D11DepthStencilView* m_DepthStencilView = nullptr;
+    bool m_HasViewport = false;
+    D3D11_VIEWPORT m_Viewport = {};
+    ID3D11DepthStencilState* m_DepthStencilState = nullptr;
+    UINT m_StencilRef = 0;
+    ID3D11RasterizerState* m_RasterizerState = nullptr;
+    ID3D11BlendState* m_BlendState = nullptr;
+    FLOAT m_BlendFactor[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+    UINT m_SampleMask = 0xFFFFFFFF;
+};
+
+// State objects
+// Created once per distinct description: the cache keeps a reference to each object it
+// creates, keyed by a hash of the description's bytes, and hands out another reference
+// when the same description comes back. Blend and depth stencil descriptions have padding
+// and are copied member by member into zeroed keys first, so it never takes part.
+class StateObjectCache
+{
+public:
+    void Init(ID3D11Device* device) { m_Device = device; }
+
+    void Release()
+    {
+        for (Entry& entry : m_Entries)
+            SAFE_RELEASE(entry.object);
+        m_Entries.clear();
+        m_Hits = 0;
+    }
+
+    HRESULT CreateDepthStencilState(const D3D11_DEPTH_STENCIL_DESC& desc, ID3D11DepthStencilState** state)
+    {
+        D3D11_DEPTH_STENCIL_DESC key;
+        memset(&key, 0, sizeof(key));
+        key.DepthEnable = desc.DepthEnable;
+        key.DepthWriteMask = desc.DepthWriteMask;
+        key.DepthFunc = desc.DepthFunc;
+        key.StencilEnable = desc.StencilEnable;
+        key.StencilReadMask = desc.StencilReadMask;
+        key.StencilWriteMask = desc.StencilWriteMask;
+        key.FrontFace = desc.FrontFace;
+        key.BackFace = desc.BackFace;
+        return Find(STATE_OBJECT_DEPTH_STENCIL, key, state, [&](ID3D11DepthStencilState** created) { return m_Device->CreateDepthStencilState(&desc, created); });
+    }
+
+    HRESULT CreateRasterizerState(const D3D11_RASTERIZER_DESC& desc, ID3D11RasterizerState** state)
+    {
+        return Find(STATE_OBJECT_RASTERIZER, desc, state, [&](ID3D11RasterizerState** created) { return m_Device->CreateRasterizerState(&desc, created); });
+    }
+
+    HRESULT CreateBlendState(const D3D11_BLEND_DESC& desc, ID3D11BlendState** state)
+    {
+        D3D11_BLEND_DESC key;
+        memset(&key, 0, sizeof(key));
+        key.AlphaToCoverageEnable = desc.AlphaToCoverageEnable;
+        key.IndependentBlendEnable = desc.IndependentBlendEnable;
+        for (UINT i = 0; i < D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT; ++i)
+        {
+            const D3D11_RENDER_TARGET_BLEND_DESC& target = desc.RenderTarget[i];
+            key.RenderTarget[i].BlendEnable = target.BlendEnable;
+            key.RenderTarget[i].SrcBlend = target.SrcBlend;
+            key.RenderTarget[i].DestBlend = target.DestBlend;
+            key.RenderTarget[i].BlendOp = target.BlendOp;
+            key.RenderTarget[i].SrcBlendAlpha = target.SrcBlendAlpha;
+            key.RenderTarget[i].DestBlendAlpha = target.DestBlendAlpha;
+            key.RenderTarget[i].BlendOpAlpha = target.BlendOpAlpha;
+            key.RenderTarget[i].RenderTargetWriteMask = target.RenderTargetWriteMask;
+        }
+        return Find(STATE_OBJECT_BLEND, key, state, [&](ID3D11BlendState** created) { return m_Device->CreateBlendState(&desc, created); });
+    }
+
+    HRESULT CreateSamplerState(const D3D11_SAMPLER_DESC& desc, ID3D11SamplerState** state)
+    {
+        return Find(STATE_OBJECT_SAMPLER, desc, state, [&](ID3D11SamplerState** created) { return m_Device->CreateSamplerState(&desc, created); });
+    }
+
+    // Requests answered with an existing object
+    UINT GetHitCount() const { return m_Hits; }
+    UINT GetObjectCount() const { return (UINT)m_Entries.size(); }
+
+private:
+    // Sampler and depth stencil descriptions are the same size, so the kind is part of the key
+    enum Kind
+    {
+        STATE_OBJECT_DEPTH_STENCIL,
+        STATE_OBJECT_RASTERIZER,
+        STATE_OBJECT_BLEND,
+        STATE_OBJECT_SAMPLER,
+    };
+
+    struct Entry
+    {
+        UINT64 hash;
+        Kind kind;
+        BYTE desc[sizeof(D3D11_BLEND_DESC)];  // the largest description
+        ID3D11DeviceChild* object;
+    };
+
+    // FNV-1a over the kind and the description
+    static UINT64 HashDesc(Kind kind, const void* desc, size_t size)
+    {
+        const BYTE* bytes = static_cast<const BYTE*>(desc);
+        UINT64 hash = (14695981039346656037ull ^ (UINT64)kind) * 1099511628211ull;
+        for (size_t i = 0; i < size; ++i)
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+        return hash;
+    }
+
+    template<typename Desc, typename State, typename Create>
+    HRESULT Find(Kind kind, const Desc& key, State** state, Create create)
+    {
+        static_assert(sizeof(Desc) <= sizeof(Entry::desc), "state description larger than the cache key");
+
+        UINT64 hash = HashDesc(kind, &key, sizeof(key));
+        for (const Entry& entry : m_Entries)
+        {
+            if (entry.hash == hash && entry.kind == kind && memcmp(entry.desc, &key, sizeof(key)) == 0)
+            {
+                entry.object->AddRef();
+                *state = static_cast<State*>(entry.object);
+                ++m_Hits;
+                return S_OK;
+            }
+        }
+
+        State* created = nullptr;
+        HRESULT hr = create(&created);
+        if (FAILED(hr))
+            return hr;
+
+        Entry entry = {};
+        entry.hash = hash;
+        entry.kind = kind;
+        memcpy(entry.desc, &key, sizeof(key));
+        entry.object = created;
+        m_Entries.push_back(entry);
+        created->AddRef();
+        *state = created;
+        return S_OK;
+    }
+
+    ID3D11Device* m_Device = nullptr;
+    std::vector<Entry> m_Entries;
+    UINT m_Hits = 0;
+};
+
+// Render target pool
+// Transient render targets for the render graph, kept from frame to frame and matched by
+// size, format and bind flags. A texture nobody asked for in RENDER_TARGET_POOL_IDLE_FRAMES
+// frames is released, so after a resize the old sizes go away on their own.
+static const UINT RENDER_TARGET_POOL_IDLE_FRAMES = 2;
+static const UINT RENDER_TARGET_NONE = ~0u;
+
+static UINT RenderTargetBytesPerPixel(DXGI_FORMAT format)
+{
+    switch (format)
+    {
+    case DXGI_FORMAT_R32G32B32A32_FLOAT: return 16;
+    case DXGI_FORMAT_R16G16B16A16_FLOAT: return 8;
+    case DXGI_FORMAT_R8G8B8A8_UNORM:
+    case DXGI_FORMAT_R8G8B8A8_UNORM_SRGB:
+    case DXGI_FORMAT_B8G8R8A8_UNORM:
+    case DXGI_FORMAT_R10G10B10A2_UNORM:
+    case DXGI_FORMAT_R11G11B10_FLOAT:
+    case DXGI_FORMAT_R32_FLOAT:
+    case DXGI_FORMAT_D32_FLOAT:
+    case DXGI_FORMAT_D24_UNORM_S8_UINT: return 4;
+    case DXGI_FORMAT_R16_FLOAT:
+    case DXGI_FORMAT_D16_UNORM: return 2;
+    case DXGI_FORMAT_R8_UNORM: return 1;
+    default: return 4;
+    }
+}
+
+class RenderTargetPool
+{
+public:
+    struct Target
+    {
+        UINT width;
+        UINT height;
+        DXGI_FORMAT format;
+        UINT bindFlags;
+        ID3D11Texture2D* texture;
+        ID3D11RenderTargetView* rtv;
+        ID3D11DepthStencilView* dsv;
+        ID3D11ShaderResourceView* srv;
+        UINT64 lastUsedFrame;
+        bool inUse;
+    };
+
+    void Init(ID3D11Device* device) { m_Device = device; }
+
+    // A free target matching the description, created if there is none; RENDER_TARGET_NONE
+    // if creation fails. Indices are valid until EndFrame.
+    UINT Acquire(const char* name, UINT width, UINT height, DXGI_FORMAT format, UINT bindFlags)
+    {
+        for (UINT i = 0; i < (UINT)m_Targets.size(); ++i)
+        {
+            Target& target = m_Targets[i];
+            if (!target.inUse && target.width == width && target.height == height && target.format == format && target.bindFlags == bindFlags)
+            {
+                target.inUse = true;
+                target.lastUsedFrame = m_Frame;
+                return i;
+            }
+        }
+
+        Target target = {};
+        target.width = width;
+        target.height = height;
+        target.format = format;
+        target.bindFlags = bindFlags;
+
+        D3D11_TEXTURE2D_DESC desc = {};
+        desc.Width = width;
+        desc.Height = height;
+        desc.MipLevels = 1;
+        desc.ArraySize = 1;
+        desc.Format = format;
+        desc.SampleDesc.Count = 1;
+        desc.Usage = D3D11_USAGE_DEFAULT;
+        desc.BindFlags = bindFlags;
+        bool created = SUCCEEDED(m_Device->CreateTexture2D(&desc, nullptr, &target.texture));
+        if (created && (bindFlags & D3D11_BIND_RENDER_TARGET))
+            created = SUCCEEDED(m_Device->CreateRenderTargetView(target.texture, nullptr, &target.rtv));
+        if (created && (bindFlags & D3D11_BIND_DEPTH_STENCIL))
+            created = SUCCEEDED(m_Device->CreateDepthStencilView(target.texture, nullptr, &target.dsv));
+        if (created && (bindFlags & D3D11_BIND_SHADER_RESOURCE))
+            created = SUCCEEDED(m_Device->CreateShaderResourceView(target.texture, nullptr, &target.srv));
+        if (!created)
+        {
+            ReleaseTarget(target);
+            return RENDER_TARGET_NONE;
+        }
+        SetResourceName(target.texture, name);
+
+        target.inUse = true;
+        target.lastUsedFrame = m_Frame;
+        m_Targets.push_back(target);
+        return (UINT)m_Targets.size() - 1;
+    }
+
+    const Target& Get(UINT index) const { return m_Targets[index]; }
+
+    // Every target is free again; the ones idle for too long are released
+    void EndFrame()
+    {
+        for (size_t i = 0; i < m_Targets.size();)
+        {
+            Target& target = m_Targets[i];
+            target.inUse = false;
+            if (m_Frame - target.lastUsedFrame >= RENDER_TARGET_POOL_IDLE_FRAMES)
+            {
+                ReleaseTarget(target);
+                m_Targets.erase(m_Targets.begin() + i);
+            }
+            else
+            {
+                ++i;
+            }
+        }
+        ++m_Frame;
+    }
+
+    void Release()
+    {
+        for (Target& target : m_Targets)
+            ReleaseTarget(target);
+        m_Targets.clear();
+    }
+
+    UINT GetTargetCount() const { return (UINT)m_Targets.size(); }
+
+    UINT64 GetBytes() const
+    {
+        UINT64 bytes = 0;
+        for (const Target& target : m_Targets)
+            bytes += (UINT64)target.width * target.height * RenderTargetBytesPerPixel(target.format);
+        return bytes;
+    }
+
+private:
+    static void ReleaseTarget(Target& target)
+    {
+        SAFE_RELEASE(target.srv);
+        SAFE_RELEASE(target.dsv);
+        SAFE_RELEASE(target.rtv);
+        SAFE_RELEASE(target.texture);
+    }
+
+    ID3D11Device* m_Device = nullptr;
+    std::vector<Target> m_Targets;
+    UINT64 m_Frame = 0;
+};
+
+// Render graph
+// A frame is declared as passes, each naming the textures it reads and writes, and Compile
+// works out the rest without a device:
+//  - Order: the writers of a texture run before its readers, and writers of the same
+//    texture in the order they were added; passes are otherwise kept in declaration order
+//  - Culling: only the passes that contribute to an output (the back buffer) are kept
+//  - Lifetimes: a transient texture lives from the first to the last kept pass using it
+//  - Aliasing: transients with the same description and disjoint lifetimes share one
+//    texture, so a chain of effects needs as many textures as it has alive at once. D3D11
+//    can't place textures in shared memory without tiled resources, so whole textures are
+//    shared; RenderTargetPool keeps them from frame to frame.
+//  - Barriers: D3D11 tracks hazards itself, but silently drops a view still bound for
+//    reading when its texture becomes an output. The graph unbinds views before their
+//    texture is written again and, for transients, at the end of the frame, when the pool
+//    may hand the texture to another resource next frame.
+// Execute binds each pass's outputs, clears and views, then calls the pass to draw.
+typedef UINT RenderGraphHandle;
+static const RenderGraphHandle RENDER_GRAPH_NONE = ~0u;
+
+enum RenderGraphAccessType
+{
+    RENDER_GRAPH_SHADER_READ,   // pixel shader view at a slot
+    RENDER_GRAPH_DEPTH_TEST,    // bound as the depth buffer, tested but not written
+    RENDER_GRAPH_RENDER_TARGET,
+    RENDER_GRAPH_DEPTH_WRITE,
+};
+
+// A view unbound from pixel shader slot `slot` before the pass at `position` in execution
+// order runs; position == executed pass count is the end of the frame
+struct RenderGraphBarrier
+{
+    UINT position;
+    RenderGraphHandle texture;
+    UINT slot;
+};
+
+class RenderGraph
+{
+public:
+    typedef void (*ExecuteFunc)(const RenderGraph& graph, void* data);
+
+    void Reset()
+    {
+        m_Textures.clear();
+        m_Passes.clear();
+        m_Accesses.clear();
+        m_Order.clear();
+        m_Barriers.clear();
+        m_PhysicalDescs.clear();
+        m_PhysicalTargets.clear();
+        m_Pool = nullptr;
+        m_Error = nullptr;
+        m_Compiled = false;
+    }
+
+    RenderGraphHandle CreateTexture(const char* name, UINT width, UINT height, DXGI_FORMAT format)
+    {
+        Texture texture = {};
+        texture.name = name;
+        texture.width = width;
+        texture.height = height;
+        texture.format = format;
+        m_Textures.push_back(texture);
+        return (RenderGraphHandle)m_Textures.size() - 1;
+    }
+
+    RenderGraphHandle ImportTexture(const char* name, UINT width, UINT height, ID3D11RenderTargetView* rtv, ID3D11DepthStencilView* dsv, ID3D11ShaderResourceView* srv)
+    {
+        RenderGraphHandle handle = CreateTexture(name, width, height, DXGI_FORMAT_UNKNOWN);
+        Texture& texture = m_Textures[handle];
+        texture.imported = true;
+        texture.rtv = rtv;
+        texture.dsv = dsv;
+        texture.srv = srv;
+        return handle;
+    }
+
+    // Outputs keep their writers alive, see Compile
+    void MarkOutput(RenderGraphHandle texture) { m_Textures[texture].output = true; }
+
+    RenderGraphHandle AddPass(const char* name, ExecuteFunc execute, void* data)
+    {
+        Pass pass = {};
+        pass.name = name;
+        pass.execute = execute;
+        pass.data = data;
+        m_Passes.push_back(pass);
+        return (RenderGraphHandle)m_Passes.size() - 1;
+    }
+
+    void ReadTexture(RenderGraphHandle pass, RenderGraphHandle texture, UINT slot) { AddAccess(pass, texture, RENDER_GRAPH_SHADER_READ, slot, nullptr); }
+    void TestDepth(RenderGraphHandle pass, RenderGraphHandle texture) { AddAccess(pass, texture, RENDER_GRAPH_DEPTH_TEST, 0, nullptr); }
+
+    // A null clear color keeps the contents, which transients don't have before their first write
+    void WriteRenderTarget(RenderGraphHandle pass, RenderGraphHandle texture, const FLOAT* clearColor)
+    {
+        AddAccess(pass, texture, RENDER_GRAPH_RENDER_TARGET, 0, clearColor);
+    }
+
+    void WriteDepth(RenderGraphHandle pass, RenderGraphHandle texture, bool clear)
+    {
+        const FLOAT farDepth[4] = { 1.0f, 0.0f, 0.0f, 0.0f };
+        AddAccess(pass, texture, RENDER_GRAPH_DEPTH_WRITE, 0, clear ? farDepth : nullptr);
+    }
+
+    // False, with GetError set, for graphs that can't run: a pass reading and writing one
+    // texture, a transient read before anything writes it, more outputs than D3D11 binds,
+    // or a dependency cycle
+    bool Compile()
+    {
+        m_Order.clear();
+        m_Barriers.clear();
+        m_PhysicalDescs.clear();
+        m_Compiled = false;
+        m_Error = nullptr;
+
+        UINT passCount = (UINT)m_Passes.size();
+        for (Texture& texture : m_Textures)
+        {
+            texture.needed = texture.output;
+            texture.writers = 0;
+            texture.bindFlags = 0;
+            texture.firstUse = RENDER_GRAPH_NONE;
+            texture.lastUse = RENDER_GRAPH_NONE;
+            texture.physical = RENDER_GRAPH_NONE;
+        }
+        for (Pass& pass : m_Passes)
+        {
+            pass.live = false;
+            pass.position = RENDER_GRAPH_NONE;
+            pass.outputs = 0;
+            pass.hasDepth = false;
+        }
+
+        for (const Access& access : m_Accesses)
+        {
+            Texture& texture = m_Textures[access.texture];
+            Pass& pass = m_Passes[access.pass];
+            if (IsWrite(access.type))
+            {
+                ++texture.writers;
+                if (access.type == RENDER_GRAPH_RENDER_TARGET && ++pass.outputs > D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT)
+                    return Fail("more render targets than a pass can bind");
+            }
+            if (access.type == RENDER_GRAPH_DEPTH_TEST || access.type == RENDER_GRAPH_DEPTH_WRITE)
+            {
+                if (pass.hasDepth)
+                    return Fail("two depth buffers in one pass");
+                pass.hasDepth = true;
+            }
+        }
+        for (const Access& read : m_Accesses)
+        {
+            if (IsWrite(read.type))
+                continue;
+            if (!m_Textures[read.texture].imported && m_Textures[read.texture].writers == 0)
+                return Fail("a transient texture read before anything writes it");
+            for (const Access& write : m_Accesses)
+            {
+                if (write.pass == read.pass && write.texture == read.texture && IsWrite(write.type))
+                    return Fail("a pass reading a texture it writes");
+            }
+        }
+
+        // Culling: a pass is kept if it writes a texture that is an output or that a kept
+        // pass reads; repeated until nothing changes, graphs are a handful of passes
+        for (bool changed = true; changed;)
+        {
+            changed = false;
+            for (const Access& access : m_Accesses)
+            {
+                if (!m_Passes[access.pass].live && IsWrite(access.type) && m_Textures[access.texture].needed)
+                {
+                    m_Passes[access.pass].live = true;
+                    changed = true;
+                }
+            }
+            for (const Access& access : m_Accesses)
+            {
+                if (m_Passes[access.pass].live && !IsWrite(access.type) && !m_Textures[access.texture].needed)
+                {
+                    m_Textures[access.texture].needed = true;
+                    changed = true;
+                }
+            }
+        }
+
+        // Order: Kahn's algorithm, taking the first ready pass in declaration order
+        for (UINT placed = 0, liveCount = LiveCount(); placed < liveCount; ++placed)
+        {
+            UINT next = RENDER_GRAPH_NONE;
+            for (UINT p = 0; p < passCount && next == RENDER_GRAPH_NONE; ++p)
+            {
+                if (m_Passes[p].live && m_Passes[p].position == RENDER_GRAPH_NONE && IsReady(p))
+                    next = p;
+            }
+            if (next == RENDER_GRAPH_NONE)
+                return Fail("a dependency cycle");
+            m_Passes[next].position = (UINT)m_Order.size();
+            m_Order.push_back(next);
+        }
+
+        // Lifetimes and bind flags, over the kept passes
+        for (const Access& access : m_Accesses)
+        {
+            const Pass& pass = m_Passes[access.pass];
+            if (!pass.live)
+                continue;
+            Texture& texture = m_Textures[access.texture];
+            if (texture.firstUse == RENDER_GRAPH_NONE || pass.position < texture.firstUse)
+                texture.firstUse = pass.position;
+            if (texture.lastUse == RENDER_GRAPH_NONE || pass.position > texture.lastUse)
+                texture.lastUse = pass.position;
+            texture.bindFlags |= BindFlag(access.type);
+        }
+
+        // Aliasing: transients by first use, each into the first physical texture of the
+        // same description that is free by then
+        for (UINT position = 0; position < (UINT)m_Order.size(); ++position)
+        {
+            for (Texture& texture : m_Textures)
+            {
+                if (texture.imported || texture.firstUse != position)
+                    continue;
+                for (UINT i = 0; i < (UINT)m_PhysicalDescs.size() && texture.physical == RENDER_GRAPH_NONE; ++i)
+                {
+                    PhysicalDesc& physical = m_PhysicalDescs[i];
+                    if (physical.lastUse < position && physical.width == texture.width && physical.height == texture.height &&
+                        physical.format == texture.format && physical.bindFlags == texture.bindFlags)
+                    {
+                        physical.lastUse = texture.lastUse;
+                        texture.physical = i;
+                    }
+                }
+                if (texture.physical == RENDER_GRAPH_NONE)
+                {
+                    texture.physical = (UINT)m_PhysicalDescs.size();
+                    m_PhysicalDescs.push_back({ texture.name, texture.width, texture.height, texture.format, texture.bindFlags, texture.lastUse });
+                }
+            }
+        }
+
+        // Barriers: follow what each pixel shader slot holds. Writing a texture whose
+        // physical texture is still bound unbinds it first; so does the end of the frame
+        // for transients.
+        RenderGraphHandle bound[D3D11_COMMONSHADER_INPUT_RESOURCE_SLOT_COUNT];
+        std::fill(std::begin(bound), std::end(bound), RENDER_GRAPH_NONE);
+        for (UINT position = 0; position < (UINT)m_Order.size(); ++position)
+        {
+            UINT pass = m_Order[position];
+            for (const Access& access : m_Accesses)
+            {
+                if (access.pass != pass || !IsWrite(access.type))
+                    continue;
+                for (UINT slot = 0; slot < _countof(bound); ++slot)
+                {
+                    if (bound[slot] != RENDER_GRAPH_NONE && SamePhysical(bound[slot], access.texture))
+                    {
+                        m_Barriers.push_back({ position, bound[slot], slot });
+                        bound[slot] = RENDER_GRAPH_NONE;
+                    }
+                }
+            }
+            for (const Access& access : m_Accesses)
+            {
+                if (access.pass == pass && access.type == RENDER_GRAPH_SHADER_READ)
+                    bound[access.slot] = access.texture;
+            }
+        }
+        for (UINT slot = 0; slot < _countof(bound); ++slot)
+        {
+            if (bound[slot] != RENDER_GRAPH_NONE && !m_Textures[bound[slot]].imported)
+                m_Barriers.push_back({ (UINT)m_Order.size(), bound[slot], slot });
+        }
+
+        m_Compiled = true;
+        return true;
+    }
+
+    // Takes a pool target for every physical texture; false if one can't be created
+    bool Allocate(RenderTargetPool& pool)
+    {
+        assert(m_Compiled);
+        m_Pool = &pool;
+        m_PhysicalTargets.clear();
+        for (const PhysicalDesc& physical : m_PhysicalDescs)
+        {
+            UINT target = pool.Acquire(physical.name, physical.width, physical.height, physical.format, physical.bindFlags);
+            if (target == RENDER_TARGET_NONE)
+                return false;
+            m_PhysicalTargets.push_back(target);
+        }
+        return true;
+    }
+
+    void Execute(D3D11StateCache& cache, ID3D11DeviceContext* context) const
+    {
+        assert(m_Compiled && m_PhysicalTargets.size() == m_PhysicalDescs.size());
+        size_t barrier = 0;
+        for (UINT position = 0; position <= (UINT)m_Order.size(); ++position)
+        {
+            for (; barrier < m_Barriers.size() && m_Barriers[barrier].position == position; ++barrier)
+                cache.PSUnbindShaderResource(m_Barriers[barrier].slot, GetShaderResourceView(m_Barriers[barrier].texture));
+            if (position == m_Order.size())
+                break;
+
+            UINT pass = m_Order[position];
+            ID3D11RenderTargetView* rtvs[D3D11_SIMULTANEOUS_RENDER_TARGET_COUNT] = {};
+            UINT rtvCount = 0;
+            ID3D11DepthStencilView* dsv = nullptr;
+            RenderGraphHandle sizeFrom = RENDER_GRAPH_NONE;
+            for (const Access& access : m_Accesses)
+            {
+                if (access.pass != pass)
+                    continue;
+                if (access.type == RENDER_GRAPH_RENDER_TARGET)
+                    rtvs[rtvCount++] = GetRenderTargetView(access.texture);
+                else if (access.type == RENDER_GRAPH_DEPTH_TEST || access.type == RENDER_GRAPH_DEPTH_WRITE)
+                    dsv = GetDepthStencilView(access.texture);
+                else
+                    continue;
+                if (sizeFrom == RENDER_GRAPH_NONE)
+                    sizeFrom = access.texture;
+            }
+            cache.OMSetRenderTargets(rtvCount, rtvs, dsv);
+            if (sizeFrom != RENDER_GRAPH_NONE)
+            {
+                const Texture& texture = m_Textures[sizeFrom];
+                D3D11_VIEWPORT viewport = { 0.0f, 0.0f, (FLOAT)texture.width, (FLOAT)texture.height, 0.0f, 1.0f };
+                cache.RSSetViewport(viewport);
+            }
+
+            for (const Access& access : m_Accesses)
+            {
+                if (access.pass != pass)
+                    continue;
+                if (access.clear && access.type == RENDER_GRAPH_RENDER_TARGET)
+                    context->ClearRenderTargetView(GetRenderTargetView(access.texture), access.clearValue);
+                else if (access.clear && access.type == RENDER_GRAPH_DEPTH_WRITE)
+                    context->ClearDepthStencilView(GetDepthStencilView(access.texture), D3D11_CLEAR_DEPTH, access.clearValue[0], 0);
+                else if (access.type == RENDER_GRAPH_SHADER_READ)
+                {
+                    ID3D11ShaderResourceView* srv = GetShaderResourceView(access.texture);
+                    cache.PSSetShaderResources(access.slot, 1, &srv);
+                }
+            }
+
+            m_Passes[pass].execute(*this, m_Passes[pass].data);
+        }
+    }
+
+    ID3D11RenderTargetView* GetRenderTargetView(RenderGraphHandle texture) const
+    {
+        const Texture& t = m_Textures[texture];
+        return t.imported ? t.rtv : m_Pool->Get(m_PhysicalTargets[t.physical]).rtv;
+    }
+
+    ID3D11DepthStencilView* GetDepthStencilView(RenderGraphHandle texture) const
+    {
+        const Texture& t = m_Textures[texture];
+        return t.imported ? t.dsv : m_Pool->Get(m_PhysicalTargets[t.physical]).dsv;
+    }
+
+    ID3D11ShaderResourceView* GetShaderResourceView(RenderGraphHandle texture) const
+    {
+        const Texture& t = m_Textures[texture];
+        return t.imported ? t.srv : m_Pool->Get(m_PhysicalTargets[t.physical]).srv;
+    }
+
+    const char* GetError() const { return m_Error; }
+    UINT GetPassCount() const { return (UINT)m_Passes.size(); }
+    UINT GetExecutedPassCount() const { return (UINT)m_Order.size(); }
+    RenderGraphHandle GetExecutedPass(UINT position) const { return m_Order[position]; }
+    bool IsPassCulled(RenderGraphHandle pass) const { return !m_Passes[pass].live; }
+    UINT GetTransientCount() const
+    {
+        UINT count = 0;
+        for (const Texture& texture : m_Textures)
+            count += !texture.imported && texture.physical != RENDER_GRAPH_NONE;
+        return count;
+    }
+    UINT GetPhysicalCount() const { return (UINT)m_PhysicalDescs.size(); }
+    // Physical texture of a transient, RENDER_GRAPH_NONE if it is imported or unused
+    UINT GetPhysical(RenderGraphHandle texture) const { return m_Textures[texture].physical; }
+    UINT GetFirstUse(RenderGraphHandle texture) const { return m_Textures[texture].firstUse; }
+    UINT GetLastUse(RenderGraphHandle texture) const { return m_Textures[texture].lastUse; }
+    const std::vector<RenderGraphBarrier>& GetBarriers() const { return m_Barriers; }
+
+private:
+    struct Texture
+    {
+        const char* name;
+        UINT width;
+        UINT height;
+        DXGI_FORMAT format;
+        bool imported;
+        bool output;
+        ID3D11RenderTargetView* rtv;
+        ID3D11DepthStencilView* dsv;
+        ID3D11ShaderResourceView* srv;
+        // Compile
+        bool needed;
+        UINT writers;
+        UINT bindFlags;
+        UINT firstUse;  // positions in execution order
+        UINT lastUse;
+        UINT physical;
+    };
+
+    struct Pass
+    {
+        const char* name;
+        ExecuteFunc execute;
+        void* data;
+        // Compile
+        bool live;
+        UINT position;
+        UINT outputs;
+        bool hasDepth;
+    };
+
+    struct Access
+    {
+        RenderGraphHandle pass;
+        RenderGraphHandle texture;
+        RenderGraphAccessType type;
+        UINT slot;
+        bool clear;
+        FLOAT clearValue[4];
+    };
+
+    struct PhysicalDesc
+    {
+        const char* name;  // of the first texture using it
+        UINT width;
+        UINT height;
+        DXGI_FORMAT format;
+        UINT bindFlags;
+        UINT lastUse;
+    };
+
+    static bool IsWrite(RenderGraphAccessType type) { return type == RENDER_GRAPH_RENDER_TARGET || type == RENDER_GRAPH_DEPTH_WRITE; }
+
+    static UINT BindFlag(RenderGraphAccessType type)
+    {
+        switch (type)
+        {
+        case RENDER_GRAPH_SHADER_READ: return D3D11_BIND_SHADER_RESOURCE;
+        case RENDER_GRAPH_RENDER_TARGET: return D3D11_BIND_RENDER_TARGET;
+        default: return D3D11_BIND_DEPTH_STENCIL;
+        }
+    }
+
+    void AddAccess(RenderGraphHandle pass, RenderGraphHandle texture, RenderGraphAccessType type, UINT slot, const FLOAT* clearValue)
+    {
+        assert(pass < m_Passes.size() && texture < m_Textures.size() && slot < D3D11_COMMONSHADER_INPUT_RESOURCE_SLOT_COUNT);
+        Access access = {};
+        access.pass = pass;
+        access.texture = texture;
+        access.type = type;
+        access.slot = slot;
+        access.clear = clearValue != nullptr;
+        if (clearValue)
+            memcpy(access.clearValue, clearValue, sizeof(access.clearValue));
+        m_Accesses.push_back(access);
+    }
+
+    bool Fail(const char* error)
+    {
+        m_Error = error;
+        return false;
+    }
+
+    UINT LiveCount() const
+    {
+        UINT count = 0;
+        for (const Pass& pass : m_Passes)
+            count += pass.live;
+        return count;
+    }
+
+    // Every pass `pass` depends on is placed: the writers of what it reads, and the writers
+    // added before it of what it writes
+    bool IsReady(RenderGraphHandle pass) const
+    {
+        for (const Access& access : m_Accesses)
+        {
+            if (access.pass != pass)
+                continue;
+            for (const Access& other : m_Accesses)
+            {
+                if (other.texture != access.texture || other.pass == pass || !IsWrite(other.type) || !m_Passes[other.pass].live)
+                    continue;
+                bool before = !IsWrite(access.type) || other.pass < pass;
+                if (before && m_Passes[other.pass].position == RENDER_GRAPH_NONE)
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    bool SamePhysical(RenderGraphHandle a, RenderGraphHandle b) const
+    {
+        const Texture& ta = m_Textures[a];
+        const Texture& tb = m_Textures[b];
+        if (ta.imported || tb.imported)
+            return a == b;
+        return ta.physical == tb.physical;
+    }
+
+    std::vector<Texture> m_Textures;
+    std::vector<Pass> m_Passes;
+    std::vector<Access> m_Accesses;
+    std::vector<UINT> m_Order;  // kept passes in execution order
+    std::vector<RenderGraphBarrier> m_Barriers;
+    std::vector<PhysicalDesc> m_PhysicalDescs;
+    std::vector<UINT> m_PhysicalTargets;  // pool index of each physical texture
+    RenderTargetPool* m_Pool = nullptr;
+    const char* m_Error = nullptr;
+    bool m_Compiled = false;
+};
+
+// Global resources
+HWND g_hWnd = nullptr;
+
+ID3D11Device* g_pDevice = nullptr;
+bool g_UseNullDevice = false;               // -nulldevice: headless, see RunHeadlessFrames
+NullD3D11Device* g_pNullDevice = nullptr;  // the same object as g_pDevice, which owns it
+ID3D11DeviceContext* g_pDeviceContext = nullptr;
+IDXGISwapChain* g_pSwapChain = nullptr;
+ID3D11RenderTargetView* g_pBackBufferRTV = nullptr;
+ID3D11DepthStencilView* g_pDepthStencilView = nullptr;
+ID3D11Texture2D* g_pDepthStencilTexture = nullptr;
+
+UINT g_ClientWidth = 1280;
+UINT g_ClientHeight = 720;
+
+struct LitVertex
+{
+    float px, py, pz;
+    float nx, ny, nz;
+    float tx, ty, tz;
+    float u, v;
+};
+
+struct SkyboxVertex
+{
+    float x, y, z;
+    float u, v;
+};
+
+ID3D11Buffer* g_pVertexBuffer = nullptr;
+ID3D11Buffer* g_pIndexBuffer = nullptr;
+ID3D11Buffer* g_pSkyboxVertexBuffer = nullptr;
+ID3D11Buffer* g_pSkyboxIndexBuffer = nullptr;
+
+// Main lit instanced shaders, one pixel shader per LOD (0 = full quality)
+static const UINT LOD_COUNT = 3;
+ID3D11VertexShader* g_pVertexShader = nullptr;
+ID3D11PixelShader* g_pLodPixelShaders[LOD_COUNT] = {};
+ID3D11InputLayout* g_pInputLayout = nullptr;
+
+// Skybox shaders
+ID3D11VertexShader* g_pSkyboxVS = nullptr;
+ID3D11PixelShader* g_pSkyboxPS = nullptr;
+ID3D11InputLayout* g_pSkyboxInputLayout = nullptr;
+
+// Transparent shaders
+ID3D11VertexShader* g_pTransparentVS = nullptr;
+ID3D11PixelShader* g_pTransparentPS = nullptr;
+ID3D11InputLayout* g_pTransparentInputLayout = nullptr;
+ID3D11VertexShader* g_pTransparentBspVS = nullptr;
+ID3D11InputLayout* g_pTransparentBspInputLayout = nullptr;
+
+// Post-process shaders
+ID3D11VertexShader* g_pPostVS = nullptr;
+ID3D11PixelShader* g_pPostPS = nullptr;
+
+struct ViewProjBuffer
+{
+    XMMATRIX vp;
+};
+
+struct LightData
+{
+    XMFLOAT4 position;
+    XMFLOAT4 color;
+};
+
+static const UINT MAX_SCENE_LIGHTS = 4;  // lights[] in SceneBuffer
+
+struct SceneBuffer
+{
+    XMFLOAT4 cameraPos;
+    XMFLOAT4 ambientColor;
+    LightData lights[MAX_SCENE_LIGHTS];
+    XMINT4 lightCount;
+};
+
+struct TransparentBuffer
+{
+    XMMATRIX model;
+    XMFLOAT4 color;
+};
+
+struct DrawParamsBuffer
+{
+    XMUINT4 params; // x = byte offset into the instance ring of the draw's first InstanceGPU
+};
+
+struct PostProcessBuffer
+{
+    XMINT4 mode; // x = effect mode: 0=normal, 1=grayscale, 2=sepia, 3=brightness
+};
+
+// Instance data decoded in litVS / litPS (keep both sides in sync). Every frame the
+// transform kernel writes one InstanceGPU per visible instance, in draw order, into the
+// frame packet, and the submit stage copies them into the upload ring: the static part of
+// the instance (kept in its entity) with this frame's rotation.
+struct InstanceStaticGPU
+{
+    XMFLOAT4 posScale;  // xyz = position, w = uniform scale
+    UINT params[2];     // half: shininess | rotation speed << 16, textureId | hasNormalMap << 16
+};
+
+struct InstanceGPU
+{
+    XMFLOAT4 posScale;
+    UINT rotation[2];   // snorm16 quaternion: x | y << 16, z | w << 16
+    UINT params[2];
+};
+
+struct CubeInstanceCPU
+{
+    XMFLOAT3 basePos;
+    float scale;
+    float rotSpeed;
+    UINT textureId;
+    bool hasNormalMap;
+};
+
+ID3D11Buffer* g_pViewProjBuffer = nullptr;
+ID3D11Buffer* g_pSkyViewProjBuffer = nullptr;  // the camera rotation only, written once a frame like g_pViewProjBuffer
+ID3D11Buffer* g_pSceneBuffer = nullptr;
+ID3D11Buffer* g_pTransparentBuffer = nullptr;
+ID3D11Buffer* g_pPostProcessBuffer = nullptr;
+ID3D11Buffer* g_pInstanceRingBuffer = nullptr;  // dynamic raw buffer, the upload ring's memory
+ID3D11ShaderResourceView* g_pInstanceRingSRV = nullptr;
+UINT g_InstanceRingCapacity = 0;
+
+// The ring grows with the scene and keeps room for a few frames of instance records
+// before it has to discard
+static const UINT UPLOAD_RING_BYTES = 64 * 1024;
+static const UINT UPLOAD_RING_FRAMES = 3;
+static const UINT UPLOAD_RING_ALIGNMENT = 64;  // whole cache lines, as write-combined memory wants them
+D3D11UploadTarget g_InstanceRingTarget;
+UploadRing g_InstanceRing;
+FrameFences g_FrameFences;
+ID3D11Buffer* g_pDrawParamsBuffer = nullptr;
+
+// Per-draw constants come in slices of one dynamic buffer, see EnsureConstantRing. Its
+// ring ends its frames along with the instance ring, so the same fences retire both.
+static const UINT CONSTANT_SLICE_BYTES = 256;  // 16 constants, the unit of 11.1 constant buffer offsets
+static const UINT CONSTANT_RING_BYTES = 64 * 1024;
+ID3D11Buffer* g_pConstantRingBuffer = nullptr;
+UINT g_ConstantRingCapacity = 0;
+bool g_ConstantBufferOffsets = false;  // draws bind their slice of the ring themselves
+D3D11UploadTarget g_ConstantRingTarget;
+UploadRing g_ConstantRing;
+
+D3D11StateCache g_StateCache;
+StateObjectCache g_StateObjects;
+
+// Textures
+ID3D11Texture2D* g_pNormalTexture = nullptr;
+ID3D11ShaderResourceView* g_pNormalTextureView = nullptr;
+
+ID3D11Texture2D* g_pTextureArray = nullptr;
+ID3D11ShaderResourceView* g_pTextureArrayView = nullptr;
+
+ID3D11Texture2D* g_pCubemapTexture = nullptr;
+ID3D11ShaderResourceView* g_pCubemapView = nullptr;
+
+ID3D11SamplerState* g_pSampler = nullptr;
+
+ID3D11BlendState* g_pTransparentBlendState = nullptr;
+ID3D11DepthStencilState* g_pTransparentDepthState = nullptr;
+ID3D11DepthStencilState* g_pOpaqueDepthState = nullptr;
+ID3D11DepthStencilState* g_pSkyboxDepthState = nullptr;
+ID3D11RasterizerState* g_pCullBackRS = nullptr;
+ID3D11RasterizerState* g_pCullNoneRS = nullptr;
+
+// Frame graph, rebuilt every frame; its transient targets come from the pool
+RenderGraph g_FrameGraph;
+RenderTargetPool g_RenderTargetPool;
+
+float g_CameraYaw = 0.0f;
+float g_CameraPitch = 0.3f;
+float g_CameraDist = 10.0f;
+bool g_KeyLeft = false, g_KeyRight = false, g_KeyUp = false, g_KeyDown = false;
+
+double g_LastTime = 0.0;
+int g_PostEffectMode = 2; // 0=normal, 1=grayscale, 2=sepia, 3=brightness
+
+struct TransparentObject
+{
+    XMMATRIX model;
+    XMFLOAT4 color;
+    XMFLOAT3 center;
+    float distanceToCamera;
+    bool isStatic;
+};
+
+// World-space transparent triangles sorted by the BSP, one vertex buffer and one draw per frame
+struct TransparentVertex
+{
+    float x, y, z;
+    float r, g, b, a;
+};
+
+ID3D11Buffer* g_pTransparentBspVB = nullptr;
+ID3D11Buffer* g_pTransparentBspIB = nullptr;
+UINT g_TransparentBspVertexCapacity = 0;
+UINT g_TransparentBspIndexCapacity = 0;
+bool g_TransparentBspEnabled = true;
+
+// Scene components
+enum SceneComponent
+{
+    COMPONENT_POSITION_X,
+    COMPONENT_POSITION_Y,
+    COMPONENT_POSITION_Z,
+    COMPONENT_SCALE,
+    COMPONENT_SPIN,          // rotation speed about Y, radians per second
+    COMPONENT_INSTANCE_GPU,  // InstanceStaticGPU, the static part of an opaque instance's GPU record
+    COMPONENT_TRANSPARENT,   // TransparentPanel
+    COMPONENT_TRANSFORM,     // TransformHandle, the entity's node in g_SceneTransforms
+    COMPONENT_TYPE_COUNT
+};
+
+typedef UINT TransformHandle;
+
+struct TransparentPanel
+{
+    XMFLOAT4 color;
+    XMFLOAT3 size;
+    float spin;     // rotation speed about Y of the panel's transform node, radians per second
+    UINT isStatic;  // never moves, so the BSP keeps its polygons
+};
+
+static const UINT SCENE_COMPONENT_SIZES[COMPONENT_TYPE_COUNT] =
+{
+    sizeof(float), sizeof(float), sizeof(float), sizeof(float), sizeof(float), sizeof(InstanceStaticGPU), sizeof(TransparentPanel), sizeof(TransformHandle)
+};
+
+static const ComponentMask POSITION_COMPONENTS = (1u << COMPONENT_POSITION_X) | (1u << COMPONENT_POSITION_Y) | (1u << COMPONENT_POSITION_Z);
+static const ComponentMask OPAQUE_INSTANCE_COMPONENTS = POSITION_COMPONENTS | (1u << COMPONENT_SCALE) | (1u << COMPONENT_SPIN) | (1u << COMPONENT_INSTANCE_GPU);
+static const ComponentMask TRANSPARENT_PANEL_COMPONENTS = (1u << COMPONENT_TRANSPARENT) | (1u << COMPONENT_TRANSFORM);
+
+EntityWorld g_Scene;
+
+// Point light moving about its position
+struct SceneLight
+{
+    XMFLOAT4 position;  // w = 1
+    XMFLOAT4 color;
+    XMFLOAT4 motion;    // x = orbit radius about Y, y = orbit rate, z = bob height, w = bob rate
+};
+
+std::vector<SceneLight> g_SceneLights;  // the first MAX_SCENE_LIGHTS are lit
+
+// Opaque instances are the entities of one archetype (positions, scale and spin as float
+// columns for the transform kernels, plus the packed GPU record). The archetype's rows are
+// dense and chunk-major, so an entity's row doubles as its instance slot: the index into
+// the bounds, the pages and the visible lists. staticDirty lists the slots added or
+// changed since the bounds, pages and light grid last caught up.
+struct InstanceStore
+{
+    EntityWorld* world = nullptr;
+    EntityArchetype* archetype = nullptr;
+    DirtyRanges staticDirty;
+    UINT count = 0;
+};
+
+InstanceStore g_Instances;
+
+template <class T>
+const T& InstanceComponent(const InstanceStore& store, UINT slot, UINT type)
+{
+    const EntityArchetype& archetype = *store.archetype;
+    return archetype.chunks[slot / archetype.capacity].Column<T>(type)[slot % archetype.capacity];
+}
+
+static const wchar_t* WINDOW_TITLE = L"Thu Hoai - Instancing + Frustum Culling + Post Process";
+
+struct CullingStats
+{
+    UINT totalInstances = 0;
+    UINT frustumVisible = 0;
+    UINT pageCount = 0;
+    UINT pagesVisible = 0;    // pages not entirely outside the frustum
+    UINT sphereAccepted = 0;  // passed the coarse sphere test
+    UINT boxRejected = 0;     // sphere false positives removed by the box test
+    UINT occluders = 0;
+    UINT occlusionCulled = 0;
+    double occlusionMs = 0.0;
+    UINT contributionCulled = 0;
+    UINT lodCounts[LOD_COUNT] = {};  // instances the opaque pass drew per LOD, from the packet's records
+    UINT transparentTriangles = 0;
+    UINT bspSplits = 0;
+    UINT lightInstances[2] = {};  // instances within reach of each point light
+    double lightQueryMs = 0.0;
+    double drawSortMs = 0.0;
+    double transformMs = 0.0;
+    UINT uploadBytes = 0;   // instance records written for the GPU this frame
+    double uploadCopyMs = 0.0;  // copying them from the frame arena into the upload ring
+    UINT uploadRingDiscards = 0;
+    size_t frameArenaBytes = 0;     // transient CPU memory the last frame used
+    size_t frameArenaHighWater = 0;
+    UINT opaqueBatches = 0;
+    UINT stateCalls = 0;         // binds that reached the context
+    UINT stateCallsSkipped = 0;  // redundant binds the state cache dropped
+    UINT renderPasses = 0;
+    UINT renderPassesCulled = 0;
+    UINT renderTargets = 0;         // transient targets the frame graph declared
+    UINT renderTargetTextures = 0;  // textures they were aliased into
+    UINT64 renderTargetBytes = 0;   // held by the render target pool
+    UINT transformNodesUpdated = 0;
+    UINT transformNodes = 0;
+    double prepareMs = 0.0;  // CPU side of the frame, on the prepare stage
+    double submitMs = 0.0;   // D3D calls and Present, on the main thread
+    double frameMs = 0.0;    // between the last two Presents
+    double latencyMs = 0.0;  // from the input snapshot to its Present
+};
+
+// Written by the prepare stage; the submit stage reads the copy in the frame packet
+CullingStats g_CullingStats;
+CullingStats g_SubmittedStats;  // the packet's stats plus the submit timings of the last Present
+double g_LastStatsTime = 0.0;
+
+JobSystem g_JobSystem;
+FrameArenas g_FrameArenas;
+bool g_OcclusionCullingEnabled = true;
+bool g_LodEnabled = true;
+bool g_AnimationPaused = false;
+double g_AnimationTimeOffset = 0.0;  // time spent paused
+
+// Frame packets
+// A frame is prepared on the CPU into an immutable packet (camera constants, the visible
+// instance records grouped by LOD, the transparent draws in back-to-front order) that the
+// submit stage turns into D3D calls. With the pipeline on, a thread of its own prepares
+// frame N+1 while the main thread submits frame N, so a frame costs about the longer of the
+// two stages instead of their sum, for `depth` frames of extra latency. The prepare stage
+// owns the scene, the frame arenas and g_CullingStats; the packet's arrays live in the
+// arenas and stay valid until FRAME_PACKET_COUNT more frames have begun.
+static const UINT FRAME_PACKET_COUNT = 3;
+static const UINT FRAME_PIPELINE_MAX_DEPTH = FRAME_PACKET_COUNT - 1;
+static_assert(FRAME_PACKET_COUNT <= FRAME_ARENA_BUFFERS, "a packet's arrays must outlive it in the frame arenas");
+
+// The main thread's state for one frame (clocks, camera, toggles), so the prepare stage
+// reads nothing the window procedure writes
+struct FrameInput
+{
+    UINT64 frameIndex = 0;
+    double inputMs = 0.0;      // GetTimeMs when taken; the latency runs from here to Present
+    double currentTime = 0.0;  // seconds, as g_LastTime
+    float angle = 0.0f;        // animation clock
+    float cameraYaw = 0.0f, cameraPitch = 0.0f, cameraDist = 0.0f;
+    UINT width = 0, height = 0;
+    int postEffectMode = 0;
+    bool occlusionCulling = true;
+    bool lod = true;
+    bool transparentBsp = true;
+};
+
+struct FramePacket
+{
+    FrameInput input;
+    ViewProjBuffer viewProj;     // constant buffer contents, already transposed
+    ViewProjBuffer skyViewProj;
+    SceneBuffer scene;
+    UINT instanceCount = 0;                  // sizes the upload ring
+    const InstanceGPU* records = nullptr;    // visible instances, grouped by LOD
+    UINT recordCount = 0;
+    UINT lodOffsets[LOD_COUNT + 1] = {};
+    const TransparentBuffer* transparentDraws = nullptr;  // back to front, with the BSP off
+    UINT transparentDrawCount = 0;
+    const TransparentVertex* bspVertices = nullptr;       // with the BSP on
+    UINT bspVertexCount = 0;
+    const UINT* bspIndices = nullptr;                     // back to front
+    UINT bspIndexCount = 0;
+    CullingStats stats;
+    double prepareMs = 0.0;
+};
+
+// Hands frame inputs to the prepare stage and prepared packets back, in order. Packets go
+// round a ring of FRAME_PACKET_COUNT; Push and Release are for the main thread only, and
+// at most `depth` + 1 packets are in flight, so Push always finds its slot free.
+class FramePipeline
+{
+public:
+    typedef void (*PrepareFunc)(FramePacket& packet);
+
+    // Depth 0 prepares on the calling thread inside Push, one frame after another
+    void Start(PrepareFunc prepare, UINT depth)
+    {
+        assert(depth <= FRAME_PIPELINE_MAX_DEPTH && !m_Thread.joinable());
+        m_Prepare = prepare;
+        m_Depth = depth;
+        m_Queued = m_Prepared = m_Released = 0;
+        m_Quit = false;
+        if (depth > 0)
+            m_Thread = std::thread(&FramePipeline::PrepareLoop, this);
+    }
+
+    // Stops after the packet being prepared; unsubmitted packets are dropped
+    void Shutdown()
+    {
+        if (!m_Thread.joinable())
+            return;
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Quit = true;
+        }
+        m_QueuedCV.notify_all();
+        m_Thread.join();
+    }
+
+    UINT GetDepth() const { return m_Depth; }
+
+    // Queues the input of the next frame. Once `depth` frames are queued behind it, waits for
+    // the oldest packet and returns it, the caller's to submit until Release; null while the
+    // pipeline fills.
+    const FramePacket* Push(const FrameInput& input)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            assert(m_Queued - m_Released < FRAME_PACKET_COUNT);
+            m_Packets[m_Queued % FRAME_PACKET_COUNT].input = input;
+            ++m_Queued;
+        }
+
+        if (m_Depth == 0)
+        {
+            m_Prepare(m_Packets[m_Prepared % FRAME_PACKET_COUNT]);
+            ++m_Prepared;
+        }
+        else
+        {
+            m_QueuedCV.notify_one();
+        }
+
+        if (m_Queued - m_Released <= m_Depth)
+            return nullptr;
+
+        std::unique_lock<std::mutex> lock(m_Mutex);
+        m_PreparedCV.wait(lock, [this]() { return m_Prepared > m_Released; });
+        return &m_Packets[m_Released % FRAME_PACKET_COUNT];
+    }
+
+    // The packet Push returned is submitted; its slot takes the next frame
+    void Release()
+    {
+        std::lock_guard<std::mutex> lock(m_Mutex);
+        assert(m_Released < m_Prepared);
+        ++m_Released;
+    }
+
+private:
+    void PrepareLoop()
+    {
+        for (;;)
+        {
+            UINT64 frame = 0;
+            {
+                std::unique_lock<std::mutex> lock(m_Mutex);
+                m_QueuedCV.wait(lock, [this]() { return m_Quit || m_Prepared < m_Queued; });
+                if (m_Quit)
+                    return;
+                frame = m_Prepared;
+            }
+
+            m_Prepare(m_Packets[frame % FRAME_PACKET_COUNT]);
+
+            {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                ++m_Prepared;
+            }
+            m_PreparedCV.notify_one();
+        }
+    }
+
+    FramePacket m_Packets[FRAME_PACKET_COUNT];
+    PrepareFunc m_Prepare = nullptr;
+    UINT m_Depth = 0;
+    std::thread m_Thread;
+    std::mutex m_Mutex;
+    std::condition_variable m_QueuedCV;
+    std::condition_variable m_PreparedCV;
+    UINT64 m_Queued = 0;    // frames pushed
+    UINT64 m_Prepared = 0;  // frames whose packet is complete
+    UINT64 m_Released = 0;  // frames submitted
+    bool m_Quit = false;
+};
+
+FramePipeline g_FramePipeline;
+UINT g_FramePipelineDepth = 1;  // -pipeline 0|1|2
+
+// Procedural scene, see GenerateInstance
+enum class SceneLayout
+{
+    Grid,
+    Poisson,
+    Cluster,
+};
+
+struct SceneGenerationDesc
+{
+    SceneLayout layout = SceneLayout::Grid;
+    UINT count = 144;
+    UINT seed = 1;
+};
+
+SceneGenerationDesc g_SceneGeneration;  // -cubes N, -layout grid|poisson|cluster, -seed S
+std::wstring g_SceneFilePath;        // -scene path: load instead of generating
+std::wstring g_SaveSceneFilePath;    // -savescene path: write the scene out after creating it
+
+// Prototypes
+LRESULT CALLBACK WndProc(HWND, UINT, WPARAM, LPARAM);
+bool InitDirectX();
+bool CreateHardwareDevice(DXGI_SWAP_CHAIN_DESC& scd);
+void CreateCubeResources();
+bool CompileShaders();
+HRESULT CompileShaderSource(const char* source, const D3D_SHADER_MACRO* defines, const char* entry, const char* target, UINT flags, ID3DBlob** code, ID3DBlob** errors);
+bool LoadTextures();
+bool CreateRenderStates();
+bool CreateConstantBuffers();
+void CreateOpaqueInstances();
+void CreateTransparentPanels();
+void CreateSceneLights();
+void RunMathBenchmark();
+bool LoadSceneFile(const wchar_t* path);
+bool SaveSceneFile(const wchar_t* path);
+void CleanupDirectX();
+void RenderFrame();
+int RunHeadlessFrames(UINT frameCount);
+void PrepareFrame(FramePacket& packet);
+void SubmitFrame(const FramePacket& packet);
+void OnResize(UINT newWidth, UINT newHeight);
+void UpdateCamera(double deltaTime);
+
+struct Plane
+{
+    XMFLOAT4 p;
+};
+
+Plane NormalizePlane(const Plane& in);
+void ExtractFrustumPlanes(Plane planes[6], const XMMATRIX& vp);
+bool IsSphereInsideFrustum(const Plane planes[6], const XMFLOAT3& center, float radius);
+
+// Per-instance world bounds, structure of arrays padded to a multiple of 8
+struct InstanceBounds
+{
+    std::vector<float> centerX, centerY, centerZ;
+    std::vector<float> extentX, extentY, extentZ;
+    std::vector<float> radius;
+    UINT count = 0;
+};
+
+// Bounding sphere radius of the unit cube per unit of scale, sqrt(3) / 2
+static const float CUBE_RADIUS_PER_SCALE = 0.8660254f;
+
+// Instances are culled in pages of consecutive ids
+static const UINT INSTANCE_PAGE_SIZE = 1024;
+
+enum class PageCoverage
+{
+    Outside,
+    Partial,
+    Inside
+};
+
+// Sphere and box test counts of one view
+struct CullViewStats
+{
+    UINT sphereAccepted = 0;
+    UINT boxRejected = 0;
+};
+
+struct InstancePage
+{
+    UINT begin = 0, end = 0;
+    XMFLOAT3 boundsMin, boundsMax;  // encloses the bounding spheres of the page's instances
+    PageCoverage coverage = PageCoverage::Partial;
+    UINT* visible = nullptr;        // this frame's visible ids, page-local, in a frame arena
+    UINT visibleCount = 0;
+    CullViewStats stats;
+};
+
+void ResizeInstanceBounds(InstanceBounds& bounds, UINT count);
+void InitInstanceStore(InstanceStore& store, EntityWorld& world);
+void ClearInstanceStore(InstanceStore& store);
+Entity AddInstance(InstanceStore& store, const CubeInstanceCPU& c);
+void RemoveInstance(InstanceStore& store, Entity entity);
+void UpdateInstanceBounds(const InstanceStore& store, const DirtyRanges& changed, InstanceBounds& bounds);
+void BuildVisibleInstances(const InstanceStore& store, const FrameVector<UINT>& visible, float angle, InstanceGPU* out);
+bool ValidateFrameArenas();
+bool ValidateHeadlessFrames();
+bool ValidateFramePipeline();
+bool ValidateEntityWorld();
+bool ValidateTransformHierarchy();
+bool ValidateSceneFileRoundTrip();
+bool ValidateSceneGenerator();
+bool ValidateSpatialHashGrid();
+bool ValidateTransparentBsp();
+bool ValidateOcclusionCulling();
+bool ValidateTransformMath();
+bool ValidateSimdMath();
+bool ValidateInstancePacking();
+bool ValidateUploadRing();
+bool ValidateInstancePages();
+bool ValidateBoxCulling();
+bool ValidateMultiViewCulling();
+bool ValidateNullDevice();
+bool ValidateStateCache();
+bool ValidateRenderGraph();
+bool ValidateDrawKeySort();
+bool ValidateConstantSlices();
+int RunSelfTests();
+void CullInstanceBounds(const Plane planes[6], const InstanceBounds& bounds, std::vector<UINT>& visible);
+
+// Frustum of one camera for batched culling (stereo eyes, cubemap faces, split-screen players)
+static const UINT MAX_CULL_VIEWS = 32;
+
+struct CullView
+{
+    Plane planes[6];
+};
+
+void CullInstanceBoundsMultiView(const CullView* views, UINT viewCount, const InstanceBounds& bounds,
+    std::vector<UINT>& viewMasks, std::vector<UINT>& visibleAny, CullViewStats* viewStats);
+void UpdateInstancePages(const InstanceStore& store, const DirtyRanges& changed, std::vector<InstancePage>& pages);
+void CullInstancePages(const Plane planes[6], const InstanceBounds& bounds, std::vector<InstancePage>& pages, FrameVector<UINT>& visible);
+void BuildCubemapCullViews(const XMFLOAT3& position, float nearZ, float farZ, CullView views[6]);
+void CullCubemapInstances(const XMFLOAT3& position, float nearZ, float farZ, const InstanceBounds& bounds,
+    std::vector<UINT>& faceMasks, std::vector<UINT>& visibleAny, CullViewStats faceStats[6]);
+void CullOccludedInstances(const XMMATRIX& vp, const XMFLOAT3& eye, float angle, FrameVector<UINT>& candidates);
+void SelectInstanceLods(const XMMATRIX& vp, float projScaleY, float viewportHeight, FrameVector<UINT>& visible, FrameVector<BYTE>& lods);
+void SortOpaqueDraws(const XMMATRIX& vp, FrameVector<UINT>& visible, const FrameVector<BYTE>& lods, UINT lodOffsets[LOD_COUNT + 1]);
+void BuildTransparentBsp(const FrameVector<TransparentObject>& objects, const XMFLOAT3& eye, FrameArena& arena, FramePacket& packet);
+void DrawTransparentBsp(const FramePacket& packet);
+class TransformHierarchy;
+void AnimateTransparentPanels(EntityWorld& world, TransformHierarchy& transforms, float angle);
+void GatherTransparentObjects(EntityWorld& world, const TransformHierarchy& transforms, const XMFLOAT3& eye, FrameVector<TransparentObject>& objects);
+void UpdateStatsTitle(const CullingStats& s, double currentTime);
+
+// WinMain
+// `name` as a whole word on the command line, or null
+static const wchar_t* FindCommandLineOption(const wchar_t* cmdLine, const wchar_t* name)
+{
+    size_t length = wcslen(name);
+    for (const wchar_t* p = wcsstr(cmdLine, name); p; p = wcsstr(p + 1, name))
+    {
+        if ((p == cmdLine || p[-1] == L' ') && (p[length] == L' ' || p[length] == 0))
+            return p;
+    }
+    return nullptr;
+}
+
+// Value following `name` on the command line ("-cubes 5000"), quoted if it has spaces;
+// empty when the option is absent
+static std::wstring CommandLineOption(const wchar_t* cmdLine, const wchar_t* name)
+{
+    if (const wchar_t* p = FindCommandLineOption(cmdLine, name))
+    {
+        const wchar_t* value = p + wcslen(name);
+        while (*value == L' ')
+            ++value;
+        wchar_t terminator = L' ';
+        if (*value == L'"')
+            terminator = *value++;
+        const wchar_t* end = value;
+        while (*end && *end != terminator)
+            ++end;
+        return std::wstring(value, end);
+    }
+    return std::wstring();
+}
+
+int WINAPI wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE, _In_ LPWSTR lpCmdLine, _In_ int nCmdShow)
+{
+    CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+
+    // Room for the most threads the job system can have, so the self-checks can use them too
+    g_FrameArenas.Init(MAX_JOB_WORKERS + 1);
+
+    if (FindCommandLineOption(lpCmdLine, L"-selftest"))
+    {
+#ifdef _DEBUG
+        int result = RunSelfTests();
+#else
+        OutputDebugStringA("-selftest: the self-checks are only built in Debug\n");
+        int result = 1;
+#endif
+        CoUninitialize();
+        return result;
+    }
+
+    if (FindCommandLineOption(lpCmdLine, L"-mathbench"))
+    {
+        RunMathBenchmark();
+        CoUninitialize();
+        return 0;
+    }
+
+    std::wstring cubes = CommandLineOption(lpCmdLine, L"-cubes");
+    if (!cubes.empty())
+        g_SceneGeneration.count = wcstoul(cubes.c_str(), nullptr, 10);
+    std::wstring layout = CommandLineOption(lpCmdLine, L"-layout");
+    if (layout == L"poisson")
+        g_SceneGeneration.layout = SceneLayout::Poisson;
+    else if (layout == L"cluster")
+        g_SceneGeneration.layout = SceneLayout::Cluster;
+    std::wstring seed = CommandLineOption(lpCmdLine, L"-seed");
+    if (!seed.empty())
+        g_SceneGeneration.seed = wcstoul(seed.c_str(), nullptr, 10);
+    g_SceneFilePath = CommandLineOption(lpCmdLine, L"-scene");
+    g_SaveSceneFilePath = CommandLineOption(lpCmdLine, L"-savescene");
+    std::wstring pipeline = CommandLineOption(lpCmdLine, L"-pipeline");
+    if (!pipeline.empty())
+        g_FramePipelineDepth = (std::min)((UINT)wcstoul(pipeline.c_str(), nullptr, 10), FRAME_PIPELINE_MAX_DEPTH);
+    g_UseNullDevice = FindCommandLineOption(lpCmdLine, L"-nulldevice");
+    UINT headlessFrames = 600;
+    std::wstring frames = CommandLineOption(lpCmdLine, L"-frames");
+    if (!frames.empty())
+        headlessFrames = wcstoul(frames.c_str(), nullptr, 10);
+
+    // Headless runs have no window; the frame stats go to the report instead of the title
+    if (!g_UseNullDevice)
+    {
+        WNDCLASSEXW wc = {};
+        wc.cbSize = sizeof(WNDCLASSEXW);
+        wc.style = CS_HREDRAW | CS_VREDRAW;
+        wc.lpfnWndProc = WndProc;
+        wc.hInstance = hInstance;
+        wc.hCursor = LoadCursor(nullptr, IDC_ARROW);
+        wc.lpszClassName = L"DX11";
+
+        if (!RegisterClassExW(&wc))
+        {
+            MessageBoxW(nullptr, L"RegisterClassEx failed", L"Error", MB_OK | MB_ICONERROR);
+            CoUninitialize();
+            return 0;
+        }
+
+        RECT rc = { 0, 0, (LONG)g_ClientWidth, (LONG)g_ClientHeight };
+        AdjustWindowRect(&rc, WS_OVERLAPPEDWINDOW, FALSE);
+        int winWidth = rc.right - rc.left;
+        int winHeight = rc.bottom - rc.top;
+
+        g_hWnd = CreateWindowW(
+            wc.lpszClassName,
+            WINDOW_TITLE,
+            WS_OVERLAPPEDWINDOW,
+            CW_USEDEFAULT, CW_USEDEFAULT,
+            winWidth, winHeight,
+            nullptr, nullptr, hInstance, nullptr);
+
+        if (!g_hWnd)
+        {
+            MessageBoxW(nullptr, L"CreateWindow failed", L"Error", MB_OK | MB_ICONERROR);
+            CoUninitialize();
+            return 0;
+        }
+
+        ShowWindow(g_hWnd, nCmdShow);
+        UpdateWindow(g_hWnd);
+    }
+
+    if (!InitDirectX())
+    {
+        CleanupDirectX();
+        DestroyWindow(g_hWnd);
+        CoUninitialize();
+        return -1;
+    }
+
+    CreateCubeResources();
+
+    if (!CompileShaders())
+    {
+        CleanupDirectX();
+        DestroyWindow(g_hWnd);
+        CoUninitialize();
+        return -1;
+    }
+
+    // Headless frames never sample the textures
+    if (!g_UseNullDevice && !LoadTextures())
+    {
+        CleanupDirectX();
+        DestroyWindow(g_hWnd);
+        CoUninitialize();
+        return -1;
+    }
+
+    if (!CreateRenderStates())
+    {
+        CleanupDirectX();
+        DestroyWindow(g_hWnd);
+        CoUninitialize();
+        return -1;
+    }
+
+    if (!CreateConstantBuffers())
+    {
+        CleanupDirectX();
+        DestroyWindow(g_hWnd);
+        CoUninitialize();
+        return -1;
+    }
+
+    UINT hardwareThreads = std::thread::hardware_concurrency();
+    g_JobSystem.Init(hardwareThreads > 1 ? (std::min)(hardwareThreads - 1, MAX_JOB_WORKERS) : 0u);
+
+    g_Scene.Init(SCENE_COMPONENT_SIZES, COMPONENT_TYPE_COUNT);
+    if (!g_SceneFilePath.empty())
+    {
+        if (!LoadSceneFile(g_SceneFilePath.c_str()))
+        {
+            MessageBoxA(NULL, "Failed to load the scene file", "Error", MB_OK);
+            CleanupDirectX();
+            DestroyWindow(g_hWnd);
+            CoUninitialize();
+            return -1;
+        }
+    }
+    else
+    {
+        CreateOpaqueInstances();
+        CreateTransparentPanels();
+        CreateSceneLights();
+    }
+    if (!g_SaveSceneFilePath.empty() && !SaveSceneFile(g_SaveSceneFilePath.c_str()))
+        MessageBoxA(NULL, "Failed to write the scene file", "Error", MB_OK);
+
+    g_LastTime = (double)GetTickCount64() / 1000.0;
+    g_FramePipeline.Start(PrepareFrame, g_FramePipelineDepth);
+
+    if (g_UseNullDevice)
+    {
+        int result = RunHeadlessFrames(headlessFrames);
+        CleanupDirectX();
+        CoUninitialize();
+        return result;
+    }
+
+    MSG msg = {};
+    bool done = false;
+    while (!done)
+    {
+        while (PeekMessageW(&msg, nullptr, 0, 0, PM_REMOVE))
+        {
+            if (msg.message == WM_QUIT)
+                done = true;
+            TranslateMessage(&msg);
+            DispatchMessageW(&msg);
+        }
+
+        if (!done)
+            RenderFrame();
+    }
+
+    CleanupDirectX();
+    CoUninitialize();
+    return (int)msg.wParam;
+}
+
+// WndProc
+LRESULT CALLBACK WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
+{
+    switch (message)
+    {
+    case WM_SIZE:
         if (g_pSwapChain && wParam != SIZE_MINIMIZED)
         {
-            UINT newW = LOWORD(lParam);
-            UINT newH = HIWORD(lParam);
-            if (newW > 0 && newH > 0)
-                OnResize(newW, newH);
+            UINT newW = LOWORD(lParam);
+            UINT newH = HIWORD(lParam);
+            if (newW > 0 && newH > 0)
+                OnResize(newW, newH);
+        }
+        return 0;
+
+    case WM_KEYDOWN:
+        if (wParam == VK_LEFT)  g_KeyLeft = true;
+        if (wParam == VK_RIGHT) g_KeyRight = true;
+        if (wParam == VK_UP)    g_KeyUp = true;
+        if (wParam == VK_DOWN)  g_KeyDown = true;
+        if (wParam == '1') g_PostEffectMode = 0;
+        if (wParam == '2') g_PostEffectMode = 1;
+        if (wParam == '3') g_PostEffectMode = 2;
+        if (wParam == '4') g_PostEffectMode = 3;
+        if (wParam == 'O') g_OcclusionCullingEnabled = !g_OcclusionCullingEnabled;
+        if (wParam == 'L') g_LodEnabled = !g_LodEnabled;
+        if (wParam == 'B') g_TransparentBspEnabled = !g_TransparentBspEnabled;
+        if (wParam == 'P') g_AnimationPaused = !g_AnimationPaused;
+        return 0;
+
+    case WM_KEYUP:
+        if (wParam == VK_LEFT)  g_KeyLeft = false;
+        if (wParam == VK_RIGHT) g_KeyRight = false;
+        if (wParam == VK_UP)    g_KeyUp = false;
+        if (wParam == VK_DOWN)  g_KeyDown = false;
+        return 0;
+
+    case WM_DESTROY:
+        PostQuitMessage(0);
+        return 0;
+    }
+
+    return DefWindowProcW(hWnd, message, wParam, lParam);
+}
+
+// Init DirectX
+// Null device problems go to the debugger and, headless, to stderr
+void NullDeviceMessage(const char* message)
+{
+    OutputDebugStringA(message);
+    fputs(message, stderr);
+}
+
+bool InitDirectX()
+{
+    HRESULT hr;
+
+    DXGI_SWAP_CHAIN_DESC scd = {};
+    scd.BufferCount = 2;
+    scd.BufferDesc.Width = g_ClientWidth;
+    scd.BufferDesc.Height = g_ClientHeight;
+    scd.BufferDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+    scd.BufferDesc.RefreshRate.Numerator = 0;
+    scd.BufferDesc.RefreshRate.Denominator = 1;
+    scd.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT;
+    scd.OutputWindow = g_hWnd;
+    scd.SampleDesc.Count = 1;
+    scd.SampleDesc.Quality = 0;
+    scd.Windowed = TRUE;
+    scd.SwapEffect = DXGI_SWAP_EFFECT_FLIP_DISCARD;
+    scd.Flags = 0;
+
+    if (g_UseNullDevice)
+    {
+        // Headless: the null device validates the calls and counts the work, see NullD3D11.h
+        hr = CreateNullD3D11Device(scd, 0, NullDeviceMessage, &g_pNullDevice, &g_pDeviceContext, &g_pSwapChain);
+        if (FAILED(hr)) return false;
+        g_pDevice = g_pNullDevice;
+    }
+    else if (!CreateHardwareDevice(scd))
+    {
+        return false;
+    }
+
+    g_StateCache.Init(g_pDeviceContext);
+    g_StateObjects.Init(g_pDevice);
+    g_RenderTargetPool.Init(g_pDevice);
+
+    ID3D11Texture2D* pBackBuffer = nullptr;
+    hr = g_pSwapChain->GetBuffer(0, __uuidof(ID3D11Texture2D), (LPVOID*)&pBackBuffer);
+    if (FAILED(hr)) return false;
+
+    hr = g_pDevice->CreateRenderTargetView(pBackBuffer, nullptr, &g_pBackBufferRTV);
+    pBackBuffer->Release();
+    if (FAILED(hr)) return false;
+
+    D3D11_TEXTURE2D_DESC depthDesc = {};
+    depthDesc.Width = g_ClientWidth;
+    depthDesc.Height = g_ClientHeight;
+    depthDesc.MipLevels = 1;
+    depthDesc.ArraySize = 1;
+    depthDesc.Format = DXGI_FORMAT_D32_FLOAT;
+    depthDesc.SampleDesc.Count = 1;
+    depthDesc.SampleDesc.Quality = 0;
+    depthDesc.Usage = D3D11_USAGE_DEFAULT;
+    depthDesc.BindFlags = D3D11_BIND_DEPTH_STENCIL;
+
+    hr = g_pDevice->CreateTexture2D(&depthDesc, nullptr, &g_pDepthStencilTexture);
+    if (FAILED(hr)) return false;
+
+    hr = g_pDevice->CreateDepthStencilView(g_pDepthStencilTexture, nullptr, &g_pDepthStencilView);
+    if (FAILED(hr)) return false;
+
+    return true;
+}
+
+// The first adapter that is not the software rasterizer
+bool CreateHardwareDevice(DXGI_SWAP_CHAIN_DESC& scd)
+{
+    HRESULT hr;
+
+    IDXGIFactory* pFactory = nullptr;
+    hr = CreateDXGIFactory(__uuidof(IDXGIFactory), (void**)&pFactory);
+    if (FAILED(hr)) return false;
+
+    IDXGIAdapter* pSelectedAdapter = nullptr;
+    UINT idx = 0;
+    while (true)
+    {
+        IDXGIAdapter* pAdapter = nullptr;
+        hr = pFactory->EnumAdapters(idx, &pAdapter);
+        if (FAILED(hr) || pAdapter == nullptr) break;
+
+        DXGI_ADAPTER_DESC desc;
+        pAdapter->GetDesc(&desc);
+        if (wcscmp(desc.Description, L"Microsoft Basic Render Driver") != 0)
+        {
+            pSelectedAdapter = pAdapter;
+            break;
+        }
+        pAdapter->Release();
+        idx++;
+    }
+
+    if (!pSelectedAdapter)
+    {
+        pFactory->Release();
+        return false;
+    }
+
+    UINT flags = 0;
+#ifdef _DEBUG
+    flags |= D3D11_CREATE_DEVICE_DEBUG;
+#endif
+
+    D3D_FEATURE_LEVEL levels[] = { D3D_FEATURE_LEVEL_11_0 };
+    D3D_FEATURE_LEVEL obtainedLevel;
+
+    hr = D3D11CreateDevice(
+        pSelectedAdapter,
+        D3D_DRIVER_TYPE_UNKNOWN,
+        nullptr,
+        flags,
+        levels,
+        1,
+        D3D11_SDK_VERSION,
+        &g_pDevice,
+        &obtainedLevel,
+        &g_pDeviceContext);
+    pSelectedAdapter->Release();
+
+    if (FAILED(hr) || obtainedLevel != D3D_FEATURE_LEVEL_11_0)
+    {
+        pFactory->Release();
+        return false;
+    }
+
+    hr = pFactory->CreateSwapChain(g_pDevice, &scd, &g_pSwapChain);
+    pFactory->Release();
+    return SUCCEEDED(hr);
+}
+
+// Geometry
+void CreateCubeResources()
+{
+    const LitVertex cubeVertices[] =
+    {
+        // Back (-Z)
+        { -0.5f, -0.5f, -0.5f,  0, 0,-1,  -1, 0, 0,  0,1 },
+        {  0.5f, -0.5f, -0.5f,  0, 0,-1,  -1, 0, 0,  1,1 },
+        {  0.5f,  0.5f, -0.5f,  0, 0,-1,  -1, 0, 0,  1,0 },
+        { -0.5f,  0.5f, -0.5f,  0, 0,-1,  -1, 0, 0,  0,0 },
+
+        // Front (+Z)
+        { -0.5f, -0.5f,  0.5f,  0, 0, 1,   1, 0, 0,  0,1 },
+        {  0.5f, -0.5f,  0.5f,  0, 0, 1,   1, 0, 0,  1,1 },
+        {  0.5f,  0.5f,  0.5f,  0, 0, 1,   1, 0, 0,  1,0 },
+        { -0.5f,  0.5f,  0.5f,  0, 0, 1,   1, 0, 0,  0,0 },
+
+        // Left (-X)
+        { -0.5f, -0.5f,  0.5f, -1, 0, 0,   0, 0,-1,  0,1 },
+        { -0.5f, -0.5f, -0.5f, -1, 0, 0,   0, 0,-1,  1,1 },
+        { -0.5f,  0.5f, -0.5f, -1, 0, 0,   0, 0,-1,  1,0 },
+        { -0.5f,  0.5f,  0.5f, -1, 0, 0,   0, 0,-1,  0,0 },
+
+        // Right (+X)
+        {  0.5f, -0.5f, -0.5f,  1, 0, 0,   0, 0, 1,  0,1 },
+        {  0.5f, -0.5f,  0.5f,  1, 0, 0,   0, 0, 1,  1,1 },
+        {  0.5f,  0.5f,  0.5f,  1, 0, 0,   0, 0, 1,  1,0 },
+        {  0.5f,  0.5f, -0.5f,  1, 0, 0,   0, 0, 1,  0,0 },
+
+        // Top (+Y)
+        { -0.5f,  0.5f, -0.5f,  0, 1, 0,   1, 0, 0,  0,1 },
+        {  0.5f,  0.5f, -0.5f,  0, 1, 0,   1, 0, 0,  1,1 },
+        {  0.5f,  0.5f,  0.5f,  0, 1, 0,   1, 0, 0,  1,0 },
+        { -0.5f,  0.5f,  0.5f,  0, 1, 0,   1, 0, 0,  0,0 },
+
+        // Bottom (-Y)
+        { -0.5f, -0.5f,  0.5f,  0,-1, 0,   1, 0, 0,  0,1 },
+        {  0.5f, -0.5f,  0.5f,  0,-1, 0,   1, 0, 0,  1,1 },
+        {  0.5f, -0.5f, -0.5f,  0,-1, 0,   1, 0, 0,  1,0 },
+        { -0.5f, -0.5f, -0.5f,  0,-1, 0,   1, 0, 0,  0,0 }
+    };
+
+    const USHORT cubeIndices[] =
+    {
+        0, 2, 1,  0, 3, 2,
+        4, 5, 6,  4, 6, 7,
+        8,10, 9,  8,11,10,
+        12,14,13, 12,15,14,
+        16,18,17, 16,19,18,
+        20,22,21, 20,23,22
+    };
+
+    D3D11_BUFFER_DESC desc = {};
+    desc.ByteWidth = sizeof(cubeVertices);
+    desc.Usage = D3D11_USAGE_IMMUTABLE;
+    desc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+    D3D11_SUBRESOURCE_DATA data = { cubeVertices };
+
+    HRESULT hr = g_pDevice->CreateBuffer(&desc, &data, &g_pVertexBuffer);
+    if (FAILED(hr)) return;
+
+    desc = {};
+    desc.ByteWidth = sizeof(cubeIndices);
+    desc.Usage = D3D11_USAGE_IMMUTABLE;
+    desc.BindFlags = D3D11_BIND_INDEX_BUFFER;
+    data.pSysMem = cubeIndices;
+
+    hr = g_pDevice->CreateBuffer(&desc, &data, &g_pIndexBuffer);
+    if (FAILED(hr)) return;
+
+    const SkyboxVertex skyboxVertices[] =
+    {
+        {-10, -10, -10, 0, 0}, { 10, -10, -10, 0, 0}, { 10,  10, -10, 0, 0}, {-10,  10, -10, 0, 0},
+        {-10, -10,  10, 0, 0}, { 10, -10,  10, 0, 0}, { 10,  10,  10, 0, 0}, {-10,  10,  10, 0, 0}
+    };
+
+    const USHORT skyboxIndices[] =
+    {
+        0,2,1, 0,3,2,
+        4,5,6, 4,6,7,
+        0,7,3, 0,4,7,
+        1,2,6, 1,6,5,
+        3,7,6, 3,6,2,
+        0,1,5, 0,5,4
+    };
+
+    desc = {};
+    desc.ByteWidth = sizeof(skyboxVertices);
+    desc.Usage = D3D11_USAGE_IMMUTABLE;
+    desc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+    data.pSysMem = skyboxVertices;
+    hr = g_pDevice->CreateBuffer(&desc, &data, &g_pSkyboxVertexBuffer);
+    if (FAILED(hr)) return;
+
+    desc = {};
+    desc.ByteWidth = sizeof(skyboxIndices);
+    desc.Usage = D3D11_USAGE_IMMUTABLE;
+    desc.BindFlags = D3D11_BIND_INDEX_BUFFER;
+    data.pSysMem = skyboxIndices;
+    hr = g_pDevice->CreateBuffer(&desc, &data, &g_pSkyboxIndexBuffer);
+    if (FAILED(hr)) return;
+}
+
+// Shaders
+// The null device takes the HLSL source as its bytecode, so headless runs need no compiler
+HRESULT CompileShaderSource(const char* source, const D3D_SHADER_MACRO* defines, const char* entry, const char* target, UINT flags, ID3DBlob** code, ID3DBlob** errors)
+{
+    if (g_UseNullDevice)
+        return NullCompileShader(source, strlen(source), code, errors);
+    return D3DCompile(source, strlen(source), nullptr, defines, nullptr, entry, target, flags, 0, code, errors);
+}
+
+bool CompileShaders()
+{
+    const char* litVS = R"(
+cbuffer ViewProjBuffer : register(b1)
+{
+    float4x4 vp;
+};
+
+// InstanceGPU records of the draw's instances from byte drawParams.x: float4 position and
+// scale, snorm16 quaternion (x | y << 16, z | w << 16), half material params
+ByteAddressBuffer instanceRing : register(t2);
+
+cbuffer DrawParamsBuffer : register(b5)
+{
+    uint4 drawParams;
+};
+
+struct VSInput
+{
+    float3 pos : POSITION;
+    float3 normal : NORMAL;
+    float3 tangent : TANGENT;
+    float2 uv : TEXCOORD;
+    uint instanceId : SV_InstanceID;
+};
+
+struct VSOutput
+{
+    float4 pos : SV_Position;
+    float3 worldPos : POSITION1;
+    float3 normalW : NORMAL;
+    float3 tangentW : TANGENT;
+    float2 uv : TEXCOORD;
+    nointerpolation uint2 params : INST_PARAMS;
+};
+
+float4 DecodeQuaternion(uint2 p)
+{
+    int4 q = int4((int)(p.x << 16) >> 16, (int)p.x >> 16, (int)(p.y << 16) >> 16, (int)p.y >> 16);
+    return normalize(max(float4(q) / 32767.0f, -1.0f));
+}
+
+// Same rotation as XMMatrixRotationQuaternion with row vectors
+float3 RotateByQuaternion(float4 q, float3 v)
+{
+    float3 t = 2.0f * cross(q.xyz, v);
+    return v + q.w * t + cross(q.xyz, t);
+}
+
+VSOutput vs(VSInput v)
+{
+    VSOutput o;
+
+    uint address = drawParams.x + 32 * v.instanceId;
+    float4 posScale = asfloat(instanceRing.Load4(address));
+    uint4 rotationParams = instanceRing.Load4(address + 16);
+    float4 rotation = DecodeQuaternion(rotationParams.xy);
+
+    // Uniform scale, so the normal matrix is the rotation itself
+    float3 worldPos = RotateByQuaternion(rotation, v.pos * posScale.w) + posScale.xyz;
+    o.pos = mul(float4(worldPos, 1.0f), vp);
+    o.worldPos = worldPos;
+
+    o.normalW = normalize(RotateByQuaternion(rotation, v.normal));
+    o.tangentW = normalize(RotateByQuaternion(rotation, v.tangent));
+    o.uv = v.uv;
+    o.params = rotationParams.zw;
+
+    return o;
+}
+)";
+
+    const char* litPS = R"(
+Texture2DArray colorTexture  : register(t0);
+Texture2D normalTexture      : register(t1);
+SamplerState colorSampler    : register(s0);
+
+struct LightData
+{
+    float4 position;
+    float4 color;
+};
+
+cbuffer SceneBuffer : register(b2)
+{
+    float4 cameraPos;
+    float4 ambientColor;
+    LightData lights[4];
+    int4 lightCount;
+};
+
+struct VSOutput
+{
+    float4 pos : SV_Position;
+    float3 worldPos : POSITION1;
+    float3 normalW : NORMAL;
+    float3 tangentW : TANGENT;
+    float2 uv : TEXCOORD;
+    nointerpolation uint2 params : INST_PARAMS;
+};
+
+float4 ps(VSOutput pixel) : SV_Target
+{
+    uint2 params = pixel.params;
+    float shininess = f16tof32(params.x);
+    float texId = f16tof32(params.y);
+    float hasNM = f16tof32(params.y >> 16);
+
+    float3 albedo = colorTexture.Sample(colorSampler, float3(pixel.uv, texId)).rgb;
+
+    float3 N = normalize(pixel.normalW);
+    float3 T = normalize(pixel.tangentW);
+    float3 B = normalize(cross(N, T));
+
+    float3 normal = N;
+#if LOD_LEVEL == 0
+    if (hasNM > 0.5f)
+    {
+        float3 nMap = normalTexture.Sample(colorSampler, pixel.uv).xyz;
+        nMap = normalize(nMap * 2.0f - 1.0f);
+        normal = normalize(nMap.x * T + nMap.y * B + nMap.z * N);
+    }
+#endif
+
+    float3 viewDir = normalize(cameraPos.xyz - pixel.worldPos);
+
+    float3 finalColor = ambientColor.rgb * albedo;
+
+    [unroll]
+    for (int i = 0; i < lightCount.x; ++i)
+    {
+        float3 lightVec = lights[i].position.xyz - pixel.worldPos;
+        float dist = length(lightVec);
+        float3 lightDir = lightVec / max(dist, 0.0001f);
+
+        float attenuation = 1.0f / (1.0f + 0.15f * dist + 0.08f * dist * dist);
+        float diffuse = max(dot(normal, lightDir), 0.0f);
+
+        float3 lightColor = lights[i].color.rgb;
+        finalColor += albedo * (0.15f + diffuse) * lightColor * attenuation;
+
+#if LOD_LEVEL < 2
+        float3 reflectDir = reflect(-lightDir, normal);
+        float spec = pow(max(dot(viewDir, reflectDir), 0.0f), shininess);
+        finalColor += spec * lightColor * attenuation * 0.45f;
+#endif
+    }
+
+    return float4(saturate(finalColor), 1.0f);
+}
+)";
+
+    const char* skyboxVS = R"(
+cbuffer ViewProjBuffer : register(b1)
+{
+    float4x4 vp;
+};
+
+struct VSInput
+{
+    float3 pos : POSITION;
+    float2 uv : TEXCOORD;
+};
+
+struct VSOutput
+{
+    float4 pos : SV_Position;
+    float3 localPos : TEXCOORD;
+};
+
+VSOutput vs(VSInput vertex)
+{
+    VSOutput result;
+    result.pos = mul(float4(vertex.pos, 1.0), vp);
+    result.localPos = vertex.pos;
+    return result;
+}
+)";
+
+    const char* skyboxPS = R"(
+TextureCube skyboxTexture : register(t5);
+SamplerState skyboxSampler : register(s1);
+
+struct VSOutput
+{
+    float4 pos : SV_Position;
+    float3 localPos : TEXCOORD;
+};
+
+float4 ps(VSOutput pixel) : SV_Target0
+{
+    return skyboxTexture.Sample(skyboxSampler, pixel.localPos);
+}
+)";
+
+    const char* transparentVS = R"(
+cbuffer TransparentBuffer : register(b0)
+{
+    float4x4 model;
+    float4 color;
+}
+cbuffer ViewProjBuffer : register(b1)
+{
+    float4x4 vp;
+}
+
+struct VSInput
+{
+    float3 pos : POSITION;
+    float3 normal : NORMAL;
+    float3 tangent : TANGENT;
+    float2 uv : TEXCOORD;
+};
+
+struct VSOutput
+{
+    float4 pos : SV_Position;
+    float4 color : COLOR0;
+};
+
+VSOutput vs(VSInput vertex)
+{
+    VSOutput result;
+    float4 worldPos = mul(float4(vertex.pos, 1.0), model);
+    result.pos = mul(worldPos, vp);
+    result.color = color;
+    return result;
+}
+)";
+
+    const char* transparentBspVS = R"(
+cbuffer ViewProjBuffer : register(b1)
+{
+    float4x4 vp;
+}
+
+struct VSInput
+{
+    float3 pos : POSITION;
+    float4 color : COLOR;
+};
+
+struct VSOutput
+{
+    float4 pos : SV_Position;
+    float4 color : COLOR0;
+};
+
+VSOutput vs(VSInput vertex)
+{
+    VSOutput result;
+    result.pos = mul(float4(vertex.pos, 1.0), vp);
+    result.color = vertex.color;
+    return result;
+}
+)";
+
+    const char* transparentPS = R"(
+struct VSOutput
+{
+    float4 pos : SV_Position;
+    float4 color : COLOR0;
+};
+
+float4 ps(VSOutput pixel) : SV_Target0
+{
+    return pixel.color;
+}
+)";
+
+    const char* postVS = R"(
+struct VSOutput
+{
+    float4 pos : SV_Position;
+    float2 uv  : TEXCOORD0;
+};
+
+VSOutput vs(uint vertexId : SV_VertexID)
+{
+    VSOutput o;
+
+    float2 pos[6] =
+    {
+        float2(-1.0, -1.0),
+        float2(-1.0,  1.0),
+        float2( 1.0,  1.0),
+        float2(-1.0, -1.0),
+        float2( 1.0,  1.0),
+        float2( 1.0, -1.0)
+    };
+
+    float2 p = pos[vertexId];
+    o.pos = float4(p, 0.0, 1.0);
+    o.uv = float2(p.x * 0.5 + 0.5, 0.5 - p.y * 0.5);
+    return o;
+}
+)";
+
+    const char* postPS = R"(
+Texture2D sceneTexture : register(t0);
+SamplerState sceneSampler : register(s0);
+
+cbuffer PostProcessBuffer : register(b0)
+{
+    int4 effectMode;
+};
+
+struct VSOutput
+{
+    float4 pos : SV_Position;
+    float2 uv  : TEXCOORD0;
+};
+
+float4 ps(VSOutput pixel) : SV_Target0
+{
+    float3 color = sceneTexture.Sample(sceneSampler, pixel.uv).rgb;
+
+    if (effectMode.x == 1)
+    {
+        float gray = dot(color, float3(0.299, 0.587, 0.114));
+        color = float3(gray, gray, gray);
+    }
+    else if (effectMode.x == 2)
+    {
+        float3 sepia;
+        sepia.r = dot(color, float3(0.393, 0.769, 0.189));
+        sepia.g = dot(color, float3(0.349, 0.686, 0.168));
+        sepia.b = dot(color, float3(0.272, 0.534, 0.131));
+        color = lerp(color, sepia, 0.75);
+    }
+    else if (effectMode.x == 3)
+    {
+        color *= 1.18;
+    }
+
+    return float4(saturate(color), 1.0);
+}
+)";
+
+    UINT flags = D3DCOMPILE_ENABLE_STRICTNESS;
+#ifdef _DEBUG
+    flags |= D3DCOMPILE_DEBUG | D3DCOMPILE_SKIP_OPTIMIZATION;
+#endif
+
+    HRESULT hr;
+    ID3DBlob* pVsBlob = nullptr;
+    ID3DBlob* pPsBlob = nullptr;
+    ID3DBlob* pErrorBlob = nullptr;
+
+    D3D11_INPUT_ELEMENT_DESC litLayout[] =
+    {
+        {"POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0,  0, D3D11_INPUT_PER_VERTEX_DATA, 0},
+        {"NORMAL",   0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 12, D3D11_INPUT_PER_VERTEX_DATA, 0},
+        {"TANGENT",  0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 24, D3D11_INPUT_PER_VERTEX_DATA, 0},
+        {"TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT,    0, 36, D3D11_INPUT_PER_VERTEX_DATA, 0}
+    };
+
+    D3D11_INPUT_ELEMENT_DESC skyboxLayout[] =
+    {
+        {"POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 0,  D3D11_INPUT_PER_VERTEX_DATA, 0},
+        {"TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT,    0, 12, D3D11_INPUT_PER_VERTEX_DATA, 0}
+    };
+
+    D3D11_INPUT_ELEMENT_DESC transparentBspLayout[] =
+    {
+        {"POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT,    0, 0,  D3D11_INPUT_PER_VERTEX_DATA, 0},
+        {"COLOR",    0, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, 12, D3D11_INPUT_PER_VERTEX_DATA, 0}
+    };
+
+    auto PrintError = [&](ID3DBlob* blob)
+        {
+            if (blob)
+                OutputDebugStringA((const char*)blob->GetBufferPointer());
+        };
+
+    hr = CompileShaderSource(litVS, nullptr, "vs", "vs_5_0", flags, &pVsBlob, &pErrorBlob);
+    if (FAILED(hr))
+    {
+        PrintError(pErrorBlob);
+        SAFE_RELEASE(pErrorBlob);
+        return false;
+    }
+    hr = g_pDevice->CreateVertexShader(pVsBlob->GetBufferPointer(), pVsBlob->GetBufferSize(), nullptr, &g_pVertexShader);
+    if (FAILED(hr)) return false;
+    hr = g_pDevice->CreateInputLayout(litLayout, 4, pVsBlob->GetBufferPointer(), pVsBlob->GetBufferSize(), &g_pInputLayout);
+    if (FAILED(hr)) return false;
+    SAFE_RELEASE(pVsBlob);
+
+    // LOD 1 drops normal mapping, LOD 2 also drops specular
+    const char* lodLevels[LOD_COUNT] = { "0", "1", "2" };
+    for (UINT lod = 0; lod < LOD_COUNT; ++lod)
+    {
+        D3D_SHADER_MACRO lodDefines[] = { { "LOD_LEVEL", lodLevels[lod] }, { nullptr, nullptr } };
+        hr = CompileShaderSource(litPS, lodDefines, "ps", "ps_5_0", flags, &pPsBlob, &pErrorBlob);
+        if (FAILED(hr))
+        {
+            PrintError(pErrorBlob);
+            SAFE_RELEASE(pErrorBlob);
+            return false;
+        }
+        hr = g_pDevice->CreatePixelShader(pPsBlob->GetBufferPointer(), pPsBlob->GetBufferSize(), nullptr, &g_pLodPixelShaders[lod]);
+        if (FAILED(hr)) return false;
+        SAFE_RELEASE(pPsBlob);
+    }
+
+    hr = CompileShaderSource(skyboxVS, nullptr, "vs", "vs_5_0", flags, &pVsBlob, &pErrorBlob);
+    if (FAILED(hr))
+    {
+        PrintError(pErrorBlob);
+        SAFE_RELEASE(pErrorBlob);
+        return false;
+    }
+    hr = g_pDevice->CreateVertexShader(pVsBlob->GetBufferPointer(), pVsBlob->GetBufferSize(), nullptr, &g_pSkyboxVS);
+    if (FAILED(hr)) return false;
+    hr = g_pDevice->CreateInputLayout(skyboxLayout, 2, pVsBlob->GetBufferPointer(), pVsBlob->GetBufferSize(), &g_pSkyboxInputLayout);
+    if (FAILED(hr)) return false;
+    SAFE_RELEASE(pVsBlob);
+
+    hr = CompileShaderSource(skyboxPS, nullptr, "ps", "ps_5_0", flags, &pPsBlob, &pErrorBlob);
+    if (FAILED(hr))
+    {
+        PrintError(pErrorBlob);
+        SAFE_RELEASE(pErrorBlob);
+        return false;
+    }
+    hr = g_pDevice->CreatePixelShader(pPsBlob->GetBufferPointer(), pPsBlob->GetBufferSize(), nullptr, &g_pSkyboxPS);
+    if (FAILED(hr)) return false;
+    SAFE_RELEASE(pPsBlob);
+
+    hr = CompileShaderSource(transparentVS, nullptr, "vs", "vs_5_0", flags, &pVsBlob, &pErrorBlob);
+    if (FAILED(hr))
+    {
+        PrintError(pErrorBlob);
+        SAFE_RELEASE(pErrorBlob);
+        return false;
+    }
+    hr = g_pDevice->CreateVertexShader(pVsBlob->GetBufferPointer(), pVsBlob->GetBufferSize(), nullptr, &g_pTransparentVS);
+    if (FAILED(hr)) return false;
+    hr = g_pDevice->CreateInputLayout(litLayout, 4, pVsBlob->GetBufferPointer(), pVsBlob->GetBufferSize(), &g_pTransparentInputLayout);
+    if (FAILED(hr)) return false;
+    SAFE_RELEASE(pVsBlob);
+
+    hr = CompileShaderSource(transparentBspVS, nullptr, "vs", "vs_5_0", flags, &pVsBlob, &pErrorBlob);
+    if (FAILED(hr))
+    {
+        PrintError(pErrorBlob);
+        SAFE_RELEASE(pErrorBlob);
+        return false;
+    }
+    hr = g_pDevice->CreateVertexShader(pVsBlob->GetBufferPointer(), pVsBlob->GetBufferSize(), nullptr, &g_pTransparentBspVS);
+    if (FAILED(hr)) return false;
+    hr = g_pDevice->CreateInputLayout(transparentBspLayout, 2, pVsBlob->GetBufferPointer(), pVsBlob->GetBufferSize(), &g_pTransparentBspInputLayout);
+    if (FAILED(hr)) return false;
+    SAFE_RELEASE(pVsBlob);
+
+    hr = CompileShaderSource(transparentPS, nullptr, "ps", "ps_5_0", flags, &pPsBlob, &pErrorBlob);
+    if (FAILED(hr))
+    {
+        PrintError(pErrorBlob);
+        SAFE_RELEASE(pErrorBlob);
+        return false;
+    }
+    hr = g_pDevice->CreatePixelShader(pPsBlob->GetBufferPointer(), pPsBlob->GetBufferSize(), nullptr, &g_pTransparentPS);
+    if (FAILED(hr)) return false;
+    SAFE_RELEASE(pPsBlob);
+
+    hr = CompileShaderSource(postVS, nullptr, "vs", "vs_5_0", flags, &pVsBlob, &pErrorBlob);
+    if (FAILED(hr))
+    {
+        PrintError(pErrorBlob);
+        SAFE_RELEASE(pErrorBlob);
+        return false;
+    }
+    hr = g_pDevice->CreateVertexShader(pVsBlob->GetBufferPointer(), pVsBlob->GetBufferSize(), nullptr, &g_pPostVS);
+    if (FAILED(hr)) return false;
+    SAFE_RELEASE(pVsBlob);
+
+    hr = CompileShaderSource(postPS, nullptr, "ps", "ps_5_0", flags, &pPsBlob, &pErrorBlob);
+    if (FAILED(hr))
+    {
+        PrintError(pErrorBlob);
+        SAFE_RELEASE(pErrorBlob);
+        return false;
+    }
+    hr = g_pDevice->CreatePixelShader(pPsBlob->GetBufferPointer(), pPsBlob->GetBufferSize(), nullptr, &g_pPostPS);
+    if (FAILED(hr)) return false;
+    SAFE_RELEASE(pPsBlob);
+
+    SAFE_RELEASE(pErrorBlob);
+    return true;
+}
+
+// Texture loading
+bool CreateTexture2DArrayFromDDS(
+    const wchar_t* file0,
+    const wchar_t* file1,
+    ID3D11Texture2D** ppTex,
+    ID3D11ShaderResourceView** ppSRV)
+{
+    if (!ppTex || !ppSRV) return false;
+
+    TextureDesc texDesc[2];
+    if (!LoadDDS(file0, texDesc[0])) return false;
+
+    if (!LoadDDS(file1, texDesc[1]))
+    {
+        free(texDesc[0].pData);
+        return false;
+    }
+
+    if (texDesc[0].fmt != texDesc[1].fmt ||
+        texDesc[0].width != texDesc[1].width ||
+        texDesc[0].height != texDesc[1].height ||
+        texDesc[0].mipmapsCount != texDesc[1].mipmapsCount)
+    {
+        free(texDesc[0].pData);
+        free(texDesc[1].pData);
+        return false;
+    }
+
+    D3D11_TEXTURE2D_DESC desc = {};
+    desc.Width = texDesc[0].width;
+    desc.Height = texDesc[0].height;
+    desc.MipLevels = texDesc[0].mipmapsCount;
+    desc.ArraySize = 2;
+    desc.Format = texDesc[0].fmt;
+    desc.SampleDesc.Count = 1;
+    desc.Usage = D3D11_USAGE_IMMUTABLE;
+    desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+
+    std::vector<D3D11_SUBRESOURCE_DATA> data(desc.MipLevels * 2);
+
+    for (UINT slice = 0; slice < 2; ++slice)
+    {
+        for (UINT mip = 0; mip < desc.MipLevels; ++mip)
+        {
+            UINT idx = slice * desc.MipLevels + mip;
+            data[idx].pSysMem = reinterpret_cast<const BYTE*>(texDesc[slice].pData) + texDesc[slice].mipOffsets[mip];
+            data[idx].SysMemPitch = texDesc[slice].mipPitches[mip];
+            data[idx].SysMemSlicePitch = 0;
+        }
+    }
+
+    HRESULT hr = g_pDevice->CreateTexture2D(&desc, data.data(), ppTex);
+    if (FAILED(hr))
+    {
+        free(texDesc[0].pData);
+        free(texDesc[1].pData);
+        return false;
+    }
+
+    D3D11_SHADER_RESOURCE_VIEW_DESC srvDesc = {};
+    srvDesc.Format = desc.Format;
+    srvDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2DARRAY;
+    srvDesc.Texture2DArray.MostDetailedMip = 0;
+    srvDesc.Texture2DArray.MipLevels = desc.MipLevels;
+    srvDesc.Texture2DArray.FirstArraySlice = 0;
+    srvDesc.Texture2DArray.ArraySize = 2;
+
+    hr = g_pDevice->CreateShaderResourceView(*ppTex, &srvDesc, ppSRV);
+
+    free(texDesc[0].pData);
+    free(texDesc[1].pData);
+
+    return SUCCEEDED(hr);
+}
+
+bool LoadTextures()
+{
+    // Diffuse texture array: Brick + Kitty
+    if (!CreateTexture2DArrayFromDDS(L"Brick.dds", L"Kitty.dds", &g_pTextureArray, &g_pTextureArrayView))
+    {
+        MessageBoxA(NULL, "Failed to create texture array from Brick.dds and Kitty.dds", "Error", MB_OK);
+        return false;
+    }
+
+    // Normal map: BrickNM
+    {
+        TextureDesc texDesc;
+        if (!LoadDDS(L"BrickNM.dds", texDesc))
+        {
+            MessageBoxA(NULL, "Failed to load BrickNM.dds", "Error", MB_OK);
+            return false;
+        }
+
+        if (!CreateTextureFromDesc(g_pDevice, texDesc, &g_pNormalTexture, &g_pNormalTextureView))
+        {
+            free(texDesc.pData);
+            MessageBoxA(NULL, "Failed to create normal map texture", "Error", MB_OK);
+            return false;
+        }
+
+        free(texDesc.pData);
+    }
+
+    // Sampler
+    {
+        D3D11_SAMPLER_DESC sampDesc = {};
+        sampDesc.Filter = D3D11_FILTER_ANISOTROPIC;
+        sampDesc.AddressU = D3D11_TEXTURE_ADDRESS_WRAP;
+        sampDesc.AddressV = D3D11_TEXTURE_ADDRESS_WRAP;
+        sampDesc.AddressW = D3D11_TEXTURE_ADDRESS_WRAP;
+        sampDesc.MinLOD = -FLT_MAX;
+        sampDesc.MaxLOD = FLT_MAX;
+        sampDesc.MaxAnisotropy = 16;
+        sampDesc.ComparisonFunc = D3D11_COMPARISON_NEVER;
+        sampDesc.BorderColor[0] = 1.0f;
+        sampDesc.BorderColor[1] = 1.0f;
+        sampDesc.BorderColor[2] = 1.0f;
+        sampDesc.BorderColor[3] = 1.0f;
+
+        HRESULT hr = g_StateObjects.CreateSamplerState(sampDesc, &g_pSampler);
+        if (FAILED(hr))
+        {
+            MessageBoxA(NULL, "CreateSampler failed", "Error", MB_OK);
+            return false;
+        }
+    }
+
+    // Skybox
+    {
+        const std::wstring faceNames[6] =
+        {
+            L"Skybox/posx.png",
+            L"Skybox/negx.png",
+            L"Skybox/posy.png",
+            L"Skybox/negy.png",
+            L"Skybox/posz.png",
+            L"Skybox/negz.png"
+        };
+
+        TextureDesc faceDescs[6];
+        bool allOk = true;
+        for (int i = 0; i < 6; ++i)
+        {
+            if (!LoadImageAny(faceNames[i].c_str(), faceDescs[i]))
+            {
+                allOk = false;
+                break;
+            }
+        }
+
+        if (!allOk)
+        {
+            MessageBoxA(NULL, "Failed to load cubemap faces", "Error", MB_OK);
+            for (int i = 0; i < 6; ++i)
+                if (faceDescs[i].pData) free(faceDescs[i].pData);
+            return false;
+        }
+
+        for (int i = 1; i < 6; ++i)
+        {
+            if (faceDescs[i].fmt != faceDescs[0].fmt ||
+                faceDescs[i].width != faceDescs[0].width ||
+                faceDescs[i].height != faceDescs[0].height)
+            {
+                MessageBoxA(NULL, "Cubemap faces must have same format and size", "Error", MB_OK);
+                for (int j = 0; j < 6; ++j)
+                    if (faceDescs[j].pData) free(faceDescs[j].pData);
+                return false;
+            }
+        }
+
+        D3D11_TEXTURE2D_DESC cubeDesc = {};
+        cubeDesc.Width = faceDescs[0].width;
+        cubeDesc.Height = faceDescs[0].height;
+        cubeDesc.MipLevels = 1;
+        cubeDesc.ArraySize = 6;
+        cubeDesc.Format = faceDescs[0].fmt;
+        cubeDesc.SampleDesc.Count = 1;
+        cubeDesc.SampleDesc.Quality = 0;
+        cubeDesc.Usage = D3D11_USAGE_IMMUTABLE;
+        cubeDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+        cubeDesc.CPUAccessFlags = 0;
+        cubeDesc.MiscFlags = D3D11_RESOURCE_MISC_TEXTURECUBE;
+
+        D3D11_SUBRESOURCE_DATA initData[6] = {};
+        for (int i = 0; i < 6; ++i)
+        {
+            initData[i].pSysMem = faceDescs[i].pData;
+            initData[i].SysMemPitch = faceDescs[i].pitch;
+            initData[i].SysMemSlicePitch = 0;
+        }
+
+        HRESULT hr = g_pDevice->CreateTexture2D(&cubeDesc, initData, &g_pCubemapTexture);
+
+        for (int i = 0; i < 6; ++i)
+            free(faceDescs[i].pData);
+
+        if (FAILED(hr) || !g_pCubemapTexture)
+        {
+            MessageBoxA(NULL, "CreateCubemapTexture failed", "Error", MB_OK);
+            return false;
+        }
+
+        D3D11_SHADER_RESOURCE_VIEW_DESC cubeSRVDesc = {};
+        cubeSRVDesc.Format = cubeDesc.Format;
+        cubeSRVDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURECUBE;
+        cubeSRVDesc.TextureCube.MipLevels = 1;
+        cubeSRVDesc.TextureCube.MostDetailedMip = 0;
+
+        hr = g_pDevice->CreateShaderResourceView(g_pCubemapTexture, &cubeSRVDesc, &g_pCubemapView);
+        if (FAILED(hr) || !g_pCubemapView)
+        {
+            MessageBoxA(NULL, "CreateCubemapSRV failed", "Error", MB_OK);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Render states / resources
+bool CreateRenderStates()
+{
+    HRESULT hr;
+
+    D3D11_DEPTH_STENCIL_DESC opaqueDesc = {};
+    opaqueDesc.DepthEnable = TRUE;
+    opaqueDesc.DepthWriteMask = D3D11_DEPTH_WRITE_MASK_ALL;
+    opaqueDesc.DepthFunc = D3D11_COMPARISON_LESS;
+    hr = g_StateObjects.CreateDepthStencilState(opaqueDesc, &g_pOpaqueDepthState);
+    if (FAILED(hr)) return false;
+
+    D3D11_DEPTH_STENCIL_DESC skyboxDesc = {};
+    skyboxDesc.DepthEnable = TRUE;
+    skyboxDesc.DepthWriteMask = D3D11_DEPTH_WRITE_MASK_ZERO;
+    skyboxDesc.DepthFunc = D3D11_COMPARISON_LESS_EQUAL;
+    hr = g_StateObjects.CreateDepthStencilState(skyboxDesc, &g_pSkyboxDepthState);
+    if (FAILED(hr)) return false;
+
+    D3D11_DEPTH_STENCIL_DESC transparentDesc = {};
+    transparentDesc.DepthEnable = TRUE;
+    transparentDesc.DepthWriteMask = D3D11_DEPTH_WRITE_MASK_ZERO;
+    transparentDesc.DepthFunc = D3D11_COMPARISON_LESS;
+    hr = g_StateObjects.CreateDepthStencilState(transparentDesc, &g_pTransparentDepthState);
+    if (FAILED(hr)) return false;
+
+    D3D11_RASTERIZER_DESC rsBack = {};
+    rsBack.FillMode = D3D11_FILL_SOLID;
+    rsBack.CullMode = D3D11_CULL_BACK;
+    rsBack.DepthClipEnable = TRUE;
+    hr = g_StateObjects.CreateRasterizerState(rsBack, &g_pCullBackRS);
+    if (FAILED(hr)) return false;
+
+    D3D11_RASTERIZER_DESC rsNone = {};
+    rsNone.FillMode = D3D11_FILL_SOLID;
+    rsNone.CullMode = D3D11_CULL_NONE;
+    rsNone.DepthClipEnable = TRUE;
+    hr = g_StateObjects.CreateRasterizerState(rsNone, &g_pCullNoneRS);
+    if (FAILED(hr)) return false;
+
+    D3D11_BLEND_DESC blendDesc = {};
+    blendDesc.RenderTarget[0].BlendEnable = TRUE;
+    blendDesc.RenderTarget[0].SrcBlend = D3D11_BLEND_SRC_ALPHA;
+    blendDesc.RenderTarget[0].DestBlend = D3D11_BLEND_INV_SRC_ALPHA;
+    blendDesc.RenderTarget[0].BlendOp = D3D11_BLEND_OP_ADD;
+    blendDesc.RenderTarget[0].SrcBlendAlpha = D3D11_BLEND_ONE;
+    blendDesc.RenderTarget[0].DestBlendAlpha = D3D11_BLEND_ZERO;
+    blendDesc.RenderTarget[0].BlendOpAlpha = D3D11_BLEND_OP_ADD;
+    blendDesc.RenderTarget[0].RenderTargetWriteMask = D3D11_COLOR_WRITE_ENABLE_ALL;
+
+    hr = g_StateObjects.CreateBlendState(blendDesc, &g_pTransparentBlendState);
+    if (FAILED(hr)) return false;
+
+    return true;
+}
+
+static bool CreateDynamicRawBuffer(UINT byteWidth, ID3D11Buffer** buffer, ID3D11ShaderResourceView** srv)
+{
+    D3D11_BUFFER_DESC desc = {};
+    desc.ByteWidth = byteWidth;
+    desc.Usage = D3D11_USAGE_DYNAMIC;
+    desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+    desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+    desc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_ALLOW_RAW_VIEWS;
+    HRESULT hr = g_pDevice->CreateBuffer(&desc, nullptr, buffer);
+    if (FAILED(hr)) return false;
+
+    D3D11_SHADER_RESOURCE_VIEW_DESC srvDesc = {};
+    srvDesc.Format = DXGI_FORMAT_R32_TYPELESS;
+    srvDesc.ViewDimension = D3D11_SRV_DIMENSION_BUFFEREX;
+    srvDesc.BufferEx.FirstElement = 0;
+    srvDesc.BufferEx.NumElements = byteWidth / 4;
+    srvDesc.BufferEx.Flags = D3D11_BUFFEREX_SRV_FLAG_RAW;
+    hr = g_pDevice->CreateShaderResourceView(*buffer, &srvDesc, srv);
+    return SUCCEEDED(hr);
+}
+
+// Ring space one frame takes with every instance visible
+static UINT InstanceRecordBytes(UINT count)
+{
+    return DivUp(count * (UINT)sizeof(InstanceGPU), UPLOAD_RING_ALIGNMENT) * UPLOAD_RING_ALIGNMENT;
+}
+
+// Grows the instance ring to hold a few frames of `count` instances
+bool EnsureInstanceBuffers(UINT count)
+{
+    UINT ringCapacity = (std::max)(UPLOAD_RING_BYTES, InstanceRecordBytes(count) * UPLOAD_RING_FRAMES);
+    if (ringCapacity > g_InstanceRingCapacity)
+    {
+        SAFE_RELEASE(g_pInstanceRingSRV);
+        SAFE_RELEASE(g_pInstanceRingBuffer);
+        g_InstanceRingCapacity = 0;
+        if (!CreateDynamicRawBuffer(ringCapacity, &g_pInstanceRingBuffer, &g_pInstanceRingSRV))
+            return false;
+        g_InstanceRingCapacity = ringCapacity;
+
+        g_InstanceRingTarget.Init(g_pDeviceContext, g_pInstanceRingBuffer);
+        g_InstanceRing.Resize(ringCapacity);
+    }
+    return true;
+}
+
+// Every draw's constants take one slice of a single dynamic buffer, written through an
+// upload ring like the instance records: one map a frame for all of them instead of an
+// UpdateSubresource per draw. With 11.1 constant buffer offsetting the ring is a constant
+// buffer and each draw binds its own slice. Without it a shader only sees the start of a
+// constant buffer, so each slice is copied on the GPU into the constant buffer the shader
+// reads; the ring is then a dynamic vertex buffer that is never bound, as those take
+// NO_OVERWRITE maps on any runtime and have no 64 KB limit.
+bool EnsureConstantRing(UINT sliceCount)
+{
+    UINT ringCapacity = (std::max)(CONSTANT_RING_BYTES, sliceCount * CONSTANT_SLICE_BYTES * UPLOAD_RING_FRAMES);
+    if (ringCapacity > g_ConstantRingCapacity)
+    {
+        SAFE_RELEASE(g_pConstantRingBuffer);
+        g_ConstantRingCapacity = 0;
+
+        D3D11_BUFFER_DESC desc = {};
+        desc.ByteWidth = ringCapacity;
+        desc.Usage = D3D11_USAGE_DYNAMIC;
+        desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+        desc.BindFlags = g_ConstantBufferOffsets ? D3D11_BIND_CONSTANT_BUFFER : D3D11_BIND_VERTEX_BUFFER;
+        HRESULT hr = g_pDevice->CreateBuffer(&desc, nullptr, &g_pConstantRingBuffer);
+        if (FAILED(hr)) return false;
+        SetResourceName(g_pConstantRingBuffer, "ConstantRing");
+        g_ConstantRingCapacity = ringCapacity;
+
+        g_ConstantRingTarget.Init(g_pDeviceContext, g_pConstantRingBuffer);
+        g_ConstantRing.Resize(ringCapacity);
+    }
+    return true;
+}
+
+// Draws bind their slices by offset when the device reports it and the state cache has
+// the 11.1 context, by copy otherwise. `options` is null when the device did not say.
+bool InitConstantRing(const D3D11_FEATURE_DATA_D3D11_OPTIONS* options)
+{
+    g_ConstantBufferOffsets = options && options->ConstantBufferOffsetting && g_StateCache.SupportsConstantBufferRanges();
+    g_ConstantRing.Init(&g_ConstantRingTarget, 0, CONSTANT_SLICE_BYTES,
+        g_ConstantBufferOffsets ? options->MapNoOverwriteOnDynamicConstantBuffer != FALSE : true);
+    return EnsureConstantRing(0);
+}
+
+void ReleaseConstantRing()
+{
+    SAFE_RELEASE(g_pConstantRingBuffer);
+    g_ConstantRingCapacity = 0;
+}
+
+// Points a draw at the `size` bytes of constants at byte `offset` of the ring, for the
+// vertex shader's `slot`; without offsetting, `buffer` must be bound there already
+void BindConstantSlice(UINT slot, ID3D11Buffer* buffer, UINT offset, UINT size)
+{
+    if (g_ConstantBufferOffsets)
+    {
+        g_StateCache.VSSetConstantBufferRange(slot, g_pConstantRingBuffer, offset / 16, CONSTANT_SLICE_BYTES / 16);
+        return;
+    }
+    D3D11_BOX box = { offset, 0, 0, offset + size, 1, 1 };
+    g_pDeviceContext->CopySubresourceRegion(buffer, 0, 0, 0, 0, g_pConstantRingBuffer, 0, &box);
+}
+
+bool CreateConstantBuffers()
+{
+    HRESULT hr;
+
+    D3D11_BUFFER_DESC desc = {};
+    desc.ByteWidth = sizeof(ViewProjBuffer);
+    desc.Usage = D3D11_USAGE_DYNAMIC;
+    desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+    desc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+    hr = g_pDevice->CreateBuffer(&desc, nullptr, &g_pViewProjBuffer);
+    if (FAILED(hr)) return false;
+    hr = g_pDevice->CreateBuffer(&desc, nullptr, &g_pSkyViewProjBuffer);
+    if (FAILED(hr)) return false;
+
+    desc = {};
+    desc.ByteWidth = sizeof(SceneBuffer);
+    desc.Usage = D3D11_USAGE_DEFAULT;
+    desc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+    hr = g_pDevice->CreateBuffer(&desc, nullptr, &g_pSceneBuffer);
+    if (FAILED(hr)) return false;
+
+    desc = {};
+    desc.ByteWidth = sizeof(TransparentBuffer);
+    desc.Usage = D3D11_USAGE_DEFAULT;
+    desc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+    hr = g_pDevice->CreateBuffer(&desc, nullptr, &g_pTransparentBuffer);
+    if (FAILED(hr)) return false;
+
+    desc = {};
+    desc.ByteWidth = sizeof(PostProcessBuffer);
+    desc.Usage = D3D11_USAGE_DEFAULT;
+    desc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+    hr = g_pDevice->CreateBuffer(&desc, nullptr, &g_pPostProcessBuffer);
+    if (FAILED(hr)) return false;
+
+    if (!g_FrameFences.Init(g_pDevice))
+        return false;
+
+    // NO_OVERWRITE on a buffer read through an SRV needs the 11.1 runtime; without it the
+    // ring discards every frame. So do constant buffer offsets and NO_OVERWRITE on a
+    // constant buffer, for the constant ring.
+    D3D11_FEATURE_DATA_D3D11_OPTIONS options = {};
+    bool optionsKnown = SUCCEEDED(g_pDevice->CheckFeatureSupport(D3D11_FEATURE_D3D11_OPTIONS, &options, sizeof(options)));
+    bool noOverwrite = optionsKnown && options.MapNoOverwriteOnDynamicBufferSRV;
+    g_InstanceRing.Init(&g_InstanceRingTarget, 0, UPLOAD_RING_ALIGNMENT, noOverwrite);
+
+    if (!InitConstantRing(optionsKnown ? &options : nullptr))
+        return false;
+
+    // Buffers rather than constant buffers: those are capped at 64 KB and can only be
+    // replaced whole, these take any instance count, the partial copies of the dirty
+    // ranges and the ring's NO_OVERWRITE maps. RenderFrame grows them with the scene.
+    if (!EnsureInstanceBuffers(0))
+        return false;
+
+    desc = {};
+    desc.ByteWidth = sizeof(DrawParamsBuffer);
+    desc.Usage = D3D11_USAGE_DEFAULT;
+    desc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+    hr = g_pDevice->CreateBuffer(&desc, nullptr, &g_pDrawParamsBuffer);
+    if (FAILED(hr)) return false;
+
+    return true;
+}
+
+// Scene generation
+// Instances come from a seeded generator. Every parameter of instance i is a hash of
+// (seed, i), so the entity chunks can be filled in parallel and the scene is the same
+// for any number of threads. Layouts:
+//  - Grid: the square grid, with the original repeating scale, spin and texture pattern
+//  - Poisson: one cube jittered inside each cell of a sparser grid, a blue-noise scatter
+//    that keeps spinning cubes apart (a dart-throwing Poisson-disk sampler would be
+//    sequential)
+//  - Cluster: gaussian clumps of SCENE_CLUSTER_SIZE consecutive ids around hashed centres
+//    spread over the grid's square, with some height
+static const float SCENE_SPACING = 1.65f;
+static const float SCENE_POISSON_SPACING = 2.4f;
+static const float SCENE_MAX_CUBE_FOOTPRINT = 1.05f * 1.4142136f;  // largest cube spinning about Y
+static const UINT SCENE_CLUSTER_SIZE = 4096;
+static const UINT SCENE_MAX_GENERATED_INSTANCES = 10000000;
+static const UINT SCENE_GENERATION_CHUNKS_PER_JOB = 8;
+
+static UINT PackHalf2(float lo, float hi)
+{
+    return (UINT)PackedVector::XMConvertFloatToHalf(lo) | ((UINT)PackedVector::XMConvertFloatToHalf(hi) << 16);
+}
+
+static InstanceStaticGPU PackInstanceStatic(const CubeInstanceCPU& c)
+{
+    InstanceStaticGPU gpu;
+    gpu.posScale = XMFLOAT4(c.basePos.x, c.basePos.y, c.basePos.z, c.scale);
+    gpu.params[0] = PackHalf2(32.0f, c.rotSpeed);
+    gpu.params[1] = PackHalf2((float)c.textureId, c.hasNormalMap ? 1.0f : 0.0f);
+    return gpu;
+}
+
+static UINT HashUint(UINT x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+// Uniform in [0, 1), one independent stream per parameter
+static float SceneRandom(UINT seed, UINT index, UINT stream)
+{
+    return (float)(HashUint(HashUint(index * 16u + stream) ^ seed) >> 8) * (1.0f / 16777216.0f);
+}
+
+static float SceneGaussian(UINT seed, UINT index, UINT stream)
+{
+    float u = (std::max)(SceneRandom(seed, index, stream), 1e-7f);
+    float v = SceneRandom(seed, index, stream + 1);
+    return sqrtf(-2.0f * logf(u)) * cosf(XM_2PI * v);
+}
+
+CubeInstanceCPU GenerateInstance(const SceneGenerationDesc& desc, UINT i)
+{
+    const UINT grid = (UINT)ceil(sqrt((double)desc.count));
+    const UINT x = i % grid;
+    const UINT z = i / grid;
+    const float half = (float)(grid / 2);
+
+    CubeInstanceCPU cube = {};
+    if (desc.layout == SceneLayout::Grid)
+    {
+        cube.basePos = XMFLOAT3(((float)x - half) * SCENE_SPACING, 0.0f, ((float)z - half) * SCENE_SPACING);
+        cube.scale = 0.75f + 0.15f * float((x + z) % 3);
+        cube.rotSpeed = 0.35f + 0.08f * float((x * 7 + z * 3) % 5);
+        cube.textureId = ((x + z) % 2 == 0) ? 0u : 1u; // 0 = Brick, 1 = Kitty
+        cube.hasNormalMap = (cube.textureId == 0u);     // only Brick uses BrickNM
+        return cube;
+    }
+
+    if (desc.layout == SceneLayout::Poisson)
+    {
+        float jitter = 0.5f * (SCENE_POISSON_SPACING - SCENE_MAX_CUBE_FOOTPRINT);
+        cube.basePos = XMFLOAT3(
+            ((float)x - half) * SCENE_POISSON_SPACING + jitter * (2.0f * SceneRandom(desc.seed, i, 0) - 1.0f),
+            0.0f,
+            ((float)z - half) * SCENE_POISSON_SPACING + jitter * (2.0f * SceneRandom(desc.seed, i, 1) - 1.0f));
+    }
+    else
+    {
+        // Cluster centres are hashed from the cluster index, kept a cluster radius inside
+        // the grid's square
+        UINT cluster = i / SCENE_CLUSTER_SIZE;
+        UINT members = (std::min)(SCENE_CLUSTER_SIZE, desc.count);
+        float radius = 0.5f * SCENE_SPACING * sqrtf((float)members);
+        float extent = (std::max)(0.5f * SCENE_SPACING * grid - radius, 0.0f);
+        float cx = extent * (2.0f * SceneRandom(desc.seed, 0x80000000u | cluster, 0) - 1.0f);
+        float cz = extent * (2.0f * SceneRandom(desc.seed, 0x80000000u | cluster, 1) - 1.0f);
+        cube.basePos = XMFLOAT3(
+            cx + 0.5f * radius * SceneGaussian(desc.seed, i, 0),
+            fabsf(0.25f * radius * SceneGaussian(desc.seed, i, 2)),
+            cz + 0.5f * radius * SceneGaussian(desc.seed, i, 4));
+    }
+    cube.scale = 0.75f + 0.3f * SceneRandom(desc.seed, i, 6);
+    cube.rotSpeed = 0.35f + 0.32f * SceneRandom(desc.seed, i, 7);
+    cube.textureId = SceneRandom(desc.seed, i, 8) < 0.5f ? 0u : 1u;
+    cube.hasNormalMap = (cube.textureId == 0u);
+    return cube;
+}
+
+// Appends desc.count instances to the store, filling the new rows chunk by chunk on the
+// job system
+void GenerateOpaqueInstances(const SceneGenerationDesc& desc, InstanceStore& store, JobSystem& jobs)
+{
+    UINT n = (std::min)(desc.count, SCENE_MAX_GENERATED_INSTANCES);
+    EntityArchetype& archetype = *store.archetype;
+    UINT first = store.world->CreateMany(OPAQUE_INSTANCE_COMPONENTS, n);
+    assert(first == store.count);
+    store.count += n;
+
+    UINT firstChunk = first / archetype.capacity;
+    jobs.ParallelFor((UINT)archetype.chunks.size() - firstChunk, SCENE_GENERATION_CHUNKS_PER_JOB, [&](UINT begin, UINT end)
+        {
+            for (UINT c = firstChunk + begin; c < firstChunk + end; ++c)
+            {
+                EntityChunk& chunk = archetype.chunks[c];
+                float* posX = chunk.Column<float>(COMPONENT_POSITION_X);
+                float* posY = chunk.Column<float>(COMPONENT_POSITION_Y);
+                float* posZ = chunk.Column<float>(COMPONENT_POSITION_Z);
+                float* scale = chunk.Column<float>(COMPONENT_SCALE);
+                float* spin = chunk.Column<float>(COMPONENT_SPIN);
+                InstanceStaticGPU* gpu = chunk.Column<InstanceStaticGPU>(COMPONENT_INSTANCE_GPU);
+                for (UINT row = (std::max)(first, chunk.firstRow); row < chunk.firstRow + chunk.count; ++row)
+                {
+                    UINT k = row - chunk.firstRow;
+                    CubeInstanceCPU cube = GenerateInstance(desc, row - first);
+                    posX[k] = cube.basePos.x;
+                    posY[k] = cube.basePos.y;
+                    posZ[k] = cube.basePos.z;
+                    scale[k] = cube.scale;
+                    spin[k] = cube.rotSpeed;
+                    gpu[k] = PackInstanceStatic(cube);
+                }
+            }
+        });
+    store.staticDirty.Mark(first, first + n);
+}
+
+void CreateOpaqueInstances()
+{
+    InitInstanceStore(g_Instances, g_Scene);
+    GenerateOpaqueInstances(g_SceneGeneration, g_Instances, g_JobSystem);
+}
+
+// A warm light circling the grid and a cool one bobbing on the far side
+void CreateSceneLights()
+{
+    g_SceneLights.clear();
+    g_SceneLights.push_back({ XMFLOAT4(0.0f, 2.2f, 0.0f, 1.0f), XMFLOAT4(1.0f, 0.82f, 0.72f, 1.0f), XMFLOAT4(4.5f, 1.0f, 0.0f, 0.0f) });
+    g_SceneLights.push_back({ XMFLOAT4(-4.5f, 1.2f, -3.2f, 1.0f), XMFLOAT4(0.55f, 0.75f, 1.0f, 1.0f), XMFLOAT4(0.0f, 0.0f, 0.8f, 1.5f) });
+}
+
+void InitInstanceStore(InstanceStore& store, EntityWorld& world)
+{
+    store.world = &world;
+    store.archetype = world.GetArchetype(OPAQUE_INSTANCE_COMPONENTS);
+    ClearInstanceStore(store);
+}
+
+void ClearInstanceStore(InstanceStore& store)
+{
+    EntityArchetype& archetype = *store.archetype;
+    while (archetype.count > 0)
+        store.world->Destroy(archetype.chunks.back().Entities()[(archetype.count - 1) % archetype.capacity]);
+    store.staticDirty.Clear();
+    store.count = 0;
+}
+
+Entity AddInstance(InstanceStore& store, const CubeInstanceCPU& c)
+{
+    EntityWorld& world = *store.world;
+    Entity e = world.Create(OPAQUE_INSTANCE_COMPONENTS);
+    UINT i = store.count++;
+    assert(world.GetRow(e) == i);
+
+    world.Get<float>(e, COMPONENT_POSITION_X) = c.basePos.x;
+    world.Get<float>(e, COMPONENT_POSITION_Y) = c.basePos.y;
+    world.Get<float>(e, COMPONENT_POSITION_Z) = c.basePos.z;
+    world.Get<float>(e, COMPONENT_SCALE) = c.scale;
+    world.Get<float>(e, COMPONENT_SPIN) = c.rotSpeed;
+
+    world.Get<InstanceStaticGPU>(e, COMPONENT_INSTANCE_GPU) = PackInstanceStatic(c);
+    store.staticDirty.Mark(i, i + 1);
+    return e;
+}
+
+// The last instance moves into the freed slot, which then needs uploading again
+void RemoveInstance(InstanceStore& store, Entity entity)
+{
+    UINT slot = store.world->GetRow(entity);
+    UINT last = --store.count;
+    store.world->Destroy(entity);
+    if (slot != last)
+        store.staticDirty.Mark(slot, slot + 1);
+}
+
+// Camera / culling
+void UpdateCamera(double deltaTime)
+{
+    float speed = 1.0f;
+    if (g_KeyLeft)  g_CameraYaw -= speed * (float)deltaTime;
+    if (g_KeyRight) g_CameraYaw += speed * (float)deltaTime;
+    if (g_KeyUp)    g_CameraPitch += speed * (float)deltaTime;
+    if (g_KeyDown)  g_CameraPitch -= speed * (float)deltaTime;
+
+    if (g_CameraPitch > 1.5f)  g_CameraPitch = 1.5f;
+    if (g_CameraPitch < -1.5f) g_CameraPitch = -1.5f;
+}
+
+Plane NormalizePlane(const Plane& in)
+{
+    Plane out = in;
+    float len = sqrtf(in.p.x * in.p.x + in.p.y * in.p.y + in.p.z * in.p.z);
+    if (len > 0.00001f)
+    {
+        out.p.x /= len;
+        out.p.y /= len;
+        out.p.z /= len;
+        out.p.w /= len;
+    }
+    return out;
+}
+
+void ExtractFrustumPlanes(Plane planes[6], const XMMATRIX& vp)
+{
+    XMFLOAT4X4 m;
+    XMStoreFloat4x4(&m, vp);
+
+    planes[0].p = XMFLOAT4(m._14 + m._11, m._24 + m._21, m._34 + m._31, m._44 + m._41); // left
+    planes[1].p = XMFLOAT4(m._14 - m._11, m._24 - m._21, m._34 - m._31, m._44 - m._41); // right
+    planes[2].p = XMFLOAT4(m._14 + m._12, m._24 + m._22, m._34 + m._32, m._44 + m._42); // bottom
+    planes[3].p = XMFLOAT4(m._14 - m._12, m._24 - m._22, m._34 - m._32, m._44 - m._42); // top
+    planes[4].p = XMFLOAT4(m._13, m._23, m._33, m._43);           // near
+    planes[5].p = XMFLOAT4(m._14 - m._13, m._24 - m._23, m._34 - m._33, m._44 - m._43); // far
+
+    for (int i = 0; i < 6; ++i)
+        planes[i] = NormalizePlane(planes[i]);
+}
+
+bool IsSphereInsideFrustum(const Plane planes[6], const XMFLOAT3& center, float radius)
+{
+    for (int i = 0; i < 6; ++i)
+    {
+        const XMFLOAT4& p = planes[i].p;
+        float d = p.x * center.x + p.y * center.y + p.z * center.z + p.w;
+        if (d < -radius)
+            return false;
+    }
+    return true;
+}
+
+// Bounds
+void ResizeInstanceBounds(InstanceBounds& bounds, UINT count)
+{
+    UINT padded = DivUp(count, 8u) * 8u;
+    bounds.centerX.assign(padded, 0.0f);
+    bounds.centerY.assign(padded, 0.0f);
+    bounds.centerZ.assign(padded, 0.0f);
+    bounds.extentX.assign(padded, 0.0f);
+    bounds.extentY.assign(padded, 0.0f);
+    bounds.extentZ.assign(padded, 0.0f);
+    bounds.radius.assign(padded, 0.0f);
+    bounds.count = count;
+}
+
+// Cubes spin about Y in place, so their bounds can hold for every rotation and be culled
+// before any transform is evaluated: the bounding sphere, and the box of the cube swept
+// about Y (its footprint's half diagonal across, half its height up). They only change
+// with the instances themselves, for the slots marked in `changed`.
+static const float CUBE_SPIN_EXTENT_PER_SCALE = 0.70710678f;  // sqrt(2) / 2
+static const UINT INSTANCE_BOUNDS_PER_JOB = 16384;
+
+static void ComputeInstanceBounds(const InstanceStore& store, UINT begin, UINT end, InstanceBounds& bounds)
+{
+    const EntityArchetype& archetype = *store.archetype;
+    for (UINT i = begin; i < end;)
+    {
+        const EntityChunk& chunk = archetype.chunks[i / archetype.capacity];
+        const float* posX = chunk.Column<float>(COMPONENT_POSITION_X);
+        const float* posY = chunk.Column<float>(COMPONENT_POSITION_Y);
+        const float* posZ = chunk.Column<float>(COMPONENT_POSITION_Z);
+        const float* scale = chunk.Column<float>(COMPONENT_SCALE);
+        UINT chunkEnd = (std::min)(end, chunk.firstRow + chunk.count);
+        for (; i < chunkEnd; ++i)
+        {
+            UINT row = i - chunk.firstRow;
+            bounds.centerX[i] = posX[row];
+            bounds.centerY[i] = posY[row];
+            bounds.centerZ[i] = posZ[row];
+            bounds.extentX[i] = CUBE_SPIN_EXTENT_PER_SCALE * scale[row];
+            bounds.extentY[i] = 0.5f * scale[row];
+            bounds.extentZ[i] = CUBE_SPIN_EXTENT_PER_SCALE * scale[row];
+            bounds.radius[i] = CUBE_RADIUS_PER_SCALE * scale[row];
+        }
+    }
+}
+
+void UpdateInstanceBounds(const InstanceStore& store, const DirtyRanges& changed, InstanceBounds& bounds)
+{
+    if (bounds.count != store.count)
+    {
+        ResizeInstanceBounds(bounds, store.count);
+        g_JobSystem.ParallelFor(store.count, INSTANCE_BOUNDS_PER_JOB, [&](UINT begin, UINT end)
+            {
+                ComputeInstanceBounds(store, begin, end, bounds);
+            });
+        return;
+    }
+    for (const DirtyRange& range : changed.GetRanges())
+        ComputeInstanceBounds(store, range.begin, (std::min)(range.end, store.count), bounds);  // rows removed since they were marked
+}
+
+// Plane coefficients and their absolute values, broadcast on load
+struct CullPlaneSet
+{
+    float x[6], y[6], z[6], w[6];
+    float absX[6], absY[6], absZ[6];
+};
+
+static void PrepareCullPlaneSets(const CullView* views, UINT viewCount, CullPlaneSet* sets)
+{
+    for (UINT v = 0; v < viewCount; ++v)
+    {
+        for (int p = 0; p < 6; ++p)
+        {
+            const XMFLOAT4& plane = views[v].planes[p].p;
+            sets[v].x[p] = plane.x;
+            sets[v].y[p] = plane.y;
+            sets[v].z[p] = plane.z;
+            sets[v].w[p] = plane.w;
+            sets[v].absX[p] = fabsf(plane.x);
+            sets[v].absY[p] = fabsf(plane.y);
+            sets[v].absZ[p] = fabsf(plane.z);
+        }
+    }
+}
+
+// Four instances per step: bounding sphere first, then the AABB p-vertex test
+// (the box is outside a plane when n.c + d < -(|n.x| * e.x + |n.y| * e.y + |n.z| * e.z)).
+// Every view is tested while the instance bounds are in registers, so N views cost
+// one pass over the instance data. laneMasks[lane] gets bit v when that lane is inside
+// view v; lanes outside validMask are skipped. viewStats[v] counts the tests of view v.
+static inline void CullInstanceLanes(const CullPlaneSet* planeSets, UINT viewCount, __m128 cx, __m128 cy, __m128 cz,
+    __m128 ex, __m128 ey, __m128 ez, __m128 radius, int validMask, UINT laneMasks[4], CullViewStats* viewStats)
+{
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    __m128 negRadius = _mm_xor_ps(radius, signMask);
+
+    for (UINT v = 0; v < viewCount; ++v)
+    {
+        const CullPlaneSet& ps = planeSets[v];
+
+        __m128 dist[6];
+        __m128 sphereOutside = _mm_setzero_ps();
+        for (int p = 0; p < 6; ++p)
+        {
+            dist[p] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_load1_ps(&ps.x[p]), cx), _mm_mul_ps(_mm_load1_ps(&ps.y[p]), cy)),
+                _mm_add_ps(_mm_mul_ps(_mm_load1_ps(&ps.z[p]), cz), _mm_load1_ps(&ps.w[p])));
+            sphereOutside = _mm_or_ps(sphereOutside, _mm_cmplt_ps(dist[p], negRadius));
+        }
+
+        int sphereMask = ~_mm_movemask_ps(sphereOutside) & validMask;
+        if (sphereMask == 0)
+            continue;
+
+        __m128 boxOutside = _mm_setzero_ps();
+        for (int p = 0; p < 6; ++p)
+        {
+            __m128 reach = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_load1_ps(&ps.absX[p]), ex), _mm_mul_ps(_mm_load1_ps(&ps.absY[p]), ey)),
+                _mm_mul_ps(_mm_load1_ps(&ps.absZ[p]), ez));
+            boxOutside = _mm_or_ps(boxOutside, _mm_cmplt_ps(dist[p], _mm_xor_ps(reach, signMask)));
+        }
+
+        int boxMask = sphereMask & ~_mm_movemask_ps(boxOutside);
+        for (UINT lane = 0; lane < 4; ++lane)
+        {
+            if (!(sphereMask & (1 << lane)))
+                continue;
+
+            ++viewStats[v].sphereAccepted;
+            if (boxMask & (1 << lane))
+                laneMasks[lane] |= 1u << v;
+            else
+                ++viewStats[v].boxRejected;
+        }
+    }
+}
+
+// The ids range [begin, end) through CullInstanceLanes. viewMasks[i] (when given) gets
+// the view bits of instance i; the instances seen by at least one view go to visibleAny,
+// which has room for end - begin ids. Returns how many ids were written.
+static UINT CullInstanceRange(const CullPlaneSet* planeSets, UINT viewCount, const InstanceBounds& bounds, UINT begin, UINT end,
+    UINT* viewMasks, UINT* visibleAny, CullViewStats* viewStats)
+{
+    UINT visibleCount = 0;
+
+    for (UINT base = begin; base < end; base += 4)
+    {
+        UINT laneCount = (std::min)(end - base, 4u);
+        UINT laneMasks[4] = {};
+        CullInstanceLanes(planeSets, viewCount,
+            _mm_loadu_ps(&bounds.centerX[base]), _mm_loadu_ps(&bounds.centerY[base]), _mm_loadu_ps(&bounds.centerZ[base]),
+            _mm_loadu_ps(&bounds.extentX[base]), _mm_loadu_ps(&bounds.extentY[base]), _mm_loadu_ps(&bounds.extentZ[base]),
+            _mm_loadu_ps(&bounds.radius[base]), (1 << laneCount) - 1, laneMasks, viewStats);
+
+        for (UINT lane = 0; lane < laneCount; ++lane)
+        {
+            if (laneMasks[lane] == 0)
+                continue;
+            if (viewMasks)
+                viewMasks[base + lane] = laneMasks[lane];
+            visibleAny[visibleCount++] = base + lane;
+        }
+    }
+    return visibleCount;
+}
+
+// viewStats (room for viewCount entries) is overwritten with each view's own counts
+void CullInstanceBoundsMultiView(const CullView* views, UINT viewCount, const InstanceBounds& bounds,
+    std::vector<UINT>& viewMasks, std::vector<UINT>& visibleAny, CullViewStats* viewStats)
+{
+    assert(viewCount > 0 && viewCount <= MAX_CULL_VIEWS);
+
+    CullPlaneSet planeSets[MAX_CULL_VIEWS];
+    PrepareCullPlaneSets(views, viewCount, planeSets);
+
+    viewMasks.assign(bounds.count, 0u);
+    std::fill(viewStats, viewStats + viewCount, CullViewStats());
+    size_t first = visibleAny.size();
+    visibleAny.resize(first + bounds.count);
+    UINT visibleCount = CullInstanceRange(planeSets, viewCount, bounds, 0, bounds.count, viewMasks.data(), visibleAny.data() + first, viewStats);
+    visibleAny.resize(first + visibleCount);
+}
+
+// One view needs no per-instance masks, so this goes straight to the range kernel and
+// allocates nothing once visible has grown to the instance count
+void CullInstanceBounds(const Plane planes[6], const InstanceBounds& bounds, std::vector<UINT>& visible)
+{
+    CullView view;
+    std::copy(planes, planes + 6, view.planes);
+    CullPlaneSet planeSet;
+    PrepareCullPlaneSets(&view, 1, &planeSet);
+
+    CullViewStats stats;
+    size_t first = visible.size();
+    visible.resize(first + bounds.count);
+    UINT visibleCount = CullInstanceRange(&planeSet, 1, bounds, 0, bounds.count, nullptr, visible.data() + first, &stats);
+    visible.resize(first + visibleCount);
+    g_CullingStats.sphereAccepted = stats.sphereAccepted;
+    g_CullingStats.boxRejected = stats.boxRejected;
+}
+
+// Six 90 degree views around a point, in the usual +X, -X, +Y, -Y, +Z, -Z face order
+void BuildCubemapCullViews(const XMFLOAT3& position, float nearZ, float farZ, CullView views[6])
+{
+    const XMFLOAT3 forward[6] = { { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 } };
+    const XMFLOAT3 up[6] = { { 0, 1, 0 }, { 0, 1, 0 }, { 0, 0, -1 }, { 0, 0, 1 }, { 0, 1, 0 }, { 0, 1, 0 } };
+
+    XMVECTOR eye = XMVectorSet(position.x, position.y, position.z, 1.0f);
+    XMMATRIX proj = XMMatrixPerspectiveFovLH(XM_PIDIV2, 1.0f, nearZ, farZ);
+    for (int face = 0; face < 6; ++face)
+    {
+        XMMATRIX view = XMMatrixLookToLH(eye,
+            XMVectorSet(forward[face].x, forward[face].y, forward[face].z, 0.0f),
+            XMVectorSet(up[face].x, up[face].y, up[face].z, 0.0f));
+        ExtractFrustumPlanes(views[face].planes, XMMatrixMultiply(view, proj));
+    }
+}
+
+// The instances a cubemap rendered at `position` needs, all six faces in one pass over the
+// bounds: faceMasks[i] gets bit f when instance i is inside face f
+void CullCubemapInstances(const XMFLOAT3& position, float nearZ, float farZ, const InstanceBounds& bounds,
+    std::vector<UINT>& faceMasks, std::vector<UINT>& visibleAny, CullViewStats faceStats[6])
+{
+    CullView views[6];
+    BuildCubemapCullViews(position, nearZ, farZ, views);
+    CullInstanceBoundsMultiView(views, 6, bounds, faceMasks, visibleAny, faceStats);
+}
+
+// Instance pages
+// Consecutive ids are grouped in fixed-size pages. A page's box encloses its instances'
+// bounding spheres, which no rotation can leave, so it only changes when instances are
+// added. Pages outside the frustum are skipped without touching their instances, pages
+// fully inside take all of them, and only the pages crossing a plane test instances.
+// Pages are culled in parallel into page-local lists (in the culling thread's frame arena)
+// that are then joined in page order, so the result is the same as one pass over all ids.
+static void ComputePageBounds(const InstanceStore& store, UINT pageIndex, InstancePage& page)
+{
+    page.begin = pageIndex * INSTANCE_PAGE_SIZE;
+    page.end = (std::min)(page.begin + INSTANCE_PAGE_SIZE, store.count);
+    page.boundsMin = XMFLOAT3(FLT_MAX, FLT_MAX, FLT_MAX);
+    page.boundsMax = XMFLOAT3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    for (UINT i = page.begin; i < page.end; ++i)
+    {
+        float x = InstanceComponent<float>(store, i, COMPONENT_POSITION_X);
+        float y = InstanceComponent<float>(store, i, COMPONENT_POSITION_Y);
+        float z = InstanceComponent<float>(store, i, COMPONENT_POSITION_Z);
+        float r = CUBE_RADIUS_PER_SCALE * InstanceComponent<float>(store, i, COMPONENT_SCALE);
+        page.boundsMin = XMFLOAT3((std::min)(page.boundsMin.x, x - r), (std::min)(page.boundsMin.y, y - r), (std::min)(page.boundsMin.z, z - r));
+        page.boundsMax = XMFLOAT3((std::max)(page.boundsMax.x, x + r), (std::max)(page.boundsMax.y, y + r), (std::max)(page.boundsMax.z, z + r));
+    }
+}
+
+void UpdateInstancePages(const InstanceStore& store, const DirtyRanges& changed, std::vector<InstancePage>& pages)
+{
+    pages.resize(DivUp(store.count, INSTANCE_PAGE_SIZE));
+    for (const DirtyRange& range : changed.GetRanges())
+    {
+        if (range.begin >= store.count)
+            continue;
+        UINT lastPage = (std::min)((range.end - 1) / INSTANCE_PAGE_SIZE, (UINT)pages.size() - 1);
+        for (UINT p = range.begin / INSTANCE_PAGE_SIZE; p <= lastPage; ++p)
+            ComputePageBounds(store, p, pages[p]);
+    }
+
+    // Removals shrink the last page without marking it
+    if (!pages.empty() && pages.back().end != store.count)
+        ComputePageBounds(store, (UINT)pages.size() - 1, pages.back());
+}
+
+static PageCoverage ClassifyPage(const Plane planes[6], const InstancePage& page)
+{
+    XMFLOAT3 c(0.5f * (page.boundsMin.x + page.boundsMax.x), 0.5f * (page.boundsMin.y + page.boundsMax.y), 0.5f * (page.boundsMin.z + page.boundsMax.z));
+    XMFLOAT3 e(0.5f * (page.boundsMax.x - page.boundsMin.x), 0.5f * (page.boundsMax.y - page.boundsMin.y), 0.5f * (page.boundsMax.z - page.boundsMin.z));
+
+    PageCoverage coverage = PageCoverage::Inside;
+    for (int p = 0; p < 6; ++p)
+    {
+        const XMFLOAT4& n = planes[p].p;
+        float dist = n.x * c.x + n.y * c.y + n.z * c.z + n.w;
+        float reach = fabsf(n.x) * e.x + fabsf(n.y) * e.y + fabsf(n.z) * e.z;
+        if (dist < -reach)
+            return PageCoverage::Outside;
+        if (dist < reach)
+            coverage = PageCoverage::Partial;
+    }
+    return coverage;
+}
+
+void CullInstancePages(const Plane planes[6], const InstanceBounds& bounds, std::vector<InstancePage>& pages, FrameVector<UINT>& visible)
+{
+    CullView view;
+    std::copy(planes, planes + 6, view.planes);
+    CullPlaneSet planeSet;
+    PrepareCullPlaneSets(&view, 1, &planeSet);
+
+    g_JobSystem.ParallelFor((UINT)pages.size(), 1, [&](UINT pageBegin, UINT pageEnd)
+        {
+            for (UINT p = pageBegin; p < pageEnd; ++p)
+            {
+                InstancePage& page = pages[p];
+                page.visibleCount = 0;
+                page.stats = CullViewStats();
+                page.coverage = ClassifyPage(planes, page);
+                if (page.coverage == PageCoverage::Outside)
+                    continue;
+
+                page.visible = static_cast<UINT*>(g_FrameArenas.Get().Allocate((page.end - page.begin) * sizeof(UINT)));
+                if (page.coverage == PageCoverage::Inside)
+                {
+                    for (UINT i = page.begin; i < page.end; ++i)
+                        page.visible[page.visibleCount++] = i;
+                }
+                else
+                {
+                    page.visibleCount = CullInstanceRange(&planeSet, 1, bounds, page.begin, page.end, nullptr, page.visible, &page.stats);
+                }
+            }
+        });
+
+    size_t total = 0;
+    UINT pagesVisible = 0;
+    g_CullingStats.sphereAccepted = 0;
+    g_CullingStats.boxRejected = 0;
+    for (const InstancePage& page : pages)
+    {
+        total += page.visibleCount;
+        pagesVisible += page.coverage != PageCoverage::Outside ? 1 : 0;
+        g_CullingStats.sphereAccepted += page.stats.sphereAccepted;
+        g_CullingStats.boxRejected += page.stats.boxRejected;
+    }
+
+    visible.resize(total);
+    size_t cursor = 0;
+    for (const InstancePage& page : pages)
+    {
+        std::copy(page.visible, page.visible + page.visibleCount, visible.begin() + cursor);
+        cursor += page.visibleCount;
+    }
+
+    g_CullingStats.pagesVisible = pagesVisible;
+    g_CullingStats.pageCount = (UINT)pages.size();
+}
+
+// Transform math
+// Uniform-scale TRS and general affine transforms in the row-vector convention used
+// everywhere else (v' = v * M, so "first then second" is first * second).
+// Inverses and inverse-transposes are closed form. A TRS inverse is (1 / s, conj(q),
+// -t * R^T / s), and its normal matrix is just R / s. For a 3x3 with rows a, b, c the
+// inverse-transpose has rows (b x c, c x a, a x b) / det.
+struct Trs
+{
+    XMFLOAT3 translation;
+    float scale;
+    XMFLOAT4 rotation;  // unit quaternion
+};
+
+struct Affine
+{
+    XMFLOAT3 rows[3];  // linear part
+    XMFLOAT3 translation;
+};
+
+static XMFLOAT3 Cross3(const XMFLOAT3& a, const XMFLOAT3& b)
+{
+    return XMFLOAT3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+}
+
+static float Dot3(const XMFLOAT3& a, const XMFLOAT3& b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+// v * rows
+static XMFLOAT3 MulRows3(const XMFLOAT3& v, const XMFLOAT3 rows[3])
+{
+    return XMFLOAT3(
+        v.x * rows[0].x + v.y * rows[1].x + v.z * rows[2].x,
+        v.x * rows[0].y + v.y * rows[1].y + v.z * rows[2].y,
+        v.x * rows[0].z + v.y * rows[1].z + v.z * rows[2].z);
+}
+
+// Same matrix as XMMatrixRotationQuaternion
+static void QuaternionToRows(const XMFLOAT4& q, XMFLOAT3 rows[3])
+{
+    float xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+    float xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+    float xw = q.x * q.w, yw = q.y * q.w, zw = q.z * q.w;
+
+    rows[0] = XMFLOAT3(1.0f - 2.0f * (yy + zz), 2.0f * (xy + zw), 2.0f * (xz - yw));
+    rows[1] = XMFLOAT3(2.0f * (xy - zw), 1.0f - 2.0f * (xx + zz), 2.0f * (yz + xw));
+    rows[2] = XMFLOAT3(2.0f * (xz + yw), 2.0f * (yz - xw), 1.0f - 2.0f * (xx + yy));
+}
+
+static XMMATRIX RowsToMatrix(const XMFLOAT3 rows[3], const XMFLOAT3& translation)
+{
+    return XMMATRIX(
+        rows[0].x, rows[0].y, rows[0].z, 0.0f,
+        rows[1].x, rows[1].y, rows[1].z, 0.0f,
+        rows[2].x, rows[2].y, rows[2].z, 0.0f,
+        translation.x, translation.y, translation.z, 1.0f);
+}
+
+Trs MakeTrs(float scale, const XMFLOAT4& rotation, const XMFLOAT3& translation)
+{
+    Trs t;
+    t.translation = translation;
+    t.scale = scale;
+    t.rotation = rotation;
+    return t;
+}
+
+Trs ComposeTrs(const Trs& first, const Trs& second)
+{
+    // Rotating by q1 and then q2 is the Hamilton product q2 * q1
+    const XMFLOAT4& a = second.rotation;
+    const XMFLOAT4& b = first.rotation;
+    XMFLOAT4 q(
+        a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y,
+        a.w * b.y - a.x * b.z + a.y * b.w + a.z * b.x,
+        a.w * b.z + a.x * b.y - a.y * b.x + a.z * b.w,
+        a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z);
+
+    XMFLOAT3 rows[3];
+    QuaternionToRows(second.rotation, rows);
+    XMFLOAT3 t = MulRows3(first.translation, rows);
+
+    return MakeTrs(first.scale * second.scale, q,
+        XMFLOAT3(t.x * second.scale + second.translation.x,
+            t.y * second.scale + second.translation.y,
+            t.z * second.scale + second.translation.z));
+}
+
+Trs InverseTrs(const Trs& t)
+{
+    float invScale = 1.0f / t.scale;
+    XMFLOAT4 conj(-t.rotation.x, -t.rotation.y, -t.rotation.z, t.rotation.w);
+
+    XMFLOAT3 rows[3];
+    QuaternionToRows(conj, rows);
+    XMFLOAT3 p = MulRows3(t.translation, rows);
+
+    return MakeTrs(invScale, conj, XMFLOAT3(-p.x * invScale, -p.y * invScale, -p.z * invScale));
+}
+
+XMMATRIX TrsToMatrix(const Trs& t)
+{
+    XMFLOAT3 rows[3];
+    QuaternionToRows(t.rotation, rows);
+    for (int i = 0; i < 3; ++i)
+        rows[i] = XMFLOAT3(rows[i].x * t.scale, rows[i].y * t.scale, rows[i].z * t.scale);
+    return RowsToMatrix(rows, t.translation);
+}
+
+// Inverse-transpose of the model matrix for transforming normals (translation dropped)
+XMMATRIX TrsNormalMatrix(const Trs& t)
+{
+    XMFLOAT3 rows[3];
+    QuaternionToRows(t.rotation, rows);
+    float invScale = 1.0f / t.scale;
+    for (int i = 0; i < 3; ++i)
+        rows[i] = XMFLOAT3(rows[i].x * invScale, rows[i].y * invScale, rows[i].z * invScale);
+    return RowsToMatrix(rows, XMFLOAT3(0.0f, 0.0f, 0.0f));
+}
+
+Affine AffineFromTrs(const Trs& t)
+{
+    Affine a;
+    QuaternionToRows(t.rotation, a.rows);
+    for (int i = 0; i < 3; ++i)
+        a.rows[i] = XMFLOAT3(a.rows[i].x * t.scale, a.rows[i].y * t.scale, a.rows[i].z * t.scale);
+    a.translation = t.translation;
+    return a;
+}
+
+Affine ComposeAffine(const Affine& first, const Affine& second)
+{
+    Affine a;
+    for (int i = 0; i < 3; ++i)
+        a.rows[i] = MulRows3(first.rows[i], second.rows);
+    XMFLOAT3 t = MulRows3(first.translation, second.rows);
+    a.translation = XMFLOAT3(t.x + second.translation.x, t.y + second.translation.y, t.z + second.translation.z);
+    return a;
+}
+
+// Rows of the inverse-transpose of the linear part; false when it is singular
+static bool InverseTransposeRows(const XMFLOAT3 rows[3], XMFLOAT3 out[3])
+{
+    XMFLOAT3 c0 = Cross3(rows[1], rows[2]);
+    float det = Dot3(rows[0], c0);
+    if (fabsf(det) < 1e-12f)
+        return false;
+
+    float invDet = 1.0f / det;
+    XMFLOAT3 c1 = Cross3(rows[2], rows[0]);
+    XMFLOAT3 c2 = Cross3(rows[0], rows[1]);
+    out[0] = XMFLOAT3(c0.x * invDet, c0.y * invDet, c0.z * invDet);
+    out[1] = XMFLOAT3(c1.x * invDet, c1.y * invDet, c1.z * invDet);
+    out[2] = XMFLOAT3(c2.x * invDet, c2.y * invDet, c2.z * invDet);
+    return true;
+}
+
+bool InverseAffine(const Affine& a, Affine& out)
+{
+    XMFLOAT3 it[3];
+    if (!InverseTransposeRows(a.rows, it))
+        return false;
+
+    // The inverse is the transpose of the inverse-transpose
+    out.rows[0] = XMFLOAT3(it[0].x, it[1].x, it[2].x);
+    out.rows[1] = XMFLOAT3(it[0].y, it[1].y, it[2].y);
+    out.rows[2] = XMFLOAT3(it[0].z, it[1].z, it[2].z);
+    XMFLOAT3 t = MulRows3(a.translation, out.rows);
+    out.translation = XMFLOAT3(-t.x, -t.y, -t.z);
+    return true;
+}
+
+XMMATRIX AffineToMatrix(const Affine& a)
+{
+    return RowsToMatrix(a.rows, a.translation);
+}
+
+bool AffineNormalMatrix(const Affine& a, XMMATRIX& out)
+{
+    XMFLOAT3 it[3];
+    if (!InverseTransposeRows(a.rows, it))
+        return false;
+    out = RowsToMatrix(it, XMFLOAT3(0.0f, 0.0f, 0.0f));
+    return true;
+}
+
+// SIMD width traits so that the batched code is written once for SSE and AVX2
+static bool CpuSupportsAvx2()
+{
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)  // OS must save the YMM registers
+        return false;
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+}
+
+static const bool g_HasAvx2 = CpuSupportsAvx2();
+
+struct SimdSSE
+{
+    typedef __m128 Float;
+    typedef __m128i Int;
+    static const UINT Width = 4;
+
+    static Float Set(float v) { return _mm_set1_ps(v); }
+    static Float Load(const float* p) { return _mm_loadu_ps(p); }
+    static void Store(float* p, Float v) { _mm_storeu_ps(p, v); }
+    static Float Add(Float a, Float b) { return _mm_add_ps(a, b); }
+    static Float Sub(Float a, Float b) { return _mm_sub_ps(a, b); }
+    static Float Mul(Float a, Float b) { return _mm_mul_ps(a, b); }
+    static Float Div(Float a, Float b) { return _mm_div_ps(a, b); }
+    static Float Abs(Float a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+    static Float Gather(const float* base, const int* indices) { return _mm_setr_ps(base[indices[0]], base[indices[1]], base[indices[2]], base[indices[3]]); }
+    static Float Min(Float a, Float b) { return _mm_min_ps(a, b); }
+    static Float Max(Float a, Float b) { return _mm_max_ps(a, b); }
+    static Float RsqrtEstimate(Float a) { return _mm_rsqrt_ps(a); }  // relative error below 1.5 * 2^-12
+    static Float Less(Float a, Float b) { return _mm_cmplt_ps(a, b); }
+    static Float And(Float a, Float b) { return _mm_and_ps(a, b); }
+    static Float Xor(Float a, Float b) { return _mm_xor_ps(a, b); }
+    static Float Select(Float mask, Float a, Float b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+    static Int SetInt(int v) { return _mm_set1_epi32(v); }
+    static Int ToInt(Float a) { return _mm_cvtps_epi32(a); }  // round to nearest even
+    static Float ToFloat(Int a) { return _mm_cvtepi32_ps(a); }
+    static Int AsInt(Float a) { return _mm_castps_si128(a); }
+    static Float AsFloat(Int a) { return _mm_castsi128_ps(a); }
+    static Int AddInt(Int a, Int b) { return _mm_add_epi32(a, b); }
+    static Int SubInt(Int a, Int b) { return _mm_sub_epi32(a, b); }
+    static Int AndInt(Int a, Int b) { return _mm_and_si128(a, b); }
+    static Int OrInt(Int a, Int b) { return _mm_or_si128(a, b); }
+    static Int EqualInt(Int a, Int b) { return _mm_cmpeq_epi32(a, b); }
+    static Int ShiftLeft(Int a, int n) { return _mm_sll_epi32(a, _mm_cvtsi32_si128(n)); }
+    static Int ShiftRight(Int a, int n) { return _mm_srl_epi32(a, _mm_cvtsi32_si128(n)); }
+
+    // round(lo * 32767) in the low 16 bits, round(hi * 32767) in the high 16 bits
+    static Float PackSnorm16x2(Float lo, Float hi)
+    {
+        const __m128 range = _mm_set1_ps(32767.0f);
+        __m128i l = _mm_and_si128(_mm_cvtps_epi32(_mm_mul_ps(lo, range)), _mm_set1_epi32(0xFFFF));
+        __m128i h = _mm_slli_epi32(_mm_cvtps_epi32(_mm_mul_ps(hi, range)), 16);
+        return _mm_castsi128_ps(_mm_or_si128(l, h));
+    }
+};
+
+struct SimdAVX2
+{
+    typedef __m256 Float;
+    typedef __m256i Int;
+    static const UINT Width = 8;
+
+    static Float Set(float v) { return _mm256_set1_ps(v); }
+    static Float Load(const float* p) { return _mm256_loadu_ps(p); }
+    static void Store(float* p, Float v) { _mm256_storeu_ps(p, v); }
+    static Float Add(Float a, Float b) { return _mm256_add_ps(a, b); }
+    static Float Sub(Float a, Float b) { return _mm256_sub_ps(a, b); }
+    static Float Mul(Float a, Float b) { return _mm256_mul_ps(a, b); }
+    static Float Div(Float a, Float b) { return _mm256_div_ps(a, b); }
+    static Float Abs(Float a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+    static Float Gather(const float* base, const int* indices) { return _mm256_i32gather_ps(base, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(indices)), 4); }
+    static Float Min(Float a, Float b) { return _mm256_min_ps(a, b); }
+    static Float Max(Float a, Float b) { return _mm256_max_ps(a, b); }
+    static Float RsqrtEstimate(Float a) { return _mm256_rsqrt_ps(a); }
+    static Float Less(Float a, Float b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    static Float And(Float a, Float b) { return _mm256_and_ps(a, b); }
+    static Float Xor(Float a, Float b) { return _mm256_xor_ps(a, b); }
+    static Float Select(Float mask, Float a, Float b) { return _mm256_blendv_ps(b, a, mask); }
+    static Int SetInt(int v) { return _mm256_set1_epi32(v); }
+    static Int ToInt(Float a) { return _mm256_cvtps_epi32(a); }
+    static Float ToFloat(Int a) { return _mm256_cvtepi32_ps(a); }
+    static Int AsInt(Float a) { return _mm256_castps_si256(a); }
+    static Float AsFloat(Int a) { return _mm256_castsi256_ps(a); }
+    static Int AddInt(Int a, Int b) { return _mm256_add_epi32(a, b); }
+    static Int SubInt(Int a, Int b) { return _mm256_sub_epi32(a, b); }
+    static Int AndInt(Int a, Int b) { return _mm256_and_si256(a, b); }
+    static Int OrInt(Int a, Int b) { return _mm256_or_si256(a, b); }
+    static Int EqualInt(Int a, Int b) { return _mm256_cmpeq_epi32(a, b); }
+    static Int ShiftLeft(Int a, int n) { return _mm256_sll_epi32(a, _mm_cvtsi32_si128(n)); }
+    static Int ShiftRight(Int a, int n) { return _mm256_srl_epi32(a, _mm_cvtsi32_si128(n)); }
+
+    static Float PackSnorm16x2(Float lo, Float hi)
+    {
+        const __m256 range = _mm256_set1_ps(32767.0f);
+        __m256i l = _mm256_and_si256(_mm256_cvtps_epi32(_mm256_mul_ps(lo, range)), _mm256_set1_epi32(0xFFFF));
+        __m256i h = _mm256_slli_epi32(_mm256_cvtps_epi32(_mm256_mul_ps(hi, range)), 16);
+        return _mm256_castsi256_ps(_mm256_or_si256(l, h));
+    }
+};
+
+// SIMD math
+// Transcendentals on whole registers, written once against the width traits: Cody-Waite
+// range reduction and the single-precision minimax polynomials from Cephes. Error bounds,
+// checked by ValidateSimdMath against double-precision libm:
+//  - SimdSinCos: absolute error <= 1.5e-7 for |x| <= 8192; beyond that the reduction is
+//    no longer exact and the error grows to about 1e-6 at 65536
+//  - SimdExp: relative error <= 1.5e-7 for x in [-87, 88]; larger x saturates to about
+//    2^128, smaller to about 2^-126
+//  - SimdLog: absolute error <= 1e-7 when |ln x| < 1, relative error <= 1.5e-7 otherwise,
+//    for normal x > 0
+//  - SimdPow: relative error <= 2e-7 * (1 + |y ln x|) for x > 0 and results within the exp
+//    range; x = 0 gives a tiny positive value and negative x is not supported
+//  - SimdRsqrt: relative error <= 4e-7 for normal x > 0 (hardware estimate plus one
+//    Newton-Raphson step)
+static const float SIMD_SINCOS_MAX_ERROR = 1.5e-7f;
+static const float SIMD_EXP_MAX_ERROR = 1.5e-7f;
+static const float SIMD_LOG_MAX_ERROR = 1.5e-7f;
+static const float SIMD_POW_MAX_ERROR = 2e-7f;
+static const float SIMD_RSQRT_MAX_ERROR = 4e-7f;
+
+template <class S>
+static void SimdSinCos(typename S::Float x, typename S::Float& sine, typename S::Float& cosine)
+{
+    typedef typename S::Float F;
+    typedef typename S::Int I;
+
+    // x = q * pi / 2 + r with r in [-pi / 4, pi / 4]. pi / 2 is split in three so that
+    // q times each of the first two parts is exact while |q| < 2^13.
+    I q = S::ToInt(S::Mul(x, S::Set(0.636619772f)));
+    F qf = S::ToFloat(q);
+    F r = S::Sub(x, S::Mul(qf, S::Set(1.5703125f)));
+    r = S::Sub(r, S::Mul(qf, S::Set(4.837512969970703125e-4f)));
+    r = S::Sub(r, S::Mul(qf, S::Set(7.54978995489188216e-8f)));
+    F z = S::Mul(r, r);
+
+    F sinR = S::Add(S::Mul(z, S::Set(-1.9515295891e-4f)), S::Set(8.3321608736e-3f));
+    sinR = S::Add(S::Mul(z, sinR), S::Set(-1.6666654611e-1f));
+    sinR = S::Add(r, S::Mul(S::Mul(r, z), sinR));
+    F cosR = S::Add(S::Mul(z, S::Set(2.443315711809948e-5f)), S::Set(-1.388731625493765e-3f));
+    cosR = S::Add(S::Mul(z, cosR), S::Set(4.166664568298827e-2f));
+    cosR = S::Add(S::Sub(S::Set(1.0f), S::Mul(S::Set(0.5f), z)), S::Mul(S::Mul(z, z), cosR));
+
+    // Odd quadrants swap the two; bit 1 of q negates the sine, bit 1 of q + 1 the cosine
+    const I one = S::SetInt(1);
+    const I two = S::SetInt(2);
+    F swap = S::AsFloat(S::EqualInt(S::AndInt(q, one), one));
+    sine = S::Xor(S::Select(swap, cosR, sinR), S::AsFloat(S::ShiftLeft(S::AndInt(q, two), 30)));
+    cosine = S::Xor(S::Select(swap, sinR, cosR), S::AsFloat(S::ShiftLeft(S::AndInt(S::AddInt(q, one), two), 30)));
+}
+
+template <class S>
+static typename S::Float SimdExp(typename S::Float x)
+{
+    typedef typename S::Float F;
+    typedef typename S::Int I;
+
+    // x = n * ln 2 + r, exp(x) = 2^n * exp(r), with n clamped to the normal exponents
+    x = S::Min(S::Max(x, S::Set(-87.33654f)), S::Set(88.72283f));
+    F n = S::Min(S::ToFloat(S::ToInt(S::Mul(x, S::Set(1.44269504088896341f)))), S::Set(127.0f));
+    F r = S::Sub(x, S::Mul(n, S::Set(0.693359375f)));
+    r = S::Sub(r, S::Mul(n, S::Set(-2.12194440e-4f)));
+
+    F p = S::Add(S::Mul(r, S::Set(1.9875691500e-4f)), S::Set(1.3981999507e-3f));
+    p = S::Add(S::Mul(r, p), S::Set(8.3334519073e-3f));
+    p = S::Add(S::Mul(r, p), S::Set(4.1665795894e-2f));
+    p = S::Add(S::Mul(r, p), S::Set(1.6666665459e-1f));
+    p = S::Add(S::Mul(r, p), S::Set(5.0000001201e-1f));
+    p = S::Add(S::Add(S::Mul(S::Mul(r, r), p), r), S::Set(1.0f));
+
+    I exponent = S::ShiftLeft(S::AddInt(S::ToInt(n), S::SetInt(127)), 23);
+    return S::Mul(p, S::AsFloat(exponent));
+}
+
+template <class S>
+static typename S::Float SimdLog(typename S::Float x)
+{
+    typedef typename S::Float F;
+    typedef typename S::Int I;
+    const F one = S::Set(1.0f);
+
+    // x = 2^e * m with m in [sqrt(1/2), sqrt(2)), log(x) = e * ln 2 + log(m)
+    I bits = S::AsInt(x);
+    F e = S::ToFloat(S::SubInt(S::ShiftRight(bits, 23), S::SetInt(126)));
+    F m = S::AsFloat(S::OrInt(S::AndInt(bits, S::SetInt(0x007FFFFF)), S::SetInt(0x3F000000)));
+    F small = S::Less(m, S::Set(0.707106781186547524f));
+    e = S::Sub(e, S::And(small, one));
+    m = S::Add(S::Sub(m, one), S::And(small, m));
+    F z = S::Mul(m, m);
+
+    F y = S::Add(S::Mul(m, S::Set(7.0376836292e-2f)), S::Set(-1.1514610310e-1f));
+    y = S::Add(S::Mul(m, y), S::Set(1.1676998740e-1f));
+    y = S::Add(S::Mul(m, y), S::Set(-1.2420140846e-1f));
+    y = S::Add(S::Mul(m, y), S::Set(1.4249322787e-1f));
+    y = S::Add(S::Mul(m, y), S::Set(-1.6668057665e-1f));
+    y = S::Add(S::Mul(m, y), S::Set(2.0000714765e-1f));
+    y = S::Add(S::Mul(m, y), S::Set(-2.4999993993e-1f));
+    y = S::Add(S::Mul(m, y), S::Set(3.3333331174e-1f));
+    y = S::Mul(S::Mul(y, m), z);
+
+    y = S::Add(y, S::Mul(e, S::Set(-2.12194440e-4f)));
+    y = S::Sub(y, S::Mul(S::Set(0.5f), z));
+    return S::Add(S::Add(m, y), S::Mul(e, S::Set(0.693359375f)));
+}
+
+template <class S>
+static typename S::Float SimdPow(typename S::Float x, typename S::Float y)
+{
+    return SimdExp<S>(S::Mul(y, SimdLog<S>(x)));
+}
+
+template <class S>
+static typename S::Float SimdRsqrt(typename S::Float x)
+{
+    typedef typename S::Float F;
+    F r = S::RsqrtEstimate(x);
+    F xrr = S::Mul(S::Mul(x, r), r);
+    return S::Mul(S::Mul(S::Set(0.5f), r), S::Sub(S::Set(3.0f), xrr));
+}
+
+// Fills the lights of the scene constant buffer; the orbits and bobs of all
+// MAX_SCENE_LIGHTS (4) lights take one SSE sincos each
+void AnimateSceneLights(const std::vector<SceneLight>& lights, float angle, SceneBuffer& scene)
+{
+    UINT count = (UINT)(std::min)(lights.size(), (size_t)MAX_SCENE_LIGHTS);
+    alignas(16) float orbit[4] = {}, bob[4] = {};
+    for (UINT l = 0; l < count; ++l)
+    {
+        orbit[l] = angle * lights[l].motion.y;
+        bob[l] = angle * lights[l].motion.w;
+    }
+    __m128 orbitSin, orbitCos, bobSin, bobCos;
+    SimdSinCos<SimdSSE>(_mm_load_ps(orbit), orbitSin, orbitCos);
+    SimdSinCos<SimdSSE>(_mm_load_ps(bob), bobSin, bobCos);
+    alignas(16) float orbitSines[4], orbitCosines[4], bobSines[4];
+    _mm_store_ps(orbitSines, orbitSin);
+    _mm_store_ps(orbitCosines, orbitCos);
+    _mm_store_ps(bobSines, bobSin);
+
+    scene.lightCount = XMINT4((int)count, 0, 0, 0);
+    for (UINT l = 0; l < count; ++l)
+    {
+        const SceneLight& light = lights[l];
+        scene.lights[l].position = XMFLOAT4(
+            light.position.x + light.motion.x * orbitCosines[l],
+            light.position.y + light.motion.z * bobSines[l],
+            light.position.z + light.motion.x * orbitSines[l],
+            1.0f);
+        scene.lights[l].color = light.color;
+    }
+}
+
+// Microbenchmark behind -mathbench: each kernel over a large array at both widths against
+// the scalar path it replaces (XMScalarSinCos for the instance rotations, libm otherwise)
+enum class MathKernel
+{
+    SinCos,
+    Exp,
+    Pow,
+    Rsqrt,
+};
+
+static void RunScalarMathKernel(MathKernel kernel, const float* in, float* out, float* out2, UINT count)
+{
+    for (UINT i = 0; i < count; ++i)
+    {
+        switch (kernel)
+        {
+        case MathKernel::SinCos: XMScalarSinCos(&out[i], &out2[i], in[i]); break;
+        case MathKernel::Exp: out[i] = expf(in[i]); break;
+        case MathKernel::Pow: out[i] = powf(in[i], 2.2f); break;
+        case MathKernel::Rsqrt: out[i] = 1.0f / sqrtf(in[i]); break;
+        }
+    }
+}
+
+template <class S>
+static void RunSimdMathKernel(MathKernel kernel, const float* in, float* out, float* out2, UINT count)
+{
+    typedef typename S::Float F;
+    const F gamma = S::Set(2.2f);
+    for (UINT i = 0; i < count; i += S::Width)
+    {
+        F x = S::Load(in + i);
+        switch (kernel)
+        {
+        case MathKernel::SinCos:
+        {
+            F s, c;
+            SimdSinCos<S>(x, s, c);
+            S::Store(out + i, s);
+            S::Store(out2 + i, c);
+            break;
+        }
+        case MathKernel::Exp: S::Store(out + i, SimdExp<S>(x)); break;
+        case MathKernel::Pow: S::Store(out + i, SimdPow<S>(x, gamma)); break;
+        case MathKernel::Rsqrt: S::Store(out + i, SimdRsqrt<S>(x)); break;
+        }
+    }
+}
+
+// Nanoseconds per value, best of a few passes
+template <class Fn>
+static double TimeMathKernel(UINT count, Fn fn)
+{
+    double best = DBL_MAX;
+    for (UINT pass = 0; pass < 5; ++pass)
+    {
+        double start = GetTimeMs();
+        fn();
+        best = (std::min)(best, GetTimeMs() - start);
+    }
+    return best * 1e6 / count;
+}
+
+// The per-instance loop instance transforms replaced: scale * rotY * translate, a full
+// inverse for the normal matrix and both transposed into a 160-byte record
+struct BaselineInstanceGPU
+{
+    XMMATRIX model;
+    XMMATRIX normalMatrix;
+    XMFLOAT4 params;
+    XMFLOAT4 posAngle;
+};
+
+static void BuildBaselineInstances(const std::vector<CubeInstanceCPU>& cubes, float angle, BaselineInstanceGPU* out)
+{
+    for (size_t i = 0; i < cubes.size(); ++i)
+    {
+        const CubeInstanceCPU& c = cubes[i];
+        float currentAngle = angle * c.rotSpeed;
+        XMMATRIX model =
+            XMMatrixScaling(c.scale, c.scale, c.scale) *
+            XMMatrixRotationY(currentAngle) *
+            XMMatrixTranslation(c.basePos.x, c.basePos.y, c.basePos.z);
+        XMMATRIX normalM = XMMatrixInverse(nullptr, model);
+
+        BaselineInstanceGPU gpu = {};
+        gpu.model = XMMatrixTranspose(model);
+        gpu.normalMatrix = XMMatrixTranspose(normalM);
+        gpu.params = XMFLOAT4(32.0f, c.rotSpeed, (float)c.textureId, c.hasNormalMap ? 1.0f : 0.0f);
+        gpu.posAngle = XMFLOAT4(c.basePos.x, c.basePos.y, c.basePos.z, currentAngle);
+        out[i] = gpu;
+    }
+}
+
+// Instance transforms at 100k instances on the calling thread, the old loop against
+// BuildVisibleInstances; the target is 5x
+static const UINT TRANSFORM_BENCH_INSTANCES = 100000;
+static const double TRANSFORM_BENCH_TARGET_SPEEDUP = 5.0;
+
+static double RunTransformBenchmark(char* report, size_t reportSize)
+{
+    UINT state = 1;
+    std::vector<CubeInstanceCPU> cubes(TRANSFORM_BENCH_INSTANCES);
+    EntityWorld world;
+    world.Init(SCENE_COMPONENT_SIZES, COMPONENT_TYPE_COUNT);
+    InstanceStore store;
+    InitInstanceStore(store, world);
+    for (CubeInstanceCPU& c : cubes)
+    {
+        state = state * 1664525u + 1013904223u;
+        c.basePos = XMFLOAT3((float)(state >> 20) - 2048.0f, (float)((state >> 8) & 15), (float)((state >> 12) & 4095) - 2048.0f);
+        c.scale = 0.25f + (float)(state & 255) / 128.0f;
+        c.rotSpeed = (float)((state >> 4) & 63) / 16.0f - 2.0f;
+        c.textureId = state & 3;
+        AddInstance(store, c);
+    }
+
+    std::vector<BaselineInstanceGPU> baseline(TRANSFORM_BENCH_INSTANCES);
+    g_FrameArenas.BeginFrame();
+    FrameArena& arena = g_FrameArenas.Get();
+    FrameVector<UINT> visible{ ArenaAllocator<UINT>(arena) };
+    for (UINT i = 0; i < TRANSFORM_BENCH_INSTANCES; ++i)
+        visible.push_back(i);
+    InstanceGPU* records = static_cast<InstanceGPU*>(arena.Allocate(TRANSFORM_BENCH_INSTANCES * sizeof(InstanceGPU)));
+
+    double oldLoop = TimeMathKernel(TRANSFORM_BENCH_INSTANCES, [&]() { BuildBaselineInstances(cubes, 1.0f, baseline.data()); });
+    double kernel = TimeMathKernel(TRANSFORM_BENCH_INSTANCES, [&]() { BuildVisibleInstances(store, visible, 1.0f, records); });
+    double speedup = oldLoop / kernel;
+
+    size_t used = strlen(report);
+    snprintf(report + used, reportSize - used, "transforms, %u instances, 1 thread: old loop %.2f / BuildVisibleInstances %.2f ns  (x%.1f, target x%.1f: %s)\n",
+        TRANSFORM_BENCH_INSTANCES, oldLoop, kernel, speedup, TRANSFORM_BENCH_TARGET_SPEEDUP,
+        speedup >= TRANSFORM_BENCH_TARGET_SPEEDUP ? "met" : "not met");
+    return baseline[TRANSFORM_BENCH_INSTANCES / 3].posAngle.w + records[TRANSFORM_BENCH_INSTANCES / 3].posScale.w;
+}
+
+// The six faces of a cubemap at 100k instances: one CullInstanceBounds pass per face
+// against CullCubemapInstances, which reads the bounds once for all six
+static const UINT CUBEMAP_BENCH_INSTANCES = 100000;
+
+static double RunCubemapCullBenchmark(char* report, size_t reportSize)
+{
+    UINT state = 7;
+    InstanceBounds bounds;
+    ResizeInstanceBounds(bounds, CUBEMAP_BENCH_INSTANCES);
+    for (UINT i = 0; i < CUBEMAP_BENCH_INSTANCES; ++i)
+    {
+        state = state * 1664525u + 1013904223u;
+        float scale = 0.25f + (float)(state & 255) / 128.0f;
+        bounds.centerX[i] = (float)(state >> 20) * 0.1f - 204.8f;
+        bounds.centerY[i] = (float)((state >> 8) & 15);
+        bounds.centerZ[i] = (float)((state >> 12) & 4095) * 0.1f - 204.8f;
+        bounds.extentX[i] = CUBE_SPIN_EXTENT_PER_SCALE * scale;
+        bounds.extentY[i] = 0.5f * scale;
+        bounds.extentZ[i] = CUBE_SPIN_EXTENT_PER_SCALE * scale;
+        bounds.radius[i] = CUBE_RADIUS_PER_SCALE * scale;
+    }
+
+    const XMFLOAT3 probe(0.0f, 4.0f, 0.0f);
+    CullView views[6];
+    BuildCubemapCullViews(probe, 0.1f, 100.0f, views);
+    std::vector<UINT> single, faceMasks, visibleAny;
+    CullViewStats faceStats[6];
+    size_t kept = 0;
+
+    double sixPasses = TimeMathKernel(CUBEMAP_BENCH_INSTANCES, [&]()
+        {
+            for (UINT face = 0; face < 6; ++face)
+            {
+                single.clear();
+                CullInstanceBounds(views[face].planes, bounds, single);
+                kept += single.size();
+            }
+        });
+    double onePass = TimeMathKernel(CUBEMAP_BENCH_INSTANCES, [&]()
+        {
+            visibleAny.clear();
+            CullCubemapInstances(probe, 0.1f, 100.0f, bounds, faceMasks, visibleAny, faceStats);
+            kept += visibleAny.size();
+        });
+
+    size_t used = strlen(report);
+    snprintf(report + used, reportSize - used, "cubemap cull, %u instances: 6x CullInstanceBounds %.2f / CullCubemapInstances %.2f ns  (x%.1f)\n",
+        CUBEMAP_BENCH_INSTANCES, sixPasses, onePass, sixPasses / onePass);
+    return (double)kept;
+}
+
+void RunMathBenchmark()
+{
+    const UINT count = 1u << 20;
+    std::vector<float> input(count), out(count), out2(count);
+    const struct
+    {
+        MathKernel kernel;
+        const char* name;
+        float lo, hi;
+    } kernels[] =
+    {
+        { MathKernel::SinCos, "sincos", -100.0f, 100.0f },
+        { MathKernel::Exp, "exp", -20.0f, 20.0f },
+        { MathKernel::Pow, "pow", 0.001f, 4.0f },
+        { MathKernel::Rsqrt, "rsqrt", 0.001f, 100.0f },
+    };
+
+    char report[1024] = "ns per value: scalar / SSE / AVX2\n";
+    double checksum = 0.0;
+    for (const auto& k : kernels)
+    {
+        for (UINT i = 0; i < count; ++i)
+            input[i] = k.lo + (k.hi - k.lo) * (float)((i * 2654435761u) >> 8) * (1.0f / 16777216.0f);
+
+        double scalar = TimeMathKernel(count, [&]() { RunScalarMathKernel(k.kernel, input.data(), out.data(), out2.data(), count); });
+        checksum += out[count / 3];
+        double sse = TimeMathKernel(count, [&]() { RunSimdMathKernel<SimdSSE>(k.kernel, input.data(), out.data(), out2.data(), count); });
+        checksum += out[count / 3];
+        double avx2 = 0.0;
+        if (g_HasAvx2)
+        {
+            avx2 = TimeMathKernel(count, [&]() { RunSimdMathKernel<SimdAVX2>(k.kernel, input.data(), out.data(), out2.data(), count); });
+            checksum += out[count / 3];
+        }
+
+        size_t used = strlen(report);
+        snprintf(report + used, sizeof(report) - used, "%-7s %6.2f / %5.2f / %5.2f  (x%.1f)\n",
+            k.name, scalar, sse, avx2, scalar / (g_HasAvx2 ? avx2 : sse));
+    }
+
+    checksum += RunTransformBenchmark(report, sizeof(report));
+    checksum += RunCubemapCullBenchmark(report, sizeof(report));
+
+    // One copy: the message box is the only output a window app shows, and the portable
+    // build prints it
+    size_t used = strlen(report);
+    snprintf(report + used, sizeof(report) - used, "checksum %g\n", checksum);
+    MessageBoxA(NULL, report, "SIMD math benchmark", MB_OK);
+}
+
+// S::Width TRS transforms, one lane each
+template <class S>
+struct TrsBatch
+{
+    typename S::Float tx, ty, tz;
+    typename S::Float scale;
+    typename S::Float qx, qy, qz, qw;
+};
+
+// r[i][j] = rotation row i, column j (same matrix as QuaternionToRows)
+template <class S>
+static void TrsBatchRotation(const TrsBatch<S>& t, typename S::Float r[3][3])
+{
+    typedef typename S::Float F;
+    const F one = S::Set(1.0f);
+    const F two = S::Set(2.0f);
+
+    F xx = S::Mul(t.qx, t.qx), yy = S::Mul(t.qy, t.qy), zz = S::Mul(t.qz, t.qz);
+    F xy = S::Mul(t.qx, t.qy), xz = S::Mul(t.qx, t.qz), yz = S::Mul(t.qy, t.qz);
+    F xw = S::Mul(t.qx, t.qw), yw = S::Mul(t.qy, t.qw), zw = S::Mul(t.qz, t.qw);
+
+    r[0][0] = S::Sub(one, S::Mul(two, S::Add(yy, zz)));
+    r[0][1] = S::Mul(two, S::Add(xy, zw));
+    r[0][2] = S::Mul(two, S::Sub(xz, yw));
+    r[1][0] = S::Mul(two, S::Sub(xy, zw));
+    r[1][1] = S::Sub(one, S::Mul(two, S::Add(xx, zz)));
+    r[1][2] = S::Mul(two, S::Add(yz, xw));
+    r[2][0] = S::Mul(two, S::Add(xz, yw));
+    r[2][1] = S::Mul(two, S::Sub(yz, xw));
+    r[2][2] = S::Sub(one, S::Mul(two, S::Add(xx, yy)));
+}
+
+// Columns of the model matrix and of its normal matrix (the rows a shader would receive
+// after the usual transpose). Column j is (M0j, M1j, M2j, tj); the fourth columns are
+// (0, 0, 0, 1) and not produced.
+template <class S>
+static void TrsBatchColumns(const TrsBatch<S>& t, typename S::Float model[3][4], typename S::Float normal[3][4])
+{
+    typedef typename S::Float F;
+    const F one = S::Set(1.0f);
+    const F zero = S::Set(0.0f);
+
+    F r[3][3];
+    TrsBatchRotation<S>(t, r);
+
+    F invScale = S::Div(one, t.scale);
+    F translation[3] = { t.tx, t.ty, t.tz };
+    for (int j = 0; j < 3; ++j)
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            model[j][i] = S::Mul(r[i][j], t.scale);
+            normal[j][i] = S::Mul(r[i][j], invScale);
+        }
+        model[j][3] = translation[j];
+        normal[j][3] = zero;
+    }
+}
+
+// Instance transforms
+// Every instance is a TRS with a rotation about Y. Culling only needs bounds that hold for
+// any rotation (see UpdateInstanceBounds), so transforms are evaluated after culling and
+// only for the instances that survived: the kernel writes one InstanceGPU per visible
+// instance, in visible order, and litVS reads the record of its SV_InstanceID with no
+// indirection. Position, scale and the material params never change and are copied from
+// the instance's static record; the kernel adds the rotation, as a snorm16 quaternion, for
+// 4 (SSE) or 8 (AVX2) instances at once.
+// Records go to the frame packet in the frame arena with ordinary stores. The upload ring
+// is mapped on the main thread's immediate context, which the prepare stage can't touch,
+// so the submit stage copies them there, and it finds them still in cache (non-temporal
+// stores would evict them and send that copy to memory). `out` is 16-byte aligned.
+template <class S>
+static void BuildVisibleInstancesT(const InstanceStore& store, const UINT* slots, UINT count, float angle, InstanceGPU* out)
+{
+    typedef typename S::Float F;
+    const UINT W = S::Width;
+    const EntityArchetype& archetype = *store.archetype;
+    const F zero = S::Set(0.0f);
+    const F halfAngle = S::Set(0.5f * angle);
+
+    for (UINT first = 0; first < count; first += W)
+    {
+        UINT n = (std::min)(W, count - first);
+        const InstanceStaticGPU* records[8];
+        alignas(32) float spin[8] = {};
+        for (UINT lane = 0; lane < n; ++lane)
+        {
+            UINT slot = slots[first + lane];
+            const EntityChunk& chunk = archetype.chunks[slot / archetype.capacity];
+            UINT row = slot - chunk.firstRow;
+            records[lane] = &chunk.Column<InstanceStaticGPU>(COMPONENT_INSTANCE_GPU)[row];
+            spin[lane] = chunk.Column<float>(COMPONENT_SPIN)[row];
+        }
+
+        // Rotation about Y by a is the quaternion (0, sin(a / 2), 0, cos(a / 2))
+        F qy, qw;
+        SimdSinCos<S>(S::Mul(halfAngle, S::Load(spin)), qy, qw);
+        alignas(32) UINT rotationXY[8], rotationZW[8];
+        S::Store(reinterpret_cast<float*>(rotationXY), S::PackSnorm16x2(zero, qy));
+        S::Store(reinterpret_cast<float*>(rotationZW), S::PackSnorm16x2(zero, qw));
+
+        for (UINT lane = 0; lane < n; ++lane)
+        {
+            const InstanceStaticGPU& s = *records[lane];
+            __m128i* dst = reinterpret_cast<__m128i*>(&out[first + lane]);
+            _mm_store_si128(dst, _mm_castps_si128(_mm_loadu_ps(&s.posScale.x)));
+            _mm_store_si128(dst + 1, _mm_setr_epi32((int)rotationXY[lane], (int)rotationZW[lane], (int)s.params[0], (int)s.params[1]));
+        }
+    }
+}
+
+// Whole SIMD groups per job
+static const UINT VISIBLE_INSTANCES_PER_JOB = 2048;
+
+void BuildVisibleInstances(const InstanceStore& store, const FrameVector<UINT>& visible, float angle, InstanceGPU* out)
+{
+    assert(((uintptr_t)out & 15) == 0);
+    g_JobSystem.ParallelFor((UINT)visible.size(), VISIBLE_INSTANCES_PER_JOB, [&](UINT begin, UINT end)
+        {
+            if (g_HasAvx2)
+                BuildVisibleInstancesT<SimdAVX2>(store, visible.data() + begin, end - begin, angle, out + begin);
+            else
+                BuildVisibleInstancesT<SimdSSE>(store, visible.data() + begin, end - begin, angle, out + begin);
+        });
+}
+
+// Transform hierarchy
+// Parent/child TRS transforms (world = local, then the parent's world). Nodes are stored
+// in breadth-first order as structure of arrays, each level starting on a group of 8, so
+// a level only reads worlds finished by the level before it and can be split across jobs.
+// SetLocal marks a node dirty; Update walks the levels in order, passing the changed flag
+// from parents to children, and recomputes only the groups holding a changed node, 4 or 8
+// lanes at a time with the parent worlds gathered by index. Static nodes under static
+// parents cost nothing. Handles stay valid when adding nodes reorders the storage.
+static const TransformHandle TRANSFORM_NO_PARENT = 0xFFFFFFFFu;
+
+template <class S>
+static void ComposeTrsBatch(const TrsBatch<S>& local, const TrsBatch<S>& parent, TrsBatch<S>& world)
+{
+    typedef typename S::Float F;
+
+    F r[3][3];
+    TrsBatchRotation<S>(parent, r);
+    world.tx = S::Add(S::Mul(S::Add(S::Add(S::Mul(local.tx, r[0][0]), S::Mul(local.ty, r[1][0])), S::Mul(local.tz, r[2][0])), parent.scale), parent.tx);
+    world.ty = S::Add(S::Mul(S::Add(S::Add(S::Mul(local.tx, r[0][1]), S::Mul(local.ty, r[1][1])), S::Mul(local.tz, r[2][1])), parent.scale), parent.ty);
+    world.tz = S::Add(S::Mul(S::Add(S::Add(S::Mul(local.tx, r[0][2]), S::Mul(local.ty, r[1][2])), S::Mul(local.tz, r[2][2])), parent.scale), parent.tz);
+    world.scale = S::Mul(local.scale, parent.scale);
+
+    // Hamilton product parent.q * local.q, as in ComposeTrs
+    const TrsBatch<S>& a = parent;
+    const TrsBatch<S>& b = local;
+    world.qx = S::Sub(S::Add(S::Add(S::Mul(a.qw, b.qx), S::Mul(a.qx, b.qw)), S::Mul(a.qy, b.qz)), S::Mul(a.qz, b.qy));
+    world.qy = S::Add(S::Add(S::Sub(S::Mul(a.qw, b.qy), S::Mul(a.qx, b.qz)), S::Mul(a.qy, b.qw)), S::Mul(a.qz, b.qx));
+    world.qz = S::Add(S::Sub(S::Add(S::Mul(a.qw, b.qz), S::Mul(a.qx, b.qy)), S::Mul(a.qy, b.qx)), S::Mul(a.qz, b.qw));
+    world.qw = S::Sub(S::Sub(S::Sub(S::Mul(a.qw, b.qw), S::Mul(a.qx, b.qx)), S::Mul(a.qy, b.qy)), S::Mul(a.qz, b.qz));
+}
+
+class TransformHierarchy
+{
+public:
+    // Parents must be added before their children
+    TransformHandle Add(TransformHandle parent, const Trs& local)
+    {
+        assert(parent == TRANSFORM_NO_PARENT || parent < m_Parents.size());
+        if (!m_OrderStale)
+        {
+            // Locals move back to handle order until the next rebuild
+            m_PendingLocals.resize(m_Parents.size());
+            for (TransformHandle h = 0; h < m_Parents.size(); ++h)
+                m_PendingLocals[h] = m_Local.Get(m_Index[h]);
+            m_OrderStale = true;
+        }
+
+        TransformHandle handle = (TransformHandle)m_Parents.size();
+        m_Parents.push_back(parent);
+        m_Depths.push_back(parent == TRANSFORM_NO_PARENT ? 0 : m_Depths[parent] + 1);
+        m_PendingLocals.push_back(local);
+        m_Index.push_back(0);
+        return handle;
+    }
+
+    void SetLocal(TransformHandle node, const Trs& local)
+    {
+        if (m_OrderStale)
+        {
+            m_PendingLocals[node] = local;
+            return;
+        }
+        UINT i = m_Index[node];
+        m_Local.Set(i, local);
+        m_Dirty[i] = 1;
+    }
+
+    Trs GetLocal(TransformHandle node) const
+    {
+        return m_OrderStale ? m_PendingLocals[node] : m_Local.Get(m_Index[node]);
+    }
+
+    // As of the last Update
+    Trs GetWorld(TransformHandle node) const
+    {
+        assert(!m_OrderStale);
+        return m_World.Get(m_Index[node]);
+    }
+
+    UINT GetCount() const { return (UINT)m_Parents.size(); }
+
+    // Returns the number of nodes whose world was recomputed
+    UINT Update(JobSystem& jobs)
+    {
+        if (m_OrderStale)
+            Rebuild();
+
+        std::atomic<UINT> updated(0);
+        for (size_t level = 0; level + 1 < m_LevelBegin.size(); ++level)
+        {
+            UINT levelBegin = m_LevelBegin[level];
+            UINT levelEnd = m_LevelBegin[level + 1];
+            jobs.ParallelFor((levelEnd - levelBegin) / 8, TRANSFORM_NODE_GROUPS_PER_JOB, [&](UINT groupBegin, UINT groupEnd)
+                {
+                    UINT count = 0;
+                    for (UINT g = groupBegin; g < groupEnd; ++g)
+                    {
+                        UINT first = levelBegin + g * 8;
+                        if (g_HasAvx2)
+                            count += UpdateGroup<SimdAVX2>(first, level == 0);
+                        else
+                            count += UpdateGroup<SimdSSE>(first, level == 0) + UpdateGroup<SimdSSE>(first + 4, level == 0);
+                    }
+                    updated += count;
+                });
+        }
+        return updated;
+    }
+
+private:
+    static const UINT TRANSFORM_NODE_GROUPS_PER_JOB = 64;
+
+    // TRS in structure of arrays
+    struct TrsArrays
+    {
+        std::vector<float> tx, ty, tz, scale, qx, qy, qz, qw;
+
+        void Resize(size_t count)
+        {
+            std::vector<float>* columns[] = { &tx, &ty, &tz, &scale, &qx, &qy, &qz, &qw };
+            for (std::vector<float>* column : columns)
+                column->assign(count, 0.0f);
+        }
+
+        void Set(UINT i, const Trs& t)
+        {
+            tx[i] = t.translation.x; ty[i] = t.translation.y; tz[i] = t.translation.z;
+            scale[i] = t.scale;
+            qx[i] = t.rotation.x; qy[i] = t.rotation.y; qz[i] = t.rotation.z; qw[i] = t.rotation.w;
+        }
+
+        Trs Get(UINT i) const
+        {
+            return MakeTrs(scale[i], XMFLOAT4(qx[i], qy[i], qz[i], qw[i]), XMFLOAT3(tx[i], ty[i], tz[i]));
+        }
+
+        template <class S>
+        void Load(UINT i, TrsBatch<S>& t) const
+        {
+            t.tx = S::Load(&tx[i]); t.ty = S::Load(&ty[i]); t.tz = S::Load(&tz[i]);
+            t.scale = S::Load(&scale[i]);
+            t.qx = S::Load(&qx[i]); t.qy = S::Load(&qy[i]); t.qz = S::Load(&qz[i]); t.qw = S::Load(&qw[i]);
+        }
+
+        template <class S>
+        void Gather(const int* indices, TrsBatch<S>& t) const
+        {
+            t.tx = S::Gather(tx.data(), indices); t.ty = S::Gather(ty.data(), indices); t.tz = S::Gather(tz.data(), indices);
+            t.scale = S::Gather(scale.data(), indices);
+            t.qx = S::Gather(qx.data(), indices); t.qy = S::Gather(qy.data(), indices);
+            t.qz = S::Gather(qz.data(), indices); t.qw = S::Gather(qw.data(), indices);
+        }
+
+        template <class S>
+        void Store(UINT i, const TrsBatch<S>& t)
+        {
+            S::Store(&tx[i], t.tx); S::Store(&ty[i], t.ty); S::Store(&tz[i], t.tz);
+            S::Store(&scale[i], t.scale);
+            S::Store(&qx[i], t.qx); S::Store(&qy[i], t.qy); S::Store(&qz[i], t.qz); S::Store(&qw[i], t.qw);
+        }
+    };
+
+    // Lanes [first, first + S::Width) of one level; returns how many real nodes changed
+    template <class S>
+    UINT UpdateGroup(UINT first, bool root)
+    {
+        UINT changed = 0;
+        for (UINT lane = 0; lane < S::Width; ++lane)
+        {
+            UINT i = first + lane;
+            m_Changed[i] = m_Dirty[i] | (root ? 0 : m_Changed[m_ParentIndex[i]]);
+            m_Dirty[i] = 0;
+            changed += m_Changed[i] & m_Real[i];
+        }
+        if (changed == 0)
+            return 0;
+
+        TrsBatch<S> local;
+        m_Local.Load<S>(first, local);
+        if (root)
+        {
+            m_World.Store<S>(first, local);
+        }
+        else
+        {
+            TrsBatch<S> parent, world;
+            m_World.Gather<S>(&m_ParentIndex[first], parent);
+            ComposeTrsBatch<S>(local, parent, world);
+            m_World.Store<S>(first, world);
+        }
+        return changed;
+    }
+
+    // Stable sort by depth, with every level padded to a group of 8; everything is dirty after
+    void Rebuild()
+    {
+        std::vector<TransformHandle> order(m_Parents.size());
+        for (TransformHandle h = 0; h < order.size(); ++h)
+            order[h] = h;
+        std::stable_sort(order.begin(), order.end(), [&](TransformHandle a, TransformHandle b) { return m_Depths[a] < m_Depths[b]; });
+
+        m_LevelBegin.clear();
+        UINT index = 0;
+        for (TransformHandle h : order)
+        {
+            while (m_LevelBegin.size() <= m_Depths[h])
+            {
+                index = DivUp(index, 8u) * 8;
+                m_LevelBegin.push_back(index);
+            }
+            m_Index[h] = index++;
+        }
+        index = DivUp(index, 8u) * 8;
+        m_LevelBegin.push_back(index);
+
+        // Padding lanes are identity nodes hanging off slot 0 so the kernels can run them blindly
+        m_Local.Resize(index);
+        m_World.Resize(index);
+        m_ParentIndex.assign(index, 0);
+        m_Real.assign(index, 0);
+        m_Dirty.assign(index, 1);
+        m_Changed.assign(index, 0);
+        const Trs identity = MakeTrs(1.0f, XMFLOAT4(0.0f, 0.0f, 0.0f, 1.0f), XMFLOAT3(0.0f, 0.0f, 0.0f));
+        for (UINT i = 0; i < index; ++i)
+            m_Local.Set(i, identity);
+        for (TransformHandle h = 0; h < m_Parents.size(); ++h)
+        {
+            UINT i = m_Index[h];
+            m_Local.Set(i, m_PendingLocals[h]);
+            m_ParentIndex[i] = m_Parents[h] == TRANSFORM_NO_PARENT ? 0 : (int)m_Index[m_Parents[h]];
+            m_Real[i] = 1;
+        }
+        m_PendingLocals.clear();
+        m_OrderStale = false;
+    }
+
+    // By handle
+    std::vector<TransformHandle> m_Parents;
+    std::vector<UINT> m_Depths;
+    std::vector<UINT> m_Index;
+    std::vector<Trs> m_PendingLocals;  // in handle order, while the storage order is stale
+    bool m_OrderStale = false;
+
+    // By storage index
+    TrsArrays m_Local, m_World;
+    std::vector<int> m_ParentIndex;
+    std::vector<BYTE> m_Real;  // 0 for level padding
+    std::vector<BYTE> m_Dirty;
+    std::vector<BYTE> m_Changed;
+    std::vector<UINT> m_LevelBegin;  // storage index of each level, plus the end
+};
+
+TransformHierarchy g_SceneTransforms;
+
+#ifdef _DEBUG
+// Debug-build check of the closed-form and batched transforms against DirectXMath
+static const float TRANSFORM_CHECK_TOLERANCE = 1e-5f;
+
+static bool MatricesClose(const XMMATRIX& a, const XMMATRIX& b, bool linearOnly)
+{
+    XMFLOAT4X4 fa, fb;
+    XMStoreFloat4x4(&fa, a);
+    XMStoreFloat4x4(&fb, b);
+    int size = linearOnly ? 3 : 4;
+    for (int r = 0; r < size; ++r)
+    {
+        for (int c = 0; c < size; ++c)
+        {
+            if (fabsf(fa.m[r][c] - fb.m[r][c]) > TRANSFORM_CHECK_TOLERANCE * (std::max)(1.0f, fabsf(fb.m[r][c])))
+                return false;
+        }
+    }
+    return true;
+}
+
+static float CheckRandom(UINT& state, float lo, float hi)
+{
+    state = state * 1664525u + 1013904223u;
+    return lo + (hi - lo) * (float)(state >> 8) * (1.0f / 16777216.0f);
+}
+
+static Trs RandomTrs(UINT& state)
+{
+    XMFLOAT4 q(CheckRandom(state, -1.0f, 1.0f), CheckRandom(state, -1.0f, 1.0f), CheckRandom(state, -1.0f, 1.0f), CheckRandom(state, -1.0f, 1.0f));
+    XMStoreFloat4(&q, XMQuaternionNormalize(XMLoadFloat4(&q)));
+    XMFLOAT3 t(CheckRandom(state, -20.0f, 20.0f), CheckRandom(state, -20.0f, 20.0f), CheckRandom(state, -20.0f, 20.0f));
+    return MakeTrs(CheckRandom(state, 0.25f, 4.0f), q, t);
+}
+
+static XMMATRIX ReferenceTrsMatrix(const Trs& t)
+{
+    return XMMatrixScaling(t.scale, t.scale, t.scale) *
+        XMMatrixRotationQuaternion(XMLoadFloat4(&t.rotation)) *
+        XMMatrixTranslation(t.translation.x, t.translation.y, t.translation.z);
+}
+
+template <class S>
+static bool CheckTrsBatch(UINT& state)
+{
+    const UINT W = S::Width;
+    Trs trs[8];
+    alignas(32) float lanes[8][8];
+    for (UINT k = 0; k < W; ++k)
+    {
+        trs[k] = RandomTrs(state);
+        const float values[8] = { trs[k].translation.x, trs[k].translation.y, trs[k].translation.z, trs[k].scale,
+            trs[k].rotation.x, trs[k].rotation.y, trs[k].rotation.z, trs[k].rotation.w };
+        for (UINT v = 0; v < 8; ++v)
+            lanes[v][k] = values[v];
+    }
+
+    TrsBatch<S> batch = { S::Load(lanes[0]), S::Load(lanes[1]), S::Load(lanes[2]), S::Load(lanes[3]),
+        S::Load(lanes[4]), S::Load(lanes[5]), S::Load(lanes[6]), S::Load(lanes[7]) };
+    typename S::Float model[3][4], normal[3][4];
+    TrsBatchColumns<S>(batch, model, normal);
+
+    alignas(32) float modelOut[3][4][8], normalOut[3][4][8];
+    for (UINT j = 0; j < 3; ++j)
+    {
+        for (UINT i = 0; i < 4; ++i)
+        {
+            S::Store(modelOut[j][i], model[j][i]);
+            S::Store(normalOut[j][i], normal[j][i]);
+        }
+    }
+
+    for (UINT k = 0; k < W; ++k)
+    {
+        XMFLOAT4X4 m, n;
+        for (UINT j = 0; j < 4; ++j)
+        {
+            for (UINT i = 0; i < 4; ++i)
+            {
+                m.m[i][j] = (j < 3) ? modelOut[j][i][k] : (i == 3 ? 1.0f : 0.0f);
+                n.m[i][j] = (j < 3) ? normalOut[j][i][k] : (i == 3 ? 1.0f : 0.0f);
+            }
+        }
+        if (!MatricesClose(XMLoadFloat4x4(&m), TrsToMatrix(trs[k]), false) ||
+            !MatricesClose(XMLoadFloat4x4(&n), TrsNormalMatrix(trs[k]), false))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ValidateTransformMath()
+{
+    const char* failed = nullptr;
+    UINT state = 12345u;
+
+    for (int iteration = 0; iteration < 200 && !failed; ++iteration)
+    {
+        Trs a = RandomTrs(state);
+        Trs b = RandomTrs(state);
+        XMMATRIX ma = ReferenceTrsMatrix(a);
+        XMMATRIX mb = ReferenceTrsMatrix(b);
+        XMMATRIX inverseA = XMMatrixInverse(nullptr, ma);
+
+        if (!MatricesClose(TrsToMatrix(a), ma, false))
+            failed = "TrsToMatrix";
+        else if (!MatricesClose(TrsToMatrix(InverseTrs(a)), inverseA, false))
+            failed = "InverseTrs";
+        else if (!MatricesClose(TrsNormalMatrix(a), XMMatrixTranspose(inverseA), true))
+            failed = "TrsNormalMatrix";
+        else if (!MatricesClose(TrsToMatrix(ComposeTrs(a, b)), ma * mb, false))
+            failed = "ComposeTrs";
+
+        // General affine with shear and non-uniform scale, kept away from singular
+        Affine g;
+        for (int r = 0; r < 3; ++r)
+            g.rows[r] = XMFLOAT3(CheckRandom(state, -2.0f, 2.0f), CheckRandom(state, -2.0f, 2.0f), CheckRandom(state, -2.0f, 2.0f));
+        g.translation = XMFLOAT3(CheckRandom(state, -20.0f, 20.0f), CheckRandom(state, -20.0f, 20.0f), CheckRandom(state, -20.0f, 20.0f));
+        if (fabsf(Dot3(g.rows[0], Cross3(g.rows[1], g.rows[2]))) < 1.0f)
+            continue;
+
+        XMMATRIX mg = AffineToMatrix(g);
+        XMMATRIX inverseG = XMMatrixInverse(nullptr, mg);
+        Affine gInverse;
+        XMMATRIX gNormal;
+        if (failed)
+            break;
+        else if (!InverseAffine(g, gInverse) || !MatricesClose(AffineToMatrix(gInverse), inverseG, false))
+            failed = "InverseAffine";
+        else if (!AffineNormalMatrix(g, gNormal) || !MatricesClose(gNormal, XMMatrixTranspose(inverseG), true))
+            failed = "AffineNormalMatrix";
+        else if (!MatricesClose(AffineToMatrix(ComposeAffine(g, AffineFromTrs(b))), mg * mb, false))
+            failed = "ComposeAffine";
+    }
+
+    for (int iteration = 0; iteration < 50 && !failed; ++iteration)
+    {
+        if (!CheckTrsBatch<SimdSSE>(state))
+            failed = "TrsBatchColumns (SSE)";
+        else if (g_HasAvx2 && !CheckTrsBatch<SimdAVX2>(state))
+            failed = "TrsBatchColumns (AVX2)";
+    }
+
+    if (failed)
+    {
+        char message[128];
+        snprintf(message, sizeof(message), "Transform self-check failed: %s\n", failed);
+        OutputDebugStringA(message);
+        assert(false);
+        return false;
+    }
+    return true;
+}
+
+// SIMD math against double-precision libm, at random arguments over each kernel's
+// documented range plus the edges, to the bounds stated with the kernels
+template <class S>
+static const char* CheckSimdMath(UINT& state)
+{
+    const UINT W = S::Width;
+    alignas(32) float x[8], y[8], a[8], b[8];
+    auto fill = [&](float* v, float lo, float hi) { for (UINT k = 0; k < W; ++k) v[k] = CheckRandom(state, lo, hi); };
+    const float edges[] = { 0.0f, 1.5707964f, -3.1415927f, 4.712389f, 8192.0f, -8192.0f, 1e-30f, -1e-30f };
+
+    for (UINT iteration = 0; iteration < 20000; ++iteration)
+    {
+        fill(x, iteration % 2 ? -8192.0f : -10.0f, iteration % 2 ? 8192.0f : 10.0f);
+        if (iteration < _countof(edges))
+            x[0] = edges[iteration];
+        typename S::Float s, c;
+        SimdSinCos<S>(S::Load(x), s, c);
+        S::Store(a, s);
+        S::Store(b, c);
+        for (UINT k = 0; k < W; ++k)
+        {
+            if (fabs(a[k] - sin((double)x[k])) > SIMD_SINCOS_MAX_ERROR || fabs(b[k] - cos((double)x[k])) > SIMD_SINCOS_MAX_ERROR)
+                return "SimdSinCos";
+        }
+
+        fill(x, -87.0f, 88.0f);
+        S::Store(a, SimdExp<S>(S::Load(x)));
+        for (UINT k = 0; k < W; ++k)
+        {
+            double reference = exp((double)x[k]);
+            if (fabs(a[k] - reference) > SIMD_EXP_MAX_ERROR * reference)
+                return "SimdExp";
+        }
+
+        // Log over every binade, with 1 and the normal extremes
+        for (UINT k = 0; k < W; ++k)
+            x[k] = (float)exp2((double)CheckRandom(state, -125.0f, 127.0f));
+        if (iteration < 3)
+            x[0] = iteration == 0 ? 1.0f : iteration == 1 ? FLT_MIN : FLT_MAX;
+        S::Store(a, SimdLog<S>(S::Load(x)));
+        for (UINT k = 0; k < W; ++k)
+        {
+            double reference = log((double)x[k]);
+            if (fabs(a[k] - reference) > SIMD_LOG_MAX_ERROR * (std::max)(1.0, fabs(reference)))
+                return "SimdLog";
+        }
+
+        for (UINT k = 0; k < W; ++k)
+            x[k] = (float)exp2((double)CheckRandom(state, -10.0f, 10.0f));
+        fill(y, -8.0f, 8.0f);
+        if (iteration == 0)
+            y[0] = 0.0f;
+        S::Store(a, SimdPow<S>(S::Load(x), S::Load(y)));
+        for (UINT k = 0; k < W; ++k)
+        {
+            double reference = pow((double)x[k], (double)y[k]);
+            double magnitude = fabs((double)y[k] * log((double)x[k]));
+            if (fabs(a[k] - reference) > SIMD_POW_MAX_ERROR * (1.0 + magnitude) * reference)
+                return "SimdPow";
+        }
+
+        for (UINT k = 0; k < W; ++k)
+            x[k] = (float)exp2((double)CheckRandom(state, -125.0f, 127.0f));
+        if (iteration < 2)
+            x[0] = iteration == 0 ? FLT_MIN : FLT_MAX;
+        S::Store(a, SimdRsqrt<S>(S::Load(x)));
+        for (UINT k = 0; k < W; ++k)
+        {
+            double reference = 1.0 / sqrt((double)x[k]);
+            if (fabs(a[k] - reference) > SIMD_RSQRT_MAX_ERROR * reference)
+                return "SimdRsqrt";
+        }
+    }
+    return nullptr;
+}
+
+bool ValidateSimdMath()
+{
+    UINT state = 8642u;
+    const char* failed = CheckSimdMath<SimdSSE>(state);
+    if (!failed && g_HasAvx2)
+        failed = CheckSimdMath<SimdAVX2>(state);
+
+    if (failed)
+    {
+        char message[128];
+        snprintf(message, sizeof(message), "SIMD math self-check failed: %s\n", failed);
+        OutputDebugStringA(message);
+        assert(false);
+        return false;
+    }
+    return true;
+}
+
+// Round trip of the instance records: decode them the way litVS / litPS do and compare
+// with the full-precision transform. snorm16 rotations are good to ~1e-4.
+static const float PACKING_CHECK_TOLERANCE = 1e-3f;
+
+static XMMATRIX DecodeInstanceMatrix(const InstanceGPU& data)
+{
+    const UINT* bits = data.rotation;
+    const int q[4] = { (int)(bits[0] << 16) >> 16, (int)bits[0] >> 16, (int)(bits[1] << 16) >> 16, (int)bits[1] >> 16 };
+    XMVECTOR quaternion = XMVectorMax(XMVectorSet(q[0] / 32767.0f, q[1] / 32767.0f, q[2] / 32767.0f, q[3] / 32767.0f), XMVectorReplicate(-1.0f));
+    const XMFLOAT4& p = data.posScale;
+    return XMMatrixScaling(p.w, p.w, p.w) *
+        XMMatrixRotationQuaternion(XMQuaternionNormalize(quaternion)) *
+        XMMatrixTranslation(p.x, p.y, p.z);
+}
+
+static float DecodeHalf(UINT bits, UINT shift)
+{
+    return PackedVector::XMConvertHalfToFloat((PackedVector::HALF)(bits >> shift));
+}
+
+static bool CheckDirtyRanges(const DirtyRanges& dirty, std::initializer_list<DirtyRange> expected)
+{
+    if (dirty.GetRanges().size() != expected.size())
+        return false;
+    size_t i = 0;
+    for (const DirtyRange& range : expected)
+    {
+        const DirtyRange& actual = dirty.GetRanges()[i++];
+        if (actual.begin != range.begin || actual.end != range.end)
+            return false;
+    }
+    return true;
+}
+
+// Records of `visible`, in its order; every rotated cube must also stay inside the
+// rotation-independent bounds culling uses
+template <class S>
+static bool CheckInstancePacking(const InstanceStore& store, const std::vector<CubeInstanceCPU>& cubes, const InstanceBounds& bounds,
+    const std::vector<UINT>& visible, float angle, InstanceGPU* records)
+{
+    BuildVisibleInstancesT<S>(store, visible.data(), (UINT)visible.size(), angle, records);
+    _mm_sfence();
+
+    for (UINT v = 0; v < (UINT)visible.size(); ++v)
+    {
+        UINT i = visible[v];
+        const CubeInstanceCPU& c = cubes[i];
+        const InstanceGPU& s = records[v];
+        XMMATRIX model = DecodeInstanceMatrix(s);
+        XMFLOAT4X4 decoded, expected;
+        XMStoreFloat4x4(&decoded, model);
+        XMStoreFloat4x4(&expected, XMMatrixScaling(c.scale, c.scale, c.scale) *
+            XMMatrixRotationY(angle * c.rotSpeed) *
+            XMMatrixTranslation(c.basePos.x, c.basePos.y, c.basePos.z));
+        for (int r = 0; r < 4; ++r)
+        {
+            for (int k = 0; k < 4; ++k)
+            {
+                if (fabsf(decoded.m[r][k] - expected.m[r][k]) > PACKING_CHECK_TOLERANCE * (std::max)(1.0f, fabsf(expected.m[r][k])))
+                    return false;
+            }
+        }
+
+        for (UINT corner = 0; corner < 8; ++corner)
+        {
+            XMFLOAT3 p;
+            XMStoreFloat3(&p, XMVector3TransformCoord(XMVectorSet(corner & 1 ? 0.5f : -0.5f, corner & 2 ? 0.5f : -0.5f, corner & 4 ? 0.5f : -0.5f, 1.0f), model));
+            float slack = PACKING_CHECK_TOLERANCE * c.scale;
+            if (fabsf(p.x - bounds.centerX[i]) > bounds.extentX[i] + slack ||
+                fabsf(p.y - bounds.centerY[i]) > bounds.extentY[i] + slack ||
+                fabsf(p.z - bounds.centerZ[i]) > bounds.extentZ[i] + slack)
+            {
+                return false;
+            }
+        }
+
+        if (DecodeHalf(s.params[0], 0) != 32.0f ||
+            fabsf(DecodeHalf(s.params[0], 16) - c.rotSpeed) > PACKING_CHECK_TOLERANCE * (std::max)(1.0f, fabsf(c.rotSpeed)) ||
+            DecodeHalf(s.params[1], 0) != (float)c.textureId ||
+            DecodeHalf(s.params[1], 16) != (c.hasNormalMap ? 1.0f : 0.0f))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ValidateInstancePacking()
+{
+    UINT state = 54321u;
+    EntityWorld world;
+    world.Init(SCENE_COMPONENT_SIZES, COMPONENT_TYPE_COUNT);
+    InstanceStore store;
+    InitInstanceStore(store, world);
+    std::vector<CubeInstanceCPU> cubes;
+    for (UINT i = 0; i < 837; ++i)
+    {
+        CubeInstanceCPU c = {};
+        c.basePos = XMFLOAT3(CheckRandom(state, -50.0f, 50.0f), CheckRandom(state, -5.0f, 5.0f), CheckRandom(state, -50.0f, 50.0f));
+        c.scale = CheckRandom(state, 0.25f, 4.0f);
+        c.rotSpeed = CheckRandom(state, -3.0f, 3.0f);
+        c.textureId = i % 4;
+        c.hasNormalMap = (i % 3) == 0;
+        cubes.push_back(c);
+        AddInstance(store, c);
+    }
+
+    const char* failed = nullptr;
+    if (!CheckDirtyRanges(store.staticDirty, { { 0, 837 } }))
+        failed = "static dirty range";
+
+    InstanceBounds bounds;
+    UpdateInstanceBounds(store, store.staticDirty, bounds);
+
+    // A scrambled subset, not a multiple of 8 long, as culling would leave it
+    std::vector<UINT> visible;
+    for (UINT k = 0; k < store.count; ++k)
+    {
+        UINT i = (k * 7) % store.count;
+        if (i % 4 != 1)
+            visible.push_back(i);
+    }
+
+    // Same alignment as an upload ring allocation
+    InstanceGPU* records = static_cast<InstanceGPU*>(_mm_malloc(visible.size() * sizeof(InstanceGPU), 64));
+    for (int frame = 0; frame < 16 && !failed; ++frame)
+    {
+        float angle = frame * 0.7f;
+        if (!CheckInstancePacking<SimdSSE>(store, cubes, bounds, visible, angle, records))
+            failed = "SSE";
+        else if (g_HasAvx2 && !CheckInstancePacking<SimdAVX2>(store, cubes, bounds, visible, angle, records))
+            failed = "AVX2";
+    }
+    _mm_free(records);
+
+    // Out of order, overlapping and nearly adjacent marks
+    DirtyRanges dirty;
+    dirty.Mark(40, 48);
+    dirty.Mark(0, 8);
+    dirty.Mark(4, 12);
+    dirty.Mark(14, 16);
+    dirty.Mark(100, 101);
+    dirty.Coalesce(2);
+    if (!failed && !CheckDirtyRanges(dirty, { { 0, 16 }, { 40, 48 }, { 100, 101 } }))
+        failed = "DirtyRanges::Coalesce";
+
+    if (failed)
+    {
+        char message[128];
+        snprintf(message, sizeof(message), "Instance packing self-check failed: %s\n", failed);
+        OutputDebugStringA(message);
+        assert(false);
+        return false;
+    }
+    return true;
+}
+
+// Upload ring against a mock buffer. Every discard hands out a new block of memory, like
+// the driver renaming the buffer; each frame fills its allocations with its own number and
+// the "GPU" checks them when the frame retires, so any overwrite of bytes still in flight
+// shows up. The GPU runs a few frames behind and occasionally stalls.
+class MockUploadTarget : public IUploadTarget
+{
+public:
+    explicit MockUploadTarget(UINT capacity) : m_Capacity(capacity) {}
+    ~MockUploadTarget()
+    {
+        for (BYTE* block : m_Blocks)
+            _mm_free(block);
+    }
+
+    void* Map(bool discard) override
+    {
+        if (m_Mapped)
+            return nullptr;  // D3D11 does not allow nested maps either
+        if (discard || m_Blocks.empty())
+        {
+            m_Blocks.push_back(static_cast<BYTE*>(_mm_malloc(m_Capacity, 64)));
+            memset(m_Blocks.back(), 0, m_Capacity);
+        }
+        else
+        {
+            ++m_NoOverwriteMaps;
+        }
+        m_Mapped = true;
+        return m_Blocks.back();
+    }
+
+    void Unmap() override { m_Mapped = false; }
+
+    BYTE* CurrentBlock() const { return m_Blocks.back(); }
+    UINT GetNoOverwriteMaps() const { return m_NoOverwriteMaps; }
+
+private:
+    UINT m_Capacity;
+    std::vector<BYTE*> m_Blocks;
+    bool m_Mapped = false;
+    UINT m_NoOverwriteMaps = 0;
+};
+
+bool ValidateUploadRing()
+{
+    struct Allocation
+    {
+        UINT64 frame;
+        BYTE* memory;
+        UINT offset;
+        UINT size;
+    };
+
+    const UINT capacity = 4096;
+    const UINT alignment = 64;
+    MockUploadTarget target(capacity);
+    UploadRing ring;
+    ring.Init(&target, capacity, alignment, true);
+
+    std::vector<Allocation> inFlight;
+    UINT64 completed = 0;
+    UINT state = 777u;
+    const char* failed = nullptr;
+
+    for (UINT frame = 1; frame <= 2000 && !failed; ++frame)
+    {
+        // The GPU is 1-3 frames behind, and now and then stalls for a while
+        UINT lag = 1 + (UINT)CheckRandom(state, 0.0f, 3.0f);
+        if (frame % 97 < 6)
+            lag += 6;
+        if (frame > lag && frame - lag > completed)
+            completed = frame - lag;
+
+        // Retired frames must still see exactly what they wrote
+        for (size_t i = 0; i < inFlight.size() && !failed; ++i)
+        {
+            const Allocation& a = inFlight[i];
+            if (a.frame > completed)
+                continue;
+            for (UINT b = 0; b < a.size; ++b)
+            {
+                if (a.memory[a.offset + b] != (BYTE)a.frame)
+                {
+                    failed = "overwrote bytes in flight";
+                    break;
+                }
+            }
+        }
+        inFlight.erase(std::remove_if(inFlight.begin(), inFlight.end(), [&](const Allocation& a) { return a.frame <= completed; }), inFlight.end());
+
+        ring.BeginFrame(completed);
+        UINT allocations = 1 + (UINT)CheckRandom(state, 0.0f, 3.0f);
+        for (UINT k = 0; k < allocations && !failed; ++k)
+        {
+            UINT size = 8 + (UINT)CheckRandom(state, 0.0f, 600.0f);
+            UINT offset = 0;
+            BYTE* p = static_cast<BYTE*>(ring.Allocate(size, offset));
+            if (!p)
+                break;  // this frame's allocations no longer fit; later ones get a fresh lap
+            if (offset % alignment != 0 || offset + size > capacity || p != target.CurrentBlock() + offset)
+                failed = "bad allocation";
+            memset(p, (BYTE)frame, size);
+            inFlight.push_back({ frame, target.CurrentBlock(), offset, size });
+        }
+        if (ring.EndFrame() != frame)
+            failed = "frame numbering";
+    }
+
+    // The stalls must force discards, and the common case must not
+    if (!failed && (ring.GetDiscardCount() < 2 || target.GetNoOverwriteMaps() < 1000))
+        failed = "discard / no-overwrite balance";
+
+    // Without NO_OVERWRITE support every frame discards
+    UploadRing discardOnly;
+    MockUploadTarget discardTarget(capacity);
+    discardOnly.Init(&discardTarget, capacity, alignment, false);
+    for (UINT frame = 1; frame <= 10 && !failed; ++frame)
+    {
+        UINT offset = 0;
+        discardOnly.BeginFrame(frame - 1);
+        if (!discardOnly.Allocate(256, offset) || !discardOnly.Allocate(256, offset))
+            failed = "discard-only allocation";
+        discardOnly.EndFrame();
+    }
+    if (!failed && (discardOnly.GetDiscardCount() != 10 || discardTarget.GetNoOverwriteMaps() != 0))
+        failed = "discard-only maps";
+
+    if (failed)
+    {
+        char message[128];
+        snprintf(message, sizeof(message), "Upload ring self-check failed: %s\n", failed);
+        OutputDebugStringA(message);
+        assert(false);
+        return false;
+    }
+    return true;
+}
+
+// Paged culling against the flat per-instance cull, for cameras inside, across and
+// outside the scene. The store grows between runs so partly filled pages get rebuilt.
+bool ValidateInstancePages()
+{
+    UINT state = 13579u;
+    EntityWorld world;
+    world.Init(SCENE_COMPONENT_SIZES, COMPONENT_TYPE_COUNT);
+    InstanceStore store;
+    InitInstanceStore(store, world);
+    std::vector<InstancePage> pages;
+    InstanceBounds bounds;
+    const char* failed = nullptr;
+
+    for (UINT round = 0; round < 3 && !failed; ++round)
+    {
+        UINT target = 1500 + round * 2000;
+        while (store.count < target)
+        {
+            CubeInstanceCPU c = {};
+            c.basePos = XMFLOAT3(CheckRandom(state, -80.0f, 80.0f), CheckRandom(state, -4.0f, 4.0f), CheckRandom(state, -80.0f, 80.0f));
+            c.scale = CheckRandom(state, 0.25f, 3.0f);
+            c.rotSpeed = CheckRandom(state, -3.0f, 3.0f);
+            AddInstance(store, c);
+        }
+        UpdateInstancePages(store, store.staticDirty, pages);
+        UpdateInstanceBounds(store, store.staticDirty, bounds);
+        store.staticDirty.Clear();
+
+        for (UINT camera = 0; camera < 8 && !failed; ++camera)
+        {
+            XMVECTOR eye = XMVectorSet(CheckRandom(state, -120.0f, 120.0f), CheckRandom(state, 1.0f, 30.0f), CheckRandom(state, -120.0f, 120.0f), 1.0f);
+            XMVECTOR target = XMVectorSet(CheckRandom(state, -40.0f, 40.0f), 0.0f, CheckRandom(state, -40.0f, 40.0f), 1.0f);
+            XMMATRIX vp = XMMatrixLookAtLH(eye, target, XMVectorSet(0, 1, 0, 0)) * XMMatrixPerspectiveFovLH(XM_PI / 3.0f, 16.0f / 9.0f, 0.1f, 100.0f);
+            Plane planes[6];
+            ExtractFrustumPlanes(planes, vp);
+
+            std::vector<UINT> expected;
+            FrameVector<UINT> paged{ ArenaAllocator<UINT>(g_FrameArenas.Get()) };
+            CullInstanceBounds(planes, bounds, expected);
+            CullInstancePages(planes, bounds, pages, paged);
+            if (paged.size() != expected.size() || !std::equal(paged.begin(), paged.end(), expected.begin()))
+                failed = "paged and flat visible lists differ";
+        }
+    }
+
+    if (failed)
+    {
+        char message[128];
+        snprintf(message, sizeof(message), "Instance page self-check failed: %s\n", failed);
+        OutputDebugStringA(message);
+        assert(false);
+        return false;
+    }
+    return true;
+}
+
+// The AABB pass of CullInstanceRange against the baseline sphere test and a box test on
+// the eight corners. The boxes sit near one frustum plane each at distances spread from
+// well inside to beyond both the sphere's and the box's reach, so some are kept while
+// partly outside the plane and some pass the sphere test and are then rejected by the box.
+// The count is not a multiple of four, so the last step has unused lanes.
+bool ValidateBoxCulling()
+{
+    UINT state = 24680u;
+    const char* failed = nullptr;
+    const UINT count = 4003;
+
+    XMMATRIX vp = XMMatrixLookAtLH(XMVectorSet(5.0f, 12.0f, -30.0f, 1.0f), XMVectorSet(0.0f, 0.0f, 10.0f, 1.0f), XMVectorSet(0, 1, 0, 0)) *
+        XMMatrixPerspectiveFovLH(XM_PI / 3.0f, 16.0f / 9.0f, 0.5f, 80.0f);
+    Plane planes[6];
+    ExtractFrustumPlanes(planes, vp);
+    XMVECTOR eye = XMVectorSet(5.0f, 12.0f, -30.0f, 1.0f);
+    XMVECTOR forward = XMVector3Normalize(XMVectorSubtract(XMVectorSet(0.0f, 0.0f, 10.0f, 1.0f), eye));
+
+    InstanceBounds bounds;
+    ResizeInstanceBounds(bounds, count);
+    for (UINT i = 0; i < count; ++i)
+    {
+        // A point on the view axis pushed onto one plane, then off it along the normal
+        const XMFLOAT4& plane = planes[i % 6].p;
+        XMFLOAT3 axis;
+        XMStoreFloat3(&axis, XMVectorAdd(eye, XMVectorScale(forward, CheckRandom(state, 2.0f, 75.0f))));
+        float onPlane = plane.x * axis.x + plane.y * axis.y + plane.z * axis.z + plane.w;
+        float scale = CheckRandom(state, 0.25f, 3.0f);
+        float radius = CUBE_RADIUS_PER_SCALE * scale;
+        float reach = (fabsf(plane.x) + fabsf(plane.z)) * CUBE_SPIN_EXTENT_PER_SCALE * scale + fabsf(plane.y) * 0.5f * scale;
+        float offset;
+        do
+        {
+            offset = CheckRandom(state, -1.3f, 1.5f) * (std::max)(radius, reach);
+        } while (fabsf(offset + radius) < 1e-3f * scale || fabsf(offset + reach) < 1e-3f * scale);
+
+        bounds.centerX[i] = axis.x + (offset - onPlane) * plane.x;
+        bounds.centerY[i] = axis.y + (offset - onPlane) * plane.y;
+        bounds.centerZ[i] = axis.z + (offset - onPlane) * plane.z;
+        bounds.extentX[i] = CUBE_SPIN_EXTENT_PER_SCALE * scale;
+        bounds.extentY[i] = 0.5f * scale;
+        bounds.extentZ[i] = CUBE_SPIN_EXTENT_PER_SCALE * scale;
+        bounds.radius[i] = radius;
+    }
+
+    CullView view;
+    std::copy(planes, planes + 6, view.planes);
+    CullPlaneSet planeSet;
+    PrepareCullPlaneSets(&view, 1, &planeSet);
+    std::vector<UINT> visible(count);
+    CullViewStats stats;
+    visible.resize(CullInstanceRange(&planeSet, 1, bounds, 0, count, nullptr, visible.data(), &stats));
+
+    std::vector<UINT> expected;
+    UINT sphereAccepted = 0, boxRejected = 0, keptAcrossPlane = 0;
+    for (UINT i = 0; i < count; ++i)
+    {
+        XMFLOAT3 center(bounds.centerX[i], bounds.centerY[i], bounds.centerZ[i]);
+        if (!IsSphereInsideFrustum(planes, center, bounds.radius[i]))
+            continue;
+        ++sphereAccepted;
+
+        bool boxInside = true, acrossPlane = false;
+        for (int p = 0; p < 6; ++p)
+        {
+            UINT cornersOutside = 0;
+            for (int c = 0; c < 8; ++c)
+            {
+                XMFLOAT3 corner(center.x + ((c & 1) ? bounds.extentX[i] : -bounds.extentX[i]),
+                    center.y + ((c & 2) ? bounds.extentY[i] : -bounds.extentY[i]),
+                    center.z + ((c & 4) ? bounds.extentZ[i] : -bounds.extentZ[i]));
+                const XMFLOAT4& plane = planes[p].p;
+                if (plane.x * corner.x + plane.y * corner.y + plane.z * corner.z + plane.w < 0.0f)
+                    ++cornersOutside;
+            }
+            boxInside = boxInside && cornersOutside < 8;
+            acrossPlane = acrossPlane || cornersOutside > 0;
+        }
+        if (boxInside)
+        {
+            expected.push_back(i);
+            if (acrossPlane)
+                ++keptAcrossPlane;
+        }
+        else
+        {
+            ++boxRejected;
+        }
+    }
+
+    if (visible != expected)
+        failed = "box test and corner test disagree";
+    else if (stats.sphereAccepted != sphereAccepted || stats.boxRejected != boxRejected)
+        failed = "sphere and box counts";
+    else if (boxRejected == 0 || keptAcrossPlane == 0)
+        failed = "boxes do not straddle the planes";
+
+    if (failed)
+    {
+        char message[128];
+        snprintf(message, sizeof(message), "Box culling self-check failed: %s\n", failed);
+        OutputDebugStringA(message);
+        assert(false);
+        return false;
+    }
+    return true;
+}
+
+// One batched cull of N views against N single-view culls: each view's bit must select
+// exactly the instances its own cull keeps, in the same order, with the same sphere and
+// box counts, and the combined list must hold every instance some view sees. The view
+// sets are a stereo pair, six cube faces around a point and all 32 views at once. The
+// cubemap cull must then match six CullInstanceBounds passes, one per face.
+bool ValidateMultiViewCulling()
+{
+    UINT state = 97531u;
+    EntityWorld world;
+    world.Init(SCENE_COMPONENT_SIZES, COMPONENT_TYPE_COUNT);
+    InstanceStore store;
+    InitInstanceStore(store, world);
+    while (store.count < 4000)
+    {
+        CubeInstanceCPU c = {};
+        c.basePos = XMFLOAT3(CheckRandom(state, -60.0f, 60.0f), CheckRandom(state, -10.0f, 10.0f), CheckRandom(state, -60.0f, 60.0f));
+        c.scale = CheckRandom(state, 0.25f, 3.0f);
+        AddInstance(store, c);
+    }
+    InstanceBounds bounds;
+    UpdateInstanceBounds(store, store.staticDirty, bounds);
+    store.staticDirty.Clear();
+
+    CullView views[MAX_CULL_VIEWS];
+    XMMATRIX proj = XMMatrixPerspectiveFovLH(XM_PI / 3.0f, 16.0f / 9.0f, 0.1f, 100.0f);
+    XMVECTOR up = XMVectorSet(0, 1, 0, 0);
+
+    // Stereo pair, 6.4 cm apart
+    for (UINT eye = 0; eye < 2; ++eye)
+    {
+        float offset = eye ? 0.032f : -0.032f;
+        XMMATRIX view = XMMatrixLookAtLH(XMVectorSet(offset, 4.0f, -70.0f, 1.0f), XMVectorSet(offset, 0.0f, 0.0f, 1.0f), up);
+        ExtractFrustumPlanes(views[eye].planes, view * proj);
+    }
+
+    // Cube faces
+    const XMFLOAT3 probe(5.0f, 0.0f, -8.0f);
+    BuildCubemapCullViews(probe, 0.1f, 40.0f, views + 2);
+
+    // The rest are random cameras inside, across and outside the scene
+    for (UINT v = 8; v < MAX_CULL_VIEWS; ++v)
+    {
+        XMVECTOR eye = XMVectorSet(CheckRandom(state, -100.0f, 100.0f), CheckRandom(state, -5.0f, 30.0f), CheckRandom(state, -100.0f, 100.0f), 1.0f);
+        XMVECTOR target = XMVectorSet(CheckRandom(state, -40.0f, 40.0f), 0.0f, CheckRandom(state, -40.0f, 40.0f), 1.0f);
+        ExtractFrustumPlanes(views[v].planes, XMMatrixLookAtLH(eye, target, up) * proj);
+    }
+
+    const UINT viewSets[3][2] = { { 0, 2 }, { 2, 6 }, { 0, MAX_CULL_VIEWS } };
+    const char* failed = nullptr;
+    for (UINT set = 0; set < _countof(viewSets) && !failed; ++set)
+    {
+        UINT first = viewSets[set][0];
+        UINT count = viewSets[set][1];
+
+        std::vector<UINT> masks, visibleAny;
+        CullViewStats stats[MAX_CULL_VIEWS];
+        CullInstanceBoundsMultiView(views + first, count, bounds, masks, visibleAny, stats);
+
+        std::vector<UINT> expectedAny;
+        for (UINT i = 0; i < bounds.count; ++i)
+        {
+            if (masks[i] != 0)
+                expectedAny.push_back(i);
+        }
+        if (visibleAny != expectedAny)
+            failed = "the combined list is not the instances with a view bit";
+
+        UINT viewsSeen = 0;
+        for (UINT v = 0; v < count && !failed; ++v)
+        {
+            std::vector<UINT> singleMasks, single, fromMask;
+            CullViewStats singleStats;
+            CullInstanceBoundsMultiView(views + first + v, 1, bounds, singleMasks, single, &singleStats);
+            for (UINT id : visibleAny)
+            {
+                if (masks[id] & (1u << v))
+                    fromMask.push_back(id);
+            }
+
+            if (fromMask != single)
+                failed = "a view's bit differs from its single-view cull";
+            else if (stats[v].sphereAccepted != singleStats.sphereAccepted || stats[v].boxRejected != singleStats.boxRejected)
+                failed = "a view's sphere and box counts differ from its single-view cull";
+            viewsSeen += single.empty() ? 0 : 1;
+        }
+        if (!failed && viewsSeen < 2)
+            failed = "fewer than two views see any instance";
+    }
+
+    // The cubemap cull against six CullInstanceBounds passes, one per face, stats included
+    if (!failed)
+    {
+        std::vector<UINT> faceMasks, visibleAny;
+        CullViewStats faceStats[6];
+        CullCubemapInstances(probe, 0.1f, 40.0f, bounds, faceMasks, visibleAny, faceStats);
+        for (UINT face = 0; face < 6 && !failed; ++face)
+        {
+            std::vector<UINT> single, fromMask;
+            CullInstanceBounds(views[2 + face].planes, bounds, single);
+            for (UINT id : visibleAny)
+            {
+                if (faceMasks[id] & (1u << face))
+                    fromMask.push_back(id);
+            }
+            if (single.empty() || fromMask != single)
+                failed = "a cubemap face differs from its own CullInstanceBounds pass";
+            else if (faceStats[face].sphereAccepted != g_CullingStats.sphereAccepted || faceStats[face].boxRejected != g_CullingStats.boxRejected)
+                failed = "a cubemap face's sphere and box counts differ from its own pass";
+        }
+    }
+
+    if (failed)
+    {
+        char message[128];
+        snprintf(message, sizeof(message), "Multi-view culling self-check failed: %s\n", failed);
+        OutputDebugStringA(message);
+        assert(false);
+        return false;
+    }
+    return true;
+}
+
+// Entity storage against a plain map of what each live entity should hold. Instances and
+// panels are created and destroyed at random; afterwards every entity must read back its
+// own values, archetype rows must be dense with full chunks, and both chunk walks must see
+// every entity exactly once.
+bool ValidateEntityWorld()
+{
+    UINT state = 24680u;
+    EntityWorld world;
+    world.Init(SCENE_COMPONENT_SIZES, COMPONENT_TYPE_COUNT);
+    std::vector<int> expected;  // tag by entity id; -1 = destroyed, never created ids are absent
+    std::vector<bool> isPanel;  // by entity id; panels carry no position columns
+    std::vector<Entity> live;
+    const char* failed = nullptr;
+
+    for (UINT step = 0; step < 20000; ++step)
+    {
+        if (live.empty() || CheckRandom(state, 0.0f, 1.0f) < 0.6f)
+        {
+            bool panel = CheckRandom(state, 0.0f, 1.0f) < 0.3f;
+            Entity e = world.Create(panel ? TRANSPARENT_PANEL_COMPONENTS : OPAQUE_INSTANCE_COMPONENTS);
+            int tag = (int)step;
+            if (panel)
+            {
+                world.Get<TransparentPanel>(e, COMPONENT_TRANSPARENT).isStatic = (UINT)tag;
+            }
+            else
+            {
+                world.Get<float>(e, COMPONENT_POSITION_X) = (float)tag;
+                world.Get<InstanceStaticGPU>(e, COMPONENT_INSTANCE_GPU).params[0] = (UINT)tag;
+            }
+            if (e >= expected.size())
+            {
+                expected.resize(e + 1, -1);
+                isPanel.resize(e + 1, false);
+            }
+            isPanel[e] = panel;
+            if (expected[e] != -1)
+                failed = "id reused while alive";
+            expected[e] = tag;
+            live.push_back(e);
+        }
+        else
+        {
+            UINT pick = (UINT)CheckRandom(state, 0.0f, (float)live.size() - 0.5f);
+            world.Destroy(live[pick]);
+            expected[live[pick]] = -1;
+            live[pick] = live.back();
+            live.pop_back();
+        }
+    }
+
+    for (Entity e : live)
+    {
+        UINT tag = isPanel[e] ? world.Get<TransparentPanel>(e, COMPONENT_TRANSPARENT).isStatic :
+            world.Get<InstanceStaticGPU>(e, COMPONENT_INSTANCE_GPU).params[0];
+        if (tag != (UINT)expected[e] || (!isPanel[e] && world.Get<float>(e, COMPONENT_POSITION_X) != (float)expected[e]))
+            failed = "component value lost";
+    }
+
+    const ComponentMask masks[] = { OPAQUE_INSTANCE_COMPONENTS, TRANSPARENT_PANEL_COMPONENTS };
+    UINT total = 0;
+    for (ComponentMask mask : masks)
+    {
+        EntityArchetype* archetype = world.GetArchetype(mask);
+        if (archetype->capacity % 8 != 0)
+            failed = "chunk capacity";
+        for (size_t c = 0; c < archetype->chunks.size(); ++c)
+        {
+            const EntityChunk& chunk = archetype->chunks[c];
+            bool last = c + 1 == archetype->chunks.size();
+            if (chunk.firstRow != c * archetype->capacity || (!last && chunk.count != archetype->capacity) || chunk.count == 0)
+                failed = "chunks not dense";
+            bool panels = mask == TRANSPARENT_PANEL_COMPONENTS;
+            const float* posX = panels ? nullptr : chunk.Column<float>(COMPONENT_POSITION_X);
+            for (UINT i = 0; i < chunk.count; ++i)
+            {
+                Entity e = chunk.Entities()[i];
+                if (world.GetRow(e) != chunk.firstRow + i || (posX && posX[i] != (float)expected[e]))
+                    failed = "entity column out of sync";
+                UINT tag = panels ? chunk.Column<TransparentPanel>(COMPONENT_TRANSPARENT)[i].isStatic :
+                    chunk.Column<InstanceStaticGPU>(COMPONENT_INSTANCE_GPU)[i].params[0];
+                if (tag != (UINT)expected[e])
+                    failed = "component columns out of sync";
+            }
+        }
+        total += archetype->count;
+    }
+    if (total != live.size())
+        failed = "entity count";
+
+    UINT serialCount = 0;
+    world.ForEachChunk(0, [&](const EntityChunk& chunk) { serialCount += chunk.count; });
+    std::atomic<UINT> parallelCount(0);
+    JobSystem jobs;
+    jobs.Init(3);
+    world.ParallelForEachChunk(jobs, 0, 1, [&](const EntityChunk& chunk) { parallelCount += chunk.count; });
+    jobs.Shutdown();
+    if (serialCount != live.size() || parallelCount != live.size())
+        failed = "chunk iteration";
+
+    if (failed)
+    {
+        char message[128];
+        snprintf(message, sizeof(message), "Entity world self-check failed: %s\n", failed);
+        OutputDebugStringA(message);
+        assert(false);
+        return false;
+    }
+    return true;
+}
+
+// Hierarchy update against ComposeTrs applied in handle order. A random forest is animated
+// through a few frames of sparse SetLocal calls, with nodes added part way to force a
+// reorder; each Update must match the reference worlds and recompute exactly the nodes
+// that are dirty or have a dirty ancestor.
+bool ValidateTransformHierarchy()
+{
+    UINT state = 97531u;
+    TransformHierarchy hierarchy;
+    std::vector<TransformHandle> parents;
+    std::vector<Trs> locals;
+    const char* failed = nullptr;
+
+    // Scales near 1 and short offsets keep deep chains within float tolerance
+    auto randomLocal = [&]()
+    {
+        Trs t = RandomTrs(state);
+        t.scale = CheckRandom(state, 0.8f, 1.25f);
+        t.translation.x *= 0.1f; t.translation.y *= 0.1f; t.translation.z *= 0.1f;
+        return t;
+    };
+    auto addNodes = [&](UINT count)
+    {
+        for (UINT n = 0; n < count; ++n)
+        {
+            TransformHandle parent = (parents.empty() || CheckRandom(state, 0.0f, 1.0f) < 0.1f) ? TRANSFORM_NO_PARENT :
+                (TransformHandle)CheckRandom(state, 0.0f, (float)parents.size() - 0.5f);
+            Trs local = randomLocal();
+            if (hierarchy.Add(parent, local) != parents.size())
+                failed = "handle";
+            parents.push_back(parent);
+            locals.push_back(local);
+        }
+    };
+
+    JobSystem jobs;
+    jobs.Init(3);
+    addNodes(3000);
+    std::vector<BYTE> dirty(parents.size(), 1);
+    for (UINT frame = 0; frame < 12 && !failed; ++frame)
+    {
+        if (frame > 0)
+            dirty.assign(parents.size(), 0);
+        if (frame == 6)
+        {
+            addNodes(500);
+            dirty.assign(parents.size(), 1);  // a reorder recomputes everything
+        }
+        if (frame > 0 && frame != 3)  // nothing moves on frame 3
+        {
+            for (UINT n = 0; n < parents.size() / 50; ++n)
+            {
+                TransformHandle h = (TransformHandle)CheckRandom(state, 0.0f, (float)parents.size() - 0.5f);
+                locals[h] = randomLocal();
+                hierarchy.SetLocal(h, locals[h]);
+                dirty[h] = 1;
+            }
+        }
+
+        UINT updated = hierarchy.Update(jobs);
+
+        UINT expectedUpdated = 0;
+        std::vector<Trs> worlds(parents.size());
+        for (TransformHandle h = 0; h < parents.size(); ++h)
+        {
+            bool root = parents[h] == TRANSFORM_NO_PARENT;
+            worlds[h] = root ? locals[h] : ComposeTrs(locals[h], worlds[parents[h]]);
+            if (!root)
+                dirty[h] |= dirty[parents[h]];
+            expectedUpdated += dirty[h];
+
+            Trs world = hierarchy.GetWorld(h);
+            const float actual[8] = { world.translation.x, world.translation.y, world.translation.z, world.scale,
+                world.rotation.x, world.rotation.y, world.rotation.z, world.rotation.w };
+            const float reference[8] = { worlds[h].translation.x, worlds[h].translation.y, worlds[h].translation.z, worlds[h].scale,
+                worlds[h].rotation.x, worlds[h].rotation.y, worlds[h].rotation.z, worlds[h].rotation.w };
+            for (UINT v = 0; v < 8; ++v)
+            {
+                if (fabsf(actual[v] - reference[v]) > 1e-3f * (std::max)(1.0f, fabsf(reference[v])))
+                    failed = "world transform";
+            }
+        }
+        if (updated != expectedUpdated)
+            failed = "dirty propagation";
+    }
+    jobs.Shutdown();
+
+    if (failed)
+    {
+        char message[128];
+        snprintf(message, sizeof(message), "Transform hierarchy self-check failed: %s\n", failed);
+        OutputDebugStringA(message);
+        assert(false);
+        return false;
+    }
+    return true;
+}
+#endif
+
+// Spatial hash grid
+// Instances are bucketed by uniform cell. Cells live in an open-addressed hash table
+// (linear probing) and point at contiguous ranges of cell-sorted SoA arrays, so a query
+// touches a handful of cells and streams their entries four at a time.
+// An instance moving within its cell is updated in place. One leaving its cell is
+// killed in the sorted arrays (NaN position, so every SIMD test rejects it) and
+// appended to a small overflow list that queries also scan; the grid is rebuilt once
+// that list gets long. Updates are O(1) amortised.
+// Frustum queries walk the cells inside the box around the frustum (its planes pushed out
+// by the largest radius) and run the cull kernel on the entries of the cells that box
+// and planes cannot rule out.
+static const float GRID_CELL_SIZE = 2.0f;
+static const UINT GRID_INVALID = 0xFFFFFFFFu;
+static const UINT GRID_OVERFLOW_BIT = 0x80000000u;
+
+class SpatialHashGrid
+{
+public:
+    void Build(float cellSize, const InstanceBounds& bounds);
+    void Update(UINT id, const XMFLOAT3& position, float radius);
+
+    // Instances whose bounding sphere touches the query sphere
+    void QuerySphere(const XMFLOAT3& center, float radius, std::vector<UINT>& out) const;
+    // Instances CullInstanceBounds keeps for these planes; the extents come from bounds,
+    // which have to be the bounds the grid was built and updated from
+    void QueryFrustum(const Plane planes[6], const InstanceBounds& bounds, std::vector<UINT>& out) const;
+
+    UINT GetCount() const { return m_Count; }
+    UINT GetOverflowCount() const { return (UINT)m_OverflowIds.size(); }
+
+private:
+    struct Cell
+    {
+        int x, y, z;
+        UINT start;  // GRID_INVALID marks an empty table slot
+        UINT count;
+    };
+
+    struct Entries
+    {
+        const float* x;
+        const float* y;
+        const float* z;
+        const float* r;
+        const UINT* ids;
+    };
+
+    void Rebuild();
+    UINT FindCell(int x, int y, int z) const;
+    int CellCoord(float v) const { return (int)floorf(v * m_InvCellSize); }
+    static UINT HashCell(int x, int y, int z)
+    {
+        return ((UINT)x * 73856093u) ^ ((UINT)y * 19349663u) ^ ((UINT)z * 83492791u);
+    }
+
+    static void GatherSphere(const Entries& e, UINT begin, UINT end, const XMFLOAT3& center, float radius, std::vector<UINT>& out);
+    static void GatherFrustum(const Entries& e, UINT begin, UINT end, const CullPlaneSet& planeSet, const InstanceBounds& bounds,
+        std::vector<UINT>& out);
+
+    float m_CellSize = GRID_CELL_SIZE;
+    float m_InvCellSize = 1.0f / GRID_CELL_SIZE;
+    float m_MaxRadius = 0.0f;
+    UINT m_Count = 0;
+
+    std::vector<Cell> m_Table;
+    UINT m_TableMask = 0;
+    std::vector<UINT> m_OccupiedCells;
+
+    // Cell-sorted entries, padded by 3 so the last group of four can be loaded whole
+    std::vector<float> m_X, m_Y, m_Z, m_R;
+    std::vector<UINT> m_Ids;
+
+    // Instances that left their cell since the last rebuild
+    std::vector<float> m_OverflowX, m_OverflowY, m_OverflowZ, m_OverflowR;
+    std::vector<UINT> m_OverflowIds;
+
+    // Current bounds and location (sorted index or GRID_OVERFLOW_BIT | overflow index) per id
+    std::vector<XMFLOAT4> m_Spheres;
+    std::vector<UINT> m_Location;
+};
+
+void SpatialHashGrid::Build(float cellSize, const InstanceBounds& bounds)
+{
+    m_CellSize = cellSize;
+    m_InvCellSize = 1.0f / cellSize;
+    m_Count = bounds.count;
+
+    m_Spheres.resize(m_Count);
+    for (UINT i = 0; i < m_Count; ++i)
+        m_Spheres[i] = XMFLOAT4(bounds.centerX[i], bounds.centerY[i], bounds.centerZ[i], bounds.radius[i]);
+
+    Rebuild();
+}
+
+void SpatialHashGrid::Rebuild()
+{
+    // Table at most half full
+    UINT tableSize = 16;
+    while (tableSize < m_Count * 2)
+        tableSize *= 2;
+    m_TableMask = tableSize - 1;
+    m_Table.assign(tableSize, Cell{ 0, 0, 0, GRID_INVALID, 0 });
+    m_OccupiedCells.clear();
+    m_MaxRadius = 0.0f;
+
+    std::vector<UINT> cellOf(m_Count);
+    for (UINT i = 0; i < m_Count; ++i)
+    {
+        const XMFLOAT4& s = m_Spheres[i];
+        int cx = CellCoord(s.x), cy = CellCoord(s.y), cz = CellCoord(s.z);
+
+        UINT slot = HashCell(cx, cy, cz) & m_TableMask;
+        while (m_Table[slot].start != GRID_INVALID &&
+            (m_Table[slot].x != cx || m_Table[slot].y != cy || m_Table[slot].z != cz))
+        {
+            slot = (slot + 1) & m_TableMask;
+        }
+
+        Cell& cell = m_Table[slot];
+        if (cell.start == GRID_INVALID)
+        {
+            cell = Cell{ cx, cy, cz, 0, 0 };
+            m_OccupiedCells.push_back(slot);
+        }
+        ++cell.count;
+        cellOf[i] = slot;
+        m_MaxRadius = (std::max)(m_MaxRadius, s.w);
+    }
+
+    UINT start = 0;
+    for (UINT slot : m_OccupiedCells)
+    {
+        m_Table[slot].start = start;
+        start += m_Table[slot].count;
+        m_Table[slot].count = 0;
+    }
+
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    m_X.assign(m_Count + 3, nan);
+    m_Y.assign(m_Count + 3, nan);
+    m_Z.assign(m_Count + 3, nan);
+    m_R.assign(m_Count + 3, 0.0f);
+    m_Ids.assign(m_Count + 3, GRID_INVALID);
+    m_Location.resize(m_Count);
+
+    for (UINT i = 0; i < m_Count; ++i)
+    {
+        Cell& cell = m_Table[cellOf[i]];
+        UINT dst = cell.start + cell.count++;
+        m_X[dst] = m_Spheres[i].x;
+        m_Y[dst] = m_Spheres[i].y;
+        m_Z[dst] = m_Spheres[i].z;
+        m_R[dst] = m_Spheres[i].w;
+        m_Ids[dst] = i;
+        m_Location[i] = dst;
+    }
+
+    m_OverflowX.assign(3, nan);
+    m_OverflowY.assign(3, nan);
+    m_OverflowZ.assign(3, nan);
+    m_OverflowR.assign(3, 0.0f);
+    m_OverflowIds.clear();
+}
+
+void SpatialHashGrid::Update(UINT id, const XMFLOAT3& position, float radius)
+{
+    XMFLOAT4& s = m_Spheres[id];
+    if (s.x == position.x && s.y == position.y && s.z == position.z && s.w == radius)
+        return;
+
+    m_MaxRadius = (std::max)(m_MaxRadius, radius);
+    UINT location = m_Location[id];
+
+    if (location & GRID_OVERFLOW_BIT)
+    {
+        UINT k = location & ~GRID_OVERFLOW_BIT;
+        m_OverflowX[k] = position.x;
+        m_OverflowY[k] = position.y;
+        m_OverflowZ[k] = position.z;
+        m_OverflowR[k] = radius;
+    }
+    else if (CellCoord(s.x) == CellCoord(position.x) && CellCoord(s.y) == CellCoord(position.y) && CellCoord(s.z) == CellCoord(position.z))
+    {
+        m_X[location] = position.x;
+        m_Y[location] = position.y;
+        m_Z[location] = position.z;
+        m_R[location] = radius;
+    }
+    else
+    {
+        const float nan = std::numeric_limits<float>::quiet_NaN();
+        m_X[location] = nan;
+        m_Y[location] = nan;
+        m_Z[location] = nan;
+        m_Ids[location] = GRID_INVALID;
+
+        // Overflow arrays keep 3 padding floats at the end as well
+        UINT k = (UINT)m_OverflowIds.size();
+        m_OverflowX.insert(m_OverflowX.begin() + k, position.x);
+        m_OverflowY.insert(m_OverflowY.begin() + k, position.y);
+        m_OverflowZ.insert(m_OverflowZ.begin() + k, position.z);
+        m_OverflowR.insert(m_OverflowR.begin() + k, radius);
+        m_OverflowIds.push_back(id);
+        m_Location[id] = GRID_OVERFLOW_BIT | k;
+    }
+
+    s = XMFLOAT4(position.x, position.y, position.z, radius);
+
+    if (m_OverflowIds.size() > (std::max)(64u, m_Count / 8))
+        Rebuild();
+}
+
+UINT SpatialHashGrid::FindCell(int x, int y, int z) const
+{
+    if (m_Table.empty())
+        return GRID_INVALID;
+
+    UINT slot = HashCell(x, y, z) & m_TableMask;
+    while (m_Table[slot].start != GRID_INVALID)
+    {
+        const Cell& cell = m_Table[slot];
+        if (cell.x == x && cell.y == y && cell.z == z)
+            return slot;
+        slot = (slot + 1) & m_TableMask;
+    }
+    return GRID_INVALID;
+}
+
+void SpatialHashGrid::GatherSphere(const Entries& e, UINT begin, UINT end, const XMFLOAT3& center, float radius, std::vector<UINT>& out)
+{
+    const __m128 cx = _mm_set1_ps(center.x);
+    const __m128 cy = _mm_set1_ps(center.y);
+    const __m128 cz = _mm_set1_ps(center.z);
+    const __m128 qr = _mm_set1_ps(radius);
+
+    for (UINT i = begin; i < end; i += 4)
+    {
+        __m128 dx = _mm_sub_ps(_mm_loadu_ps(e.x + i), cx);
+        __m128 dy = _mm_sub_ps(_mm_loadu_ps(e.y + i), cy);
+        __m128 dz = _mm_sub_ps(_mm_loadu_ps(e.z + i), cz);
+        __m128 reach = _mm_add_ps(qr, _mm_loadu_ps(e.r + i));
+        __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+
+        int mask = _mm_movemask_ps(_mm_cmple_ps(d2, _mm_mul_ps(reach, reach)));
+        UINT laneCount = (std::min)(4u, end - i);
+        for (UINT lane = 0; lane < laneCount; ++lane)
+        {
+            if (mask & (1 << lane))
+                out.push_back(e.ids[i + lane]);
         }
-        return 0;
+    }
+}
 
-    case WM_KEYDOWN:
-        if (wParam == VK_LEFT)  g_KeyLeft = true;
-        if (wParam == VK_RIGHT) g_KeyRight = true;
-        if (wParam == VK_UP)    g_KeyUp = true;
-        if (wParam == VK_DOWN)  g_KeyDown = true;
-        if (wParam == '1') g_PostEffectMode = 0;
-        if (wParam == '2') g_PostEffectMode = 1;
-        if (wParam == '3') g_PostEffectMode = 2;
-        if (wParam == '4') g_PostEffectMode = 3;
-        return 0;
+void SpatialHashGrid::QuerySphere(const XMFLOAT3& center, float radius, std::vector<UINT>& out) const
+{
+    out.clear();
+    if (m_Count == 0)
+        return;
 
-    case WM_KEYUP:
-        if (wParam == VK_LEFT)  g_KeyLeft = false;
-        if (wParam == VK_RIGHT) g_KeyRight = false;
-        if (wParam == VK_UP)    g_KeyUp = false;
-        if (wParam == VK_DOWN)  g_KeyDown = false;
-        return 0;
+    // Entries are bucketed by centre, so widen the search by the largest radius
+    float reach = radius + m_MaxRadius;
+    int x0 = CellCoord(center.x - reach), x1 = CellCoord(center.x + reach);
+    int y0 = CellCoord(center.y - reach), y1 = CellCoord(center.y + reach);
+    int z0 = CellCoord(center.z - reach), z1 = CellCoord(center.z + reach);
 
-    case WM_DESTROY:
-        PostQuitMessage(0);
-        return 0;
+    Entries sorted = { m_X.data(), m_Y.data(), m_Z.data(), m_R.data(), m_Ids.data() };
+
+    UINT cellRange = (UINT)((x1 - x0 + 1) * (y1 - y0 + 1) * (z1 - z0 + 1));
+    if (cellRange > (UINT)m_OccupiedCells.size())
+    {
+        // Query covers more cells than exist, walk the occupied ones instead
+        for (UINT slot : m_OccupiedCells)
+        {
+            const Cell& cell = m_Table[slot];
+            if (cell.x < x0 || cell.x > x1 || cell.y < y0 || cell.y > y1 || cell.z < z0 || cell.z > z1)
+                continue;
+            GatherSphere(sorted, cell.start, cell.start + cell.count, center, radius, out);
+        }
+    }
+    else
+    {
+        for (int z = z0; z <= z1; ++z)
+        {
+            for (int y = y0; y <= y1; ++y)
+            {
+                for (int x = x0; x <= x1; ++x)
+                {
+                    UINT slot = FindCell(x, y, z);
+                    if (slot == GRID_INVALID)
+                        continue;
+                    const Cell& cell = m_Table[slot];
+                    GatherSphere(sorted, cell.start, cell.start + cell.count, center, radius, out);
+                }
+            }
+        }
     }
 
-    return DefWindowProcW(hWnd, message, wParam, lParam);
+    Entries overflow = { m_OverflowX.data(), m_OverflowY.data(), m_OverflowZ.data(), m_OverflowR.data(), m_OverflowIds.data() };
+    GatherSphere(overflow, 0, (UINT)m_OverflowIds.size(), center, radius, out);
 }
 
-// Init DirectX
-bool InitDirectX()
+void SpatialHashGrid::GatherFrustum(const Entries& e, UINT begin, UINT end, const CullPlaneSet& planeSet, const InstanceBounds& bounds,
+    std::vector<UINT>& out)
 {
-    HRESULT hr;
+    for (UINT i = begin; i < end; i += 4)
+    {
+        // Killed entries hold NaN, which the plane tests don't reject, so they are masked out
+        UINT laneCount = (std::min)(4u, end - i);
+        int validMask = 0;
+        float ex[4] = {}, ey[4] = {}, ez[4] = {};
+        for (UINT lane = 0; lane < laneCount; ++lane)
+        {
+            UINT id = e.ids[i + lane];
+            if (id == GRID_INVALID)
+                continue;
+            validMask |= 1 << lane;
+            ex[lane] = bounds.extentX[id];
+            ey[lane] = bounds.extentY[id];
+            ez[lane] = bounds.extentZ[id];
+        }
+        if (validMask == 0)
+            continue;
+
+        UINT laneMasks[4] = {};
+        CullViewStats stats;
+        CullInstanceLanes(&planeSet, 1, _mm_loadu_ps(e.x + i), _mm_loadu_ps(e.y + i), _mm_loadu_ps(e.z + i),
+            _mm_loadu_ps(ex), _mm_loadu_ps(ey), _mm_loadu_ps(ez), _mm_loadu_ps(e.r + i), validMask, laneMasks, &stats);
+        for (UINT lane = 0; lane < laneCount; ++lane)
+        {
+            if (laneMasks[lane])
+                out.push_back(e.ids[i + lane]);
+        }
+    }
+}
 
-    IDXGIFactory* pFactory = nullptr;
-    hr = CreateDXGIFactory(__uuidof(IDXGIFactory), (void**)&pFactory);
-    if (FAILED(hr)) return false;
+void SpatialHashGrid::QueryFrustum(const Plane planes[6], const InstanceBounds& bounds, std::vector<UINT>& out) const
+{
+    out.clear();
+    if (m_Count == 0)
+        return;
 
-    IDXGIAdapter* pSelectedAdapter = nullptr;
-    UINT idx = 0;
-    while (true)
+    // A kept sphere centre lies inside the planes moved out by its radius, so inside them
+    // moved out by m_MaxRadius. That polytope's box comes from its corners: the points
+    // where three planes meet that no other plane is in front of.
+    const float slack = 1e-3f * m_CellSize;
+    XMVECTOR grown[6];
+    for (int p = 0; p < 6; ++p)
+        grown[p] = XMVectorAdd(XMLoadFloat4(&planes[p].p), XMVectorSet(0.0f, 0.0f, 0.0f, m_MaxRadius + slack));
+
+    XMVECTOR lo = XMVectorReplicate(FLT_MAX), hi = XMVectorReplicate(-FLT_MAX);
+    bool bounded = false;
+    for (int a = 0; a < 6; ++a)
     {
-        IDXGIAdapter* pAdapter = nullptr;
-        hr = pFactory->EnumAdapters(idx, &pAdapter);
-        if (FAILED(hr) || pAdapter == nullptr) break;
+        for (int b = a + 1; b < 6; ++b)
+        {
+            for (int c = b + 1; c < 6; ++c)
+            {
+                XMVECTOR bc = XMVector3Cross(grown[b], grown[c]);
+                float det = XMVectorGetX(XMVector3Dot(grown[a], bc));
+                if (fabsf(det) < 1e-6f)
+                    continue;
+                XMVECTOR corner = XMVectorAdd(XMVectorAdd(XMVectorScale(bc, XMVectorGetW(grown[a])),
+                    XMVectorScale(XMVector3Cross(grown[c], grown[a]), XMVectorGetW(grown[b]))),
+                    XMVectorScale(XMVector3Cross(grown[a], grown[b]), XMVectorGetW(grown[c])));
+                corner = XMVectorScale(corner, -1.0f / det);
+
+                bool inside = true;
+                float tolerance = 1e-4f * (1.0f + XMVectorGetX(XMVector3Length(corner)));
+                for (int p = 0; p < 6 && inside; ++p)
+                    inside = XMVectorGetX(XMVector3Dot(grown[p], corner)) + XMVectorGetW(grown[p]) >= -tolerance;
+                if (!inside)
+                    continue;
+                lo = XMVectorMin(lo, corner);
+                hi = XMVectorMax(hi, corner);
+                bounded = true;
+            }
+        }
+    }
+    if (!bounded)
+        return;
 
-        DXGI_ADAPTER_DESC desc;
-        pAdapter->GetDesc(&desc);
-        if (wcscmp(desc.Description, L"Microsoft Basic Render Driver") != 0)
+    XMFLOAT3 boxMin, boxMax;
+    XMStoreFloat3(&boxMin, XMVectorSubtract(lo, XMVectorReplicate(slack)));
+    XMStoreFloat3(&boxMax, XMVectorAdd(hi, XMVectorReplicate(slack)));
+    int x0 = CellCoord(boxMin.x), x1 = CellCoord(boxMax.x);
+    int y0 = CellCoord(boxMin.y), y1 = CellCoord(boxMax.y);
+    int z0 = CellCoord(boxMin.z), z1 = CellCoord(boxMax.z);
+
+    CullView view;
+    std::copy(planes, planes + 6, view.planes);
+    CullPlaneSet planeSet;
+    PrepareCullPlaneSets(&view, 1, &planeSet);
+
+    // Cells whose centre box, grown by m_MaxRadius, is outside a plane hold nothing to keep
+    float halfCell = 0.5f * m_CellSize;
+    float reachCell = halfCell + m_MaxRadius + slack;
+    Entries sorted = { m_X.data(), m_Y.data(), m_Z.data(), m_R.data(), m_Ids.data() };
+    auto gatherCell = [&](const Cell& cell)
+    {
+        float cx = cell.x * m_CellSize + halfCell;
+        float cy = cell.y * m_CellSize + halfCell;
+        float cz = cell.z * m_CellSize + halfCell;
+        for (int p = 0; p < 6; ++p)
         {
-            pSelectedAdapter = pAdapter;
-            break;
+            float d = planeSet.x[p] * cx + planeSet.y[p] * cy + planeSet.z[p] * cz + planeSet.w[p];
+            if (d < -reachCell * (planeSet.absX[p] + planeSet.absY[p] + planeSet.absZ[p]))
+                return;
+        }
+        GatherFrustum(sorted, cell.start, cell.start + cell.count, planeSet, bounds, out);
+    };
+
+    double cellRange = (double)(x1 - x0 + 1) * (double)(y1 - y0 + 1) * (double)(z1 - z0 + 1);
+    if (cellRange > (double)m_OccupiedCells.size())
+    {
+        // Frustum box covers more cells than exist, walk the occupied ones instead
+        for (UINT slot : m_OccupiedCells)
+        {
+            const Cell& cell = m_Table[slot];
+            if (cell.x < x0 || cell.x > x1 || cell.y < y0 || cell.y > y1 || cell.z < z0 || cell.z > z1)
+                continue;
+            gatherCell(cell);
+        }
+    }
+    else
+    {
+        for (int z = z0; z <= z1; ++z)
+        {
+            for (int y = y0; y <= y1; ++y)
+            {
+                for (int x = x0; x <= x1; ++x)
+                {
+                    UINT slot = FindCell(x, y, z);
+                    if (slot != GRID_INVALID)
+                        gatherCell(m_Table[slot]);
+                }
+            }
         }
-        pAdapter->Release();
-        idx++;
     }
 
-    if (!pSelectedAdapter)
+    Entries overflow = { m_OverflowX.data(), m_OverflowY.data(), m_OverflowZ.data(), m_OverflowR.data(), m_OverflowIds.data() };
+    GatherFrustum(overflow, 0, (UINT)m_OverflowIds.size(), planeSet, bounds, out);
+}
+
+SpatialHashGrid g_InstanceGrid;
+
+// Light attenuation 1 / (1 + 0.15d + 0.08d^2) drops to about 0.2 here
+static const float LIGHT_QUERY_RADIUS = 6.0f;
+std::vector<UINT> g_LightInstances[MAX_SCENE_LIGHTS];
+
+// Occlusion culling
+// The largest near occluders are rasterised into a small software depth buffer
+// (8 pixels per step, two SSE registers), which keeps the farthest depth of every
+// 8x8 tile. Instance boxes whose nearest depth lies behind the tiles they cover are culled.
+static const int OCCLUSION_WIDTH = 256;
+static const int OCCLUSION_HEIGHT = 128;
+static const int OCCLUSION_TILE_SIZE = 8;
+static const int OCCLUSION_TILES_X = OCCLUSION_WIDTH / OCCLUSION_TILE_SIZE;
+static const int OCCLUSION_TILES_Y = OCCLUSION_HEIGHT / OCCLUSION_TILE_SIZE;
+static const UINT MAX_OCCLUDERS = 24;
+static const float OCCLUSION_MIN_W = 0.1f;
+static const float OCCLUSION_DEPTH_BIAS = 1e-6f;
+
+struct OccluderTriangle
+{
+    float x[3];
+    float y[3];
+    float z[3];
+    int minX, maxX;
+    int minY, maxY;
+};
+
+// Cube corners and the 12 triangles built on them
+static const float CUBE_CORNERS[8][3] =
+{
+    { -0.5f, -0.5f, -0.5f }, { 0.5f, -0.5f, -0.5f }, { 0.5f, 0.5f, -0.5f }, { -0.5f, 0.5f, -0.5f },
+    { -0.5f, -0.5f,  0.5f }, { 0.5f, -0.5f,  0.5f }, { 0.5f, 0.5f,  0.5f }, { -0.5f, 0.5f,  0.5f }
+};
+
+static const USHORT CUBE_CORNER_INDICES[36] =
+{
+    0,2,1, 0,3,2,
+    4,5,6, 4,6,7,
+    0,7,3, 0,4,7,
+    1,2,6, 1,6,5,
+    3,7,6, 3,6,2,
+    0,1,5, 0,5,4
+};
+
+class OcclusionBuffer
+{
+public:
+    OcclusionBuffer()
+        : m_Depth(OCCLUSION_WIDTH * OCCLUSION_HEIGHT, 1.0f),
+        m_TileMaxDepth(OCCLUSION_TILES_X * OCCLUSION_TILES_Y, 1.0f)
     {
-        pFactory->Release();
+    }
+
+    // Clears and rasterises the triangles; every tile row is an independent job.
+    void Render(const FrameVector<OccluderTriangle>& triangles, JobSystem& jobs)
+    {
+        jobs.ParallelFor(OCCLUSION_TILES_Y, 1, [&](UINT begin, UINT end)
+            {
+                for (UINT tileY = begin; tileY < end; ++tileY)
+                {
+                    int rowBegin = (int)tileY * OCCLUSION_TILE_SIZE;
+                    int rowEnd = rowBegin + OCCLUSION_TILE_SIZE;
+
+                    std::fill(m_Depth.begin() + rowBegin * OCCLUSION_WIDTH, m_Depth.begin() + rowEnd * OCCLUSION_WIDTH, 1.0f);
+
+                    for (const auto& tri : triangles)
+                    {
+                        if (tri.maxY < rowBegin || tri.minY >= rowEnd)
+                            continue;
+                        RasterizeRows(tri, (std::max)(tri.minY, rowBegin), (std::min)(tri.maxY + 1, rowEnd));
+                    }
+
+                    UpdateTileRow(tileY);
+                }
+            });
+    }
+
+    // Conservative test of a world-space AABB against the buffer.
+    bool IsBoxVisible(const XMFLOAT3& center, const XMFLOAT3& extents, const XMMATRIX& vp) const
+    {
+        float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
+        float minZ = FLT_MAX;
+
+        for (int i = 0; i < 8; ++i)
+        {
+            XMVECTOR corner = XMVectorSet(
+                center.x + ((i & 1) ? extents.x : -extents.x),
+                center.y + ((i & 2) ? extents.y : -extents.y),
+                center.z + ((i & 4) ? extents.z : -extents.z),
+                1.0f);
+            XMFLOAT4 clip;
+            XMStoreFloat4(&clip, XMVector4Transform(corner, vp));
+
+            // Box crosses the near plane: no reliable screen rectangle
+            if (clip.w < OCCLUSION_MIN_W)
+                return true;
+
+            float invW = 1.0f / clip.w;
+            float sx = (clip.x * invW * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+            float sy = (0.5f - clip.y * invW * 0.5f) * OCCLUSION_HEIGHT;
+            minX = (std::min)(minX, sx);
+            maxX = (std::max)(maxX, sx);
+            minY = (std::min)(minY, sy);
+            maxY = (std::max)(maxY, sy);
+            minZ = (std::min)(minZ, clip.z * invW);
+        }
+
+        // Keeps an occluder from hiding its own bounding box
+        minZ -= OCCLUSION_DEPTH_BIAS;
+
+        int x0 = (std::max)((int)floorf(minX), 0);
+        int x1 = (std::min)((int)floorf(maxX), OCCLUSION_WIDTH - 1);
+        int y0 = (std::max)((int)floorf(minY), 0);
+        int y1 = (std::min)((int)floorf(maxY), OCCLUSION_HEIGHT - 1);
+        if (x0 > x1 || y0 > y1)
+            return true;
+
+        for (int tileY = y0 / OCCLUSION_TILE_SIZE; tileY <= y1 / OCCLUSION_TILE_SIZE; ++tileY)
+        {
+            for (int tileX = x0 / OCCLUSION_TILE_SIZE; tileX <= x1 / OCCLUSION_TILE_SIZE; ++tileX)
+            {
+                if (m_TileMaxDepth[tileY * OCCLUSION_TILES_X + tileX] < minZ)
+                    continue;
+
+                // Coarse test failed, check the covered pixels of this tile
+                int py0 = (std::max)(y0, tileY * OCCLUSION_TILE_SIZE);
+                int py1 = (std::min)(y1, tileY * OCCLUSION_TILE_SIZE + OCCLUSION_TILE_SIZE - 1);
+                int px0 = (std::max)(x0, tileX * OCCLUSION_TILE_SIZE);
+                int px1 = (std::min)(x1, tileX * OCCLUSION_TILE_SIZE + OCCLUSION_TILE_SIZE - 1);
+                for (int py = py0; py <= py1; ++py)
+                {
+                    const float* row = &m_Depth[py * OCCLUSION_WIDTH];
+                    for (int px = px0; px <= px1; ++px)
+                    {
+                        if (row[px] >= minZ)
+                            return true;
+                    }
+                }
+            }
+        }
+
         return false;
     }
 
-    UINT flags = 0;
-#ifdef _DEBUG
-    flags |= D3D11_CREATE_DEVICE_DEBUG;
-#endif
+private:
+    void RasterizeRows(const OccluderTriangle& tri, int rowBegin, int rowEnd)
+    {
+        // Edge functions E(x, y) = A * x + B * y + C, positive inside
+        float edgeA[3], edgeB[3], edgeC[3];
+        for (int e = 0; e < 3; ++e)
+        {
+            int a = e;
+            int b = (e + 1) % 3;
+            edgeA[e] = tri.y[a] - tri.y[b];
+            edgeB[e] = tri.x[b] - tri.x[a];
+            edgeC[e] = (tri.y[b] - tri.y[a]) * tri.x[a] - (tri.x[b] - tri.x[a]) * tri.y[a];
+        }
 
-    D3D_FEATURE_LEVEL levels[] = { D3D_FEATURE_LEVEL_11_0 };
-    D3D_FEATURE_LEVEL obtainedLevel;
+        // Depth plane z = zA * x + zB * y + zC
+        float area = edgeC[0] + edgeC[1] + edgeC[2];
+        float invArea = 1.0f / area;
+        float zA = (edgeA[1] * tri.z[0] + edgeA[2] * tri.z[1] + edgeA[0] * tri.z[2]) * invArea;
+        float zB = (edgeB[1] * tri.z[0] + edgeB[2] * tri.z[1] + edgeB[0] * tri.z[2]) * invArea;
+        float zC = (edgeC[1] * tri.z[0] + edgeC[2] * tri.z[1] + edgeC[0] * tri.z[2]) * invArea;
 
-    hr = D3D11CreateDevice(
-        pSelectedAdapter,
-        D3D_DRIVER_TYPE_UNKNOWN,
-        nullptr,
-        flags,
-        levels,
-        1,
-        D3D11_SDK_VERSION,
-        &g_pDevice,
-        &obtainedLevel,
-        &g_pDeviceContext);
-    pSelectedAdapter->Release();
+        const __m128 laneOffsetLo = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+        const __m128 laneOffsetHi = _mm_setr_ps(4.5f, 5.5f, 6.5f, 7.5f);
+        const __m128 zero = _mm_setzero_ps();
+
+        __m128 eA[3], eB[3], eC[3];
+        for (int e = 0; e < 3; ++e)
+        {
+            eA[e] = _mm_set1_ps(edgeA[e]);
+            eB[e] = _mm_set1_ps(edgeB[e]);
+            eC[e] = _mm_set1_ps(edgeC[e]);
+        }
+        __m128 vzA = _mm_set1_ps(zA);
+        __m128 vzB = _mm_set1_ps(zB);
+        __m128 vzC = _mm_set1_ps(zC);
+
+        int startX = tri.minX & ~7;
+        for (int y = rowBegin; y < rowEnd; ++y)
+        {
+            __m128 py = _mm_set1_ps((float)y + 0.5f);
+            float* row = &m_Depth[y * OCCLUSION_WIDTH];
+
+            for (int x = startX; x <= tri.maxX; x += 8)
+            {
+                __m128 base = _mm_set1_ps((float)x);
+                __m128 px[2] = { _mm_add_ps(base, laneOffsetLo), _mm_add_ps(base, laneOffsetHi) };
+
+                for (int half = 0; half < 2; ++half)
+                {
+                    __m128 inside = _mm_cmpge_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(eA[0], px[half]), _mm_mul_ps(eB[0], py)), eC[0]), zero);
+                    inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(eA[1], px[half]), _mm_mul_ps(eB[1], py)), eC[1]), zero));
+                    inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(eA[2], px[half]), _mm_mul_ps(eB[2], py)), eC[2]), zero));
+                    if (_mm_movemask_ps(inside) == 0)
+                        continue;
+
+                    __m128 depth = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vzA, px[half]), _mm_mul_ps(vzB, py)), vzC);
+                    float* dst = row + x + half * 4;
+                    __m128 old = _mm_loadu_ps(dst);
+                    __m128 closer = _mm_min_ps(old, depth);
+                    _mm_storeu_ps(dst, _mm_or_ps(_mm_and_ps(inside, closer), _mm_andnot_ps(inside, old)));
+                }
+            }
+        }
+    }
+
+    void UpdateTileRow(UINT tileY)
+    {
+        for (int tileX = 0; tileX < OCCLUSION_TILES_X; ++tileX)
+        {
+            __m128 maxDepth = _mm_setzero_ps();
+            for (int y = 0; y < OCCLUSION_TILE_SIZE; ++y)
+            {
+                const float* src = &m_Depth[((int)tileY * OCCLUSION_TILE_SIZE + y) * OCCLUSION_WIDTH + tileX * OCCLUSION_TILE_SIZE];
+                maxDepth = _mm_max_ps(maxDepth, _mm_max_ps(_mm_loadu_ps(src), _mm_loadu_ps(src + 4)));
+            }
+            maxDepth = _mm_max_ps(maxDepth, _mm_shuffle_ps(maxDepth, maxDepth, _MM_SHUFFLE(1, 0, 3, 2)));
+            maxDepth = _mm_max_ps(maxDepth, _mm_shuffle_ps(maxDepth, maxDepth, _MM_SHUFFLE(2, 3, 0, 1)));
+            m_TileMaxDepth[tileY * OCCLUSION_TILES_X + tileX] = _mm_cvtss_f32(maxDepth);
+        }
+    }
+
+    std::vector<float> m_Depth;
+    std::vector<float> m_TileMaxDepth;
+};
+
+OcclusionBuffer g_OcclusionBuffer;
+InstanceBounds g_InstanceBounds;
+std::vector<InstancePage> g_InstancePages;
+
+// Projects one triangle into occlusion buffer space; false if it can't be used as an occluder.
+bool SetupOccluderTriangle(const XMFLOAT4 clip[3], OccluderTriangle& tri)
+{
+    for (int v = 0; v < 3; ++v)
+    {
+        if (clip[v].w < OCCLUSION_MIN_W)
+            return false;
+
+        float invW = 1.0f / clip[v].w;
+        tri.x[v] = (clip[v].x * invW * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+        tri.y[v] = (0.5f - clip[v].y * invW * 0.5f) * OCCLUSION_HEIGHT;
+        tri.z[v] = clip[v].z * invW;
+    }
+
+    float area = (tri.x[1] - tri.x[0]) * (tri.y[2] - tri.y[0]) - (tri.x[2] - tri.x[0]) * (tri.y[1] - tri.y[0]);
+    if (fabsf(area) < 1e-4f)
+        return false;
+
+    // Both windings are accepted, edges are made to face inwards
+    if (area < 0.0f)
+    {
+        std::swap(tri.x[1], tri.x[2]);
+        std::swap(tri.y[1], tri.y[2]);
+        std::swap(tri.z[1], tri.z[2]);
+    }
+
+    float minX = (std::min)(tri.x[0], (std::min)(tri.x[1], tri.x[2]));
+    float maxX = (std::max)(tri.x[0], (std::max)(tri.x[1], tri.x[2]));
+    float minY = (std::min)(tri.y[0], (std::min)(tri.y[1], tri.y[2]));
+    float maxY = (std::max)(tri.y[0], (std::max)(tri.y[1], tri.y[2]));
+
+    tri.minX = (std::max)((int)floorf(minX), 0);
+    tri.maxX = (std::min)((int)ceilf(maxX), OCCLUSION_WIDTH - 1);
+    tri.minY = (std::max)((int)floorf(minY), 0);
+    tri.maxY = (std::min)((int)ceilf(maxY), OCCLUSION_HEIGHT - 1);
+    return tri.minX <= tri.maxX && tri.minY <= tri.maxY;
+}
+
+// The 12 triangles of a unit cube under mvp that can be rasterised as occluders
+void AddCubeOccluder(const XMMATRIX& mvp, FrameVector<OccluderTriangle>& triangles)
+{
+    XMFLOAT4 clipCorners[8];
+    for (int v = 0; v < 8; ++v)
+    {
+        XMVECTOR corner = XMVectorSet(CUBE_CORNERS[v][0], CUBE_CORNERS[v][1], CUBE_CORNERS[v][2], 1.0f);
+        XMStoreFloat4(&clipCorners[v], XMVector4Transform(corner, mvp));
+    }
+
+    for (int t = 0; t < 12; ++t)
+    {
+        XMFLOAT4 clip[3] =
+        {
+            clipCorners[CUBE_CORNER_INDICES[t * 3 + 0]],
+            clipCorners[CUBE_CORNER_INDICES[t * 3 + 1]],
+            clipCorners[CUBE_CORNER_INDICES[t * 3 + 2]]
+        };
+        OccluderTriangle tri;
+        if (SetupOccluderTriangle(clip, tri))
+            triangles.push_back(tri);
+    }
+}
+
+void CullOccludedInstances(const XMMATRIX& vp, const XMFLOAT3& eye, float angle, FrameVector<UINT>& candidates)
+{
+    double startMs = GetTimeMs();
+    FrameArena& arena = g_FrameArenas.Get();
+
+    // Pick the occluders with the largest projected size (scale / distance)
+    FrameVector<std::pair<float, UINT>> ranked{ ArenaAllocator<std::pair<float, UINT>>(arena) };
+    ranked.reserve(candidates.size());
+    for (UINT id : candidates)
+    {
+        float dx = g_InstanceBounds.centerX[id] - eye.x;
+        float dy = g_InstanceBounds.centerY[id] - eye.y;
+        float dz = g_InstanceBounds.centerZ[id] - eye.z;
+        float dist = sqrtf(dx * dx + dy * dy + dz * dz);
+        ranked.push_back(std::make_pair(g_InstanceBounds.radius[id] / (std::max)(dist, 0.001f), id));
+    }
+
+    UINT occluderCount = (std::min)((UINT)ranked.size(), MAX_OCCLUDERS);
+    std::partial_sort(ranked.begin(), ranked.begin() + occluderCount, ranked.end(),
+        [](const std::pair<float, UINT>& a, const std::pair<float, UINT>& b)
+        {
+            return a.first > b.first;
+        });
+
+    FrameVector<OccluderTriangle> triangles{ ArenaAllocator<OccluderTriangle>(arena) };
+    triangles.reserve(occluderCount * 12);
+    for (UINT i = 0; i < occluderCount; ++i)
+    {
+        UINT id = ranked[i].second;
+        float scale = InstanceComponent<float>(g_Instances, id, COMPONENT_SCALE);
+        XMMATRIX mvp =
+            XMMatrixScaling(scale, scale, scale) *
+            XMMatrixRotationY(angle * InstanceComponent<float>(g_Instances, id, COMPONENT_SPIN)) *
+            XMMatrixTranslation(g_InstanceBounds.centerX[id], g_InstanceBounds.centerY[id], g_InstanceBounds.centerZ[id]) *
+            vp;
+        AddCubeOccluder(mvp, triangles);
+    }
+
+    g_OcclusionBuffer.Render(triangles, g_JobSystem);
+
+    // Test every candidate; the result bytes keep the original order for compaction
+    FrameVector<BYTE> visible(candidates.size(), 1, ArenaAllocator<BYTE>(arena));
+    g_JobSystem.ParallelFor((UINT)candidates.size(), 32, [&](UINT begin, UINT end)
+        {
+            for (UINT i = begin; i < end; ++i)
+            {
+                UINT id = candidates[i];
+                XMFLOAT3 center(g_InstanceBounds.centerX[id], g_InstanceBounds.centerY[id], g_InstanceBounds.centerZ[id]);
+                XMFLOAT3 extents(g_InstanceBounds.extentX[id], g_InstanceBounds.extentY[id], g_InstanceBounds.extentZ[id]);
+                visible[i] = g_OcclusionBuffer.IsBoxVisible(center, extents, vp) ? 1 : 0;
+            }
+        });
+
+    size_t kept = 0;
+    for (size_t i = 0; i < candidates.size(); ++i)
+    {
+        if (visible[i])
+            candidates[kept++] = candidates[i];
+    }
+
+    g_CullingStats.occluders = occluderCount;
+    g_CullingStats.occlusionCulled = (UINT)(candidates.size() - kept);
+    g_CullingStats.occlusionMs = GetTimeMs() - startMs;
+    candidates.resize(kept);
+}
+
+// LOD selection
+// Projected radius in pixels is radius * proj._22 * 0.5 * height / w.
+// The LOD steps sit where the dropped shading no longer shows: under 8 px a cube face is
+// about 9 px wide, so the 1024x1024 normal map is read from its 8x8 mip and the brick
+// relief has averaged out; under 4 px the specular highlight is smaller than a pixel.
+// The default scene never gets there (its cubes stay above 17 px at the orbit distance),
+// so only far or dense scenes switch shaders.
+static const float MIN_SCREEN_RADIUS_PX = 1.5f;
+static const float LOD_SCREEN_RADIUS_PX[LOD_COUNT - 1] = { 8.0f, 4.0f };
+
+// Drops the instances under MIN_SCREEN_RADIUS_PX and picks the LOD of the others;
+// `lods` gets one entry per kept instance
+void SelectInstanceLods(const XMMATRIX& vp, float projScaleY, float viewportHeight, FrameVector<UINT>& visible, FrameVector<BYTE>& lods)
+{
+    XMFLOAT4X4 m;
+    XMStoreFloat4x4(&m, vp);
+    float pixelScale = projScaleY * 0.5f * viewportHeight;
+
+    lods.resize(visible.size());
+    size_t kept = 0;
+    for (size_t i = 0; i < visible.size(); ++i)
+    {
+        UINT id = visible[i];
+        float radius = g_InstanceBounds.radius[id];
+        float w = g_InstanceBounds.centerX[id] * m._14 + g_InstanceBounds.centerY[id] * m._24 +
+            g_InstanceBounds.centerZ[id] * m._34 + m._44;
+
+        UINT lod = 0;
+        if (w > radius)
+        {
+            float screenRadius = radius * pixelScale / w;
+            if (screenRadius < MIN_SCREEN_RADIUS_PX)
+                continue;
+            while (lod < LOD_COUNT - 1 && screenRadius < LOD_SCREEN_RADIUS_PX[lod])
+                ++lod;
+        }
+
+        visible[kept] = id;
+        lods[kept] = (BYTE)lod;
+        ++kept;
+    }
+
+    g_CullingStats.contributionCulled = (UINT)(visible.size() - kept);
+    visible.resize(kept);
+    lods.resize(kept);
+}
+
+// Draw keys
+// Every draw is ordered by a 64-bit key, most significant field first:
+//   63..60 pass | 59..48 shader | 47..24 material | 23..0 quantised depth
+// Sorting groups the draws by pass, then shader, then material, which is where the state
+// changes are, and orders each group by depth. Opaque draws keep the depth as is (front
+// to back, so early depth testing rejects hidden pixels before litPS runs); transparent
+// draws invert it (back to front). The cubes' texture slices live in one texture array
+// and are chosen per instance, so they take no material bits: nothing is bound between
+// slices, and sorting by slice would only break the depth order.
+enum DrawPass
+{
+    DRAW_PASS_OPAQUE,
+    DRAW_PASS_SKYBOX,
+    DRAW_PASS_TRANSPARENT,
+};
+
+static const UINT DRAW_KEY_DEPTH_BITS = 24;
+static const UINT DRAW_KEY_MATERIAL_BITS = 24;
+static const UINT DRAW_KEY_SHADER_BITS = 12;
+static const UINT DRAW_KEY_DEPTH_MAX = (1u << DRAW_KEY_DEPTH_BITS) - 1;
 
-    if (FAILED(hr) || obtainedLevel != D3D_FEATURE_LEVEL_11_0)
-    {
-        pFactory->Release();
-        return false;
-    }
+inline UINT64 MakeDrawKey(UINT pass, UINT shader, UINT material, UINT depth)
+{
+    assert(pass < 16 && shader < (1u << DRAW_KEY_SHADER_BITS) && material < (1u << DRAW_KEY_MATERIAL_BITS) && depth <= DRAW_KEY_DEPTH_MAX);
+    return ((UINT64)pass << 60) | ((UINT64)shader << 48) | ((UINT64)material << DRAW_KEY_DEPTH_BITS) | depth;
+}
 
-    DXGI_SWAP_CHAIN_DESC scd = {};
-    scd.BufferCount = 2;
-    scd.BufferDesc.Width = g_ClientWidth;
-    scd.BufferDesc.Height = g_ClientHeight;
-    scd.BufferDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
-    scd.BufferDesc.RefreshRate.Numerator = 0;
-    scd.BufferDesc.RefreshRate.Denominator = 1;
-    scd.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT;
-    scd.OutputWindow = g_hWnd;
-    scd.SampleDesc.Count = 1;
-    scd.SampleDesc.Quality = 0;
-    scd.Windowed = TRUE;
-    scd.SwapEffect = DXGI_SWAP_EFFECT_FLIP_DISCARD;
-    scd.Flags = 0;
+inline UINT DrawKeyShader(UINT64 key)
+{
+    return (UINT)(key >> 48) & ((1u << DRAW_KEY_SHADER_BITS) - 1);
+}
 
-    hr = pFactory->CreateSwapChain(g_pDevice, &scd, &g_pSwapChain);
-    pFactory->Release();
-    if (FAILED(hr)) return false;
+// The top 24 bits of a non-negative float order like the float: the exponent and 15 bits
+// of mantissa, relative precision of 1/32768 at any distance and no far plane to fit
+inline UINT QuantizeDrawDepth(float depth)
+{
+    if (!(depth > 0.0f))
+        return 0;
+    UINT bits;
+    memcpy(&bits, &depth, sizeof(bits));
+    return bits >> (32 - DRAW_KEY_DEPTH_BITS);
+}
 
-    ID3D11Texture2D* pBackBuffer = nullptr;
-    hr = g_pSwapChain->GetBuffer(0, __uuidof(ID3D11Texture2D), (LPVOID*)&pBackBuffer);
-    if (FAILED(hr)) return false;
+// LSD radix sort of keys carrying a payload, 8 bits per pass, stable. Bytes every key
+// has in common are skipped, so keys with empty fields cost fewer passes. Large arrays are
+// cut into blocks that the job system counts and scatters in parallel: each block's
+// histogram gives it its own output offsets per digit, which keeps the sort stable.
+static const UINT RADIX_SORT_PARALLEL_MIN = 16384;
+static const UINT RADIX_SORT_MAX_BLOCKS = 32;
 
-    hr = g_pDevice->CreateRenderTargetView(pBackBuffer, nullptr, &g_pBackBufferRTV);
-    pBackBuffer->Release();
-    if (FAILED(hr)) return false;
+void RadixSortDrawKeys(UINT64* keys, UINT* values, UINT count, UINT64* keyScratch, UINT* valueScratch, JobSystem* jobs)
+{
+    if (count < 2)
+        return;
 
-    D3D11_TEXTURE2D_DESC depthDesc = {};
-    depthDesc.Width = g_ClientWidth;
-    depthDesc.Height = g_ClientHeight;
-    depthDesc.MipLevels = 1;
-    depthDesc.ArraySize = 1;
-    depthDesc.Format = DXGI_FORMAT_D32_FLOAT;
-    depthDesc.SampleDesc.Count = 1;
-    depthDesc.SampleDesc.Quality = 0;
-    depthDesc.Usage = D3D11_USAGE_DEFAULT;
-    depthDesc.BindFlags = D3D11_BIND_DEPTH_STENCIL;
+    UINT64 varying = 0;
+    for (UINT i = 1; i < count; ++i)
+        varying |= keys[i] ^ keys[0];
+
+    UINT blockCount = 1;
+    if (jobs && count >= RADIX_SORT_PARALLEL_MIN)
+        blockCount = (std::min)(RADIX_SORT_MAX_BLOCKS, jobs->GetThreadCount() * 4);
+    UINT blockSize = DivUp(count, blockCount);
+    UINT histograms[RADIX_SORT_MAX_BLOCKS][256];
+
+    UINT64* src = keys;
+    UINT64* dst = keyScratch;
+    UINT* srcValues = values;
+    UINT* dstValues = valueScratch;
+    auto forEachBlock = [&](const JobSystem::RangeFunc& fn)
+        {
+            if (blockCount > 1)
+                jobs->ParallelFor(blockCount, 1, fn);
+            else
+                fn(0, 1);
+        };
 
-    hr = g_pDevice->CreateTexture2D(&depthDesc, nullptr, &g_pDepthStencilTexture);
-    if (FAILED(hr)) return false;
+    for (UINT shift = 0; shift < 64; shift += 8)
+    {
+        if (((varying >> shift) & 0xFF) == 0)
+            continue;
 
-    hr = g_pDevice->CreateDepthStencilView(g_pDepthStencilTexture, nullptr, &g_pDepthStencilView);
-    if (FAILED(hr)) return false;
+        auto count256 = [&](UINT blockBegin, UINT blockEnd)
+            {
+                for (UINT block = blockBegin; block < blockEnd; ++block)
+                {
+                    UINT* histogram = histograms[block];
+                    memset(histogram, 0, sizeof(histograms[0]));
+                    UINT end = (std::min)((block + 1) * blockSize, count);
+                    for (UINT i = block * blockSize; i < end; ++i)
+                        ++histogram[(src[i] >> shift) & 0xFF];
+                }
+            };
+        forEachBlock(count256);
+
+        // Offsets digit by digit, and within a digit block by block
+        UINT offset = 0;
+        for (UINT digit = 0; digit < 256; ++digit)
+        {
+            for (UINT block = 0; block < blockCount; ++block)
+            {
+                UINT n = histograms[block][digit];
+                histograms[block][digit] = offset;
+                offset += n;
+            }
+        }
 
-    return true;
+        auto scatter = [&](UINT blockBegin, UINT blockEnd)
+            {
+                for (UINT block = blockBegin; block < blockEnd; ++block)
+                {
+                    UINT* next = histograms[block];
+                    UINT end = (std::min)((block + 1) * blockSize, count);
+                    for (UINT i = block * blockSize; i < end; ++i)
+                    {
+                        UINT to = next[(src[i] >> shift) & 0xFF]++;
+                        dst[to] = src[i];
+                        dstValues[to] = srcValues[i];
+                    }
+                }
+            };
+        forEachBlock(scatter);
+
+        std::swap(src, dst);
+        std::swap(srcValues, dstValues);
+    }
+
+    if (src != keys)
+    {
+        memcpy(keys, src, count * sizeof(UINT64));
+        memcpy(values, srcValues, count * sizeof(UINT));
+    }
 }
 
-// Geometry
-void CreateCubeResources()
+// Orders the visible instances by draw key: grouped by LOD shader, front to back within
+// each group. The groups become the LOD batches, one instanced draw each.
+void SortOpaqueDraws(const XMMATRIX& vp, FrameVector<UINT>& visible, const FrameVector<BYTE>& lods, UINT lodOffsets[LOD_COUNT + 1])
 {
-    const LitVertex cubeVertices[] =
+    double startMs = GetTimeMs();
+    XMFLOAT4X4 m;
+    XMStoreFloat4x4(&m, vp);
+
+    UINT count = (UINT)visible.size();
+    FrameArena& arena = g_FrameArenas.Get();
+    UINT64* keys = static_cast<UINT64*>(arena.Allocate(count * sizeof(UINT64) * 2));
+    UINT* values = static_cast<UINT*>(arena.Allocate(count * sizeof(UINT) * 2));
+
+    UINT lodCounts[LOD_COUNT] = {};
+    for (UINT i = 0; i < count; ++i)
     {
-        // Back (-Z)
-        { -0.5f, -0.5f, -0.5f,  0, 0,-1,  -1, 0, 0,  0,1 },
-        {  0.5f, -0.5f, -0.5f,  0, 0,-1,  -1, 0, 0,  1,1 },
-        {  0.5f,  0.5f, -0.5f,  0, 0,-1,  -1, 0, 0,  1,0 },
-        { -0.5f,  0.5f, -0.5f,  0, 0,-1,  -1, 0, 0,  0,0 },
+        UINT id = visible[i];
+        float w = g_InstanceBounds.centerX[id] * m._14 + g_InstanceBounds.centerY[id] * m._24 +
+            g_InstanceBounds.centerZ[id] * m._34 + m._44;
+        keys[i] = MakeDrawKey(DRAW_PASS_OPAQUE, lods[i], 0, QuantizeDrawDepth(w));
+        values[i] = id;
+        ++lodCounts[lods[i]];
+    }
 
-        // Front (+Z)
-        { -0.5f, -0.5f,  0.5f,  0, 0, 1,   1, 0, 0,  0,1 },
-        {  0.5f, -0.5f,  0.5f,  0, 0, 1,   1, 0, 0,  1,1 },
-        {  0.5f,  0.5f,  0.5f,  0, 0, 1,   1, 0, 0,  1,0 },
-        { -0.5f,  0.5f,  0.5f,  0, 0, 1,   1, 0, 0,  0,0 },
+    RadixSortDrawKeys(keys, values, count, keys + count, values + count, &g_JobSystem);
+    memcpy(visible.data(), values, count * sizeof(UINT));
 
-        // Left (-X)
-        { -0.5f, -0.5f,  0.5f, -1, 0, 0,   0, 0,-1,  0,1 },
-        { -0.5f, -0.5f, -0.5f, -1, 0, 0,   0, 0,-1,  1,1 },
-        { -0.5f,  0.5f, -0.5f, -1, 0, 0,   0, 0,-1,  1,0 },
-        { -0.5f,  0.5f,  0.5f, -1, 0, 0,   0, 0,-1,  0,0 },
+    lodOffsets[0] = 0;
+    for (UINT lod = 0; lod < LOD_COUNT; ++lod)
+    {
+        lodOffsets[lod + 1] = lodOffsets[lod] + lodCounts[lod];
+    }
+    g_CullingStats.drawSortMs = GetTimeMs() - startMs;
+}
 
-        // Right (+X)
-        {  0.5f, -0.5f, -0.5f,  1, 0, 0,   0, 0, 1,  0,1 },
-        {  0.5f, -0.5f,  0.5f,  1, 0, 0,   0, 0, 1,  1,1 },
-        {  0.5f,  0.5f,  0.5f,  1, 0, 0,   0, 0, 1,  1,0 },
-        {  0.5f,  0.5f, -0.5f,  1, 0, 0,   0, 0, 1,  0,0 },
+// Transparent BSP
+// Transparent triangles live in a world-space BSP tree. Walking it from the camera
+// (far side, node, near side) gives an exact back-to-front order, also for surfaces
+// that intersect each other; triangles crossing a splitting plane are cut in two.
+static const float BSP_PLANE_EPSILON = 1e-4f;
 
-        // Top (+Y)
-        { -0.5f,  0.5f, -0.5f,  0, 1, 0,   1, 0, 0,  0,1 },
-        {  0.5f,  0.5f, -0.5f,  0, 1, 0,   1, 0, 0,  1,1 },
-        {  0.5f,  0.5f,  0.5f,  0, 1, 0,   1, 0, 0,  1,0 },
-        { -0.5f,  0.5f,  0.5f,  0, 1, 0,   1, 0, 0,  0,0 },
+struct BspTriangle
+{
+    XMFLOAT3 p[3];
+    XMFLOAT4 color;
+};
 
-        // Bottom (-Y)
-        { -0.5f, -0.5f,  0.5f,  0,-1, 0,   1, 0, 0,  0,1 },
-        {  0.5f, -0.5f,  0.5f,  0,-1, 0,   1, 0, 0,  1,1 },
-        {  0.5f, -0.5f, -0.5f,  0,-1, 0,   1, 0, 0,  1,0 },
-        { -0.5f, -0.5f, -0.5f,  0,-1, 0,   1, 0, 0,  0,0 }
-    };
+class TransparentBsp
+{
+public:
+    void Clear()
+    {
+        m_Nodes.clear();
+        m_Triangles.clear();
+        m_NextCoplanar.clear();
+        m_SplitCount = 0;
+        m_MarkNodes = 0;
+        m_MarkTriangles = 0;
+        m_MarkSplits = 0;
+        m_Undo.clear();
+    }
 
-    const USHORT cubeIndices[] =
+    // Triangles inserted after Mark are taken out again by Rollback, which restores the
+    // nodes those insertions changed and drops the rest, in time proportional to them
+    void Mark()
     {
-        0, 2, 1,  0, 3, 2,
-        4, 5, 6,  4, 6, 7,
-        8,10, 9,  8,11,10,
-        12,14,13, 12,15,14,
-        16,18,17, 16,19,18,
-        20,22,21, 20,23,22
-    };
+        m_MarkNodes = m_Nodes.size();
+        m_MarkTriangles = m_Triangles.size();
+        m_MarkSplits = m_SplitCount;
+        m_Undo.clear();
+    }
 
-    D3D11_BUFFER_DESC desc = {};
-    desc.ByteWidth = sizeof(cubeVertices);
-    desc.Usage = D3D11_USAGE_IMMUTABLE;
-    desc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
-    D3D11_SUBRESOURCE_DATA data = { cubeVertices };
+    void Rollback()
+    {
+        for (size_t i = m_Undo.size(); i-- > 0;)
+            m_Nodes[m_Undo[i].index] = m_Undo[i].node;
+        m_Undo.clear();
+        m_Nodes.resize(m_MarkNodes);
+        m_Triangles.resize(m_MarkTriangles);
+        m_NextCoplanar.resize(m_MarkTriangles);
+        m_SplitCount = m_MarkSplits;
+    }
 
-    HRESULT hr = g_pDevice->CreateBuffer(&desc, &data, &g_pVertexBuffer);
-    if (FAILED(hr)) return;
+    void Insert(const BspTriangle& triangle);
+    void BackToFront(const XMFLOAT3& eye, std::vector<UINT>& order) const;
 
-    desc = {};
-    desc.ByteWidth = sizeof(cubeIndices);
-    desc.Usage = D3D11_USAGE_IMMUTABLE;
-    desc.BindFlags = D3D11_BIND_INDEX_BUFFER;
-    data.pSysMem = cubeIndices;
+    const std::vector<BspTriangle>& GetTriangles() const { return m_Triangles; }
+    UINT GetSplitCount() const { return m_SplitCount; }
 
-    hr = g_pDevice->CreateBuffer(&desc, &data, &g_pIndexBuffer);
-    if (FAILED(hr)) return;
+private:
+    struct Node
+    {
+        XMFLOAT4 plane;
+        int firstTriangle;  // coplanar triangles, chained through m_NextCoplanar
+        int front, back;
+    };
 
-    const SkyboxVertex skyboxVertices[] =
+    struct Pending
     {
-        {-10, -10, -10, 0, 0}, { 10, -10, -10, 0, 0}, { 10,  10, -10, 0, 0}, {-10,  10, -10, 0, 0},
-        {-10, -10,  10, 0, 0}, { 10, -10,  10, 0, 0}, { 10,  10,  10, 0, 0}, {-10,  10,  10, 0, 0}
+        BspTriangle triangle;
+        int node;
     };
 
-    const USHORT skyboxIndices[] =
+    struct SavedNode
     {
-        0,2,1, 0,3,2,
-        4,5,6, 4,6,7,
-        0,7,3, 0,4,7,
-        1,2,6, 1,6,5,
-        3,7,6, 3,6,2,
-        0,1,5, 0,5,4
+        int index;
+        Node node;
     };
 
-    desc = {};
-    desc.ByteWidth = sizeof(skyboxVertices);
-    desc.Usage = D3D11_USAGE_IMMUTABLE;
-    desc.BindFlags = D3D11_BIND_VERTEX_BUFFER;
-    data.pSysMem = skyboxVertices;
-    hr = g_pDevice->CreateBuffer(&desc, &data, &g_pSkyboxVertexBuffer);
-    if (FAILED(hr)) return;
+    void AddToNode(int node, const BspTriangle& triangle);
+    void PushToChild(int node, bool front, const BspTriangle& triangle);
+    void SaveNode(int node)
+    {
+        if ((size_t)node < m_MarkNodes)
+            m_Undo.push_back({ node, m_Nodes[node] });
+    }
 
-    desc = {};
-    desc.ByteWidth = sizeof(skyboxIndices);
-    desc.Usage = D3D11_USAGE_IMMUTABLE;
-    desc.BindFlags = D3D11_BIND_INDEX_BUFFER;
-    data.pSysMem = skyboxIndices;
-    hr = g_pDevice->CreateBuffer(&desc, &data, &g_pSkyboxIndexBuffer);
-    if (FAILED(hr)) return;
-}
+    std::vector<Node> m_Nodes;
+    std::vector<BspTriangle> m_Triangles;
+    std::vector<int> m_NextCoplanar;
+    std::vector<Pending> m_Pending;
+    UINT m_SplitCount = 0;
 
-// Shaders
-bool CompileShaders()
-{
-    const char* litVS = R"(
-cbuffer ViewProjBuffer : register(b1)
-{
-    float4x4 vp;
+    size_t m_MarkNodes = 0;
+    size_t m_MarkTriangles = 0;
+    UINT m_MarkSplits = 0;
+    std::vector<SavedNode> m_Undo;  // marked nodes as they were before a change, oldest first
 };
 
-struct InstanceData
+static bool ComputeTrianglePlane(const BspTriangle& t, XMFLOAT4& plane)
 {
-    float4x4 model;
-    float4x4 normalMatrix;
-    float4 params;
-    float4 posAngle;
-};
+    XMVECTOR p0 = XMLoadFloat3(&t.p[0]);
+    XMVECTOR n = XMVector3Cross(XMVectorSubtract(XMLoadFloat3(&t.p[1]), p0), XMVectorSubtract(XMLoadFloat3(&t.p[2]), p0));
+    float length = XMVectorGetX(XMVector3Length(n));
+    if (length < 1e-10f)
+        return false;
+
+    n = XMVectorScale(n, 1.0f / length);
+    XMStoreFloat4(&plane, XMVectorSetW(n, -XMVectorGetX(XMVector3Dot(n, p0))));
+    return true;
+}
 
-cbuffer InstanceBuffer : register(b3)
+static float PlaneDistance(const XMFLOAT4& plane, const XMFLOAT3& p)
 {
-    InstanceData instData[256];
-};
+    return plane.x * p.x + plane.y * p.y + plane.z * p.z + plane.w;
+}
 
-cbuffer VisibleIdsBuffer : register(b4)
+// Clips the triangle against the plane; each side gets a convex polygon of at most
+// 4 vertices (same winding as the input) which is fanned back into triangles.
+static void SplitTriangle(const BspTriangle& t, const float dist[3],
+    BspTriangle frontOut[2], UINT& frontCount, BspTriangle backOut[2], UINT& backCount)
 {
-    uint4 visibleIds[256];
-};
+    XMFLOAT3 frontPoly[4], backPoly[4];
+    UINT frontVerts = 0, backVerts = 0;
 
-struct VSInput
+    for (UINT i = 0; i < 3; ++i)
+    {
+        UINT j = (i + 1) % 3;
+        const XMFLOAT3& a = t.p[i];
+        const XMFLOAT3& b = t.p[j];
+        float da = dist[i], db = dist[j];
+
+        if (da >= -BSP_PLANE_EPSILON) frontPoly[frontVerts++] = a;
+        if (da <= BSP_PLANE_EPSILON) backPoly[backVerts++] = a;
+
+        if ((da > BSP_PLANE_EPSILON && db < -BSP_PLANE_EPSILON) || (da < -BSP_PLANE_EPSILON && db > BSP_PLANE_EPSILON))
+        {
+            float s = da / (da - db);
+            XMFLOAT3 p(a.x + (b.x - a.x) * s, a.y + (b.y - a.y) * s, a.z + (b.z - a.z) * s);
+            frontPoly[frontVerts++] = p;
+            backPoly[backVerts++] = p;
+        }
+    }
+
+    frontCount = 0;
+    for (UINT i = 2; i < frontVerts; ++i)
+        frontOut[frontCount++] = { { frontPoly[0], frontPoly[i - 1], frontPoly[i] }, t.color };
+
+    backCount = 0;
+    for (UINT i = 2; i < backVerts; ++i)
+        backOut[backCount++] = { { backPoly[0], backPoly[i - 1], backPoly[i] }, t.color };
+}
+
+void TransparentBsp::AddToNode(int node, const BspTriangle& triangle)
 {
-    float3 pos : POSITION;
-    float3 normal : NORMAL;
-    float3 tangent : TANGENT;
-    float2 uv : TEXCOORD;
-    uint instanceId : SV_InstanceID;
-};
+    int index = (int)m_Triangles.size();
+    SaveNode(node);
+    m_Triangles.push_back(triangle);
+    m_NextCoplanar.push_back(m_Nodes[node].firstTriangle);
+    m_Nodes[node].firstTriangle = index;
+}
 
-struct VSOutput
+void TransparentBsp::PushToChild(int node, bool front, const BspTriangle& triangle)
 {
-    float4 pos : SV_Position;
-    float3 worldPos : POSITION1;
-    float3 normalW : NORMAL;
-    float3 tangentW : TANGENT;
-    float2 uv : TEXCOORD;
-    nointerpolation uint instanceId : INST_ID;
-};
+    int child = front ? m_Nodes[node].front : m_Nodes[node].back;
+    if (child >= 0)
+    {
+        m_Pending.push_back({ triangle, child });
+        return;
+    }
 
-VSOutput vs(VSInput v)
+    // Slivers left over from splitting have no usable plane and cover no pixels
+    Node newNode = { XMFLOAT4(), -1, -1, -1 };
+    if (!ComputeTrianglePlane(triangle, newNode.plane))
+        return;
+
+    child = (int)m_Nodes.size();
+    SaveNode(node);
+    m_Nodes.push_back(newNode);
+    if (front)
+        m_Nodes[node].front = child;
+    else
+        m_Nodes[node].back = child;
+    AddToNode(child, triangle);
+}
+
+void TransparentBsp::Insert(const BspTriangle& triangle)
 {
-    VSOutput o;
+    if (m_Nodes.empty())
+    {
+        Node root = { XMFLOAT4(), -1, -1, -1 };
+        if (!ComputeTrianglePlane(triangle, root.plane))
+            return;
+        m_Nodes.push_back(root);
+        AddToNode(0, triangle);
+        return;
+    }
 
-    uint idx = visibleIds[v.instanceId].x;
-    float4x4 model = instData[idx].model;
-    float4x4 normalMatrix = instData[idx].normalMatrix;
+    m_Pending.clear();
+    m_Pending.push_back({ triangle, 0 });
 
-    float4 worldPos = mul(float4(v.pos, 1.0f), model);
-    o.pos = mul(worldPos, vp);
-    o.worldPos = worldPos.xyz;
+    while (!m_Pending.empty())
+    {
+        Pending item = m_Pending.back();
+        m_Pending.pop_back();
 
-    o.normalW = normalize(mul(float4(v.normal, 0.0f), normalMatrix).xyz);
-    o.tangentW = normalize(mul(float4(v.tangent, 0.0f), normalMatrix).xyz);
-    o.uv = v.uv;
-    o.instanceId = idx;
+        const XMFLOAT4 plane = m_Nodes[item.node].plane;
+        float dist[3];
+        UINT frontCount = 0, backCount = 0;
+        for (UINT i = 0; i < 3; ++i)
+        {
+            dist[i] = PlaneDistance(plane, item.triangle.p[i]);
+            if (dist[i] > BSP_PLANE_EPSILON) ++frontCount;
+            else if (dist[i] < -BSP_PLANE_EPSILON) ++backCount;
+        }
 
-    return o;
+        if (frontCount == 0 && backCount == 0)
+        {
+            AddToNode(item.node, item.triangle);
+        }
+        else if (backCount == 0)
+        {
+            PushToChild(item.node, true, item.triangle);
+        }
+        else if (frontCount == 0)
+        {
+            PushToChild(item.node, false, item.triangle);
+        }
+        else
+        {
+            BspTriangle frontPieces[2], backPieces[2];
+            UINT frontPieceCount = 0, backPieceCount = 0;
+            SplitTriangle(item.triangle, dist, frontPieces, frontPieceCount, backPieces, backPieceCount);
+            ++m_SplitCount;
+
+            for (UINT i = 0; i < frontPieceCount; ++i)
+                PushToChild(item.node, true, frontPieces[i]);
+            for (UINT i = 0; i < backPieceCount; ++i)
+                PushToChild(item.node, false, backPieces[i]);
+        }
+    }
 }
-)";
-
-    const char* litPS = R"(
-Texture2DArray colorTexture  : register(t0);
-Texture2D normalTexture      : register(t1);
-SamplerState colorSampler    : register(s0);
 
-struct LightData
+void TransparentBsp::BackToFront(const XMFLOAT3& eye, std::vector<UINT>& order) const
 {
-    float4 position;
-    float4 color;
-};
+    order.clear();
+    if (m_Nodes.empty())
+        return;
 
-cbuffer SceneBuffer : register(b2)
-{
-    float4 cameraPos;
-    float4 ambientColor;
-    LightData lights[4];
-    int4 lightCount;
-};
+    // Non-negative entries are subtrees still to visit, ~node emits that node's triangles
+    FrameVector<int> stack{ ArenaAllocator<int>(g_FrameArenas.Get()) };
+    stack.reserve(2 * m_Nodes.size());
+    stack.push_back(0);
+
+    while (!stack.empty())
+    {
+        int entry = stack.back();
+        stack.pop_back();
 
-struct InstanceData
-{
-    float4x4 model;
-    float4x4 normalMatrix;
-    float4 params;
-    float4 posAngle;
-};
+        if (entry < 0)
+        {
+            for (int t = m_Nodes[~entry].firstTriangle; t >= 0; t = m_NextCoplanar[t])
+                order.push_back((UINT)t);
+            continue;
+        }
 
-cbuffer InstanceBuffer : register(b3)
-{
-    InstanceData instData[256];
-};
+        const Node& node = m_Nodes[entry];
+        bool eyeInFront = PlaneDistance(node.plane, eye) >= 0.0f;
+        int nearChild = eyeInFront ? node.front : node.back;
+        int farChild = eyeInFront ? node.back : node.front;
 
-struct VSOutput
+        // Popped in reverse: far subtree, this node, near subtree
+        if (nearChild >= 0) stack.push_back(nearChild);
+        stack.push_back(~entry);
+        if (farChild >= 0) stack.push_back(farChild);
+    }
+}
+
+// Static objects are built into the tree once and marked. Every frame the moving objects
+// are inserted into that same tree and rolled back out of it the next frame.
+TransparentBsp g_TransparentBsp;
+bool g_StaticTransparentBspBuilt = false;  // cleared whenever the scene's panels change
+
+static void InsertTransparentObject(TransparentBsp& bsp, const TransparentObject& obj)
 {
-    float4 pos : SV_Position;
-    float3 worldPos : POSITION1;
-    float3 normalW : NORMAL;
-    float3 tangentW : TANGENT;
-    float2 uv : TEXCOORD;
-    nointerpolation uint instanceId : INST_ID;
-};
+    XMFLOAT3 corners[8];
+    for (UINT i = 0; i < 8; ++i)
+    {
+        XMVECTOR p = XMVectorSet(CUBE_CORNERS[i][0], CUBE_CORNERS[i][1], CUBE_CORNERS[i][2], 1.0f);
+        XMStoreFloat3(&corners[i], XMVector3TransformCoord(p, obj.model));
+    }
 
-float4 ps(VSOutput pixel) : SV_Target
+    for (UINT i = 0; i < 36; i += 3)
+    {
+        BspTriangle t = { { corners[CUBE_CORNER_INDICES[i]], corners[CUBE_CORNER_INDICES[i + 1]], corners[CUBE_CORNER_INDICES[i + 2]] }, obj.color };
+        bsp.Insert(t);
+    }
+}
+
+// Grows a dynamic buffer to hold at least `required` elements
+static bool EnsureDynamicBuffer(ID3D11Buffer*& buffer, UINT& capacity, UINT required, UINT stride, UINT bindFlags)
 {
-    uint idx = pixel.instanceId;
+    if (buffer && capacity >= required)
+        return true;
 
-    float shininess = instData[idx].params.x;
-    float texId = instData[idx].params.z;
-    float hasNM = instData[idx].params.w;
+    UINT newCapacity = (std::max)(required, (std::max)(capacity * 2, 256u));
+    SAFE_RELEASE(buffer);
+    capacity = 0;
 
-    float3 albedo = colorTexture.Sample(colorSampler, float3(pixel.uv, texId)).rgb;
+    D3D11_BUFFER_DESC desc = {};
+    desc.ByteWidth = newCapacity * stride;
+    desc.Usage = D3D11_USAGE_DYNAMIC;
+    desc.BindFlags = bindFlags;
+    desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+    HRESULT hr = g_pDevice->CreateBuffer(&desc, nullptr, &buffer);
+    if (FAILED(hr)) return false;
 
-    float3 N = normalize(pixel.normalW);
-    float3 T = normalize(pixel.tangentW);
-    float3 B = normalize(cross(N, T));
+    capacity = newCapacity;
+    return true;
+}
 
-    float3 normal = N;
-    if (hasNM > 0.5f)
+// Sorts the transparent triangles into the packet: last frame's moving objects rolled
+// back out of the static tree, this frame's inserted, then the triangles and their
+// back-to-front indices
+void BuildTransparentBsp(const FrameVector<TransparentObject>& objects, const XMFLOAT3& eye, FrameArena& arena, FramePacket& packet)
+{
+    if (!g_StaticTransparentBspBuilt)
     {
-        float3 nMap = normalTexture.Sample(colorSampler, pixel.uv).xyz;
-        nMap = normalize(nMap * 2.0f - 1.0f);
-        normal = normalize(nMap.x * T + nMap.y * B + nMap.z * N);
+        g_TransparentBsp.Clear();
+        for (const auto& obj : objects)
+        {
+            if (obj.isStatic)
+                InsertTransparentObject(g_TransparentBsp, obj);
+        }
+        g_TransparentBsp.Mark();
+        g_StaticTransparentBspBuilt = true;
     }
 
-    float3 viewDir = normalize(cameraPos.xyz - pixel.worldPos);
+    g_TransparentBsp.Rollback();
+    for (const auto& obj : objects)
+    {
+        if (!obj.isStatic)
+            InsertTransparentObject(g_TransparentBsp, obj);
+    }
 
-    float3 finalColor = ambientColor.rgb * albedo;
+    static std::vector<UINT> order;
+    g_TransparentBsp.BackToFront(eye, order);
 
-    [unroll]
-    for (int i = 0; i < lightCount.x; ++i)
-    {
-        float3 lightVec = lights[i].position.xyz - pixel.worldPos;
-        float dist = length(lightVec);
-        float3 lightDir = lightVec / max(dist, 0.0001f);
+    const std::vector<BspTriangle>& triangles = g_TransparentBsp.GetTriangles();
+    UINT vertexCount = (UINT)triangles.size() * 3;
+    UINT indexCount = (UINT)order.size() * 3;
 
-        float attenuation = 1.0f / (1.0f + 0.15f * dist + 0.08f * dist * dist);
-        float diffuse = max(dot(normal, lightDir), 0.0f);
+    g_CullingStats.transparentTriangles = (UINT)order.size();
+    g_CullingStats.bspSplits = g_TransparentBsp.GetSplitCount();
 
-        float3 reflectDir = reflect(-lightDir, normal);
-        float spec = pow(max(dot(viewDir, reflectDir), 0.0f), shininess);
+    if (indexCount == 0)
+        return;
 
-        float3 lightColor = lights[i].color.rgb;
-        finalColor += albedo * (0.15f + diffuse) * lightColor * attenuation;
-        finalColor += spec * lightColor * attenuation * 0.45f;
+    TransparentVertex* vertices = static_cast<TransparentVertex*>(arena.Allocate(vertexCount * sizeof(TransparentVertex)));
+    packet.bspVertices = vertices;
+    packet.bspVertexCount = vertexCount;
+    for (const auto& t : triangles)
+    {
+        for (UINT k = 0; k < 3; ++k)
+            *vertices++ = { t.p[k].x, t.p[k].y, t.p[k].z, t.color.x, t.color.y, t.color.z, t.color.w };
     }
 
-    return float4(saturate(finalColor), 1.0f);
+    UINT* indices = static_cast<UINT*>(arena.Allocate(indexCount * sizeof(UINT)));
+    packet.bspIndices = indices;
+    packet.bspIndexCount = indexCount;
+    for (UINT t : order)
+    {
+        *indices++ = t * 3;
+        *indices++ = t * 3 + 1;
+        *indices++ = t * 3 + 2;
+    }
 }
-)";
 
-    const char* skyboxVS = R"(
-cbuffer ViewProjBuffer : register(b1)
+// Copies the packet's sorted triangles into the dynamic buffers and draws them in one call
+void DrawTransparentBsp(const FramePacket& packet)
 {
-    float4x4 vp;
-};
+    if (packet.bspIndexCount == 0)
+        return;
+    if (!EnsureDynamicBuffer(g_pTransparentBspVB, g_TransparentBspVertexCapacity, packet.bspVertexCount, sizeof(TransparentVertex), D3D11_BIND_VERTEX_BUFFER))
+        return;
+    if (!EnsureDynamicBuffer(g_pTransparentBspIB, g_TransparentBspIndexCapacity, packet.bspIndexCount, sizeof(UINT), D3D11_BIND_INDEX_BUFFER))
+        return;
 
-struct VSInput
-{
-    float3 pos : POSITION;
-    float2 uv : TEXCOORD;
-};
+    D3D11_MAPPED_SUBRESOURCE mapped = {};
+    if (FAILED(g_pDeviceContext->Map(g_pTransparentBspVB, 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped)))
+        return;
+    memcpy(mapped.pData, packet.bspVertices, packet.bspVertexCount * sizeof(TransparentVertex));
+    g_pDeviceContext->Unmap(g_pTransparentBspVB, 0);
 
-struct VSOutput
-{
-    float4 pos : SV_Position;
-    float3 localPos : TEXCOORD;
-};
+    if (FAILED(g_pDeviceContext->Map(g_pTransparentBspIB, 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped)))
+        return;
+    memcpy(mapped.pData, packet.bspIndices, packet.bspIndexCount * sizeof(UINT));
+    g_pDeviceContext->Unmap(g_pTransparentBspIB, 0);
 
-VSOutput vs(VSInput vertex)
-{
-    VSOutput result;
-    result.pos = mul(float4(vertex.pos, 1.0), vp);
-    result.localPos = vertex.pos;
-    return result;
+    UINT stride = sizeof(TransparentVertex);
+    UINT offset = 0;
+    g_StateCache.VSSetShader(g_pTransparentBspVS);
+    g_StateCache.PSSetShader(g_pTransparentPS);
+    g_StateCache.IASetInputLayout(g_pTransparentBspInputLayout);
+    g_StateCache.IASetVertexBuffer(g_pTransparentBspVB, stride, offset);
+    g_StateCache.IASetIndexBuffer(g_pTransparentBspIB, DXGI_FORMAT_R32_UINT, 0);
+    g_StateCache.IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+    g_StateCache.VSSetConstantBuffers(1, 1, &g_pViewProjBuffer);
+
+    g_pDeviceContext->DrawIndexed(packet.bspIndexCount, 0, 0);
 }
-)";
 
-    const char* skyboxPS = R"(
-TextureCube skyboxTexture : register(t5);
-SamplerState skyboxSampler : register(s1);
+void UpdateStatsTitle(const CullingStats& s, double currentTime)
+{
+    if (!g_hWnd || currentTime - g_LastStatsTime < 0.5)
+        return;
+    g_LastStatsTime = currentTime;
+
+    float falsePositiveRate = s.sphereAccepted ? 100.0f * (float)s.boxRejected / (float)s.sphereAccepted : 0.0f;
+    UINT drawn = s.lodCounts[0] + s.lodCounts[1] + s.lodCounts[2];
+    wchar_t title[1024];
+    swprintf(title, 1024, L"%ls | frame %.2f ms (prepare %.2f, submit %.2f, latency %.2f, pipeline %u) | drawn %u/%u in %u batches (pages %u/%u) | xform %.3f ms (%ls) | binds %u (-%u) | graph %u passes (-%u), %u targets in %u textures, %.1f MB | upload %.2f KB, %u discards%ls | arena %.0f KB (peak %.0f KB) | frustum %u (box -%u, %.1f%% sphere FP) | occluded %u (%u occluders, %.3f ms%ls) | small %u | LOD %u/%u/%u%ls, sorted in %.3f ms | BSP %u tris, %u splits%ls | lit %u/%u (%.3f ms) | nodes %u/%u",
+        WINDOW_TITLE,
+        s.frameMs, s.prepareMs, s.submitMs, s.latencyMs, g_FramePipeline.GetDepth(),
+        drawn, s.totalInstances, s.opaqueBatches, s.pagesVisible, s.pageCount,
+        s.transformMs, g_HasAvx2 ? L"AVX2" : L"SSE",
+        s.stateCalls, s.stateCallsSkipped,
+        s.renderPasses, s.renderPassesCulled, s.renderTargets, s.renderTargetTextures, s.renderTargetBytes / (1024.0 * 1024.0),
+        s.uploadBytes / 1024.0, s.uploadRingDiscards, g_AnimationPaused ? L", paused" : L"",
+        s.frameArenaBytes / 1024.0, s.frameArenaHighWater / 1024.0,
+        s.frustumVisible, s.boxRejected, falsePositiveRate,
+        s.occlusionCulled, s.occluders, s.occlusionMs,
+        g_OcclusionCullingEnabled ? L"" : L", off",
+        s.contributionCulled, s.lodCounts[0], s.lodCounts[1], s.lodCounts[2],
+        g_LodEnabled ? L"" : L" (off)", s.drawSortMs,
+        s.transparentTriangles, s.bspSplits,
+        g_TransparentBspEnabled ? L"" : L" (off)",
+        s.lightInstances[0], s.lightInstances[1], s.lightQueryMs,
+        s.transformNodesUpdated, s.transformNodes);
+    SetWindowTextW(g_hWnd, title);
+}
 
-struct VSOutput
+// Transparent panels
+// A panel's node in the transform hierarchy places it; its size is applied on top, as the
+// hierarchy only carries uniform scale
+Entity CreateTransparentPanel(EntityWorld& world, TransformHierarchy& transforms, const XMFLOAT3& position, const TransparentPanel& panel)
 {
-    float4 pos : SV_Position;
-    float3 localPos : TEXCOORD;
-};
+    Entity e = world.Create(TRANSPARENT_PANEL_COMPONENTS);
+    world.Get<TransparentPanel>(e, COMPONENT_TRANSPARENT) = panel;
+    world.Get<TransformHandle>(e, COMPONENT_TRANSFORM) =
+        transforms.Add(TRANSFORM_NO_PARENT, MakeTrs(1.0f, XMFLOAT4(0.0f, 0.0f, 0.0f, 1.0f), position));
+    return e;
+}
 
-float4 ps(VSOutput pixel) : SV_Target0
+// Two glass panels, one fixed and one spinning
+void CreateTransparentPanels()
 {
-    return skyboxTexture.Sample(skyboxSampler, pixel.localPos);
+    struct PanelDesc
+    {
+        XMFLOAT3 position;
+        TransparentPanel panel;
+    };
+    const PanelDesc panels[] =
+    {
+        { XMFLOAT3(-2.8f, 0.0f, 1.2f), { XMFLOAT4(1.0f, 0.2f, 0.2f, 0.45f), XMFLOAT3(1.2f, 1.2f, 0.08f), 0.0f, 1u } },
+        { XMFLOAT3(0.6f, 0.2f, -2.3f), { XMFLOAT4(0.2f, 0.8f, 1.0f, 0.45f), XMFLOAT3(1.2f, 1.2f, 0.08f), 0.5f, 0u } },
+    };
+
+    for (const PanelDesc& desc : panels)
+        CreateTransparentPanel(g_Scene, g_SceneTransforms, desc.position, desc.panel);
+    g_StaticTransparentBspBuilt = false;
 }
-)";
 
-    const char* transparentVS = R"(
-cbuffer TransparentBuffer : register(b0)
+// Spinning panels turn about Y; fixed ones are left alone and stay clean in the hierarchy
+void AnimateTransparentPanels(EntityWorld& world, TransformHierarchy& transforms, float angle)
 {
-    float4x4 model;
-    float4 color;
+    world.ForEachChunk(TRANSPARENT_PANEL_COMPONENTS, [&](const EntityChunk& chunk)
+        {
+            const TransparentPanel* panels = chunk.Column<TransparentPanel>(COMPONENT_TRANSPARENT);
+            const TransformHandle* nodes = chunk.Column<TransformHandle>(COMPONENT_TRANSFORM);
+            for (UINT i = 0; i < chunk.count; ++i)
+            {
+                if (panels[i].spin == 0.0f)
+                    continue;
+                float halfAngle = 0.5f * angle * panels[i].spin;
+                Trs local = transforms.GetLocal(nodes[i]);
+                local.rotation = XMFLOAT4(0.0f, sinf(halfAngle), 0.0f, cosf(halfAngle));
+                transforms.SetLocal(nodes[i], local);
+            }
+        });
 }
-cbuffer ViewProjBuffer : register(b1)
+
+// Builds the frame's transparent draw list from the panel chunks and their world transforms,
+// with the squared distance to the eye for the back-to-front sort
+void GatherTransparentObjects(EntityWorld& world, const TransformHierarchy& transforms, const XMFLOAT3& eye, FrameVector<TransparentObject>& objects)
 {
-    float4x4 vp;
+    objects.clear();
+    world.ForEachChunk(TRANSPARENT_PANEL_COMPONENTS, [&](const EntityChunk& chunk)
+        {
+            const TransparentPanel* panels = chunk.Column<TransparentPanel>(COMPONENT_TRANSPARENT);
+            const TransformHandle* nodes = chunk.Column<TransformHandle>(COMPONENT_TRANSFORM);
+            for (UINT i = 0; i < chunk.count; ++i)
+            {
+                const TransparentPanel& panel = panels[i];
+                Trs world = transforms.GetWorld(nodes[i]);
+                TransparentObject obj;
+                obj.model = XMMatrixScaling(panel.size.x, panel.size.y, panel.size.z) * TrsToMatrix(world);
+                obj.color = panel.color;
+                obj.center = world.translation;
+                float dx = world.translation.x - eye.x;
+                float dy = world.translation.y - eye.y;
+                float dz = world.translation.z - eye.z;
+                obj.distanceToCamera = dx * dx + dy * dy + dz * dz;
+                obj.isStatic = panel.isStatic != 0;
+                objects.push_back(obj);
+            }
+        });
 }
 
-struct VSInput
+// Scene files
+// A versioned image meant to be memory-mapped and read in place: a fixed header, then one
+// section per array at a 64-byte aligned offset. Instances are stored as the same SoA
+// columns the entity world keeps, so loading is a validation pass and straight copies
+// into the archetype chunks, with no parsing and no per-object allocation. Materials
+// name their textures; the names must be among those LoadTextures binds.
+static const UINT SCENE_FILE_MAGIC = 0x53375748;  // "HW7S"
+static const UINT SCENE_FILE_VERSION = 1;
+static const UINT SCENE_FILE_ALIGNMENT = 64;
+static const UINT SCENE_TEXTURE_NAME_LENGTH = 64;
+static const UINT SCENE_NO_TEXTURE = 0xFFFFFFFFu;
+
+// Array slices of g_pTextureArray, then g_pNormalTexture
+static const char* const SCENE_ALBEDO_TEXTURES[] = { "Brick.dds", "Kitty.dds" };
+static const char* const SCENE_NORMAL_TEXTURE = "BrickNM.dds";
+
+enum SceneFileSection
 {
-    float3 pos : POSITION;
-    float3 normal : NORMAL;
-    float3 tangent : TANGENT;
-    float2 uv : TEXCOORD;
+    SCENE_SECTION_POSITION_X,  // float per instance
+    SCENE_SECTION_POSITION_Y,
+    SCENE_SECTION_POSITION_Z,
+    SCENE_SECTION_SCALE,
+    SCENE_SECTION_SPIN,
+    SCENE_SECTION_MATERIAL,    // UINT per instance, index into the materials
+    SCENE_SECTION_MATERIALS,   // SceneMaterial
+    SCENE_SECTION_TEXTURES,    // SceneFileTexture
+    SCENE_SECTION_LIGHTS,      // SceneLight
+    SCENE_SECTION_PANELS,      // SceneFilePanel
+    SCENE_SECTION_COUNT
 };
 
-struct VSOutput
+struct SceneFileRange
 {
-    float4 pos : SV_Position;
-    float4 color : COLOR0;
+    UINT64 offset;
+    UINT64 bytes;
 };
 
-VSOutput vs(VSInput vertex)
+struct SceneFileHeader
 {
-    VSOutput result;
-    float4 worldPos = mul(float4(vertex.pos, 1.0), model);
-    result.pos = mul(worldPos, vp);
-    result.color = color;
-    return result;
-}
-)";
+    UINT magic;
+    UINT version;
+    UINT headerBytes;
+    UINT sectionCount;
+    UINT64 fileBytes;
+    UINT instanceCount;
+    UINT materialCount;
+    UINT textureCount;
+    UINT lightCount;
+    UINT panelCount;
+    UINT reserved;
+    SceneFileRange sections[SCENE_SECTION_COUNT];
+};
 
-    const char* transparentPS = R"(
-struct VSOutput
+struct SceneMaterial
 {
-    float4 pos : SV_Position;
-    float4 color : COLOR0;
+    UINT albedoTexture;  // index into the textures
+    UINT normalTexture;  // or SCENE_NO_TEXTURE
+    float shininess;
+    UINT reserved;
 };
 
-float4 ps(VSOutput pixel) : SV_Target0
+struct SceneFileTexture
 {
-    return pixel.color;
-}
-)";
+    char name[SCENE_TEXTURE_NAME_LENGTH];  // NUL-terminated
+};
 
-    const char* postVS = R"(
-struct VSOutput
+struct SceneFilePanel
 {
-    float4 pos : SV_Position;
-    float2 uv  : TEXCOORD0;
+    XMFLOAT3 position;
+    UINT reserved;
+    TransparentPanel panel;
 };
 
-VSOutput vs(uint vertexId : SV_VertexID)
+// Pointers into a validated image
+struct SceneFileView
 {
-    VSOutput o;
+    const SceneFileHeader* header = nullptr;
+    const float* posX = nullptr;
+    const float* posY = nullptr;
+    const float* posZ = nullptr;
+    const float* scale = nullptr;
+    const float* spin = nullptr;
+    const UINT* material = nullptr;
+    const SceneMaterial* materials = nullptr;
+    const SceneFileTexture* textures = nullptr;
+    const SceneLight* lights = nullptr;
+    const SceneFilePanel* panels = nullptr;
+};
 
-    float2 pos[6] =
+static UINT SceneSectionCount(const SceneFileHeader& header, UINT section)
+{
+    switch (section)
     {
-        float2(-1.0, -1.0),
-        float2(-1.0,  1.0),
-        float2( 1.0,  1.0),
-        float2(-1.0, -1.0),
-        float2( 1.0,  1.0),
-        float2( 1.0, -1.0)
-    };
-
-    float2 p = pos[vertexId];
-    o.pos = float4(p, 0.0, 1.0);
-    o.uv = float2(p.x * 0.5 + 0.5, 0.5 - p.y * 0.5);
-    return o;
+    case SCENE_SECTION_MATERIALS: return header.materialCount;
+    case SCENE_SECTION_TEXTURES: return header.textureCount;
+    case SCENE_SECTION_LIGHTS: return header.lightCount;
+    case SCENE_SECTION_PANELS: return header.panelCount;
+    default: return header.instanceCount;
+    }
 }
-)";
-
-    const char* postPS = R"(
-Texture2D sceneTexture : register(t0);
-SamplerState sceneSampler : register(s0);
 
-cbuffer PostProcessBuffer : register(b0)
+static UINT SceneSectionStride(UINT section)
 {
-    int4 effectMode;
-};
+    switch (section)
+    {
+    case SCENE_SECTION_MATERIAL: return sizeof(UINT);
+    case SCENE_SECTION_MATERIALS: return sizeof(SceneMaterial);
+    case SCENE_SECTION_TEXTURES: return sizeof(SceneFileTexture);
+    case SCENE_SECTION_LIGHTS: return sizeof(SceneLight);
+    case SCENE_SECTION_PANELS: return sizeof(SceneFilePanel);
+    default: return sizeof(float);
+    }
+}
 
-struct VSOutput
+static bool AllFinite(const float* values, UINT count)
 {
-    float4 pos : SV_Position;
-    float2 uv  : TEXCOORD0;
-};
+    // x - x is NaN for NaN and infinities, so one accumulated check covers the column
+    float acc = 0.0f;
+    for (UINT i = 0; i < count; ++i)
+        acc += values[i] - values[i];
+    return acc == 0.0f;
+}
 
-float4 ps(VSOutput pixel) : SV_Target0
+// Checks everything the loader relies on; `error` names the first problem found
+bool ValidateSceneFile(const BYTE* data, UINT64 size, SceneFileView& view, const char** error)
 {
-    float3 color = sceneTexture.Sample(sceneSampler, pixel.uv).rgb;
+    const SceneFileHeader* header = reinterpret_cast<const SceneFileHeader*>(data);
+    *error = nullptr;
+    if (size < sizeof(SceneFileHeader) || header->magic != SCENE_FILE_MAGIC)
+        *error = "not a scene file";
+    else if (header->version != SCENE_FILE_VERSION)
+        *error = "unsupported version";
+    else if (header->headerBytes != sizeof(SceneFileHeader) || header->sectionCount != SCENE_SECTION_COUNT || header->fileBytes != size)
+        *error = "header does not match the file";
+    else if (header->lightCount > MAX_SCENE_LIGHTS)
+        *error = "too many lights";
+    if (*error)
+        return false;
 
-    if (effectMode.x == 1)
+    // Sections in order, aligned, inside the file and exactly as long as their arrays
+    UINT64 end = sizeof(SceneFileHeader);
+    for (UINT s = 0; s < SCENE_SECTION_COUNT; ++s)
     {
-        float gray = dot(color, float3(0.299, 0.587, 0.114));
-        color = float3(gray, gray, gray);
+        const SceneFileRange& range = header->sections[s];
+        if (range.offset % SCENE_FILE_ALIGNMENT != 0 || range.offset < end || range.offset > size ||
+            range.bytes > size - range.offset || range.bytes != (UINT64)SceneSectionCount(*header, s) * SceneSectionStride(s))
+        {
+            *error = "bad section layout";
+            return false;
+        }
+        end = range.offset + range.bytes;
     }
-    else if (effectMode.x == 2)
+
+    view.header = header;
+    view.posX = reinterpret_cast<const float*>(data + header->sections[SCENE_SECTION_POSITION_X].offset);
+    view.posY = reinterpret_cast<const float*>(data + header->sections[SCENE_SECTION_POSITION_Y].offset);
+    view.posZ = reinterpret_cast<const float*>(data + header->sections[SCENE_SECTION_POSITION_Z].offset);
+    view.scale = reinterpret_cast<const float*>(data + header->sections[SCENE_SECTION_SCALE].offset);
+    view.spin = reinterpret_cast<const float*>(data + header->sections[SCENE_SECTION_SPIN].offset);
+    view.material = reinterpret_cast<const UINT*>(data + header->sections[SCENE_SECTION_MATERIAL].offset);
+    view.materials = reinterpret_cast<const SceneMaterial*>(data + header->sections[SCENE_SECTION_MATERIALS].offset);
+    view.textures = reinterpret_cast<const SceneFileTexture*>(data + header->sections[SCENE_SECTION_TEXTURES].offset);
+    view.lights = reinterpret_cast<const SceneLight*>(data + header->sections[SCENE_SECTION_LIGHTS].offset);
+    view.panels = reinterpret_cast<const SceneFilePanel*>(data + header->sections[SCENE_SECTION_PANELS].offset);
+
+    UINT n = header->instanceCount;
+    UINT maxMaterial = 0;
+    for (UINT i = 0; i < n; ++i)
+        maxMaterial = (std::max)(maxMaterial, view.material[i]);
+    if (n > 0 && maxMaterial >= header->materialCount)
+        *error = "material index out of range";
+    else if (!AllFinite(view.posX, n) || !AllFinite(view.posY, n) || !AllFinite(view.posZ, n) || !AllFinite(view.scale, n) || !AllFinite(view.spin, n))
+        *error = "non-finite instance data";
+
+    for (UINT t = 0; t < header->textureCount && !*error; ++t)
     {
-        float3 sepia;
-        sepia.r = dot(color, float3(0.393, 0.769, 0.189));
-        sepia.g = dot(color, float3(0.349, 0.686, 0.168));
-        sepia.b = dot(color, float3(0.272, 0.534, 0.131));
-        color = lerp(color, sepia, 0.75);
+        if (!memchr(view.textures[t].name, 0, SCENE_TEXTURE_NAME_LENGTH))
+            *error = "unterminated texture name";
     }
-    else if (effectMode.x == 3)
+    for (UINT m = 0; m < header->materialCount && !*error; ++m)
     {
-        color *= 1.18;
+        const SceneMaterial& material = view.materials[m];
+        if (material.albedoTexture >= header->textureCount ||
+            (material.normalTexture != SCENE_NO_TEXTURE && material.normalTexture >= header->textureCount))
+            *error = "texture index out of range";
     }
-
-    return float4(saturate(color), 1.0);
+    return *error == nullptr;
 }
-)";
-
-    UINT flags = D3DCOMPILE_ENABLE_STRICTNESS;
-#ifdef _DEBUG
-    flags |= D3DCOMPILE_DEBUG | D3DCOMPILE_SKIP_OPTIMIZATION;
-#endif
-
-    HRESULT hr;
-    ID3DBlob* pVsBlob = nullptr;
-    ID3DBlob* pPsBlob = nullptr;
-    ID3DBlob* pErrorBlob = nullptr;
 
-    D3D11_INPUT_ELEMENT_DESC litLayout[] =
+// Image of the given instances, panels and lights, ready to write out
+void BuildSceneFile(InstanceStore& store, const TransformHierarchy& transforms, const std::vector<SceneLight>& lights, std::vector<BYTE>& image)
+{
+    // Materials are recovered from the packed GPU records: shininess, texture slice and
+    // normal map flag
+    std::vector<UINT> materialKeys;  // params[0] shininess half, then params[1]
+    std::vector<UINT> materialIds(store.count);
+    for (UINT i = 0; i < store.count; ++i)
     {
-        {"POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0,  0, D3D11_INPUT_PER_VERTEX_DATA, 0},
-        {"NORMAL",   0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 12, D3D11_INPUT_PER_VERTEX_DATA, 0},
-        {"TANGENT",  0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 24, D3D11_INPUT_PER_VERTEX_DATA, 0},
-        {"TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT,    0, 36, D3D11_INPUT_PER_VERTEX_DATA, 0}
-    };
+        const InstanceStaticGPU& gpu = InstanceComponent<InstanceStaticGPU>(store, i, COMPONENT_INSTANCE_GPU);
+        UINT shininess = gpu.params[0] & 0xFFFF;
+        UINT m = 0;
+        while (m < materialKeys.size() / 2 && (materialKeys[2 * m] != shininess || materialKeys[2 * m + 1] != gpu.params[1]))
+            ++m;
+        if (m == materialKeys.size() / 2)
+        {
+            materialKeys.push_back(shininess);
+            materialKeys.push_back(gpu.params[1]);
+        }
+        materialIds[i] = m;
+    }
 
-    D3D11_INPUT_ELEMENT_DESC skyboxLayout[] =
+    std::vector<SceneFileTexture> textures(_countof(SCENE_ALBEDO_TEXTURES) + 1);
+    for (UINT t = 0; t < _countof(SCENE_ALBEDO_TEXTURES); ++t)
+        snprintf(textures[t].name, SCENE_TEXTURE_NAME_LENGTH, "%s", SCENE_ALBEDO_TEXTURES[t]);
+    snprintf(textures.back().name, SCENE_TEXTURE_NAME_LENGTH, "%s", SCENE_NORMAL_TEXTURE);
+
+    std::vector<SceneMaterial> materials(materialKeys.size() / 2);
+    for (size_t m = 0; m < materials.size(); ++m)
     {
-        {"POSITION", 0, DXGI_FORMAT_R32G32B32_FLOAT, 0, 0,  D3D11_INPUT_PER_VERTEX_DATA, 0},
-        {"TEXCOORD", 0, DXGI_FORMAT_R32G32_FLOAT,    0, 12, D3D11_INPUT_PER_VERTEX_DATA, 0}
-    };
+        UINT params = materialKeys[2 * m + 1];
+        materials[m].albedoTexture = (UINT)PackedVector::XMConvertHalfToFloat((PackedVector::HALF)(params & 0xFFFF));
+        materials[m].normalTexture = (params >> 16) ? (UINT)textures.size() - 1 : SCENE_NO_TEXTURE;
+        materials[m].shininess = PackedVector::XMConvertHalfToFloat((PackedVector::HALF)materialKeys[2 * m]);
+        materials[m].reserved = 0;
+    }
 
-    auto PrintError = [&](ID3DBlob* blob)
+    std::vector<SceneFilePanel> panels;
+    store.world->ForEachChunk(TRANSPARENT_PANEL_COMPONENTS, [&](const EntityChunk& chunk)
         {
-            if (blob)
-                OutputDebugStringA((const char*)blob->GetBufferPointer());
-        };
+            const TransparentPanel* panel = chunk.Column<TransparentPanel>(COMPONENT_TRANSPARENT);
+            const TransformHandle* nodes = chunk.Column<TransformHandle>(COMPONENT_TRANSFORM);
+            for (UINT i = 0; i < chunk.count; ++i)
+            {
+                SceneFilePanel p = {};
+                p.position = transforms.GetLocal(nodes[i]).translation;
+                p.panel = panel[i];
+                panels.push_back(p);
+            }
+        });
 
-    hr = D3DCompile(litVS, strlen(litVS), nullptr, nullptr, nullptr, "vs", "vs_5_0", flags, 0, &pVsBlob, &pErrorBlob);
-    if (FAILED(hr))
+    SceneFileHeader header = {};
+    header.magic = SCENE_FILE_MAGIC;
+    header.version = SCENE_FILE_VERSION;
+    header.headerBytes = sizeof(SceneFileHeader);
+    header.sectionCount = SCENE_SECTION_COUNT;
+    header.instanceCount = store.count;
+    header.materialCount = (UINT)materials.size();
+    header.textureCount = (UINT)textures.size();
+    header.lightCount = (UINT)(std::min)(lights.size(), (size_t)MAX_SCENE_LIGHTS);
+    header.panelCount = (UINT)panels.size();
+    UINT64 offset = sizeof(SceneFileHeader);
+    for (UINT s = 0; s < SCENE_SECTION_COUNT; ++s)
     {
-        PrintError(pErrorBlob);
-        SAFE_RELEASE(pErrorBlob);
-        return false;
+        offset = (offset + SCENE_FILE_ALIGNMENT - 1) / SCENE_FILE_ALIGNMENT * SCENE_FILE_ALIGNMENT;
+        header.sections[s].offset = offset;
+        header.sections[s].bytes = (UINT64)SceneSectionCount(header, s) * SceneSectionStride(s);
+        offset += header.sections[s].bytes;
     }
-    hr = g_pDevice->CreateVertexShader(pVsBlob->GetBufferPointer(), pVsBlob->GetBufferSize(), nullptr, &g_pVertexShader);
-    if (FAILED(hr)) return false;
-    hr = g_pDevice->CreateInputLayout(litLayout, 4, pVsBlob->GetBufferPointer(), pVsBlob->GetBufferSize(), &g_pInputLayout);
-    if (FAILED(hr)) return false;
-    SAFE_RELEASE(pVsBlob);
+    header.fileBytes = offset;
+
+    image.assign((size_t)header.fileBytes, 0);
+    memcpy(image.data(), &header, sizeof(header));
+    auto section = [&](UINT s) { return image.data() + header.sections[s].offset; };
 
-    hr = D3DCompile(litPS, strlen(litPS), nullptr, nullptr, nullptr, "ps", "ps_5_0", flags, 0, &pPsBlob, &pErrorBlob);
-    if (FAILED(hr))
+    EntityArchetype& archetype = *store.archetype;
+    for (const EntityChunk& chunk : archetype.chunks)
     {
-        PrintError(pErrorBlob);
-        SAFE_RELEASE(pErrorBlob);
+        UINT count = (std::min)(chunk.count, store.count - (std::min)(store.count, chunk.firstRow));
+        const UINT columns[] = { COMPONENT_POSITION_X, COMPONENT_POSITION_Y, COMPONENT_POSITION_Z, COMPONENT_SCALE, COMPONENT_SPIN };
+        for (UINT c = 0; c < _countof(columns); ++c)
+            memcpy(section(SCENE_SECTION_POSITION_X + c) + chunk.firstRow * sizeof(float), chunk.Column<float>(columns[c]), count * sizeof(float));
+    }
+    memcpy(section(SCENE_SECTION_MATERIAL), materialIds.data(), header.sections[SCENE_SECTION_MATERIAL].bytes);
+    memcpy(section(SCENE_SECTION_MATERIALS), materials.data(), header.sections[SCENE_SECTION_MATERIALS].bytes);
+    memcpy(section(SCENE_SECTION_TEXTURES), textures.data(), header.sections[SCENE_SECTION_TEXTURES].bytes);
+    memcpy(section(SCENE_SECTION_LIGHTS), lights.data(), header.sections[SCENE_SECTION_LIGHTS].bytes);
+    memcpy(section(SCENE_SECTION_PANELS), panels.data(), header.sections[SCENE_SECTION_PANELS].bytes);
+}
+
+bool WriteSceneFile(const wchar_t* path, const std::vector<BYTE>& image)
+{
+    HANDLE file = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
         return false;
+
+    bool ok = true;
+    for (size_t written = 0; written < image.size() && ok; )
+    {
+        DWORD bytes = (DWORD)(std::min)(image.size() - written, (size_t)(1u << 30));
+        DWORD done = 0;
+        ok = WriteFile(file, image.data() + written, bytes, &done, NULL) && done == bytes;
+        written += bytes;
     }
-    hr = g_pDevice->CreatePixelShader(pPsBlob->GetBufferPointer(), pPsBlob->GetBufferSize(), nullptr, &g_pPixelShader);
-    if (FAILED(hr)) return false;
-    SAFE_RELEASE(pPsBlob);
+    CloseHandle(file);
+    return ok;
+}
 
-    hr = D3DCompile(skyboxVS, strlen(skyboxVS), nullptr, nullptr, nullptr, "vs", "vs_5_0", flags, 0, &pVsBlob, &pErrorBlob);
-    if (FAILED(hr))
+// Appends the image's instances and panels to the store's world and replaces the lights.
+// Fails without touching anything when a material names a texture the renderer lacks.
+bool LoadScene(const SceneFileView& view, InstanceStore& store, TransformHierarchy& transforms, std::vector<SceneLight>& lights, const char** error)
+{
+    const SceneFileHeader& header = *view.header;
+
+    // Packed GPU parameters per material
+    std::vector<UINT> shininess(header.materialCount), params(header.materialCount);
+    for (UINT m = 0; m < header.materialCount; ++m)
     {
-        PrintError(pErrorBlob);
-        SAFE_RELEASE(pErrorBlob);
-        return false;
+        const SceneMaterial& material = view.materials[m];
+        UINT slice = 0;
+        while (slice < _countof(SCENE_ALBEDO_TEXTURES) && strcmp(view.textures[material.albedoTexture].name, SCENE_ALBEDO_TEXTURES[slice]) != 0)
+            ++slice;
+        if (slice == _countof(SCENE_ALBEDO_TEXTURES) ||
+            (material.normalTexture != SCENE_NO_TEXTURE && strcmp(view.textures[material.normalTexture].name, SCENE_NORMAL_TEXTURE) != 0))
+        {
+            *error = "material uses a texture the renderer does not load";
+            return false;
+        }
+        shininess[m] = PackedVector::XMConvertFloatToHalf(material.shininess);
+        params[m] = PackHalf2((float)slice, material.normalTexture != SCENE_NO_TEXTURE ? 1.0f : 0.0f);
     }
-    hr = g_pDevice->CreateVertexShader(pVsBlob->GetBufferPointer(), pVsBlob->GetBufferSize(), nullptr, &g_pSkyboxVS);
-    if (FAILED(hr)) return false;
-    hr = g_pDevice->CreateInputLayout(skyboxLayout, 2, pVsBlob->GetBufferPointer(), pVsBlob->GetBufferSize(), &g_pSkyboxInputLayout);
-    if (FAILED(hr)) return false;
-    SAFE_RELEASE(pVsBlob);
 
-    hr = D3DCompile(skyboxPS, strlen(skyboxPS), nullptr, nullptr, nullptr, "ps", "ps_5_0", flags, 0, &pPsBlob, &pErrorBlob);
-    if (FAILED(hr))
+    // Rows are appended in order, so the new instances are [first, first + n) and fill the
+    // chunks column by column
+    EntityWorld& world = *store.world;
+    EntityArchetype& archetype = *store.archetype;
+    UINT n = header.instanceCount;
+    UINT first = world.CreateMany(OPAQUE_INSTANCE_COMPONENTS, n);
+    assert(first == store.count);
+    store.count += n;
+
+    for (EntityChunk& chunk : archetype.chunks)
     {
-        PrintError(pErrorBlob);
-        SAFE_RELEASE(pErrorBlob);
-        return false;
+        UINT begin = (std::max)(first, chunk.firstRow);
+        UINT end = (std::min)(first + n, chunk.firstRow + chunk.count);
+        if (begin >= end)
+            continue;
+        UINT src = begin - first;
+        UINT dst = begin - chunk.firstRow;
+        UINT count = end - begin;
+
+        const float* columns[] = { view.posX, view.posY, view.posZ, view.scale, view.spin };
+        const UINT types[] = { COMPONENT_POSITION_X, COMPONENT_POSITION_Y, COMPONENT_POSITION_Z, COMPONENT_SCALE, COMPONENT_SPIN };
+        for (UINT c = 0; c < _countof(columns); ++c)
+            memcpy(chunk.Column<float>(types[c]) + dst, columns[c] + src, count * sizeof(float));
+
+        InstanceStaticGPU* gpu = chunk.Column<InstanceStaticGPU>(COMPONENT_INSTANCE_GPU) + dst;
+        for (UINT i = 0; i < count; ++i)
+        {
+            UINT s = src + i;
+            UINT m = view.material[s];
+            gpu[i].posScale = XMFLOAT4(view.posX[s], view.posY[s], view.posZ[s], view.scale[s]);
+            gpu[i].params[0] = shininess[m] | ((UINT)PackedVector::XMConvertFloatToHalf(view.spin[s]) << 16);
+            gpu[i].params[1] = params[m];
+        }
     }
-    hr = g_pDevice->CreatePixelShader(pPsBlob->GetBufferPointer(), pPsBlob->GetBufferSize(), nullptr, &g_pSkyboxPS);
-    if (FAILED(hr)) return false;
-    SAFE_RELEASE(pPsBlob);
+    store.staticDirty.Mark(first, first + n);
 
-    hr = D3DCompile(transparentVS, strlen(transparentVS), nullptr, nullptr, nullptr, "vs", "vs_5_0", flags, 0, &pVsBlob, &pErrorBlob);
-    if (FAILED(hr))
+    for (UINT p = 0; p < header.panelCount; ++p)
+        CreateTransparentPanel(world, transforms, view.panels[p].position, view.panels[p].panel);
+
+    lights.assign(view.lights, view.lights + header.lightCount);
+    return true;
+}
+
+// Read-only view of a whole file
+class MappedFile
+{
+public:
+    ~MappedFile() { Close(); }
+
+    bool Open(const wchar_t* path)
     {
-        PrintError(pErrorBlob);
-        SAFE_RELEASE(pErrorBlob);
-        return false;
+        Close();
+        m_File = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (m_File == INVALID_HANDLE_VALUE)
+            return false;
+        LARGE_INTEGER size = {};
+        if (!GetFileSizeEx(m_File, &size) || size.QuadPart == 0)
+            return false;
+        m_Mapping = CreateFileMappingW(m_File, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!m_Mapping)
+            return false;
+        m_pData = static_cast<const BYTE*>(MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0));
+        m_Size = (UINT64)size.QuadPart;
+        return m_pData != nullptr;
     }
-    hr = g_pDevice->CreateVertexShader(pVsBlob->GetBufferPointer(), pVsBlob->GetBufferSize(), nullptr, &g_pTransparentVS);
-    if (FAILED(hr)) return false;
-    hr = g_pDevice->CreateInputLayout(litLayout, 4, pVsBlob->GetBufferPointer(), pVsBlob->GetBufferSize(), &g_pTransparentInputLayout);
-    if (FAILED(hr)) return false;
-    SAFE_RELEASE(pVsBlob);
 
-    hr = D3DCompile(transparentPS, strlen(transparentPS), nullptr, nullptr, nullptr, "ps", "ps_5_0", flags, 0, &pPsBlob, &pErrorBlob);
-    if (FAILED(hr))
+    void Close()
     {
-        PrintError(pErrorBlob);
-        SAFE_RELEASE(pErrorBlob);
-        return false;
+        if (m_pData)
+            UnmapViewOfFile(m_pData);
+        if (m_Mapping)
+            CloseHandle(m_Mapping);
+        if (m_File != INVALID_HANDLE_VALUE)
+            CloseHandle(m_File);
+        m_pData = nullptr;
+        m_Mapping = NULL;
+        m_File = INVALID_HANDLE_VALUE;
+        m_Size = 0;
     }
-    hr = g_pDevice->CreatePixelShader(pPsBlob->GetBufferPointer(), pPsBlob->GetBufferSize(), nullptr, &g_pTransparentPS);
-    if (FAILED(hr)) return false;
-    SAFE_RELEASE(pPsBlob);
 
-    hr = D3DCompile(postVS, strlen(postVS), nullptr, nullptr, nullptr, "vs", "vs_5_0", flags, 0, &pVsBlob, &pErrorBlob);
-    if (FAILED(hr))
+    const BYTE* GetData() const { return m_pData; }
+    UINT64 GetSize() const { return m_Size; }
+
+private:
+    HANDLE m_File = INVALID_HANDLE_VALUE;
+    HANDLE m_Mapping = NULL;
+    const BYTE* m_pData = nullptr;
+    UINT64 m_Size = 0;
+};
+
+// Replaces the scene with the file's
+bool LoadSceneFile(const wchar_t* path)
+{
+    double start = GetTimeMs();
+    MappedFile file;
+    const char* error = "cannot open the file";
+    SceneFileView view;
+    if (!file.Open(path) || !ValidateSceneFile(file.GetData(), file.GetSize(), view, &error))
     {
-        PrintError(pErrorBlob);
-        SAFE_RELEASE(pErrorBlob);
+        char message[256];
+        snprintf(message, sizeof(message), "Scene file rejected: %s\n", error);
+        OutputDebugStringA(message);
         return false;
     }
-    hr = g_pDevice->CreateVertexShader(pVsBlob->GetBufferPointer(), pVsBlob->GetBufferSize(), nullptr, &g_pPostVS);
-    if (FAILED(hr)) return false;
-    SAFE_RELEASE(pVsBlob);
 
-    hr = D3DCompile(postPS, strlen(postPS), nullptr, nullptr, nullptr, "ps", "ps_5_0", flags, 0, &pPsBlob, &pErrorBlob);
-    if (FAILED(hr))
+    InitInstanceStore(g_Instances, g_Scene);
+    g_StaticTransparentBspBuilt = false;
+    if (!LoadScene(view, g_Instances, g_SceneTransforms, g_SceneLights, &error))
     {
-        PrintError(pErrorBlob);
-        SAFE_RELEASE(pErrorBlob);
+        char message[256];
+        snprintf(message, sizeof(message), "Scene file rejected: %s\n", error);
+        OutputDebugStringA(message);
         return false;
     }
-    hr = g_pDevice->CreatePixelShader(pPsBlob->GetBufferPointer(), pPsBlob->GetBufferSize(), nullptr, &g_pPostPS);
-    if (FAILED(hr)) return false;
-    SAFE_RELEASE(pPsBlob);
 
-    SAFE_RELEASE(pErrorBlob);
+    char message[256];
+    snprintf(message, sizeof(message), "Loaded %u instances from the scene file in %.2f ms\n", view.header->instanceCount, GetTimeMs() - start);
+    OutputDebugStringA(message);
     return true;
 }
 
-// Texture loading
-bool CreateTexture2DArrayFromDDS(
-    const wchar_t* file0,
-    const wchar_t* file1,
-    ID3D11Texture2D** ppTex,
-    ID3D11ShaderResourceView** ppSRV)
+bool SaveSceneFile(const wchar_t* path)
 {
-    if (!ppTex || !ppSRV) return false;
-
-    TextureDesc texDesc[2];
-    if (!LoadDDS(file0, texDesc[0])) return false;
+    std::vector<BYTE> image;
+    BuildSceneFile(g_Instances, g_SceneTransforms, g_SceneLights, image);
+    return WriteSceneFile(path, image);
+}
 
-    if (!LoadDDS(file1, texDesc[1]))
+#ifdef _DEBUG
+// Scene file round trip: a random scene is built into an image, validated and loaded into a
+// second world, which must match it field for field. Damaged images must be rejected, and
+// an image naming a missing texture must fail to load without adding anything.
+bool ValidateSceneFileRoundTrip()
+{
+    UINT state = 13579u;
+    const char* failed = nullptr;
+    EntityWorld source, loaded;
+    source.Init(SCENE_COMPONENT_SIZES, COMPONENT_TYPE_COUNT);
+    loaded.Init(SCENE_COMPONENT_SIZES, COMPONENT_TYPE_COUNT);
+    InstanceStore sourceStore, loadedStore;
+    InitInstanceStore(sourceStore, source);
+    InitInstanceStore(loadedStore, loaded);
+    TransformHierarchy sourceTransforms, loadedTransforms;
+    std::vector<SceneLight> lights, loadedLights;
+
+    for (UINT i = 0; i < 1500; ++i)
     {
-        free(texDesc[0].pData);
-        return false;
+        CubeInstanceCPU c = {};
+        c.basePos = XMFLOAT3(CheckRandom(state, -50.0f, 50.0f), CheckRandom(state, -5.0f, 5.0f), CheckRandom(state, -50.0f, 50.0f));
+        c.scale = CheckRandom(state, 0.5f, 1.5f);
+        c.rotSpeed = CheckRandom(state, 0.2f, 0.8f);
+        c.textureId = CheckRandom(state, 0.0f, 1.0f) < 0.5f ? 0u : 1u;
+        c.hasNormalMap = CheckRandom(state, 0.0f, 1.0f) < 0.5f;
+        AddInstance(sourceStore, c);
     }
-
-    if (texDesc[0].fmt != texDesc[1].fmt ||
-        texDesc[0].width != texDesc[1].width ||
-        texDesc[0].height != texDesc[1].height ||
-        texDesc[0].mipmapsCount != texDesc[1].mipmapsCount)
+    for (UINT i = 0; i < 100; ++i)
     {
-        free(texDesc[0].pData);
-        free(texDesc[1].pData);
-        return false;
+        const EntityArchetype& archetype = *sourceStore.archetype;
+        UINT row = (UINT)CheckRandom(state, 0.0f, (float)sourceStore.count - 0.5f);
+        RemoveInstance(sourceStore, archetype.chunks[row / archetype.capacity].Entities()[row % archetype.capacity]);
+    }
+    for (UINT i = 0; i < 3; ++i)
+    {
+        TransparentPanel panel = { XMFLOAT4(CheckRandom(state, 0.0f, 1.0f), 0.5f, 0.25f, 0.45f), XMFLOAT3(1.0f, 2.0f, 0.1f), 0.5f * i, i == 0 ? 1u : 0u };
+        CreateTransparentPanel(source, sourceTransforms, XMFLOAT3(CheckRandom(state, -5.0f, 5.0f), 0.0f, CheckRandom(state, -5.0f, 5.0f)), panel);
+        lights.push_back({ XMFLOAT4(CheckRandom(state, -5.0f, 5.0f), 2.0f, 1.0f, 1.0f), XMFLOAT4(1.0f, 0.5f, 0.25f, 1.0f), XMFLOAT4(1.0f * i, 1.0f, 0.5f, 2.0f) });
     }
 
-    D3D11_TEXTURE2D_DESC desc = {};
-    desc.Width = texDesc[0].width;
-    desc.Height = texDesc[0].height;
-    desc.MipLevels = texDesc[0].mipmapsCount;
-    desc.ArraySize = 2;
-    desc.Format = texDesc[0].fmt;
-    desc.SampleDesc.Count = 1;
-    desc.Usage = D3D11_USAGE_IMMUTABLE;
-    desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
-
-    std::vector<D3D11_SUBRESOURCE_DATA> data(desc.MipLevels * 2);
-
-    for (UINT slice = 0; slice < 2; ++slice)
+    std::vector<BYTE> image;
+    BuildSceneFile(sourceStore, sourceTransforms, lights, image);
+    SceneFileView view;
+    const char* error = nullptr;
+    if (!ValidateSceneFile(image.data(), image.size(), view, &error))
+        failed = "valid image rejected";
+    else if (!LoadScene(view, loadedStore, loadedTransforms, loadedLights, &error))
+        failed = "valid image not loaded";
+    else if (loadedStore.count != sourceStore.count || loadedLights.size() != lights.size() ||
+        memcmp(loadedLights.data(), lights.data(), lights.size() * sizeof(SceneLight)) != 0)
+        failed = "counts or lights";
+
+    for (UINT i = 0; i < sourceStore.count && !failed; ++i)
     {
-        for (UINT mip = 0; mip < desc.MipLevels; ++mip)
+        const UINT columns[] = { COMPONENT_POSITION_X, COMPONENT_POSITION_Y, COMPONENT_POSITION_Z, COMPONENT_SCALE, COMPONENT_SPIN };
+        for (UINT type : columns)
         {
-            UINT idx = slice * desc.MipLevels + mip;
-            data[idx].pSysMem = reinterpret_cast<const BYTE*>(texDesc[slice].pData) + texDesc[slice].mipOffsets[mip];
-            data[idx].SysMemPitch = texDesc[slice].mipPitches[mip];
-            data[idx].SysMemSlicePitch = 0;
+            if (InstanceComponent<float>(sourceStore, i, type) != InstanceComponent<float>(loadedStore, i, type))
+                failed = "instance column";
         }
+        if (memcmp(&InstanceComponent<InstanceStaticGPU>(sourceStore, i, COMPONENT_INSTANCE_GPU),
+            &InstanceComponent<InstanceStaticGPU>(loadedStore, i, COMPONENT_INSTANCE_GPU), sizeof(InstanceStaticGPU)) != 0)
+            failed = "packed instance record";
     }
 
-    HRESULT hr = g_pDevice->CreateTexture2D(&desc, data.data(), ppTex);
-    if (FAILED(hr))
+    std::vector<SceneFilePanel> panels[2];
+    EntityWorld* worlds[2] = { &source, &loaded };
+    TransformHierarchy* transforms[2] = { &sourceTransforms, &loadedTransforms };
+    for (UINT w = 0; w < 2; ++w)
     {
-        free(texDesc[0].pData);
-        free(texDesc[1].pData);
-        return false;
+        worlds[w]->ForEachChunk(TRANSPARENT_PANEL_COMPONENTS, [&](const EntityChunk& chunk)
+            {
+                for (UINT i = 0; i < chunk.count; ++i)
+                {
+                    SceneFilePanel p = {};
+                    p.position = transforms[w]->GetLocal(chunk.Column<TransformHandle>(COMPONENT_TRANSFORM)[i]).translation;
+                    p.panel = chunk.Column<TransparentPanel>(COMPONENT_TRANSPARENT)[i];
+                    panels[w].push_back(p);
+                }
+            });
     }
+    if (!failed && (panels[0].size() != 3 || panels[1].size() != 3 || memcmp(panels[0].data(), panels[1].data(), 3 * sizeof(SceneFilePanel)) != 0))
+        failed = "panels";
 
-    D3D11_SHADER_RESOURCE_VIEW_DESC srvDesc = {};
-    srvDesc.Format = desc.Format;
-    srvDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURE2DARRAY;
-    srvDesc.Texture2DArray.MostDetailedMip = 0;
-    srvDesc.Texture2DArray.MipLevels = desc.MipLevels;
-    srvDesc.Texture2DArray.FirstArraySlice = 0;
-    srvDesc.Texture2DArray.ArraySize = 2;
-
-    hr = g_pDevice->CreateShaderResourceView(*ppTex, &srvDesc, ppSRV);
-
-    free(texDesc[0].pData);
-    free(texDesc[1].pData);
-
-    return SUCCEEDED(hr);
-}
-
-bool LoadTextures()
-{
-    // Diffuse texture array: Brick + Kitty
-    if (!CreateTexture2DArrayFromDDS(L"Brick.dds", L"Kitty.dds", &g_pTextureArray, &g_pTextureArrayView))
+    // Each damaged copy must fail validation
+    const SceneFileHeader& header = *reinterpret_cast<const SceneFileHeader*>(image.data());
+    auto rejects = [&](size_t offset, const void* value, size_t bytes, UINT64 size)
     {
-        MessageBoxA(NULL, "Failed to create texture array from Brick.dds and Kitty.dds", "Error", MB_OK);
+        std::vector<BYTE> damaged = image;
+        memcpy(damaged.data() + offset, value, bytes);
+        SceneFileView v;
+        const char* e = nullptr;
+        return !ValidateSceneFile(damaged.data(), size, v, &e);
+    };
+    const UINT zero = 0;
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    const UINT64 shifted = header.sections[SCENE_SECTION_SCALE].offset + SCENE_FILE_ALIGNMENT;
+    char unterminated[SCENE_TEXTURE_NAME_LENGTH];
+    memset(unterminated, 'a', sizeof(unterminated));
+    if (!failed && (!rejects(0, &zero, sizeof(zero), image.size()) ||
+        !rejects(0, &zero, 0, image.size() - 1) ||
+        !rejects(offsetof(SceneFileHeader, sections) + SCENE_SECTION_SCALE * sizeof(SceneFileRange), &shifted, sizeof(shifted), image.size()) ||
+        !rejects((size_t)header.sections[SCENE_SECTION_MATERIAL].offset + 4 * 7, &header.materialCount, sizeof(UINT), image.size()) ||
+        !rejects((size_t)header.sections[SCENE_SECTION_POSITION_Y].offset + 4 * 11, &nan, sizeof(nan), image.size()) ||
+        !rejects((size_t)header.sections[SCENE_SECTION_TEXTURES].offset, unterminated, sizeof(unterminated), image.size())))
+        failed = "damaged image accepted";
+
+    // Well formed, but the renderer has no such texture
+    SceneFileTexture missing = {};
+    snprintf(missing.name, SCENE_TEXTURE_NAME_LENGTH, "%s", "Missing.dds");
+    memcpy(image.data() + header.sections[SCENE_SECTION_TEXTURES].offset, &missing, sizeof(missing));
+    UINT countBefore = loadedStore.count;
+    if (!failed && (!ValidateSceneFile(image.data(), image.size(), view, &error) ||
+        LoadScene(view, loadedStore, loadedTransforms, loadedLights, &error) || loadedStore.count != countBefore))
+        failed = "missing texture";
+
+    if (failed)
+    {
+        char message[128];
+        snprintf(message, sizeof(message), "Scene file self-check failed: %s\n", failed);
+        OutputDebugStringA(message);
+        assert(false);
         return false;
     }
+    return true;
+}
 
-    // Normal map: BrickNM
+// Generated scenes must not depend on the thread count: every layout is generated on one
+// thread and on four, after a few hand-added instances so the rows start mid-chunk, and
+// the chunks must match byte for byte. The grid must keep the original pattern, the
+// Poisson scatter its minimum gap, and the seed must change the scatter.
+bool ValidateSceneGenerator()
+{
+    const char* failed = nullptr;
+    const UINT prefix = 37;
+    const SceneLayout layouts[] = { SceneLayout::Grid, SceneLayout::Poisson, SceneLayout::Cluster };
+    JobSystem serial, parallel;
+    serial.Init(0);
+    parallel.Init(3);
+
+    for (SceneLayout layout : layouts)
     {
-        TextureDesc texDesc;
-        if (!LoadDDS(L"BrickNM.dds", texDesc))
+        SceneGenerationDesc desc;
+        desc.layout = layout;
+        desc.count = 20000;
+        desc.seed = 4242;
+
+        EntityWorld worlds[2];
+        InstanceStore stores[2];
+        for (UINT w = 0; w < 2; ++w)
         {
-            MessageBoxA(NULL, "Failed to load BrickNM.dds", "Error", MB_OK);
-            return false;
+            worlds[w].Init(SCENE_COMPONENT_SIZES, COMPONENT_TYPE_COUNT);
+            InitInstanceStore(stores[w], worlds[w]);
+            for (UINT i = 0; i < prefix; ++i)
+                AddInstance(stores[w], GenerateInstance(desc, i));
+            GenerateOpaqueInstances(desc, stores[w], w == 0 ? serial : parallel);
         }
 
-        if (!CreateTextureFromDesc(g_pDevice, texDesc, &g_pNormalTexture, &g_pNormalTextureView))
+        const EntityArchetype& a = *stores[0].archetype;
+        const EntityArchetype& b = *stores[1].archetype;
+        if (stores[0].count != prefix + desc.count || stores[1].count != stores[0].count || a.chunks.size() != b.chunks.size())
+            failed = "instance count";
+        for (size_t c = 0; c < a.chunks.size() && !failed; ++c)
         {
-            free(texDesc.pData);
-            MessageBoxA(NULL, "Failed to create normal map texture", "Error", MB_OK);
-            return false;
+            if (memcmp(a.chunks[c].data, b.chunks[c].data, a.entityOffset) != 0)
+                failed = "thread count changed the scene";
         }
 
-        free(texDesc.pData);
+        const UINT grid = (UINT)ceil(sqrt((double)desc.count));
+        for (UINT i = 0; i < desc.count && !failed; ++i)
+        {
+            CubeInstanceCPU cube = GenerateInstance(desc, i);
+            const InstanceStaticGPU& gpu = InstanceComponent<InstanceStaticGPU>(stores[0], prefix + i, COMPONENT_INSTANCE_GPU);
+            if (gpu.posScale.x != cube.basePos.x || gpu.posScale.z != cube.basePos.z || gpu.posScale.w != cube.scale)
+                failed = "rows out of order";
+            else if (layout == SceneLayout::Grid)
+            {
+                int x = (int)(i % grid), z = (int)(i / grid);
+                if (cube.basePos.x != (x - (int)grid / 2) * SCENE_SPACING || cube.scale != 0.75f + 0.15f * float((x + z) % 3) ||
+                    cube.rotSpeed != 0.35f + 0.08f * float((x * 7 + z * 3) % 5) || cube.textureId != (UINT)((x + z) % 2))
+                    failed = "grid pattern";
+            }
+            else if (layout == SceneLayout::Poisson)
+            {
+                const UINT neighbours[] = { i + 1, i + grid, i + grid + 1 };
+                for (UINT j : neighbours)
+                {
+                    if (j >= desc.count)
+                        continue;
+                    CubeInstanceCPU other = GenerateInstance(desc, j);
+                    float dx = other.basePos.x - cube.basePos.x;
+                    float dz = other.basePos.z - cube.basePos.z;
+                    if (dx * dx + dz * dz < SCENE_MAX_CUBE_FOOTPRINT * SCENE_MAX_CUBE_FOOTPRINT * 0.999f)
+                        failed = "Poisson gap";
+                }
+            }
+        }
+
+        if (layout == SceneLayout::Poisson && !failed)
+        {
+            SceneGenerationDesc reseeded = desc;
+            reseeded.seed = desc.seed + 1;
+            UINT moved = 0;
+            for (UINT i = 0; i < 100; ++i)
+                moved += GenerateInstance(reseeded, i).basePos.x != GenerateInstance(desc, i).basePos.x;
+            if (moved < 90)
+                failed = "seed ignored";
+        }
     }
+    serial.Shutdown();
+    parallel.Shutdown();
 
-    // Sampler
+    if (failed)
     {
-        D3D11_SAMPLER_DESC sampDesc = {};
-        sampDesc.Filter = D3D11_FILTER_ANISOTROPIC;
-        sampDesc.AddressU = D3D11_TEXTURE_ADDRESS_WRAP;
-        sampDesc.AddressV = D3D11_TEXTURE_ADDRESS_WRAP;
-        sampDesc.AddressW = D3D11_TEXTURE_ADDRESS_WRAP;
-        sampDesc.MinLOD = -FLT_MAX;
-        sampDesc.MaxLOD = FLT_MAX;
-        sampDesc.MaxAnisotropy = 16;
-        sampDesc.ComparisonFunc = D3D11_COMPARISON_NEVER;
-        sampDesc.BorderColor[0] = 1.0f;
-        sampDesc.BorderColor[1] = 1.0f;
-        sampDesc.BorderColor[2] = 1.0f;
-        sampDesc.BorderColor[3] = 1.0f;
+        char message[128];
+        snprintf(message, sizeof(message), "Scene generator self-check failed: %s\n", failed);
+        OutputDebugStringA(message);
+        assert(false);
+        return false;
+    }
+    return true;
+}
 
-        HRESULT hr = g_pDevice->CreateSamplerState(&sampDesc, &g_pSampler);
-        if (FAILED(hr))
+// Grid sphere queries against a linear scan over the same bounds, for all three generated
+// layouts: small and large queries (the large ones walk the occupied cells instead of the
+// cell range), then again after moving instances within their cell, across cells into
+// the overflow list, and far enough that the overflow forces a rebuild. Frustum queries
+// are checked against CullInstanceBounds over the same bounds the same way.
+bool ValidateSpatialHashGrid()
+{
+    const SceneLayout layouts[] = { SceneLayout::Grid, SceneLayout::Poisson, SceneLayout::Cluster };
+    const char* failed = nullptr;
+    UINT state = 86420u;
+
+    for (SceneLayout layout : layouts)
+    {
+        SceneGenerationDesc desc;
+        desc.layout = layout;
+        desc.count = 12000;
+        desc.seed = 777;
+
+        EntityWorld world;
+        world.Init(SCENE_COMPONENT_SIZES, COMPONENT_TYPE_COUNT);
+        InstanceStore store;
+        InitInstanceStore(store, world);
+        for (UINT i = 0; i < desc.count; ++i)
+            AddInstance(store, GenerateInstance(desc, i));
+        InstanceBounds bounds;
+        UpdateInstanceBounds(store, store.staticDirty, bounds);
+        store.staticDirty.Clear();
+
+        SpatialHashGrid grid;
+        grid.Build(GRID_CELL_SIZE, bounds);
+
+        float extent = 0.5f * SCENE_POISSON_SPACING * ceilf(sqrtf((float)desc.count));
+        for (UINT round = 0; round < 4 && !failed; ++round)
         {
-            MessageBoxA(NULL, "CreateSampler failed", "Error", MB_OK);
-            return false;
+            if (round > 0)
+            {
+                // Round 1 stays inside the cells, 2 leaves them, 3 overflows into a rebuild
+                float step = round == 1 ? 0.01f : GRID_CELL_SIZE * (float)round;
+                UINT moves = round == 3 ? bounds.count / 4 : 50;
+                for (UINT m = 0; m < moves; ++m)
+                {
+                    UINT i = (UINT)CheckRandom(state, 0.0f, (float)bounds.count) % bounds.count;
+                    bounds.centerX[i] += CheckRandom(state, -step, step);
+                    bounds.centerZ[i] += CheckRandom(state, -step, step);
+                    XMFLOAT3 center(bounds.centerX[i], bounds.centerY[i], bounds.centerZ[i]);
+                    grid.Update(i, center, bounds.radius[i]);
+                }
+            }
+
+            for (UINT q = 0; q < 40 && !failed; ++q)
+            {
+                XMFLOAT3 center(CheckRandom(state, -extent, extent), CheckRandom(state, -2.0f, 6.0f), CheckRandom(state, -extent, extent));
+                float radius = q % 8 == 0 ? CheckRandom(state, 30.0f, 80.0f) : CheckRandom(state, 0.5f, 8.0f);
+
+                std::vector<UINT> found, expected;
+                grid.QuerySphere(center, radius, found);
+                for (UINT i = 0; i < bounds.count; ++i)
+                {
+                    float dx = bounds.centerX[i] - center.x;
+                    float dy = bounds.centerY[i] - center.y;
+                    float dz = bounds.centerZ[i] - center.z;
+                    float reach = radius + bounds.radius[i];
+                    if ((dx * dx + dy * dy) + dz * dz <= reach * reach)
+                        expected.push_back(i);
+                }
+
+                std::sort(found.begin(), found.end());
+                if (found != expected)
+                    failed = "grid and linear scan differ";
+            }
+
+            // Frustum queries against the linear cull, from short narrow views that walk the
+            // cell range to long wide ones that fall back to the occupied cells
+            for (UINT q = 0; q < 40 && !failed; ++q)
+            {
+                XMVECTOR eye = XMVectorSet(CheckRandom(state, -extent, extent), CheckRandom(state, 0.5f, 20.0f), CheckRandom(state, -extent, extent), 1.0f);
+                XMVECTOR at = XMVectorSet(CheckRandom(state, -extent, extent), 0.0f, CheckRandom(state, -extent, extent), 1.0f);
+                float farZ = q % 4 == 0 ? CheckRandom(state, 100.0f, 400.0f) : CheckRandom(state, 5.0f, 40.0f);
+                XMMATRIX vp = XMMatrixLookAtLH(eye, at, XMVectorSet(0, 1, 0, 0)) *
+                    XMMatrixPerspectiveFovLH(CheckRandom(state, 0.3f, 2.0f), CheckRandom(state, 0.5f, 2.5f), 0.1f, farZ);
+                Plane planes[6];
+                ExtractFrustumPlanes(planes, vp);
+
+                std::vector<UINT> found, expected;
+                grid.QueryFrustum(planes, bounds, found);
+                CullInstanceBounds(planes, bounds, expected);
+
+                std::sort(found.begin(), found.end());
+                if (found != expected)
+                    failed = "grid frustum query and linear cull differ";
+            }
         }
+        if (!failed && grid.GetOverflowCount() > (std::max)(64u, bounds.count / 8))
+            failed = "overflow list was not rebuilt";
     }
 
-    // Skybox
+    if (failed)
     {
-        const std::wstring faceNames[6] =
-        {
-            L"Skybox/posx.png",
-            L"Skybox/negx.png",
-            L"Skybox/posy.png",
-            L"Skybox/negy.png",
-            L"Skybox/posz.png",
-            L"Skybox/negz.png"
-        };
+        char message[128];
+        snprintf(message, sizeof(message), "Spatial hash grid self-check failed: %s\n", failed);
+        OutputDebugStringA(message);
+        assert(false);
+        return false;
+    }
+    return true;
+}
 
-        TextureDesc faceDescs[6];
-        bool allOk = true;
-        for (int i = 0; i < 6; ++i)
+// Occlusion culling of a known layout: a wall of five scale-4 cubes between the camera
+// and a block of small cubes. Every cube behind the wall has to be culled; the wall itself,
+// the cubes in front of it, above it and level with its end have to be kept. The wall is
+// then rasterised again on worker threads, which must give the same answers.
+bool ValidateOcclusionCulling()
+{
+    const char* failed = nullptr;
+
+    EntityWorld world;
+    world.Init(SCENE_COMPONENT_SIZES, COMPONENT_TYPE_COUNT);
+    InitInstanceStore(g_Instances, world);
+
+    std::vector<BYTE> expectVisible;
+    auto addCube = [&](float x, float y, float z, float scale, bool visible)
+    {
+        CubeInstanceCPU c = {};
+        c.basePos = XMFLOAT3(x, y, z);
+        c.scale = scale;
+        AddInstance(g_Instances, c);
+        expectVisible.push_back(visible ? 1 : 0);
+    };
+    for (int i = -2; i <= 2; ++i)
+        addCube(4.0f * i, 0.0f, 0.0f, 4.0f, true);
+    for (int x = -4; x <= 4; ++x)
+    {
+        for (int y = -1; y <= 1; ++y)
+            addCube((float)x, 0.5f * y, 10.0f, 0.5f, false);
+    }
+    for (int x = -4; x <= 4; x += 2)
+    {
+        addCube((float)x, 5.0f, 10.0f, 0.5f, true);   // above the wall
+        addCube((float)x, -1.0f, -5.0f, 0.5f, true);  // in front of it
+    }
+    addCube(-22.0f, 0.0f, 10.0f, 1.5f, true);  // straddling its left end
+    addCube(22.0f, 0.0f, 10.0f, 1.5f, true);
+
+    UpdateInstanceBounds(g_Instances, g_Instances.staticDirty, g_InstanceBounds);
+    g_Instances.staticDirty.Clear();
+
+    XMFLOAT3 eye(0.0f, 0.0f, -12.0f);
+    XMMATRIX vp = XMMatrixLookAtLH(XMLoadFloat3(&eye), XMVectorSet(0.0f, 0.0f, 10.0f, 1.0f), XMVectorSet(0, 1, 0, 0)) *
+        XMMatrixPerspectiveFovLH(XM_PI / 3.0f, (float)OCCLUSION_WIDTH / OCCLUSION_HEIGHT, 0.1f, 200.0f);
+
+    g_FrameArenas.BeginFrame();
+    FrameVector<UINT> candidates{ ArenaAllocator<UINT>(g_FrameArenas.Get()) };
+    for (UINT i = 0; i < g_Instances.count; ++i)
+        candidates.push_back(i);
+    CullOccludedInstances(vp, eye, 0.0f, candidates);
+
+    std::vector<BYTE> kept(g_Instances.count, 0);
+    for (UINT id : candidates)
+        kept[id] = 1;
+    if (kept != expectVisible)
+    {
+        for (UINT i = 0; i < g_Instances.count && !failed; ++i)
         {
-            if (!LoadImageAny(faceNames[i].c_str(), faceDescs[i]))
-            {
-                allOk = false;
-                break;
-            }
+            if (kept[i] != expectVisible[i])
+                failed = expectVisible[i] ? "a visible cube was culled" : "a hidden cube was kept";
         }
+    }
+
+    // The wall alone, rows spread over three workers
+    OcclusionBuffer threaded;
+    JobSystem jobs;
+    jobs.Init(3);
+    FrameVector<OccluderTriangle> triangles{ ArenaAllocator<OccluderTriangle>(g_FrameArenas.Get()) };
+    for (int i = -2; i <= 2; ++i)
+        AddCubeOccluder(XMMatrixScaling(4.0f, 4.0f, 4.0f) * XMMatrixTranslation(4.0f * i, 0.0f, 0.0f) * vp, triangles);
+    threaded.Render(triangles, jobs);
+    jobs.Shutdown();
+    for (UINT i = 0; i < g_Instances.count && !failed; ++i)
+    {
+        XMFLOAT3 center(g_InstanceBounds.centerX[i], g_InstanceBounds.centerY[i], g_InstanceBounds.centerZ[i]);
+        XMFLOAT3 extents(g_InstanceBounds.extentX[i], g_InstanceBounds.extentY[i], g_InstanceBounds.extentZ[i]);
+        if (threaded.IsBoxVisible(center, extents, vp) != (expectVisible[i] != 0))
+            failed = "threaded rasterisation differs";
+    }
+
+    ClearInstanceStore(g_Instances);
+    g_Instances = InstanceStore();
+    g_InstanceBounds = InstanceBounds();
+    g_CullingStats = CullingStats();
+
+    if (failed)
+    {
+        char message[128];
+        snprintf(message, sizeof(message), "Occlusion culling self-check failed: %s\n", failed);
+        OutputDebugStringA(message);
+        assert(false);
+        return false;
+    }
+    return true;
+}
+
+// Distance along the ray origin + t * dir at which it crosses the triangle, if it does
+static bool RayHitsTriangle(const XMFLOAT3& origin, const XMFLOAT3& dir, const BspTriangle& triangle, float* t)
+{
+    XMVECTOR o = XMLoadFloat3(&origin);
+    XMVECTOR d = XMLoadFloat3(&dir);
+    XMVECTOR p0 = XMLoadFloat3(&triangle.p[0]);
+    XMVECTOR e1 = XMVectorSubtract(XMLoadFloat3(&triangle.p[1]), p0);
+    XMVECTOR e2 = XMVectorSubtract(XMLoadFloat3(&triangle.p[2]), p0);
+    XMVECTOR h = XMVector3Cross(d, e2);
+    float det = XMVectorGetX(XMVector3Dot(e1, h));
+    if (fabsf(det) < 1e-8f)
+        return false;
+    XMVECTOR s = XMVectorSubtract(o, p0);
+    float u = XMVectorGetX(XMVector3Dot(s, h)) / det;
+    XMVECTOR q = XMVector3Cross(s, e1);
+    float v = XMVectorGetX(XMVector3Dot(d, q)) / det;
+    if (u < 0.0f || v < 0.0f || u + v > 1.0f)
+        return false;
+    *t = XMVectorGetX(XMVector3Dot(e2, q)) / det;
+    return *t > 0.0f;
+}
+
+static void AddBspPanel(TransparentBsp& bsp, const XMFLOAT3& a, const XMFLOAT3& b, const XMFLOAT3& c, const XMFLOAT3& d)
+{
+    bsp.Insert({ { a, b, c }, XMFLOAT4(1, 1, 1, 0.5f) });
+    bsp.Insert({ { a, c, d }, XMFLOAT4(1, 1, 1, 0.5f) });
+}
 
-        if (!allOk)
-        {
-            MessageBoxA(NULL, "Failed to load cubemap faces", "Error", MB_OK);
-            for (int i = 0; i < 6; ++i)
-                if (faceDescs[i].pData) free(faceDescs[i].pData);
-            return false;
-        }
+// A back-to-front order draws every triangle once, and no triangle is drawn after one
+// that covers it: every ray from the eye through a point inside a later triangle must
+// reach that point before it reaches any earlier triangle.
+static const char* CheckBackToFront(const TransparentBsp& bsp, const XMFLOAT3& eye, std::vector<UINT>& order)
+{
+    const std::vector<BspTriangle>& triangles = bsp.GetTriangles();
+    bsp.BackToFront(eye, order);
+    if (order.size() != triangles.size())
+        return "order does not cover every triangle";
+    std::vector<bool> seen(triangles.size(), false);
+    for (UINT t : order)
+    {
+        if (t >= triangles.size() || seen[t])
+            return "order repeats a triangle";
+        seen[t] = true;
+    }
 
-        for (int i = 1; i < 6; ++i)
+    const float weights[4][3] = { { 1.0f / 3, 1.0f / 3, 1.0f / 3 }, { 0.6f, 0.2f, 0.2f }, { 0.2f, 0.6f, 0.2f }, { 0.2f, 0.2f, 0.6f } };
+    for (size_t later = 1; later < order.size(); ++later)
+    {
+        const BspTriangle& b = triangles[order[later]];
+        for (const auto& w : weights)
         {
-            if (faceDescs[i].fmt != faceDescs[0].fmt ||
-                faceDescs[i].width != faceDescs[0].width ||
-                faceDescs[i].height != faceDescs[0].height)
+            XMFLOAT3 dir(w[0] * b.p[0].x + w[1] * b.p[1].x + w[2] * b.p[2].x - eye.x,
+                w[0] * b.p[0].y + w[1] * b.p[1].y + w[2] * b.p[2].y - eye.y,
+                w[0] * b.p[0].z + w[1] * b.p[1].z + w[2] * b.p[2].z - eye.z);
+            for (size_t earlier = 0; earlier < later; ++earlier)
             {
-                MessageBoxA(NULL, "Cubemap faces must have same format and size", "Error", MB_OK);
-                for (int j = 0; j < 6; ++j)
-                    if (faceDescs[j].pData) free(faceDescs[j].pData);
-                return false;
+                float t;
+                if (RayHitsTriangle(eye, dir, triangles[order[earlier]], &t) && t < 1.0f - 1e-3f)
+                    return "a triangle is drawn after one in front of it";
             }
         }
+    }
+    return nullptr;
+}
 
-        D3D11_TEXTURE2D_DESC cubeDesc = {};
-        cubeDesc.Width = faceDescs[0].width;
-        cubeDesc.Height = faceDescs[0].height;
-        cubeDesc.MipLevels = 1;
-        cubeDesc.ArraySize = 6;
-        cubeDesc.Format = faceDescs[0].fmt;
-        cubeDesc.SampleDesc.Count = 1;
-        cubeDesc.SampleDesc.Quality = 0;
-        cubeDesc.Usage = D3D11_USAGE_IMMUTABLE;
-        cubeDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
-        cubeDesc.CPUAccessFlags = 0;
-        cubeDesc.MiscFlags = D3D11_RESOURCE_MISC_TEXTURECUBE;
+// BSP sorting of panels that cut through each other, so nothing sorts them without
+// splitting: an X of two upright panels with a tilted one through both, seen from all
+// around, above and below. The X is then marked as the static tree, and the tilted panel
+// inserted in a different place every frame and rolled back out, which has to leave the
+// tree exactly as a fresh build of the X.
+bool ValidateTransparentBsp()
+{
+    const char* failed = nullptr;
 
-        D3D11_SUBRESOURCE_DATA initData[6] = {};
-        for (int i = 0; i < 6; ++i)
+    TransparentBsp bsp, reference;
+    for (TransparentBsp* tree : { &bsp, &reference })
+    {
+        AddBspPanel(*tree, XMFLOAT3(-1, -1, -1), XMFLOAT3(1, -1, 1), XMFLOAT3(1, 1, 1), XMFLOAT3(-1, 1, -1));
+        AddBspPanel(*tree, XMFLOAT3(-1, -1, 1), XMFLOAT3(1, -1, -1), XMFLOAT3(1, 1, -1), XMFLOAT3(-1, 1, 1));
+    }
+    bsp.Mark();
+    if (bsp.GetSplitCount() == 0)
+        failed = "crossing panels were not split";
+
+    std::vector<UINT> order, referenceOrder;
+    for (UINT frame = 0; frame < 6 && !failed; ++frame)
+    {
+        float shift = 0.2f * frame - 0.5f;
+        bsp.Rollback();
+        AddBspPanel(bsp, XMFLOAT3(-1.5f, -0.45f + shift, -1.5f), XMFLOAT3(1.5f, 0.45f + shift, -1.5f),
+            XMFLOAT3(1.5f, 0.45f + shift, 1.5f), XMFLOAT3(-1.5f, -0.45f + shift, 1.5f));
+
+        for (UINT view = 0; view < 24 && !failed; ++view)
         {
-            initData[i].pSysMem = faceDescs[i].pData;
-            initData[i].SysMemPitch = faceDescs[i].pitch;
-            initData[i].SysMemSlicePitch = 0;
+            g_FrameArenas.BeginFrame();
+            float yaw = 0.3f + view * (XM_2PI / 8.0f);
+            XMFLOAT3 eye(6.0f * sinf(yaw), -3.0f + 3.5f * (view / 8), 6.0f * cosf(yaw));
+            failed = CheckBackToFront(bsp, eye, order);
         }
+    }
 
-        HRESULT hr = g_pDevice->CreateTexture2D(&cubeDesc, initData, &g_pCubemapTexture);
+    bsp.Rollback();
+    if (!failed && (bsp.GetSplitCount() != reference.GetSplitCount() || bsp.GetTriangles().size() != reference.GetTriangles().size() ||
+        memcmp(bsp.GetTriangles().data(), reference.GetTriangles().data(), reference.GetTriangles().size() * sizeof(BspTriangle)) != 0))
+        failed = "rollback left a different set of triangles";
+    for (UINT view = 0; view < 8 && !failed; ++view)
+    {
+        g_FrameArenas.BeginFrame();
+        float yaw = 0.3f + view * (XM_2PI / 8.0f);
+        XMFLOAT3 eye(6.0f * sinf(yaw), 1.0f, 6.0f * cosf(yaw));
+        failed = CheckBackToFront(reference, eye, referenceOrder);
+        bsp.BackToFront(eye, order);
+        if (!failed && order != referenceOrder)
+            failed = "rollback left a different tree";
+    }
 
-        for (int i = 0; i < 6; ++i)
-            free(faceDescs[i].pData);
+    if (failed)
+    {
+        char message[128];
+        snprintf(message, sizeof(message), "Transparent BSP self-check failed: %s\n", failed);
+        OutputDebugStringA(message);
+        assert(false);
+        return false;
+    }
+    return true;
+}
 
-        if (FAILED(hr) || !g_pCubemapTexture)
-        {
-            MessageBoxA(NULL, "CreateCubemapTexture failed", "Error", MB_OK);
-            return false;
-        }
+// Frame arenas: bump allocation and alignment, O(1) reset back to the start of the block,
+// growth past the high-water mark after an overflow, and then the point of it all: a
+// frame's worth of culling, instance records, per-thread scratch, transform updates and
+// BSP sorting that, once warmed up, makes no heap allocation at all.
+bool ValidateFrameArenas()
+{
+    const char* failed = nullptr;
+
+    FrameArena arena;
+    arena.Reserve(FRAME_ARENA_GRANULARITY);
+    BYTE* first = static_cast<BYTE*>(arena.Allocate(3, 1));
+    BYTE* aligned = static_cast<BYTE*>(arena.Allocate(100, 64));
+    if (((uintptr_t)aligned & 63) != 0 || aligned < first + 3 || arena.GetUsed() != (size_t)(aligned - first) + 100)
+        failed = "bump allocation";
+    arena.Reset();
+    if (!failed && (arena.Allocate(8) != first || arena.GetUsed() != 8))
+        failed = "reset";
+
+    // Twice the block: the overflow comes from the heap until the reset grows the arena
+    void* overflow = arena.Allocate(2 * FRAME_ARENA_GRANULARITY);
+    memset(overflow, 0xCD, 2 * FRAME_ARENA_GRANULARITY);
+    if (!failed && (arena.GetOverflowCount() != 1 || arena.GetHighWater() != 8 + 2 * FRAME_ARENA_GRANULARITY))
+        failed = "overflow";
+    arena.Reset();
+    if (!failed && (arena.GetOverflowCount() != 0 || arena.GetCapacity() < arena.GetHighWater() ||
+        (arena.Allocate(2 * FRAME_ARENA_GRANULARITY), arena.GetOverflowCount() != 0)))
+    {
+        failed = "growth after overflow";
+    }
 
-        D3D11_SHADER_RESOURCE_VIEW_DESC cubeSRVDesc = {};
-        cubeSRVDesc.Format = cubeDesc.Format;
-        cubeSRVDesc.ViewDimension = D3D11_SRV_DIMENSION_TEXTURECUBE;
-        cubeSRVDesc.TextureCube.MipLevels = 1;
-        cubeSRVDesc.TextureCube.MostDetailedMip = 0;
+    FrameVector<int> numbers{ ArenaAllocator<int>(arena) };
+    for (int i = 0; i < 1000; ++i)
+        numbers.push_back(i);
+    FrameVector<int> swapped(10, 7, numbers.get_allocator());
+    numbers.swap(swapped);
+    if (!failed && (numbers.size() != 10 || swapped.size() != 1000 || swapped[999] != 999))
+        failed = "FrameVector";
+
+    // A small scene and the CPU side of a frame over it
+    UINT state = 112358u;
+    EntityWorld world;
+    world.Init(SCENE_COMPONENT_SIZES, COMPONENT_TYPE_COUNT);
+    InstanceStore store;
+    InitInstanceStore(store, world);
+    for (UINT i = 0; i < 3000; ++i)
+    {
+        CubeInstanceCPU c = {};
+        c.basePos = XMFLOAT3(CheckRandom(state, -60.0f, 60.0f), CheckRandom(state, -4.0f, 4.0f), CheckRandom(state, -60.0f, 60.0f));
+        c.scale = CheckRandom(state, 0.25f, 3.0f);
+        c.rotSpeed = CheckRandom(state, -3.0f, 3.0f);
+        AddInstance(store, c);
+    }
+    std::vector<InstancePage> pages;
+    InstanceBounds bounds;
+    UpdateInstancePages(store, store.staticDirty, pages);
+    UpdateInstanceBounds(store, store.staticDirty, bounds);
+    store.staticDirty.Clear();
+
+    TransformHierarchy hierarchy;
+    for (UINT n = 0; n < 200; ++n)
+        hierarchy.Add(n < 20 ? TRANSFORM_NO_PARENT : n % 20, RandomTrs(state));
+
+    TransparentBsp bsp;
+    for (UINT t = 0; t < 8; ++t)
+    {
+        BspTriangle triangle = { { XMFLOAT3(CheckRandom(state, -2.0f, 2.0f), CheckRandom(state, -2.0f, 2.0f), CheckRandom(state, -2.0f, 2.0f)),
+            XMFLOAT3(CheckRandom(state, -2.0f, 2.0f), CheckRandom(state, -2.0f, 2.0f), CheckRandom(state, -2.0f, 2.0f)),
+            XMFLOAT3(CheckRandom(state, -2.0f, 2.0f), CheckRandom(state, -2.0f, 2.0f), CheckRandom(state, -2.0f, 2.0f)) }, XMFLOAT4(1, 1, 1, 0.5f) };
+        bsp.Insert(triangle);
+    }
+    bsp.Mark();
+
+    JobSystem jobs;
+    jobs.Init(3);
+    std::vector<UINT> order;
+    std::atomic<UINT> threadArenaErrors(0);
+    const UINT cameraCount = 4;
+    UINT64 heapAllocations = 0;
+    for (UINT frame = 0; frame < FRAME_ARENA_WARMUP_FRAMES + 2 * cameraCount && !failed; ++frame)
+    {
+        UINT64 heapAllocationsAtStart = g_HeapAllocationCount;
+
+        g_FrameArenas.BeginFrame();
+        float yaw = (frame % cameraCount) * XM_PIDIV2;
+        XMVECTOR eye = XMVectorSet(80.0f * sinf(yaw), 20.0f, 80.0f * cosf(yaw), 1.0f);
+        XMMATRIX vp = XMMatrixLookAtLH(eye, XMVectorZero(), XMVectorSet(0, 1, 0, 0)) * XMMatrixPerspectiveFovLH(XM_PI / 3.0f, 16.0f / 9.0f, 0.1f, 200.0f);
+        Plane planes[6];
+        ExtractFrustumPlanes(planes, vp);
+
+        FrameVector<UINT> visible{ ArenaAllocator<UINT>(g_FrameArenas.Get()) };
+        CullInstancePages(planes, bounds, pages, visible);
+        InstanceGPU* records = static_cast<InstanceGPU*>(g_FrameArenas.Get().Allocate(visible.size() * sizeof(InstanceGPU)));
+        BuildVisibleInstances(store, visible, 0.1f * frame, records);
+
+        // Every thread's scratch comes from its own arena
+        jobs.ParallelFor(64, 1, [&](UINT begin, UINT end)
+            {
+                FrameArena& threadArena = g_FrameArenas.Get();
+                size_t usedBefore = threadArena.GetUsed();
+                FrameVector<float> scratch(256 * (end - begin), 1.0f, ArenaAllocator<float>(threadArena));
+                if (threadArena.GetUsed() < usedBefore + scratch.size() * sizeof(float))
+                    ++threadArenaErrors;
+            });
+
+        hierarchy.SetLocal(frame % 200, RandomTrs(state));
+        hierarchy.Update(jobs);
+
+        float slide = 0.25f * (frame % cameraCount);
+        BspTriangle moving = { { XMFLOAT3(-2.0f + slide, -2.0f, 0.0f), XMFLOAT3(2.0f + slide, -2.0f, 0.0f), XMFLOAT3(slide, 2.0f, 0.0f) }, XMFLOAT4(1, 1, 1, 0.5f) };
+        bsp.Rollback();
+        bsp.Insert(moving);
+        bsp.BackToFront(XMFLOAT3(0.0f, 0.0f, -10.0f), order);
+
+        if (frame >= FRAME_ARENA_WARMUP_FRAMES)
+            heapAllocations += g_HeapAllocationCount - heapAllocationsAtStart;
+    }
+    jobs.Shutdown();
 
-        hr = g_pDevice->CreateShaderResourceView(g_pCubemapTexture, &cubeSRVDesc, &g_pCubemapView);
-        if (FAILED(hr) || !g_pCubemapView)
+    if (!failed && threadArenaErrors != 0)
+        failed = "per-thread arenas";
+    if (!failed && heapAllocations != 0)
+        failed = "steady-state frames allocated from the heap";
+    if (!failed && g_FrameArenas.GetHighWater() == 0)
+        failed = "high-water mark";
+
+    if (failed)
+    {
+        char message[128];
+        snprintf(message, sizeof(message), "Frame arena self-check failed: %s\n", failed);
+        OutputDebugStringA(message);
+        assert(false);
+        return false;
+    }
+    return true;
+}
+
+// The renderer brought up on the null device as -nulldevice does, over the default scene,
+// with every stage on: after the warm-up frames, a PrepareFrame / SubmitFrame pair must
+// leave the heap alone and the device must see no errors.
+bool ValidateHeadlessFrames()
+{
+    const char* failed = nullptr;
+    g_UseNullDevice = true;
+    g_SceneGeneration = SceneGenerationDesc();
+    g_InstanceBounds = InstanceBounds();
+    g_InstancePages.clear();
+    g_InstanceGrid = SpatialHashGrid();
+    g_StaticTransparentBspBuilt = false;
+
+    if (!InitDirectX() || (CreateCubeResources(), !CompileShaders()) || !CreateRenderStates() || !CreateConstantBuffers())
+        failed = "bringing up the renderer";
+
+    UINT64 heapAllocations = 0;
+    if (!failed)
+    {
+        g_Scene.Init(SCENE_COMPONENT_SIZES, COMPONENT_TYPE_COUNT);
+        CreateOpaqueInstances();
+        CreateTransparentPanels();
+        CreateSceneLights();
+
+        for (UINT frame = 0; frame < FRAME_ARENA_WARMUP_FRAMES + 8; ++frame)
         {
-            MessageBoxA(NULL, "CreateCubemapSRV failed", "Error", MB_OK);
-            return false;
+            UINT64 heapAllocationsAtStart = g_HeapAllocationCount;
+
+            FramePacket packet;
+            packet.input.frameIndex = frame;
+            packet.input.inputMs = GetTimeMs();
+            packet.input.currentTime = frame / 60.0;
+            packet.input.angle = 0.65f * frame / 60.0f;
+            packet.input.cameraYaw = 0.1f * frame;
+            packet.input.cameraPitch = g_CameraPitch;
+            packet.input.cameraDist = g_CameraDist;
+            packet.input.width = g_ClientWidth;
+            packet.input.height = g_ClientHeight;
+            PrepareFrame(packet);
+            SubmitFrame(packet);
+
+            if (frame >= FRAME_ARENA_WARMUP_FRAMES)
+                heapAllocations += g_HeapAllocationCount - heapAllocationsAtStart;
         }
+
+        if (g_pNullDevice->GetErrorCount() != 0)
+            failed = "null device errors";
+        else if (g_pNullDevice->GetFrameCount() != FRAME_ARENA_WARMUP_FRAMES + 8 || g_SubmittedStats.frustumVisible == 0)
+            failed = "frames not presented";
+        else if (heapAllocations != 0)
+            failed = "steady-state frames allocated from the heap";
     }
 
+    CleanupDirectX();
+    g_UseNullDevice = false;
+
+    if (failed)
+    {
+        char message[128];
+        snprintf(message, sizeof(message), "Headless frame self-check failed: %s\n", failed);
+        OutputDebugStringA(message);
+        assert(false);
+        return false;
+    }
     return true;
 }
 
-// Render states / resources
-bool CreateRenderStates()
+// Frame pipeline: packets come back in order with their own input, the arrays a packet
+// keeps in the frame arenas survive the frames prepared after it until it is released,
+// depth 0 prepares on the calling thread and deeper pipelines on another one, and with the
+// two stages busy for the same time a pipelined frame costs about one stage, not both.
+static const double PIPELINE_CHECK_STAGE_MS = 2.0;
+static std::thread::id s_PipelineCheckThread;
+
+static void SpinForMs(double ms)
 {
-    HRESULT hr;
+    double end = GetTimeMs() + ms;
+    while (GetTimeMs() < end)
+        _mm_pause();
+}
 
-    D3D11_DEPTH_STENCIL_DESC opaqueDesc = {};
-    opaqueDesc.DepthEnable = TRUE;
-    opaqueDesc.DepthWriteMask = D3D11_DEPTH_WRITE_MASK_ALL;
-    opaqueDesc.DepthFunc = D3D11_COMPARISON_LESS;
-    hr = g_pDevice->CreateDepthStencilState(&opaqueDesc, &g_pOpaqueDepthState);
-    if (FAILED(hr)) return false;
+static void PrepareCheckPacket(FramePacket& packet)
+{
+    s_PipelineCheckThread = std::this_thread::get_id();
+    g_FrameArenas.BeginFrame();
+
+    // Any of the packet's arrays will do
+    UINT count = 1000 + (UINT)(packet.input.frameIndex % 7) * 500;
+    UINT* values = static_cast<UINT*>(g_FrameArenas.Get().Allocate(count * sizeof(UINT)));
+    for (UINT i = 0; i < count; ++i)
+        values[i] = (UINT)packet.input.frameIndex;
+    packet.bspIndices = values;
+    packet.bspIndexCount = count;
+
+    SpinForMs(PIPELINE_CHECK_STAGE_MS);
+}
 
-    D3D11_DEPTH_STENCIL_DESC skyboxDesc = {};
-    skyboxDesc.DepthEnable = TRUE;
-    skyboxDesc.DepthWriteMask = D3D11_DEPTH_WRITE_MASK_ZERO;
-    skyboxDesc.DepthFunc = D3D11_COMPARISON_LESS_EQUAL;
-    hr = g_pDevice->CreateDepthStencilState(&skyboxDesc, &g_pSkyboxDepthState);
-    if (FAILED(hr)) return false;
+bool ValidateFramePipeline()
+{
+    const char* failed = nullptr;
+    const UINT frameCount = 24;
+    double frameMs[FRAME_PIPELINE_MAX_DEPTH + 1] = {};
 
-    D3D11_DEPTH_STENCIL_DESC transparentDesc = {};
-    transparentDesc.DepthEnable = TRUE;
-    transparentDesc.DepthWriteMask = D3D11_DEPTH_WRITE_MASK_ZERO;
-    transparentDesc.DepthFunc = D3D11_COMPARISON_LESS;
-    hr = g_pDevice->CreateDepthStencilState(&transparentDesc, &g_pTransparentDepthState);
-    if (FAILED(hr)) return false;
+    for (UINT depth = 0; depth <= FRAME_PIPELINE_MAX_DEPTH && !failed; ++depth)
+    {
+        FramePipeline pipeline;
+        pipeline.Start(PrepareCheckPacket, depth);
 
-    D3D11_RASTERIZER_DESC rsBack = {};
-    rsBack.FillMode = D3D11_FILL_SOLID;
-    rsBack.CullMode = D3D11_CULL_BACK;
-    rsBack.DepthClipEnable = TRUE;
-    hr = g_pDevice->CreateRasterizerState(&rsBack, &g_pCullBackRS);
-    if (FAILED(hr)) return false;
+        UINT64 submitted = 0;
+        double start = GetTimeMs();
+        for (UINT64 frame = 0; frame < frameCount && !failed; ++frame)
+        {
+            FrameInput input;
+            input.frameIndex = frame;
+            const FramePacket* packet = pipeline.Push(input);
+            if (!packet)
+                continue;
+
+            if (packet->input.frameIndex != submitted++)
+                failed = "packet order";
+            for (UINT i = 0; i < packet->bspIndexCount && !failed; ++i)
+            {
+                if (packet->bspIndices[i] != (UINT)packet->input.frameIndex)
+                    failed = "packet data overwritten before release";
+            }
+            SpinForMs(PIPELINE_CHECK_STAGE_MS);
+            pipeline.Release();
+        }
+        frameMs[depth] = (GetTimeMs() - start) / frameCount;
+        pipeline.Shutdown();
 
-    D3D11_RASTERIZER_DESC rsNone = {};
-    rsNone.FillMode = D3D11_FILL_SOLID;
-    rsNone.CullMode = D3D11_CULL_NONE;
-    rsNone.DepthClipEnable = TRUE;
-    hr = g_pDevice->CreateRasterizerState(&rsNone, &g_pCullNoneRS);
-    if (FAILED(hr)) return false;
+        if (!failed && submitted != frameCount - depth)
+            failed = "packets held back";
+        if (!failed && (s_PipelineCheckThread == std::this_thread::get_id()) != (depth == 0))
+            failed = "prepare thread";
+    }
 
-    D3D11_BLEND_DESC blendDesc = {};
-    blendDesc.RenderTarget[0].BlendEnable = TRUE;
-    blendDesc.RenderTarget[0].SrcBlend = D3D11_BLEND_SRC_ALPHA;
-    blendDesc.RenderTarget[0].DestBlend = D3D11_BLEND_INV_SRC_ALPHA;
-    blendDesc.RenderTarget[0].BlendOp = D3D11_BLEND_OP_ADD;
-    blendDesc.RenderTarget[0].SrcBlendAlpha = D3D11_BLEND_ONE;
-    blendDesc.RenderTarget[0].DestBlendAlpha = D3D11_BLEND_ZERO;
-    blendDesc.RenderTarget[0].BlendOpAlpha = D3D11_BLEND_OP_ADD;
-    blendDesc.RenderTarget[0].RenderTargetWriteMask = D3D11_COLOR_WRITE_ENABLE_ALL;
+    // Overlap needs a second core
+    if (!failed && std::thread::hardware_concurrency() > 1 && frameMs[1] > 0.75 * frameMs[0])
+        failed = "no overlap between prepare and submit";
 
-    hr = g_pDevice->CreateBlendState(&blendDesc, &g_pTransparentBlendState);
-    if (FAILED(hr)) return false;
+    if (failed)
+    {
+        char message[128];
+        snprintf(message, sizeof(message), "Frame pipeline self-check failed: %s\n", failed);
+        OutputDebugStringA(message);
+        assert(false);
+        return false;
+    }
+    return true;
+}
+
+// The null device has to flag the mistakes it is there to catch and stay quiet otherwise
+bool ValidateNullDevice()
+{
+    DXGI_SWAP_CHAIN_DESC scd = {};
+    scd.BufferCount = 2;
+    scd.BufferDesc.Width = 64;
+    scd.BufferDesc.Height = 64;
+    scd.BufferDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+    scd.SampleDesc.Count = 1;
+
+    NullD3D11Device* device = nullptr;
+    ID3D11DeviceContext* context = nullptr;
+    IDXGISwapChain* swapChain = nullptr;
+    const char* failed = nullptr;
+    if (FAILED(CreateNullD3D11Device(scd, 0, nullptr, &device, &context, &swapChain)))
+    {
+        OutputDebugStringA("Null device self-check failed: creation\n");
+        assert(false);
+        return false;
+    }
+
+    ID3D11Buffer* constants = nullptr;
+    ID3D11Buffer* indices = nullptr;
+    ID3D11Buffer* dynamic = nullptr;
+    ID3D11Texture2D* backBuffer = nullptr;
+    ID3D11RenderTargetView* rtv = nullptr;
+    ID3D11VertexShader* vs = nullptr;
+
+    D3D11_BUFFER_DESC cbDesc = { 64, D3D11_USAGE_DEFAULT, D3D11_BIND_CONSTANT_BUFFER, 0, 0, 0 };
+    D3D11_BUFFER_DESC ibDesc = { 6, D3D11_USAGE_DEFAULT, D3D11_BIND_INDEX_BUFFER, 0, 0, 0 };
+    D3D11_BUFFER_DESC dynamicDesc = { 256, D3D11_USAGE_DYNAMIC, D3D11_BIND_VERTEX_BUFFER, D3D11_CPU_ACCESS_WRITE, 0, 0 };
+    const UINT16 triangle[3] = { 0, 1, 2 };
+    D3D11_SUBRESOURCE_DATA ibData = { triangle, 0, 0 };
+    const char bytecode[] = "vs";
+    if (FAILED(device->CreateBuffer(&cbDesc, nullptr, &constants)) || FAILED(device->CreateBuffer(&ibDesc, &ibData, &indices)) ||
+        FAILED(device->CreateBuffer(&dynamicDesc, nullptr, &dynamic)) ||
+        FAILED(swapChain->GetBuffer(0, __uuidof(ID3D11Texture2D), (void**)&backBuffer)) ||
+        FAILED(device->CreateRenderTargetView(backBuffer, nullptr, &rtv)) ||
+        FAILED(device->CreateVertexShader(bytecode, sizeof(bytecode), nullptr, &vs)))
+    {
+        failed = "creating the objects";
+    }
+
+    // A correct frame: no errors, and the work counted
+    if (!failed)
+    {
+        float data[16] = {};
+        context->UpdateSubresource(constants, 0, nullptr, data, 0, 0);
+        D3D11_MAPPED_SUBRESOURCE mapped;
+        if (FAILED(context->Map(dynamic, 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped)))
+            failed = "mapping a dynamic buffer";
+        else
+            context->Unmap(dynamic, 0);
+        D3D11_VIEWPORT viewport = { 0.0f, 0.0f, 64.0f, 64.0f, 0.0f, 1.0f };
+        context->OMSetRenderTargets(1, &rtv, nullptr);
+        context->RSSetViewports(1, &viewport);
+        context->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+        context->IASetIndexBuffer(indices, DXGI_FORMAT_R16_UINT, 0);
+        context->VSSetShader(vs, nullptr, 0);
+        context->VSSetConstantBuffers(0, 1, &constants);
+        context->DrawIndexedInstanced(3, 4, 0, 0, 0);
+        swapChain->Present(1, 0);
+        const NullD3D11Counters& work = device->GetLastFrameCounters();
+        if (!failed && (device->GetErrorCount() != 0 || work.drawCalls != 1 || work.instances != 4 || work.maps != 1 || work.updateBytes != 64))
+            failed = "a correct frame";
+    }
+
+    // Each mistake is reported once
+    UINT expectedErrors = 0;
+    auto expectError = [&](const char* what, bool rejected)
+        {
+            if (!failed && (!rejected || device->GetErrorCount() != ++expectedErrors))
+                failed = what;
+        };
+    if (!failed)
+    {
+        float data[16] = {};
+        D3D11_BOX box = { 0, 0, 0, 16, 1, 1 };
+        context->UpdateSubresource(constants, 0, &box, data, 0, 0);
+        expectError("a boxed constant buffer update", true);
+
+        D3D11_MAPPED_SUBRESOURCE mapped;
+        expectError("mapping a default buffer", FAILED(context->Map(constants, 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped)));
+
+        context->DrawIndexed(6, 0, 0);
+        expectError("indices past the index buffer", true);
+
+        context->IASetIndexBuffer(nullptr, DXGI_FORMAT_UNKNOWN, 0);
+        context->DrawIndexed(3, 0, 0);
+        expectError("a draw without an index buffer", true);
+
+        // Until every reference to the back buffer is gone, bound or not
+        context->OMSetRenderTargets(0, nullptr, nullptr);
+        expectError("resizing with a view of the back buffer", FAILED(swapChain->ResizeBuffers(0, 32, 32, DXGI_FORMAT_UNKNOWN, 0)));
+        SAFE_RELEASE(rtv);
+        SAFE_RELEASE(backBuffer);
+        if (!failed && FAILED(swapChain->ResizeBuffers(0, 32, 32, DXGI_FORMAT_UNKNOWN, 0)))
+            failed = "resizing without references";
+    }
 
+    SAFE_RELEASE(vs);
+    SAFE_RELEASE(rtv);
+    SAFE_RELEASE(backBuffer);
+    SAFE_RELEASE(dynamic);
+    SAFE_RELEASE(indices);
+    SAFE_RELEASE(constants);
+    context->ClearState();
+    SAFE_RELEASE(swapChain);
+    if (!failed && device->GetLiveObjectCount() != 1)
+        failed = "objects left alive";
+    SAFE_RELEASE(context);
+    SAFE_RELEASE(device);
+
+    if (failed)
+    {
+        char message[128];
+        snprintf(message, sizeof(message), "Null device self-check failed: %s\n", failed);
+        OutputDebugStringA(message);
+        assert(false);
+        return false;
+    }
     return true;
 }
 
-bool CreateConstantBuffers()
+// Redundant binds must never reach the context, and the calls that do must carry exactly
+// the slots that changed; equal state descriptions must come back as the same object
+bool ValidateStateCache()
 {
-    HRESULT hr;
+    DXGI_SWAP_CHAIN_DESC scd = {};
+    scd.BufferCount = 2;
+    scd.BufferDesc.Width = 64;
+    scd.BufferDesc.Height = 64;
+    scd.BufferDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+    scd.SampleDesc.Count = 1;
 
-    D3D11_BUFFER_DESC desc = {};
-    desc.ByteWidth = sizeof(ViewProjBuffer);
-    desc.Usage = D3D11_USAGE_DYNAMIC;
-    desc.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
-    desc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
-    hr = g_pDevice->CreateBuffer(&desc, nullptr, &g_pViewProjBuffer);
-    if (FAILED(hr)) return false;
+    NullD3D11Device* device = nullptr;
+    ID3D11DeviceContext* context = nullptr;
+    IDXGISwapChain* swapChain = nullptr;
+    const char* failed = nullptr;
+    if (FAILED(CreateNullD3D11Device(scd, 0, nullptr, &device, &context, &swapChain)))
+    {
+        OutputDebugStringA("State cache self-check failed: creating the null device\n");
+        assert(false);
+        return false;
+    }
 
-    desc = {};
-    desc.ByteWidth = sizeof(SceneBuffer);
-    desc.Usage = D3D11_USAGE_DEFAULT;
-    desc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
-    hr = g_pDevice->CreateBuffer(&desc, nullptr, &g_pSceneBuffer);
-    if (FAILED(hr)) return false;
+    ID3D11Buffer* constants[3] = {};
+    ID3D11Texture2D* backBuffer = nullptr;
+    ID3D11RenderTargetView* rtv = nullptr;
+    ID3D11VertexShader* vs = nullptr;
+    ID3D11PixelShader* ps = nullptr;
+    ID3D11DepthStencilState* depthStates[3] = {};
+    ID3D11BlendState* blendStates[2] = {};
+    ID3D11SamplerState* sampler = nullptr;
+    StateObjectCache objects;
+    objects.Init(device);
+
+    D3D11_BUFFER_DESC cbDesc = { 64, D3D11_USAGE_DEFAULT, D3D11_BIND_CONSTANT_BUFFER, 0, 0, 0 };
+    const char bytecode[] = "shader";
+    for (UINT i = 0; i < 3 && !failed; ++i)
+    {
+        if (FAILED(device->CreateBuffer(&cbDesc, nullptr, &constants[i])))
+            failed = "creating the constant buffers";
+    }
+    if (!failed && (FAILED(swapChain->GetBuffer(0, __uuidof(ID3D11Texture2D), (void**)&backBuffer)) ||
+        FAILED(device->CreateRenderTargetView(backBuffer, nullptr, &rtv)) ||
+        FAILED(device->CreateVertexShader(bytecode, sizeof(bytecode), nullptr, &vs)) ||
+        FAILED(device->CreatePixelShader(bytecode, sizeof(bytecode), nullptr, &ps))))
+    {
+        failed = "creating the objects";
+    }
 
-    desc = {};
-    desc.ByteWidth = sizeof(TransparentBuffer);
-    desc.Usage = D3D11_USAGE_DEFAULT;
-    desc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
-    hr = g_pDevice->CreateBuffer(&desc, nullptr, &g_pTransparentBuffer);
-    if (FAILED(hr)) return false;
+    // Two equal depth descriptions and a third that differs in one member; a sampler
+    // description of the same size must not be mistaken for either
+    if (!failed)
+    {
+        D3D11_DEPTH_STENCIL_DESC depthDesc = {};
+        depthDesc.DepthEnable = TRUE;
+        depthDesc.DepthWriteMask = D3D11_DEPTH_WRITE_MASK_ALL;
+        depthDesc.DepthFunc = D3D11_COMPARISON_LESS;
+        D3D11_DEPTH_STENCIL_DESC writeOff = depthDesc;
+        writeOff.DepthWriteMask = D3D11_DEPTH_WRITE_MASK_ZERO;
+        D3D11_BLEND_DESC blendDesc = {};
+        blendDesc.RenderTarget[0].BlendEnable = TRUE;
+        blendDesc.RenderTarget[0].SrcBlend = D3D11_BLEND_SRC_ALPHA;
+        blendDesc.RenderTarget[0].DestBlend = D3D11_BLEND_INV_SRC_ALPHA;
+        blendDesc.RenderTarget[0].BlendOp = D3D11_BLEND_OP_ADD;
+        blendDesc.RenderTarget[0].SrcBlendAlpha = D3D11_BLEND_ONE;
+        blendDesc.RenderTarget[0].DestBlendAlpha = D3D11_BLEND_ZERO;
+        blendDesc.RenderTarget[0].BlendOpAlpha = D3D11_BLEND_OP_ADD;
+        blendDesc.RenderTarget[0].RenderTargetWriteMask = D3D11_COLOR_WRITE_ENABLE_ALL;
+        D3D11_SAMPLER_DESC samplerDesc = {};
+        samplerDesc.Filter = D3D11_FILTER_MIN_MAG_MIP_LINEAR;
+        samplerDesc.AddressU = D3D11_TEXTURE_ADDRESS_WRAP;
+        samplerDesc.AddressV = D3D11_TEXTURE_ADDRESS_WRAP;
+        samplerDesc.AddressW = D3D11_TEXTURE_ADDRESS_WRAP;
+        samplerDesc.ComparisonFunc = D3D11_COMPARISON_NEVER;
+        samplerDesc.MaxLOD = FLT_MAX;
+
+        if (FAILED(objects.CreateDepthStencilState(depthDesc, &depthStates[0])) ||
+            FAILED(objects.CreateDepthStencilState(depthDesc, &depthStates[1])) ||
+            FAILED(objects.CreateDepthStencilState(writeOff, &depthStates[2])) ||
+            FAILED(objects.CreateBlendState(blendDesc, &blendStates[0])) ||
+            FAILED(objects.CreateBlendState(blendDesc, &blendStates[1])) ||
+            FAILED(objects.CreateSamplerState(samplerDesc, &sampler)))
+        {
+            failed = "creating the state objects";
+        }
+        else if (depthStates[0] != depthStates[1] || depthStates[0] == depthStates[2] || blendStates[0] != blendStates[1] ||
+            objects.GetObjectCount() != 4 || objects.GetHitCount() != 2)
+        {
+            failed = "sharing state objects";
+        }
+    }
 
-    desc = {};
-    desc.ByteWidth = sizeof(PostProcessBuffer);
-    desc.Usage = D3D11_USAGE_DEFAULT;
-    desc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
-    hr = g_pDevice->CreateBuffer(&desc, nullptr, &g_pPostProcessBuffer);
-    if (FAILED(hr)) return false;
+    D3D11StateCache cache;
+    std::vector<StateCall> log;
+    auto expectCall = [&](const char* what, size_t index, StateCallType type, UINT startSlot, UINT count)
+        {
+            if (!failed && (log.size() != index + 1 || log[index].type != type || log[index].startSlot != startSlot || log[index].count != count))
+                failed = what;
+        };
+    if (!failed)
+    {
+        cache.Init(context);
+        cache.SetCallLog(&log);
 
-    desc = {};
-    desc.ByteWidth = sizeof(InstanceDataGPU) * MAX_INSTANCES;
-    desc.Usage = D3D11_USAGE_DEFAULT;
-    desc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
-    hr = g_pDevice->CreateBuffer(&desc, nullptr, &g_pInstanceBuffer);
-    if (FAILED(hr)) return false;
+        // The same pass twice: the second one binds nothing
+        D3D11_VIEWPORT viewport = { 0.0f, 0.0f, 64.0f, 64.0f, 0.0f, 1.0f };
+        ID3D11Buffer* buffers[] = { constants[0], constants[1] };
+        for (UINT pass = 0; pass < 2; ++pass)
+        {
+            cache.OMSetRenderTargets(1, &rtv, nullptr);
+            cache.RSSetViewport(viewport);
+            cache.VSSetShader(vs);
+            cache.PSSetShader(ps);
+            cache.VSSetConstantBuffers(0, 2, buffers);
+            cache.OMSetDepthStencilState(depthStates[0], 0);
+        }
+        const StateCallType passCalls[] =
+        {
+            STATE_CALL_RENDER_TARGETS, STATE_CALL_VIEWPORT, STATE_CALL_VS_SHADER, STATE_CALL_PS_SHADER,
+            STATE_CALL_VS_CONSTANT_BUFFERS, STATE_CALL_DEPTH_STENCIL_STATE,
+        };
+        if (log.size() != _countof(passCalls))
+            failed = "a repeated pass";
+        for (UINT i = 0; i < log.size() && !failed; ++i)
+        {
+            if (log[i].type != passCalls[i])
+                failed = "the calls of a pass";
+        }
 
-    desc = {};
-    desc.ByteWidth = sizeof(VisibleIdGPU) * MAX_VISIBLE_INSTANCES;
-    desc.Usage = D3D11_USAGE_DEFAULT;
-    desc.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
-    hr = g_pDevice->CreateBuffer(&desc, nullptr, &g_pVisibleIdsBuffer);
-    if (FAILED(hr)) return false;
+        // A range is narrowed to the slots that changed; a shared object is the one bound
+        ID3D11Buffer* middleChanged[] = { constants[0], constants[2], nullptr };
+        cache.VSSetConstantBuffers(0, 3, middleChanged);
+        expectCall("a range with one changed slot", 6, STATE_CALL_VS_CONSTANT_BUFFERS, 1, 1);
+        cache.OMSetDepthStencilState(depthStates[1], 0);
+        cache.OMSetDepthStencilState(depthStates[2], 0);
+        expectCall("a different depth state", 7, STATE_CALL_DEPTH_STENCIL_STATE, 0, 1);
+        cache.OMSetBlendState(nullptr, nullptr, 0xFFFFFFFF);
+        FLOAT blendFactor[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        cache.OMSetBlendState(blendStates[0], blendFactor, 0xFFFFFFFF);
+        cache.OMSetBlendState(blendStates[1], blendFactor, 0xFFFFFFFF);
+        expectCall("a blend state", 8, STATE_CALL_BLEND_STATE, 0, 1);
+
+        // The context saw the calls in the log and nothing else
+        UINT issued = 0, skipped = 0;
+        cache.TakeCounts(issued, skipped);
+        swapChain->Present(1, 0);
+        cache.OnPresent();
+        if (!failed && (issued != log.size() || skipped != 9 || device->GetLastFrameCounters().stateCalls != issued))
+            failed = "the counts of issued and dropped calls";
+
+        // Present forgets the render targets, Reset everything
+        cache.OMSetRenderTargets(1, &rtv, nullptr);
+        expectCall("render targets after Present", 9, STATE_CALL_RENDER_TARGETS, 0, 1);
+        cache.PSSetShader(ps);
+        cache.Reset();
+        cache.PSSetShader(ps);
+        expectCall("a shader after Reset", 10, STATE_CALL_PS_SHADER, 0, 1);
+        cache.SetCallLog(nullptr);
+        if (!failed && device->GetErrorCount() != 0)
+            failed = "null device errors";
+    }
 
+    for (UINT i = 0; i < 3; ++i)
+        SAFE_RELEASE(depthStates[i]);
+    for (UINT i = 0; i < 2; ++i)
+        SAFE_RELEASE(blendStates[i]);
+    SAFE_RELEASE(sampler);
+    objects.Release();
+    SAFE_RELEASE(ps);
+    SAFE_RELEASE(vs);
+    SAFE_RELEASE(rtv);
+    SAFE_RELEASE(backBuffer);
+    for (UINT i = 0; i < 3; ++i)
+        SAFE_RELEASE(constants[i]);
+    cache.Release();
+    context->ClearState();
+    SAFE_RELEASE(swapChain);
+    if (!failed && device->GetLiveObjectCount() != 1)
+        failed = "objects left alive";
+    // The device's reference on its context has to be the only one left, the cache's included
+    if (context->Release() != 1 && !failed)
+        failed = "references left on the context";
+    context = nullptr;
+    SAFE_RELEASE(device);
+
+    if (failed)
+    {
+        char message[128];
+        snprintf(message, sizeof(message), "State cache self-check failed: %s\n", failed);
+        OutputDebugStringA(message);
+        assert(false);
+        return false;
+    }
     return true;
 }
 
-bool CreatePostProcessResources(UINT width, UINT height)
+// A post effect as a chain of half-resolution passes between the scene and the back
+// buffer; the chain's targets take two textures whatever its length
+static void AddBloomChain(RenderGraph& graph, RenderGraph::ExecuteFunc execute, UINT blurPasses, ID3D11RenderTargetView* backBufferRTV)
+{
+    const FLOAT black[4] = {};
+    RenderGraphHandle backBuffer = graph.ImportTexture("back buffer", 64, 64, backBufferRTV, nullptr, nullptr);
+    graph.MarkOutput(backBuffer);
+    RenderGraphHandle scene = graph.CreateTexture("scene", 64, 64, DXGI_FORMAT_R8G8B8A8_UNORM);
+    RenderGraphHandle bright = graph.CreateTexture("bright", 32, 32, DXGI_FORMAT_R8G8B8A8_UNORM);
+
+    RenderGraphHandle pass = graph.AddPass("scene", execute, nullptr);
+    graph.WriteRenderTarget(pass, scene, black);
+    pass = graph.AddPass("bright", execute, nullptr);
+    graph.ReadTexture(pass, scene, 0);
+    graph.WriteRenderTarget(pass, bright, nullptr);
+
+    RenderGraphHandle blurred = bright;
+    for (UINT i = 0; i < blurPasses; ++i)
+    {
+        RenderGraphHandle next = graph.CreateTexture("blur", 32, 32, DXGI_FORMAT_R8G8B8A8_UNORM);
+        pass = graph.AddPass("blur", execute, nullptr);
+        graph.ReadTexture(pass, blurred, 0);
+        graph.WriteRenderTarget(pass, next, nullptr);
+        blurred = next;
+    }
+
+    pass = graph.AddPass("composite", execute, nullptr);
+    graph.ReadTexture(pass, scene, 0);
+    graph.ReadTexture(pass, blurred, 1);
+    graph.WriteRenderTarget(pass, backBuffer, nullptr);
+}
+
+static void EmptyRenderPass(const RenderGraph&, void*)
+{
+}
+
+// Order, culling, lifetimes, aliasing and barriers of a few graphs, compiled without a
+// device; then one executed on the null device to check the binds
+bool ValidateRenderGraph()
 {
-    SAFE_RELEASE(g_pSceneColorSRV);
-    SAFE_RELEASE(g_pSceneColorRTV);
-    SAFE_RELEASE(g_pSceneColorTex);
+    RenderGraph graph;
+    const char* failed = nullptr;
+    const FLOAT black[4] = {};
+
+    // The frame's passes with the consumer declared first and a pass nothing reads
+    {
+        graph.Reset();
+        RenderGraphHandle backBuffer = graph.ImportTexture("back buffer", 64, 64, nullptr, nullptr, nullptr);
+        RenderGraphHandle depth = graph.ImportTexture("depth", 64, 64, nullptr, nullptr, nullptr);
+        RenderGraphHandle scene = graph.CreateTexture("scene", 64, 64, DXGI_FORMAT_R8G8B8A8_UNORM);
+        RenderGraphHandle debugView = graph.CreateTexture("debug", 64, 64, DXGI_FORMAT_R8G8B8A8_UNORM);
+        graph.MarkOutput(backBuffer);
+
+        RenderGraphHandle post = graph.AddPass("post", EmptyRenderPass, nullptr);
+        graph.ReadTexture(post, scene, 0);
+        graph.WriteRenderTarget(post, backBuffer, nullptr);
+        RenderGraphHandle debug = graph.AddPass("debug", EmptyRenderPass, nullptr);
+        graph.ReadTexture(debug, scene, 3);
+        graph.WriteRenderTarget(debug, debugView, black);
+        RenderGraphHandle opaque = graph.AddPass("opaque", EmptyRenderPass, nullptr);
+        graph.WriteRenderTarget(opaque, scene, black);
+        graph.WriteDepth(opaque, depth, true);
+        RenderGraphHandle skybox = graph.AddPass("skybox", EmptyRenderPass, nullptr);
+        graph.WriteRenderTarget(skybox, scene, nullptr);
+        graph.TestDepth(skybox, depth);
+        RenderGraphHandle transparent = graph.AddPass("transparent", EmptyRenderPass, nullptr);
+        graph.WriteRenderTarget(transparent, scene, nullptr);
+        graph.TestDepth(transparent, depth);
+
+        const RenderGraphHandle expected[] = { opaque, skybox, transparent, post };
+        if (!graph.Compile())
+            failed = "compiling the frame";
+        else if (!graph.IsPassCulled(debug) || graph.GetExecutedPassCount() != _countof(expected))
+            failed = "culling the unused pass";
+        for (UINT i = 0; i < _countof(expected) && !failed; ++i)
+        {
+            if (graph.GetExecutedPass(i) != expected[i])
+                failed = "the order of the frame's passes";
+        }
+        if (!failed && (graph.GetFirstUse(scene) != 0 || graph.GetLastUse(scene) != 3 || graph.GetPhysical(debugView) != RENDER_GRAPH_NONE))
+            failed = "the scene texture's lifetime";
+        if (!failed && (graph.GetBarriers().size() != 1 || graph.GetBarriers()[0].position != 4 ||
+            graph.GetBarriers()[0].texture != scene || graph.GetBarriers()[0].slot != 0))
+            failed = "unbinding the scene texture at the end of the frame";
+    }
+
+    // Longer effect chains alias into the same textures
+    for (UINT blurPasses : { 2u, 8u })
+    {
+        graph.Reset();
+        AddBloomChain(graph, EmptyRenderPass, blurPasses, nullptr);
+        if (!failed && !graph.Compile())
+            failed = "compiling the bloom chain";
+        if (!failed && (graph.GetTransientCount() != blurPasses + 2 || graph.GetPhysicalCount() != 3))
+            failed = "aliasing the bloom chain";
+    }
 
-    D3D11_TEXTURE2D_DESC desc = {};
-    desc.Width = width;
-    desc.Height = height;
-    desc.MipLevels = 1;
-    desc.ArraySize = 1;
-    desc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
-    desc.SampleDesc.Count = 1;
-    desc.SampleDesc.Quality = 0;
-    desc.Usage = D3D11_USAGE_DEFAULT;
-    desc.BindFlags = D3D11_BIND_RENDER_TARGET | D3D11_BIND_SHADER_RESOURCE;
+    // A texture still bound for reading when its memory is written under another name
+    {
+        graph.Reset();
+        RenderGraphHandle backBuffer = graph.ImportTexture("back buffer", 64, 64, nullptr, nullptr, nullptr);
+        graph.MarkOutput(backBuffer);
+        RenderGraphHandle a = graph.CreateTexture("a", 32, 32, DXGI_FORMAT_R16G16B16A16_FLOAT);
+        RenderGraphHandle b = graph.CreateTexture("b", 32, 32, DXGI_FORMAT_R16G16B16A16_FLOAT);
+        RenderGraphHandle c = graph.CreateTexture("c", 32, 32, DXGI_FORMAT_R16G16B16A16_FLOAT);
+        RenderGraphHandle pass = graph.AddPass("write a", EmptyRenderPass, nullptr);
+        graph.WriteRenderTarget(pass, a, black);
+        pass = graph.AddPass("a to b", EmptyRenderPass, nullptr);
+        graph.ReadTexture(pass, a, 1);
+        graph.WriteRenderTarget(pass, b, nullptr);
+        pass = graph.AddPass("b to c", EmptyRenderPass, nullptr);
+        graph.ReadTexture(pass, b, 0);
+        graph.WriteRenderTarget(pass, c, nullptr);
+        pass = graph.AddPass("c to back buffer", EmptyRenderPass, nullptr);
+        graph.ReadTexture(pass, c, 0);
+        graph.WriteRenderTarget(pass, backBuffer, nullptr);
+
+        if (!failed && !graph.Compile())
+            failed = "compiling the aliased chain";
+        if (!failed && (graph.GetPhysical(a) != graph.GetPhysical(c) || graph.GetPhysicalCount() != 2))
+            failed = "aliasing a texture once its readers are done";
+        if (!failed && (graph.GetBarriers().empty() || graph.GetBarriers()[0].position != 2 ||
+            graph.GetBarriers()[0].texture != a || graph.GetBarriers()[0].slot != 1))
+            failed = "unbinding a texture before its memory is written";
+    }
 
-    HRESULT hr = g_pDevice->CreateTexture2D(&desc, nullptr, &g_pSceneColorTex);
-    if (FAILED(hr)) return false;
+    // Graphs that can't run
+    {
+        graph.Reset();
+        RenderGraphHandle backBuffer = graph.ImportTexture("back buffer", 64, 64, nullptr, nullptr, nullptr);
+        graph.MarkOutput(backBuffer);
+        RenderGraphHandle a = graph.CreateTexture("a", 32, 32, DXGI_FORMAT_R8G8B8A8_UNORM);
+        RenderGraphHandle b = graph.CreateTexture("b", 32, 32, DXGI_FORMAT_R8G8B8A8_UNORM);
+        RenderGraphHandle pass = graph.AddPass("b to a", EmptyRenderPass, nullptr);
+        graph.ReadTexture(pass, b, 0);
+        graph.WriteRenderTarget(pass, a, nullptr);
+        pass = graph.AddPass("a to b", EmptyRenderPass, nullptr);
+        graph.ReadTexture(pass, a, 0);
+        graph.WriteRenderTarget(pass, b, nullptr);
+        graph.WriteRenderTarget(pass, backBuffer, nullptr);
+        if (!failed && graph.Compile())
+            failed = "a dependency cycle";
+
+        graph.Reset();
+        backBuffer = graph.ImportTexture("back buffer", 64, 64, nullptr, nullptr, nullptr);
+        graph.MarkOutput(backBuffer);
+        a = graph.CreateTexture("a", 32, 32, DXGI_FORMAT_R8G8B8A8_UNORM);
+        pass = graph.AddPass("read a", EmptyRenderPass, nullptr);
+        graph.ReadTexture(pass, a, 0);
+        graph.WriteRenderTarget(pass, backBuffer, nullptr);
+        if (!failed && graph.Compile())
+            failed = "reading a texture nothing writes";
+    }
 
-    hr = g_pDevice->CreateRenderTargetView(g_pSceneColorTex, nullptr, &g_pSceneColorRTV);
-    if (FAILED(hr)) return false;
+    // The bloom chain on the null device, two frames: binds without hazards, one pool
+    // texture per physical texture, kept for the second frame
+    DXGI_SWAP_CHAIN_DESC scd = {};
+    scd.BufferCount = 2;
+    scd.BufferDesc.Width = 64;
+    scd.BufferDesc.Height = 64;
+    scd.BufferDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+    scd.SampleDesc.Count = 1;
+    NullD3D11Device* device = nullptr;
+    ID3D11DeviceContext* context = nullptr;
+    IDXGISwapChain* swapChain = nullptr;
+    if (!failed && FAILED(CreateNullD3D11Device(scd, 0, nullptr, &device, &context, &swapChain)))
+        failed = "creating the null device";
+    ID3D11Texture2D* backBuffer = nullptr;
+    ID3D11RenderTargetView* backBufferRTV = nullptr;
+    if (!failed && (FAILED(swapChain->GetBuffer(0, __uuidof(ID3D11Texture2D), (void**)&backBuffer)) ||
+        FAILED(device->CreateRenderTargetView(backBuffer, nullptr, &backBufferRTV))))
+    {
+        failed = "creating the back buffer view";
+    }
+    if (device)
+    {
+        RenderTargetPool pool;
+        pool.Init(device);
+        D3D11StateCache cache;
+        cache.Init(context);
+        for (UINT frame = 0; frame < 2 && !failed; ++frame)
+        {
+            graph.Reset();
+            AddBloomChain(graph, EmptyRenderPass, 4, backBufferRTV);
+            if (!graph.Compile() || !graph.Allocate(pool))
+            {
+                failed = "allocating the bloom chain";
+                break;
+            }
+            graph.Execute(cache, context);
+            pool.EndFrame();
+            swapChain->Present(1, 0);
+            cache.OnPresent();
+            if (device->GetErrorCount() != 0 || pool.GetTargetCount() != graph.GetPhysicalCount())
+                failed = "executing the bloom chain";
+        }
 
-    hr = g_pDevice->CreateShaderResourceView(g_pSceneColorTex, nullptr, &g_pSceneColorSRV);
-    if (FAILED(hr)) return false;
+        pool.Release();
+        cache.Release();
+        SAFE_RELEASE(backBufferRTV);
+        SAFE_RELEASE(backBuffer);
+        context->ClearState();
+        SAFE_RELEASE(swapChain);
+        if (!failed && device->GetLiveObjectCount() != 1)
+            failed = "objects left alive";
+        // The device's reference on its context has to be the last, the state cache's released
+        if (context->Release() != 1 && !failed)
+            failed = "references left on the context";
+        context = nullptr;
+        SAFE_RELEASE(device);
+    }
 
+    if (failed)
+    {
+        char message[128];
+        snprintf(message, sizeof(message), "Render graph self-check failed: %s\n", failed);
+        OutputDebugStringA(message);
+        assert(false);
+        return false;
+    }
     return true;
 }
 
-// Scene generation
-void CreateOpaqueInstances()
+// Radix sort against std::stable_sort, serial and across the job system, and the field
+// order of the draw keys
+bool ValidateDrawKeySort()
 {
-    g_OpaqueCubes.clear();
+    const char* failed = nullptr;
 
-    const int gridX = 12;
-    const int gridZ = 12;
-    const float spacing = 1.65f;
+    if (MakeDrawKey(DRAW_PASS_OPAQUE, 0, 0, QuantizeDrawDepth(1.0f)) >= MakeDrawKey(DRAW_PASS_OPAQUE, 0, 0, QuantizeDrawDepth(1.01f)) ||
+        MakeDrawKey(DRAW_PASS_OPAQUE, 0, 0, QuantizeDrawDepth(0.01f)) >= MakeDrawKey(DRAW_PASS_OPAQUE, 0, 0, QuantizeDrawDepth(5000.0f)) ||
+        QuantizeDrawDepth(-1.0f) != 0)
+    {
+        failed = "opaque depth order";
+    }
+    if (!failed && MakeDrawKey(DRAW_PASS_TRANSPARENT, 0, 0, DRAW_KEY_DEPTH_MAX - QuantizeDrawDepth(10.0f)) >=
+        MakeDrawKey(DRAW_PASS_TRANSPARENT, 0, 0, DRAW_KEY_DEPTH_MAX - QuantizeDrawDepth(2.0f)))
+    {
+        failed = "transparent depth order";
+    }
+    if (!failed && (MakeDrawKey(DRAW_PASS_OPAQUE, 1, 0, 0) <= MakeDrawKey(DRAW_PASS_OPAQUE, 0, 5, DRAW_KEY_DEPTH_MAX) ||
+        MakeDrawKey(DRAW_PASS_SKYBOX, 0, 0, 0) <= MakeDrawKey(DRAW_PASS_OPAQUE, 4095, 0, DRAW_KEY_DEPTH_MAX) ||
+        DrawKeyShader(MakeDrawKey(DRAW_PASS_OPAQUE, 2, 7, 9)) != 2))
+    {
+        failed = "field order";
+    }
 
-    for (int z = 0; z < gridZ; ++z)
+    JobSystem jobs;
+    jobs.Init(3);
+    const UINT counts[] = { 0, 1, 1000, 3 * RADIX_SORT_PARALLEL_MIN + 17 };
+    for (UINT c = 0; c < _countof(counts) && !failed; ++c)
     {
-        for (int x = 0; x < gridX; ++x)
+        // Few shaders and a narrow depth range: plenty of equal keys to show up instability,
+        // and constant bytes for the sort to skip
+        UINT count = counts[c];
+        std::vector<UINT64> keys(count), expectedKeys(count), scratch(count);
+        std::vector<UINT> values(count), expectedValues(count), valueScratch(count);
+        std::vector<std::pair<UINT64, UINT>> reference(count);
+        for (UINT i = 0; i < count; ++i)
         {
-            if (g_OpaqueCubes.size() >= MAX_INSTANCES)
-                return;
-
-            CubeInstanceCPU cube = {};
-            cube.basePos = XMFLOAT3(
-                (x - gridX / 2) * spacing,
-                0.0f,
-                (z - gridZ / 2) * spacing
-            );
-            cube.scale = 0.75f + 0.15f * float((x + z) % 3);
-            cube.rotSpeed = 0.35f + 0.08f * float((x * 7 + z * 3) % 5);
-            cube.textureId = ((x + z) % 2 == 0) ? 0u : 1u; // 0 = Brick, 1 = Kitty
-            cube.hasNormalMap = (cube.textureId == 0u);     // only Brick uses BrickNM
+            UINT hash = HashUint(i * 7919u + c);
+            keys[i] = MakeDrawKey(hash % 3, (hash >> 2) % 3, 0, (hash >> 8) & 0xFFFF);
+            values[i] = i;
+            reference[i] = std::make_pair(keys[i], i);
+        }
+        std::stable_sort(reference.begin(), reference.end(),
+            [](const std::pair<UINT64, UINT>& a, const std::pair<UINT64, UINT>& b) { return a.first < b.first; });
+        for (UINT i = 0; i < count; ++i)
+        {
+            expectedKeys[i] = reference[i].first;
+            expectedValues[i] = reference[i].second;
+        }
 
-            g_OpaqueCubes.push_back(cube);
+        for (UINT parallel = 0; parallel < 2 && !failed; ++parallel)
+        {
+            std::vector<UINT64> sortedKeys = keys;
+            std::vector<UINT> sortedValues = values;
+            RadixSortDrawKeys(sortedKeys.data(), sortedValues.data(), count, scratch.data(), valueScratch.data(), parallel ? &jobs : nullptr);
+            if (sortedKeys != expectedKeys || sortedValues != expectedValues)
+                failed = parallel ? "parallel sort" : "serial sort";
         }
     }
-}
-
-// Camera / culling
-void UpdateCamera(double deltaTime)
-{
-    float speed = 1.0f;
-    if (g_KeyLeft)  g_CameraYaw -= speed * (float)deltaTime;
-    if (g_KeyRight) g_CameraYaw += speed * (float)deltaTime;
-    if (g_KeyUp)    g_CameraPitch += speed * (float)deltaTime;
-    if (g_KeyDown)  g_CameraPitch -= speed * (float)deltaTime;
-
-    if (g_CameraPitch > 1.5f)  g_CameraPitch = 1.5f;
-    if (g_CameraPitch < -1.5f) g_CameraPitch = -1.5f;
-}
+    jobs.Shutdown();
 
-Plane NormalizePlane(const Plane& in)
-{
-    Plane out = in;
-    float len = sqrtf(in.p.x * in.p.x + in.p.y * in.p.y + in.p.z * in.p.z);
-    if (len > 0.00001f)
+    if (failed)
     {
-        out.p.x /= len;
-        out.p.y /= len;
-        out.p.z /= len;
-        out.p.w /= len;
+        char message[128];
+        snprintf(message, sizeof(message), "Draw key sort self-check failed: %s\n", failed);
+        OutputDebugStringA(message);
+        assert(false);
+        return false;
     }
-    return out;
+    return true;
 }
 
-void ExtractFrustumPlanes(Plane planes[6], const XMMATRIX& vp)
+// Per-draw constants through the constant ring, bound by 11.1 offsets and by copies on a
+// device without them: after each BindConstantSlice the vertex shader must see exactly
+// that draw's constants, over enough frames to wrap the ring, without device errors.
+// Runs on the renderer's globals, so it has to run before the real device exists.
+bool ValidateConstantSlices()
 {
-    XMFLOAT4X4 m;
-    XMStoreFloat4x4(&m, vp);
+    assert(!g_pDevice);
+    DXGI_SWAP_CHAIN_DESC scd = {};
+    scd.BufferCount = 2;
+    scd.BufferDesc.Width = 64;
+    scd.BufferDesc.Height = 64;
+    scd.BufferDesc.Format = DXGI_FORMAT_R8G8B8A8_UNORM;
+    scd.SampleDesc.Count = 1;
 
-    planes[0].p = XMFLOAT4(m._14 + m._11, m._24 + m._21, m._34 + m._31, m._44 + m._41); // left
-    planes[1].p = XMFLOAT4(m._14 - m._11, m._24 - m._21, m._34 - m._31, m._44 - m._41); // right
-    planes[2].p = XMFLOAT4(m._14 + m._12, m._24 + m._22, m._34 + m._32, m._44 + m._42); // bottom
-    planes[3].p = XMFLOAT4(m._14 - m._12, m._24 - m._22, m._34 - m._32, m._44 - m._42); // top
-    planes[4].p = XMFLOAT4(m._13, m._23, m._33, m._43);           // near
-    planes[5].p = XMFLOAT4(m._14 - m._13, m._24 - m._23, m._34 - m._33, m._44 - m._43); // far
+    const UINT drawsPerFrame = 40;
+    const UINT frameCount = 3 * CONSTANT_RING_BYTES / (drawsPerFrame * CONSTANT_SLICE_BYTES);
+    const char* failed = nullptr;
+    for (UINT offsets = 0; offsets < 2 && !failed; ++offsets)
+    {
+        NullD3D11Device* device = nullptr;
+        ID3D11DeviceContext* context = nullptr;
+        IDXGISwapChain* swapChain = nullptr;
+        if (FAILED(CreateNullD3D11Device(scd, 0, nullptr, &device, &context, &swapChain)))
+        {
+            failed = "creating the null device";
+            break;
+        }
+        D3D11_FEATURE_DATA_D3D11_OPTIONS options = device->GetOptions();
+        options.ConstantBufferOffsetting = offsets;
+        options.MapNoOverwriteOnDynamicConstantBuffer = offsets;
+        device->SetOptions(options);
+
+        g_pDevice = device;
+        g_pDeviceContext = context;
+        g_StateCache.Init(context);
+        ID3D11Buffer* drawParams = nullptr;
+        D3D11_BUFFER_DESC desc = { sizeof(DrawParamsBuffer), D3D11_USAGE_DEFAULT, D3D11_BIND_CONSTANT_BUFFER, 0, 0, 0 };
+        D3D11_FEATURE_DATA_D3D11_OPTIONS reported = {};
+        if (FAILED(device->CreateBuffer(&desc, nullptr, &drawParams)) ||
+            FAILED(device->CheckFeatureSupport(D3D11_FEATURE_D3D11_OPTIONS, &reported, sizeof(reported))) || !InitConstantRing(&reported))
+        {
+            failed = "creating the constant ring";
+        }
+        else if (g_ConstantBufferOffsets != (offsets != 0))
+        {
+            failed = offsets ? "offsets unused on an 11.1 device" : "offsets used on a device without them";
+        }
 
-    for (int i = 0; i < 6; ++i)
-        planes[i] = NormalizePlane(planes[i]);
-}
+        for (UINT frame = 1; frame <= frameCount && !failed; ++frame)
+        {
+            // The GPU runs two frames behind
+            g_ConstantRing.BeginFrame(frame > 2 ? frame - 2 : 0);
+            UINT first = 0;
+            BYTE* slices = static_cast<BYTE*>(g_ConstantRing.Allocate(drawsPerFrame * CONSTANT_SLICE_BYTES, first));
+            if (!slices)
+            {
+                failed = "allocating a frame's slices";
+                break;
+            }
+            for (UINT d = 0; d < drawsPerFrame; ++d)
+            {
+                DrawParamsBuffer params = {};
+                params.params = XMUINT4(frame, d, HashUint(frame * drawsPerFrame + d), 0);
+                memcpy(slices + d * CONSTANT_SLICE_BYTES, &params, sizeof(params));
+            }
+            g_ConstantRing.EndFrame();
 
-bool IsSphereInsideFrustum(const Plane planes[6], const XMFLOAT3& center, float radius)
-{
-    for (int i = 0; i < 6; ++i)
+            if (!g_ConstantBufferOffsets)
+                g_StateCache.VSSetConstantBuffers(5, 1, &drawParams);
+            for (UINT d = 0; d < drawsPerFrame && !failed; ++d)
+            {
+                BindConstantSlice(5, drawParams, first + d * CONSTANT_SLICE_BYTES, sizeof(DrawParamsBuffer));
+                DrawParamsBuffer expected = {};
+                expected.params = XMUINT4(frame, d, HashUint(frame * drawsPerFrame + d), 0);
+                UINT bytes = 0;
+                const BYTE* seen = static_cast<NullDeviceContext*>(context)->GetVSConstants(5, &bytes);
+                if (!seen || bytes < sizeof(expected) || memcmp(seen, &expected, sizeof(expected)) != 0)
+                    failed = offsets ? "a slice bound by offset reads wrong" : "a slice bound by copy reads wrong";
+            }
+
+            swapChain->Present(0, 0);
+            if (!failed && device->GetLastFrameCounters().copies != (offsets ? 0 : drawsPerFrame))
+                failed = "copies per frame";
+        }
+        // Both rings take NO_OVERWRITE maps, so only the first map discards
+        if (!failed && (device->GetErrorCount() != 0 || g_ConstantRing.GetDiscardCount() != 1))
+            failed = offsets ? "device errors or discards with offsets" : "device errors or discards with copies";
+
+        ReleaseConstantRing();
+        SAFE_RELEASE(drawParams);
+        g_StateCache.Release();
+        context->ClearState();
+        g_pDevice = nullptr;
+        g_pDeviceContext = nullptr;
+        SAFE_RELEASE(swapChain);
+        SAFE_RELEASE(context);
+        SAFE_RELEASE(device);
+    }
+
+    if (failed)
     {
-        const XMFLOAT4& p = planes[i].p;
-        float d = p.x * center.x + p.y * center.y + p.z * center.z + p.w;
-        if (d < -radius)
-            return false;
+        char message[128];
+        snprintf(message, sizeof(message), "Constant slice self-check failed: %s\n", failed);
+        OutputDebugStringA(message);
+        assert(false);
+        return false;
     }
     return true;
 }
 
-// Render
-void RenderFrame()
+// Self-test run
+// -selftest runs every self-check once, counting heap allocations meanwhile, and exits
+// with 1 if any of them failed; normal runs skip them.
+int RunSelfTests()
 {
-    if (!g_pDeviceContext || !g_pBackBufferRTV || !g_pSwapChain || !g_pSceneColorRTV)
-        return;
+    g_CountHeapAllocations = true;
+    bool passed = true;
+    passed = ValidateFrameArenas() && passed;
+    passed = ValidateFramePipeline() && passed;
+    passed = ValidateEntityWorld() && passed;
+    passed = ValidateTransformMath() && passed;
+    passed = ValidateSimdMath() && passed;
+    passed = ValidateTransformHierarchy() && passed;
+    passed = ValidateSceneFileRoundTrip() && passed;
+    passed = ValidateSceneGenerator() && passed;
+    passed = ValidateSpatialHashGrid() && passed;
+    passed = ValidateTransparentBsp() && passed;
+    passed = ValidateOcclusionCulling() && passed;
+    passed = ValidateInstancePacking() && passed;
+    passed = ValidateUploadRing() && passed;
+    passed = ValidateInstancePages() && passed;
+    passed = ValidateBoxCulling() && passed;
+    passed = ValidateMultiViewCulling() && passed;
+    passed = ValidateNullDevice() && passed;
+    passed = ValidateStateCache() && passed;
+    passed = ValidateRenderGraph() && passed;
+    passed = ValidateDrawKeySort() && passed;
+    passed = ValidateConstantSlices() && passed;
+    passed = ValidateHeadlessFrames() && passed;  // last: it brings up the renderer's globals
+    g_CountHeapAllocations = false;
+
+    OutputDebugStringA(passed ? "Self-checks passed\n" : "Self-checks failed\n");
+    return passed ? 0 : 1;
+}
+#endif
 
-    double currentTime = (double)GetTickCount64() / 1000.0;
-    double deltaTime = currentTime - g_LastTime;
-    g_LastTime = currentTime;
+// Render
+// Prepare stage: everything the frame takes from the scene, into the packet. Runs on the
+// pipeline's thread (on the main thread with -pipeline 0) and makes no D3D call.
+void PrepareFrame(FramePacket& packet)
+{
+    double prepareStart = GetTimeMs();
+    FrameInput input = packet.input;
+    packet = FramePacket();
+    packet.input = input;
 
-    UpdateCamera(deltaTime);
+    // Transient CPU data of the frame, the packet's arrays included, comes from the frame arenas
+    g_FrameArenas.BeginFrame();
+    FrameArena& arena = g_FrameArenas.Get();
+    g_CullingStats.frameArenaBytes = g_FrameArenas.GetFrameBytes();
+    g_CullingStats.frameArenaHighWater = g_FrameArenas.GetHighWater();
 
-    g_pDeviceContext->ClearState();
+    float angle = input.angle;
 
     // Camera matrices
-    float angle = (float)currentTime * 0.65f;
-
-    float camX = g_CameraDist * sinf(g_CameraYaw) * cosf(g_CameraPitch);
-    float camY = g_CameraDist * sinf(g_CameraPitch);
-    float camZ = g_CameraDist * cosf(g_CameraYaw) * cosf(g_CameraPitch);
+    float camX = input.cameraDist * sinf(input.cameraYaw) * cosf(input.cameraPitch);
+    float camY = input.cameraDist * sinf(input.cameraPitch);
+    float camZ = input.cameraDist * cosf(input.cameraYaw) * cosf(input.cameraPitch);
 
     XMVECTOR eye = XMVectorSet(camX, camY, camZ, 1.0f);
     XMVECTOR target = XMVectorSet(0, 0, 0, 1.0f);
     XMVECTOR up = XMVectorSet(0, 1, 0, 0);
 
     XMMATRIX view = XMMatrixLookAtLH(eye, target, up);
-    float aspect = (float)g_ClientWidth / (float)g_ClientHeight;
+    float aspect = (float)input.width / (float)input.height;
     XMMATRIX proj = XMMatrixPerspectiveFovLH(XM_PI / 3.0f, aspect, 0.1f, 100.0f);
     XMMATRIX vp = XMMatrixMultiply(view, proj);
+    packet.viewProj.vp = XMMatrixTranspose(vp);
 
-    // Update VP buffer
-    D3D11_MAPPED_SUBRESOURCE mapped = {};
-    HRESULT hr = g_pDeviceContext->Map(g_pViewProjBuffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped);
-    if (SUCCEEDED(hr))
-    {
-        ViewProjBuffer* pVP = (ViewProjBuffer*)mapped.pData;
-        pVP->vp = XMMatrixTranspose(vp);
-        g_pDeviceContext->Unmap(g_pViewProjBuffer, 0);
-    }
+    XMMATRIX viewNoTranslate = view;
+    viewNoTranslate.r[3] = XMVectorSet(0, 0, 0, 1);
+    packet.skyViewProj.vp = XMMatrixTranspose(XMMatrixMultiply(viewNoTranslate, proj));
 
-    // Update scene/light buffer
-    SceneBuffer sceneData = {};
+    // Scene/light constants
+    SceneBuffer& sceneData = packet.scene;
     sceneData.cameraPos = XMFLOAT4(camX, camY, camZ, 1.0f);
     sceneData.ambientColor = XMFLOAT4(0.22f, 0.22f, 0.24f, 1.0f);
-    sceneData.lightCount = XMINT4(2, 0, 0, 0);
-
-    sceneData.lights[0].position = XMFLOAT4(4.5f * cosf(angle), 2.2f, 4.5f * sinf(angle), 1.0f);
-    sceneData.lights[0].color = XMFLOAT4(1.0f, 0.82f, 0.72f, 1.0f);
-
-    sceneData.lights[1].position = XMFLOAT4(-4.5f, 1.2f + 0.8f * sinf(angle * 1.5f), -3.2f, 1.0f);
-    sceneData.lights[1].color = XMFLOAT4(0.55f, 0.75f, 1.0f, 1.0f);
-
-    g_pDeviceContext->UpdateSubresource(g_pSceneBuffer, 0, nullptr, &sceneData, 0, 0);
+    AnimateSceneLights(g_SceneLights, angle, sceneData);
 
     // Create visible list using frustum culling
     Plane planes[6];
     ExtractFrustumPlanes(planes, vp);
 
-    std::vector<InstanceDataGPU> instanceData(g_OpaqueCubes.size());
-    std::vector<VisibleIdGPU> visibleIds;
-    visibleIds.reserve(g_OpaqueCubes.size());
+    FrameVector<UINT> visibleList{ ArenaAllocator<UINT>(arena) };
+    packet.instanceCount = g_Instances.count;
 
-    for (size_t i = 0; i < g_OpaqueCubes.size(); ++i)
+    // Bounds, pages and the light grid hold for any rotation, so they only follow the
+    // instances added or changed since the last frame
+    const DirtyRanges& changed = g_Instances.staticDirty;
+    g_Instances.staticDirty.Coalesce(0);
+    UpdateInstancePages(g_Instances, changed, g_InstancePages);
+    UpdateInstanceBounds(g_Instances, changed, g_InstanceBounds);
+    if (g_InstanceGrid.GetCount() != g_InstanceBounds.count)
     {
-        const CubeInstanceCPU& c = g_OpaqueCubes[i];
+        g_InstanceGrid.Build(GRID_CELL_SIZE, g_InstanceBounds);
+    }
+    else
+    {
+        for (const DirtyRange& range : changed.GetRanges())
+        {
+            for (UINT i = range.begin; i < (std::min)(range.end, g_InstanceBounds.count); ++i)
+            {
+                XMFLOAT3 center(g_InstanceBounds.centerX[i], g_InstanceBounds.centerY[i], g_InstanceBounds.centerZ[i]);
+                g_InstanceGrid.Update(i, center, g_InstanceBounds.radius[i]);
+            }
+        }
+    }
+    g_Instances.staticDirty.Clear();
 
-        float currentAngle = angle * c.rotSpeed;
-        XMMATRIX model =
-            XMMatrixScaling(c.scale, c.scale, c.scale) *
-            XMMatrixRotationY(currentAngle) *
-            XMMatrixTranslation(c.basePos.x, c.basePos.y, c.basePos.z);
+    // Instances each point light reaches
+    double lightQueryStart = GetTimeMs();
+    for (int l = 0; l < sceneData.lightCount.x; ++l)
+    {
+        const XMFLOAT4& lightPos = sceneData.lights[l].position;
+        g_InstanceGrid.QuerySphere(XMFLOAT3(lightPos.x, lightPos.y, lightPos.z), LIGHT_QUERY_RADIUS, g_LightInstances[l]);
+        if (l < 2)
+            g_CullingStats.lightInstances[l] = (UINT)g_LightInstances[l].size();
+    }
+    g_CullingStats.lightQueryMs = GetTimeMs() - lightQueryStart;
 
-        XMMATRIX normalM = XMMatrixInverse(nullptr, model);
+    CullInstancePages(planes, g_InstanceBounds, g_InstancePages, visibleList);
 
-        InstanceDataGPU gpu = {};
-        gpu.model = XMMatrixTranspose(model);
-        gpu.normalMatrix = XMMatrixTranspose(normalM);
-        gpu.params = XMFLOAT4(32.0f, c.rotSpeed, (float)c.textureId, c.hasNormalMap ? 1.0f : 0.0f);
-        gpu.posAngle = XMFLOAT4(c.basePos.x, c.basePos.y, c.basePos.z, currentAngle);
-        instanceData[i] = gpu;
+    g_CullingStats.totalInstances = g_Instances.count;
+    g_CullingStats.frustumVisible = (UINT)visibleList.size();
+    g_CullingStats.occluders = 0;
+    g_CullingStats.occlusionCulled = 0;
+    g_CullingStats.occlusionMs = 0.0;
 
-        const float radius = 0.8660254f * c.scale; // sqrt(3) * 0.5 * scale
-        if (IsSphereInsideFrustum(planes, c.basePos, radius))
-        {
-            VisibleIdGPU vis = {};
-            vis.id = (UINT)i;
-            visibleIds.push_back(vis);
-        }
+    // Remove instances hidden behind the nearest large cubes
+    if (input.occlusionCulling && !visibleList.empty())
+        CullOccludedInstances(vp, XMFLOAT3(camX, camY, camZ), angle, visibleList);
+
+    // Drop sub-pixel instances and bucket the rest by LOD
+    g_CullingStats.contributionCulled = 0;
+    FrameVector<BYTE> lods{ ArenaAllocator<BYTE>(arena) };
+    if (input.lod)
+    {
+        XMFLOAT4X4 projM;
+        XMStoreFloat4x4(&projM, proj);
+        SelectInstanceLods(vp, projM._22, (float)input.height, visibleList, lods);
     }
+    else
+    {
+        lods.assign(visibleList.size(), 0);
+    }
+    SortOpaqueDraws(vp, visibleList, lods, packet.lodOffsets);
+
+    // Transforms of the survivors only, in draw order (by LOD, then front to back); the
+    // submit stage copies them into the upload ring
+    double transformStart = GetTimeMs();
+    if (!visibleList.empty())
+    {
+        InstanceGPU* records = static_cast<InstanceGPU*>(arena.Allocate(visibleList.size() * sizeof(InstanceGPU)));
+        BuildVisibleInstances(g_Instances, visibleList, angle, records);
+        packet.records = records;
+        packet.recordCount = (UINT)visibleList.size();
+    }
+    g_CullingStats.transformMs = GetTimeMs() - transformStart;
+    g_CullingStats.uploadBytes = packet.recordCount * sizeof(InstanceGPU);
 
-    if (!instanceData.empty())
-        g_pDeviceContext->UpdateSubresource(g_pInstanceBuffer, 0, nullptr, instanceData.data(), 0, 0);
+    // Transparent objects, sorted back to front
+    FrameVector<TransparentObject> transparentObjects{ ArenaAllocator<TransparentObject>(arena) };
+    AnimateTransparentPanels(g_Scene, g_SceneTransforms, angle);
+    g_CullingStats.transformNodesUpdated = g_SceneTransforms.Update(g_JobSystem);
+    g_CullingStats.transformNodes = g_SceneTransforms.GetCount();
+    GatherTransparentObjects(g_Scene, g_SceneTransforms, XMFLOAT3(camX, camY, camZ), transparentObjects);
 
-    if (!visibleIds.empty())
-        g_pDeviceContext->UpdateSubresource(g_pVisibleIdsBuffer, 0, nullptr, visibleIds.data(), 0, 0);
+    if (input.transparentBsp)
+    {
+        BuildTransparentBsp(transparentObjects, XMFLOAT3(camX, camY, camZ), arena, packet);
+    }
+    else
+    {
+        g_CullingStats.transparentTriangles = 0;
+        g_CullingStats.bspSplits = 0;
+
+        // Back to front: the inverted distance in the depth field of the draw key
+        UINT count = (UINT)transparentObjects.size();
+        UINT64* keys = static_cast<UINT64*>(arena.Allocate(count * sizeof(UINT64) * 2));
+        UINT* order = static_cast<UINT*>(arena.Allocate(count * sizeof(UINT) * 2));
+        for (UINT i = 0; i < count; ++i)
+        {
+            keys[i] = MakeDrawKey(DRAW_PASS_TRANSPARENT, 0, 0, DRAW_KEY_DEPTH_MAX - QuantizeDrawDepth(transparentObjects[i].distanceToCamera));
+            order[i] = i;
+        }
+        RadixSortDrawKeys(keys, order, count, keys + count, order + count, nullptr);
 
-    // Render scene to offscreen texture
-    ID3D11RenderTargetView* sceneViews[] = { g_pSceneColorRTV };
-    g_pDeviceContext->OMSetRenderTargets(1, sceneViews, g_pDepthStencilView);
+        TransparentBuffer* draws = static_cast<TransparentBuffer*>(arena.Allocate(count * sizeof(TransparentBuffer)));
+        for (UINT i = 0; i < count; ++i)
+        {
+            const TransparentObject& object = transparentObjects[order[i]];
+            draws[i].model = XMMatrixTranspose(object.model);
+            draws[i].color = object.color;
+        }
+        packet.transparentDraws = draws;
+        packet.transparentDrawCount = count;
+    }
 
-    const FLOAT clearColor[4] = { 0.10f, 0.10f, 0.12f, 1.0f };
-    g_pDeviceContext->ClearRenderTargetView(g_pSceneColorRTV, clearColor);
-    g_pDeviceContext->ClearDepthStencilView(g_pDepthStencilView, D3D11_CLEAR_DEPTH, 1.0f, 0);
+    packet.prepareMs = GetTimeMs() - prepareStart;
+    packet.stats = g_CullingStats;
+}
 
-    D3D11_VIEWPORT viewport = { 0, 0, (FLOAT)g_ClientWidth, (FLOAT)g_ClientHeight, 0.0f, 1.0f };
-    g_pDeviceContext->RSSetViewports(1, &viewport);
+// Frame graph passes
+// The graph binds each pass's render targets, clears and scene texture; the passes bind
+// the rest through the state cache, which drops whatever is still bound from before
+struct SubmitPassData
+{
+    const FramePacket* packet;
+    UINT recordOffset;       // of the packet's instance records in the upload ring
+    UINT drawParamsOffset;   // of the LOD buckets' constant slices in the constant ring
+    UINT transparentOffset;  // of the first transparent draw's constant slice in the constant ring
+    UINT opaqueBatches;
+    UINT lodInstances[LOD_COUNT];  // instance records drawn per LOD bucket
+};
 
-    ID3D11SamplerState* samplers0[] = { g_pSampler };
+void ExecuteOpaquePass(const RenderGraph&, void* data)
+{
+    SubmitPassData& pass = *static_cast<SubmitPassData*>(data);
+    const FramePacket& packet = *pass.packet;
 
     UINT litStride = sizeof(LitVertex);
-    UINT skyStride = sizeof(SkyboxVertex);
-    UINT offset = 0;
+    ID3D11SamplerState* samplers0[] = { g_pSampler };
 
-    // OPAQUE INSTANCED CUBES
-    g_pDeviceContext->OMSetDepthStencilState(g_pOpaqueDepthState, 0);
-    g_pDeviceContext->RSSetState(g_pCullBackRS);
+    g_StateCache.OMSetBlendState(nullptr, nullptr, 0xFFFFFFFF);
+    g_StateCache.OMSetDepthStencilState(g_pOpaqueDepthState, 0);
+    g_StateCache.RSSetState(g_pCullBackRS);
 
-    g_pDeviceContext->VSSetShader(g_pVertexShader, nullptr, 0);
-    g_pDeviceContext->PSSetShader(g_pPixelShader, nullptr, 0);
-    g_pDeviceContext->IASetInputLayout(g_pInputLayout);
+    g_StateCache.VSSetShader(g_pVertexShader);
+    g_StateCache.IASetInputLayout(g_pInputLayout);
 
-    ID3D11Buffer* vbCube[] = { g_pVertexBuffer };
-    g_pDeviceContext->IASetVertexBuffers(0, 1, vbCube, &litStride, &offset);
-    g_pDeviceContext->IASetIndexBuffer(g_pIndexBuffer, DXGI_FORMAT_R16_UINT, 0);
-    g_pDeviceContext->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+    g_StateCache.IASetVertexBuffer(g_pVertexBuffer, litStride, 0);
+    g_StateCache.IASetIndexBuffer(g_pIndexBuffer, DXGI_FORMAT_R16_UINT, 0);
+    g_StateCache.IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
 
     ID3D11ShaderResourceView* cubeSRVs[] = { g_pTextureArrayView, g_pNormalTextureView };
-    g_pDeviceContext->PSSetShaderResources(0, 2, cubeSRVs);
-    g_pDeviceContext->PSSetSamplers(0, 1, samplers0);
+    g_StateCache.PSSetShaderResources(0, 2, cubeSRVs);
+    g_StateCache.PSSetSamplers(0, 1, samplers0);
 
-    g_pDeviceContext->VSSetConstantBuffers(1, 1, &g_pViewProjBuffer);
-    g_pDeviceContext->VSSetConstantBuffers(3, 1, &g_pInstanceBuffer);
-    g_pDeviceContext->VSSetConstantBuffers(4, 1, &g_pVisibleIdsBuffer);
+    g_StateCache.VSSetShaderResources(2, 1, &g_pInstanceRingSRV);
 
-    g_pDeviceContext->PSSetConstantBuffers(2, 1, &g_pSceneBuffer);
-    g_pDeviceContext->PSSetConstantBuffers(3, 1, &g_pInstanceBuffer);
+    // b5 is each LOD bucket's slice of the constant ring
+    g_StateCache.VSSetConstantBuffers(1, 1, &g_pViewProjBuffer);
+    if (!g_ConstantBufferOffsets)
+        g_StateCache.VSSetConstantBuffers(5, 1, &g_pDrawParamsBuffer);
 
-    if (!visibleIds.empty())
-        g_pDeviceContext->DrawIndexedInstanced(36, (UINT)visibleIds.size(), 0, 0, 0);
+    g_StateCache.PSSetConstantBuffers(2, 1, &g_pSceneBuffer);
 
-    // SKYBOX
+    // One instanced draw per LOD bucket, whatever the instance count
+    for (UINT lod = 0; lod < LOD_COUNT; ++lod)
     {
-        XMMATRIX viewNoTranslate = view;
-        viewNoTranslate.r[3] = XMVectorSet(0, 0, 0, 1);
-        XMMATRIX vpSky = XMMatrixMultiply(viewNoTranslate, proj);
+        UINT count = packet.lodOffsets[lod + 1] - packet.lodOffsets[lod];
+        if (count == 0)
+            continue;
 
-        D3D11_MAPPED_SUBRESOURCE mappedSky = {};
-        hr = g_pDeviceContext->Map(g_pViewProjBuffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &mappedSky);
-        if (SUCCEEDED(hr))
-        {
-            ViewProjBuffer* pVP = (ViewProjBuffer*)mappedSky.pData;
-            pVP->vp = XMMatrixTranspose(vpSky);
-            g_pDeviceContext->Unmap(g_pViewProjBuffer, 0);
-        }
+        ++pass.opaqueBatches;
+        pass.lodInstances[lod] = count;
+        BindConstantSlice(5, g_pDrawParamsBuffer, pass.drawParamsOffset + lod * CONSTANT_SLICE_BYTES, sizeof(DrawParamsBuffer));
 
-        g_pDeviceContext->OMSetDepthStencilState(g_pSkyboxDepthState, 0);
-        g_pDeviceContext->RSSetState(g_pCullNoneRS);
+        g_StateCache.PSSetShader(g_pLodPixelShaders[lod]);
+        g_pDeviceContext->DrawIndexedInstanced(36, count, 0, 0, 0);
+    }
+}
 
-        g_pDeviceContext->VSSetShader(g_pSkyboxVS, nullptr, 0);
-        g_pDeviceContext->PSSetShader(g_pSkyboxPS, nullptr, 0);
-        g_pDeviceContext->IASetInputLayout(g_pSkyboxInputLayout);
+void ExecuteSkyboxPass(const RenderGraph&, void*)
+{
+    UINT skyStride = sizeof(SkyboxVertex);
+    ID3D11SamplerState* samplers0[] = { g_pSampler };
 
-        ID3D11Buffer* vbSky[] = { g_pSkyboxVertexBuffer };
-        g_pDeviceContext->IASetVertexBuffers(0, 1, vbSky, &skyStride, &offset);
-        g_pDeviceContext->IASetIndexBuffer(g_pSkyboxIndexBuffer, DXGI_FORMAT_R16_UINT, 0);
-        g_pDeviceContext->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+    g_StateCache.OMSetBlendState(nullptr, nullptr, 0xFFFFFFFF);
+    g_StateCache.OMSetDepthStencilState(g_pSkyboxDepthState, 0);
+    g_StateCache.RSSetState(g_pCullNoneRS);
 
-        ID3D11ShaderResourceView* skySRV[] = { g_pCubemapView };
-        g_pDeviceContext->PSSetShaderResources(5, 1, skySRV);
-        g_pDeviceContext->PSSetSamplers(1, 1, samplers0);
+    g_StateCache.VSSetShader(g_pSkyboxVS);
+    g_StateCache.PSSetShader(g_pSkyboxPS);
+    g_StateCache.IASetInputLayout(g_pSkyboxInputLayout);
 
-        ID3D11Buffer* cbsSky[] = { nullptr, g_pViewProjBuffer };
-        g_pDeviceContext->VSSetConstantBuffers(0, 2, cbsSky);
+    g_StateCache.IASetVertexBuffer(g_pSkyboxVertexBuffer, skyStride, 0);
+    g_StateCache.IASetIndexBuffer(g_pSkyboxIndexBuffer, DXGI_FORMAT_R16_UINT, 0);
+    g_StateCache.IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
 
-        g_pDeviceContext->DrawIndexed(36, 0, 0);
+    ID3D11ShaderResourceView* skySRV[] = { g_pCubemapView };
+    g_StateCache.PSSetShaderResources(5, 1, skySRV);
+    g_StateCache.PSSetSamplers(1, 1, samplers0);
 
-        D3D11_MAPPED_SUBRESOURCE mappedRestore = {};
-        hr = g_pDeviceContext->Map(g_pViewProjBuffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &mappedRestore);
-        if (SUCCEEDED(hr))
-        {
-            ViewProjBuffer* pVP = (ViewProjBuffer*)mappedRestore.pData;
-            pVP->vp = XMMatrixTranspose(vp);
-            g_pDeviceContext->Unmap(g_pViewProjBuffer, 0);
-        }
+    g_StateCache.VSSetConstantBuffers(1, 1, &g_pSkyViewProjBuffer);
+
+    g_pDeviceContext->DrawIndexed(36, 0, 0);
+}
+
+void ExecuteTransparentPass(const RenderGraph&, void* data)
+{
+    const FramePacket& packet = *static_cast<SubmitPassData*>(data)->packet;
+
+    FLOAT blendFactor[4] = { 0, 0, 0, 0 };
+    g_StateCache.OMSetBlendState(g_pTransparentBlendState, blendFactor, 0xFFFFFFFF);
+    g_StateCache.OMSetDepthStencilState(g_pTransparentDepthState, 0);
+    g_StateCache.RSSetState(g_pCullBackRS);
+
+    if (packet.input.transparentBsp)
+    {
+        DrawTransparentBsp(packet);
+        return;
     }
 
-    // TRANSPARENT OBJECTS
-    std::vector<TransparentObject> transparentObjects;
+    UINT litStride = sizeof(LitVertex);
+    g_StateCache.VSSetShader(g_pTransparentVS);
+    g_StateCache.PSSetShader(g_pTransparentPS);
+    g_StateCache.IASetInputLayout(g_pTransparentInputLayout);
 
-    transparentObjects.push_back({
-        XMMatrixScaling(1.2f, 1.2f, 0.08f) * XMMatrixTranslation(-2.8f, 0.0f, 1.2f),
-        XMFLOAT4(1.0f, 0.2f, 0.2f, 0.45f),
-        XMFLOAT3(-2.8f, 0.0f, 1.2f),
-        0.0f
-        });
+    g_StateCache.IASetVertexBuffer(g_pVertexBuffer, litStride, 0);
+    g_StateCache.IASetIndexBuffer(g_pIndexBuffer, DXGI_FORMAT_R16_UINT, 0);
+    g_StateCache.IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
 
-    transparentObjects.push_back({
-        XMMatrixScaling(1.2f, 1.2f, 0.08f) * XMMatrixRotationY(angle * 0.5f) * XMMatrixTranslation(0.6f, 0.2f, -2.3f),
-        XMFLOAT4(0.2f, 0.8f, 1.0f, 0.45f),
-        XMFLOAT3(0.6f, 0.2f, -2.3f),
-        0.0f
-        });
+    // b0 is each draw's slice of the constant ring
+    g_StateCache.VSSetConstantBuffers(1, 1, &g_pViewProjBuffer);
+    if (!g_ConstantBufferOffsets)
+        g_StateCache.VSSetConstantBuffers(0, 1, &g_pTransparentBuffer);
 
-    for (auto& obj : transparentObjects)
+    UINT transparentOffset = static_cast<SubmitPassData*>(data)->transparentOffset;
+    for (UINT i = 0; i < packet.transparentDrawCount; ++i)
     {
-        float dx = obj.center.x - camX;
-        float dy = obj.center.y - camY;
-        float dz = obj.center.z - camZ;
-        obj.distanceToCamera = dx * dx + dy * dy + dz * dz;
+        BindConstantSlice(0, g_pTransparentBuffer, transparentOffset + i * CONSTANT_SLICE_BYTES, sizeof(TransparentBuffer));
+        g_pDeviceContext->DrawIndexed(36, 0, 0);
     }
+}
 
-    std::sort(transparentObjects.begin(), transparentObjects.end(),
-        [](const TransparentObject& a, const TransparentObject& b)
-        {
-            return a.distanceToCamera > b.distanceToCamera;
-        });
+// The scene texture is bound at t0 by the graph
+void ExecutePostProcessPass(const RenderGraph&, void* data)
+{
+    const FramePacket& packet = *static_cast<SubmitPassData*>(data)->packet;
 
-    FLOAT blendFactor[4] = { 0, 0, 0, 0 };
-    g_pDeviceContext->OMSetBlendState(g_pTransparentBlendState, blendFactor, 0xFFFFFFFF);
-    g_pDeviceContext->OMSetDepthStencilState(g_pTransparentDepthState, 0);
-    g_pDeviceContext->RSSetState(g_pCullBackRS);
+    PostProcessBuffer ppData = {};
+    ppData.mode = XMINT4(packet.input.postEffectMode, 0, 0, 0);
+    g_pDeviceContext->UpdateSubresource(g_pPostProcessBuffer, 0, nullptr, &ppData, 0, 0);
 
-    g_pDeviceContext->VSSetShader(g_pTransparentVS, nullptr, 0);
-    g_pDeviceContext->PSSetShader(g_pTransparentPS, nullptr, 0);
-    g_pDeviceContext->IASetInputLayout(g_pTransparentInputLayout);
+    g_StateCache.OMSetDepthStencilState(nullptr, 0);
+    g_StateCache.RSSetState(nullptr);
+    g_StateCache.OMSetBlendState(nullptr, nullptr, 0xFFFFFFFF);
 
-    g_pDeviceContext->IASetVertexBuffers(0, 1, vbCube, &litStride, &offset);
-    g_pDeviceContext->IASetIndexBuffer(g_pIndexBuffer, DXGI_FORMAT_R16_UINT, 0);
-    g_pDeviceContext->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+    // The fullscreen triangles come from SV_VertexID
+    g_StateCache.IASetInputLayout(nullptr);
+    g_StateCache.IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
 
-    for (const auto& obj : transparentObjects)
-    {
-        TransparentBuffer tb = {};
-        tb.model = XMMatrixTranspose(obj.model);
-        tb.color = obj.color;
-        g_pDeviceContext->UpdateSubresource(g_pTransparentBuffer, 0, nullptr, &tb, 0, 0);
+    g_StateCache.VSSetShader(g_pPostVS);
+    g_StateCache.PSSetShader(g_pPostPS);
 
-        ID3D11Buffer* cbsTransparent[] = { g_pTransparentBuffer, g_pViewProjBuffer };
-        g_pDeviceContext->VSSetConstantBuffers(0, 2, cbsTransparent);
+    g_StateCache.PSSetConstantBuffers(0, 1, &g_pPostProcessBuffer);
+    g_StateCache.PSSetSamplers(0, 1, &g_pSampler);
 
-        g_pDeviceContext->DrawIndexed(36, 0, 0);
-    }
+    g_pDeviceContext->Draw(6, 0);
+}
+
+// Submit stage: the packet into D3D calls, on the main thread that owns the device context
+void SubmitFrame(const FramePacket& packet)
+{
+    double submitStart = GetTimeMs();
+    CullingStats stats = packet.stats;
 
-    // Reset blend state
-    g_pDeviceContext->OMSetBlendState(nullptr, nullptr, 0xFFFFFFFF);
+    // State persists from frame to frame: every pass binds what it uses through the state
+    // cache, which drops whatever the previous pass or frame left bound already
+    if (!EnsureInstanceBuffers(packet.instanceCount) || !EnsureConstantRing(LOD_COUNT + packet.transparentDrawCount))
+        return;
 
-    // Unbind shader resources that may conflict later
+    // One write per view-projection buffer, the skybox has its own
+    const struct
+    {
+        ID3D11Buffer* buffer;
+        const ViewProjBuffer* data;
+    } viewProjUpdates[] =
+    {
+        { g_pViewProjBuffer, &packet.viewProj },
+        { g_pSkyViewProjBuffer, &packet.skyViewProj },
+    };
+    for (const auto& update : viewProjUpdates)
     {
-        ID3D11ShaderResourceView* nullPS[6] = {};
-        g_pDeviceContext->PSSetShaderResources(0, 6, nullPS);
+        D3D11_MAPPED_SUBRESOURCE mapped = {};
+        if (SUCCEEDED(g_pDeviceContext->Map(update.buffer, 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped)))
+        {
+            memcpy(mapped.pData, update.data, sizeof(ViewProjBuffer));
+            g_pDeviceContext->Unmap(update.buffer, 0);
+        }
     }
 
-    PostProcessBuffer ppData = {};
-    ppData.mode = XMINT4(g_PostEffectMode, 0, 0, 0);
-    g_pDeviceContext->UpdateSubresource(g_pPostProcessBuffer, 0, nullptr, &ppData, 0, 0);
+    g_pDeviceContext->UpdateSubresource(g_pSceneBuffer, 0, nullptr, &packet.scene, 0, 0);
+
+    // The visible instance records in one upload ring allocation, and every draw's
+    // constants (the LOD buckets' draw params, then the transparent draws) in one constant
+    // ring allocation; both rings are unmapped before the draws
+    UINT64 completedFrame = g_FrameFences.PollCompleted(g_pDeviceContext);
+    g_InstanceRing.BeginFrame(completedFrame);
+    g_ConstantRing.BeginFrame(completedFrame);
+    UINT recordBytes = packet.recordCount * sizeof(InstanceGPU);
+    UINT recordOffset = 0;
+    bool uploaded = true;
+    if (recordBytes > 0)
+    {
+        void* records = g_InstanceRing.Allocate(recordBytes, recordOffset);
+        uploaded = records != nullptr;
+        if (records)
+        {
+            double copyStart = GetTimeMs();
+            memcpy(records, packet.records, recordBytes);
+            stats.uploadCopyMs = GetTimeMs() - copyStart;
+        }
+    }
+    UINT drawParamsOffset = 0;
+    BYTE* slices = nullptr;
+    if (uploaded)
+        slices = static_cast<BYTE*>(g_ConstantRing.Allocate((LOD_COUNT + packet.transparentDrawCount) * CONSTANT_SLICE_BYTES, drawParamsOffset));
+    if (slices)
+    {
+        for (UINT lod = 0; lod < LOD_COUNT; ++lod)
+        {
+            DrawParamsBuffer drawParams = {};
+            drawParams.params = XMUINT4(recordOffset + packet.lodOffsets[lod] * sizeof(InstanceGPU), 0, 0, 0);
+            memcpy(slices + lod * CONSTANT_SLICE_BYTES, &drawParams, sizeof(drawParams));
+        }
+        for (UINT i = 0; i < packet.transparentDrawCount; ++i)
+            memcpy(slices + (LOD_COUNT + i) * CONSTANT_SLICE_BYTES, &packet.transparentDraws[i], sizeof(TransparentBuffer));
+    }
+    UINT transparentOffset = drawParamsOffset + LOD_COUNT * CONSTANT_SLICE_BYTES;
+    UINT64 uploadFrame = g_InstanceRing.EndFrame();
+    UINT64 constantFrame = g_ConstantRing.EndFrame();
+    assert(constantFrame == uploadFrame);
+    (void)constantFrame;
+    stats.uploadRingDiscards = g_InstanceRing.GetDiscardCount() + g_ConstantRing.GetDiscardCount();
+
+    // A frame that got no ring space draws nothing, but both rings have ended it and its
+    // fence still goes in, so the rings stay in step and their frames retire
+    if (!slices)
+    {
+        g_FrameFences.Signal(g_pDeviceContext, uploadFrame);
+        return;
+    }
 
-    ID3D11RenderTargetView* bbViews[] = { g_pBackBufferRTV };
-    g_pDeviceContext->OMSetRenderTargets(1, bbViews, nullptr);
-    g_pDeviceContext->ClearRenderTargetView(g_pBackBufferRTV, clearColor);
+    // The frame graph: the scene passes render into a transient color target, which the
+    // post-process pass reads into the back buffer
+    SubmitPassData passData = { &packet, recordOffset, drawParamsOffset, transparentOffset, 0, {} };
+    const FLOAT clearColor[4] = { 0.10f, 0.10f, 0.12f, 1.0f };
+    RenderGraph& graph = g_FrameGraph;
+    graph.Reset();
+    RenderGraphHandle backBuffer = graph.ImportTexture("back buffer", g_ClientWidth, g_ClientHeight, g_pBackBufferRTV, nullptr, nullptr);
+    RenderGraphHandle depth = graph.ImportTexture("depth", g_ClientWidth, g_ClientHeight, nullptr, g_pDepthStencilView, nullptr);
+    RenderGraphHandle sceneColor = graph.CreateTexture("scene color", g_ClientWidth, g_ClientHeight, DXGI_FORMAT_R8G8B8A8_UNORM);
+    graph.MarkOutput(backBuffer);
+
+    RenderGraphHandle opaquePass = graph.AddPass("opaque", ExecuteOpaquePass, &passData);
+    graph.WriteRenderTarget(opaquePass, sceneColor, clearColor);
+    graph.WriteDepth(opaquePass, depth, true);
+
+    RenderGraphHandle skyboxPass = graph.AddPass("skybox", ExecuteSkyboxPass, &passData);
+    graph.WriteRenderTarget(skyboxPass, sceneColor, nullptr);
+    graph.TestDepth(skyboxPass, depth);
+
+    RenderGraphHandle transparentPass = graph.AddPass("transparent", ExecuteTransparentPass, &passData);
+    graph.WriteRenderTarget(transparentPass, sceneColor, nullptr);
+    graph.TestDepth(transparentPass, depth);
+
+    // Every pixel is written, so the back buffer needs no clear
+    RenderGraphHandle postPass = graph.AddPass("post-process", ExecutePostProcessPass, &passData);
+    graph.ReadTexture(postPass, sceneColor, 0);
+    graph.WriteRenderTarget(postPass, backBuffer, nullptr);
+
+    if (!graph.Compile())
+    {
+        OutputDebugStringA("Frame graph: ");
+        OutputDebugStringA(graph.GetError());
+        OutputDebugStringA("\n");
+        assert(false);
+        return;
+    }
+    if (!graph.Allocate(g_RenderTargetPool))
+        return;
+    graph.Execute(g_StateCache, g_pDeviceContext);
+    g_RenderTargetPool.EndFrame();
 
-    g_pDeviceContext->OMSetDepthStencilState(nullptr, 0);
-    g_pDeviceContext->RSSetState(nullptr);
-    g_pDeviceContext->OMSetBlendState(nullptr, nullptr, 0xFFFFFFFF);
+    stats.opaqueBatches = passData.opaqueBatches;
+    std::copy(passData.lodInstances, passData.lodInstances + LOD_COUNT, stats.lodCounts);
+    stats.renderPasses = graph.GetExecutedPassCount();
+    stats.renderPassesCulled = graph.GetPassCount() - graph.GetExecutedPassCount();
+    stats.renderTargets = graph.GetTransientCount();
+    stats.renderTargetTextures = graph.GetPhysicalCount();
+    stats.renderTargetBytes = g_RenderTargetPool.GetBytes();
 
-    g_pDeviceContext->IASetInputLayout(nullptr);
-    g_pDeviceContext->IASetVertexBuffers(0, 0, nullptr, nullptr, nullptr);
-    g_pDeviceContext->IASetIndexBuffer(nullptr, DXGI_FORMAT_UNKNOWN, 0);
-    g_pDeviceContext->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLELIST);
+    g_pSwapChain->Present(1, 0);
+    g_StateCache.OnPresent();
+    g_StateCache.TakeCounts(stats.stateCalls, stats.stateCallsSkipped);
+    g_FrameFences.Signal(g_pDeviceContext, uploadFrame);
+
+    // Throughput is the Present interval; latency adds the frames the packet spent queued
+    static double s_LastPresentMs = 0.0;
+    double presentMs = GetTimeMs();
+    stats.submitMs = presentMs - submitStart;
+    stats.prepareMs = packet.prepareMs;
+    stats.frameMs = s_LastPresentMs > 0.0 ? presentMs - s_LastPresentMs : 0.0;
+    stats.latencyMs = presentMs - packet.input.inputMs;
+    s_LastPresentMs = presentMs;
+
+    g_SubmittedStats = stats;
+    UpdateStatsTitle(stats, packet.input.currentTime);
+}
 
-    g_pDeviceContext->VSSetShader(g_pPostVS, nullptr, 0);
-    g_pDeviceContext->PSSetShader(g_pPostPS, nullptr, 0);
+// One frame of the main loop: the input for the next frame goes to the prepare stage and
+// the oldest prepared packet, if the pipeline has one, is submitted
+void RenderFrame()
+{
+    if (!g_pDeviceContext || !g_pBackBufferRTV || !g_pSwapChain)
+        return;
 
-    g_pDeviceContext->PSSetConstantBuffers(0, 1, &g_pPostProcessBuffer);
-    g_pDeviceContext->PSSetSamplers(0, 1, &g_pSampler);
-    g_pDeviceContext->PSSetShaderResources(0, 1, &g_pSceneColorSRV);
+    double currentTime = (double)GetTickCount64() / 1000.0;
+    double deltaTime = currentTime - g_LastTime;
+    g_LastTime = currentTime;
 
-    g_pDeviceContext->Draw(6, 0);
+    UpdateCamera(deltaTime);
 
+    // 'P' stops the animation clock
+    if (g_AnimationPaused)
+        g_AnimationTimeOffset += deltaTime;
+
+    static UINT64 s_FrameIndex = 0;
+    FrameInput input;
+    input.frameIndex = s_FrameIndex++;
+    input.inputMs = GetTimeMs();
+    input.currentTime = currentTime;
+    input.angle = (float)(currentTime - g_AnimationTimeOffset) * 0.65f;
+    input.cameraYaw = g_CameraYaw;
+    input.cameraPitch = g_CameraPitch;
+    input.cameraDist = g_CameraDist;
+    input.width = g_ClientWidth;
+    input.height = g_ClientHeight;
+    input.postEffectMode = g_PostEffectMode;
+    input.occlusionCulling = g_OcclusionCullingEnabled;
+    input.lod = g_LodEnabled;
+    input.transparentBsp = g_TransparentBspEnabled;
+
+    if (const FramePacket* packet = g_FramePipeline.Push(input))
     {
-        ID3D11ShaderResourceView* nullSRV[1] = { nullptr };
-        g_pDeviceContext->PSSetShaderResources(0, 1, nullSRV);
+        SubmitFrame(*packet);
+        g_FramePipeline.Release();
     }
+}
 
-    g_pSwapChain->Present(1, 0);
+// Headless run
+// Renders frameCount frames on the null device as fast as they go and reports the CPU
+// cost of each stage along with the work the last frame gave the device. Returns 1 when
+// the device reported a problem, so scripted runs can fail on it.
+int RunHeadlessFrames(UINT frameCount)
+{
+    double frameMs = 0.0, prepareMs = 0.0, submitMs = 0.0, latencyMs = 0.0, drawSortMs = 0.0, occlusionMs = 0.0;
+    double transformMs = 0.0, uploadCopyMs = 0.0;
+    UINT64 frustumVisible = 0, occlusionCulled = 0;
+    UINT measured = 0;
+    double startMs = GetTimeMs();
+    for (UINT i = 0; i < frameCount; ++i)
+    {
+        UINT64 presents = g_pNullDevice->GetFrameCount();
+        RenderFrame();
+
+        // Frames still filling the pipeline present nothing, the first Present has no interval
+        if (g_pNullDevice->GetFrameCount() == presents || g_SubmittedStats.frameMs <= 0.0)
+            continue;
+        frameMs += g_SubmittedStats.frameMs;
+        prepareMs += g_SubmittedStats.prepareMs;
+        submitMs += g_SubmittedStats.submitMs;
+        latencyMs += g_SubmittedStats.latencyMs;
+        drawSortMs += g_SubmittedStats.drawSortMs;
+        occlusionMs += g_SubmittedStats.occlusionMs;
+        transformMs += g_SubmittedStats.transformMs;
+        uploadCopyMs += g_SubmittedStats.uploadCopyMs;
+        frustumVisible += g_SubmittedStats.frustumVisible;
+        occlusionCulled += g_SubmittedStats.occlusionCulled;
+        ++measured;
+    }
+    double elapsedMs = GetTimeMs() - startMs;
+    double scale = measured > 0 ? 1.0 / measured : 0.0;
+    double occludedPercent = frustumVisible > 0 ? 100.0 * occlusionCulled / frustumVisible : 0.0;
+
+    const NullD3D11Counters& work = g_pNullDevice->GetLastFrameCounters();
+    char report[1280];
+    snprintf(report, sizeof(report),
+        "Headless: %u frames in %.1f ms, pipeline depth %u, %u job workers, %u instances\n"
+        "  per frame: %.3f ms (prepare %.3f, submit %.3f, latency %.3f), draw key sort %.3f ms\n"
+        "  occlusion: %.1f%% of frustum survivors culled, %.3f ms (target under 1 ms)%s\n"
+        "  instance records: %.1f KB, transformed in %.3f ms, copied into the upload ring in %.3f ms\n"
+        "  last frame: %llu draws, %llu instances (%u cubes), %llu state calls, %llu maps, %llu bytes updated, %llu copies\n"
+        "  LOD: %u / %u / %u cubes drawn, %u too small to draw\n"
+        "  state cache: %u binds issued, %u redundant binds dropped; %u state objects, %u shared\n"
+        "  frame graph: %u passes, %u culled, %u transient targets in %u textures, %.2f MB\n"
+        "  null device: %u errors\n",
+        frameCount, elapsedMs, g_FramePipeline.GetDepth(), g_JobSystem.GetWorkerCount(), g_SubmittedStats.totalInstances,
+        frameMs * scale, prepareMs * scale, submitMs * scale, latencyMs * scale, drawSortMs * scale,
+        occludedPercent, occlusionMs * scale, g_OcclusionCullingEnabled ? "" : ", off",
+        g_SubmittedStats.uploadBytes / 1024.0, transformMs * scale, uploadCopyMs * scale,
+        (unsigned long long)work.drawCalls, (unsigned long long)work.instances,
+        g_SubmittedStats.lodCounts[0] + g_SubmittedStats.lodCounts[1] + g_SubmittedStats.lodCounts[2], (unsigned long long)work.stateCalls,
+        (unsigned long long)work.maps, (unsigned long long)work.updateBytes, (unsigned long long)work.copies,
+        g_SubmittedStats.lodCounts[0], g_SubmittedStats.lodCounts[1], g_SubmittedStats.lodCounts[2],
+        g_SubmittedStats.contributionCulled,
+        g_SubmittedStats.stateCalls, g_SubmittedStats.stateCallsSkipped,
+        g_StateObjects.GetObjectCount(), g_StateObjects.GetHitCount(),
+        g_SubmittedStats.renderPasses, g_SubmittedStats.renderPassesCulled, g_SubmittedStats.renderTargets,
+        g_SubmittedStats.renderTargetTextures, g_SubmittedStats.renderTargetBytes / (1024.0 * 1024.0),
+        g_pNullDevice->GetErrorCount());
+    fputs(report, stdout);
+    return g_pNullDevice->GetErrorCount() > 0 ? 1 : 0;
 }
 
 // Resize
@@ -2161,8 +11550,10 @@ void OnResize(UINT newWidth, UINT newHeight)
     if (!g_pSwapChain || !g_pDevice || !g_pDeviceContext)
         return;
 
-    g_pDeviceContext->OMSetRenderTargets(0, nullptr, nullptr);
+    g_StateCache.OMSetRenderTargets(0, nullptr, nullptr);
 
+    // Every pooled target is the old size
+    g_RenderTargetPool.Release();
     SAFE_RELEASE(g_pBackBufferRTV);
     SAFE_RELEASE(g_pDepthStencilView);
     SAFE_RELEASE(g_pDepthStencilTexture);
@@ -2195,9 +11586,6 @@ void OnResize(UINT newWidth, UINT newHeight)
     hr = g_pDevice->CreateDepthStencilView(g_pDepthStencilTexture, nullptr, &g_pDepthStencilView);
     if (FAILED(hr)) return;
 
-    if (!CreatePostProcessResources(newWidth, newHeight))
-        return;
-
     g_ClientWidth = newWidth;
     g_ClientHeight = newHeight;
 }
@@ -2205,6 +11593,9 @@ void OnResize(UINT newWidth, UINT newHeight)
 // Cleanup
 void CleanupDirectX()
 {
+    g_FramePipeline.Shutdown();
+    g_JobSystem.Shutdown();
+
     if (g_pDeviceContext)
         g_pDeviceContext->ClearState();
 
@@ -2216,6 +11607,8 @@ void CleanupDirectX()
     SAFE_RELEASE(g_pCullNoneRS);
 
     SAFE_RELEASE(g_pSampler);
+    g_StateObjects.Release();
+    g_StateCache.Release();
 
     SAFE_RELEASE(g_pNormalTextureView);
     SAFE_RELEASE(g_pNormalTexture);
@@ -2226,20 +11619,24 @@ void CleanupDirectX()
     SAFE_RELEASE(g_pCubemapView);
     SAFE_RELEASE(g_pCubemapTexture);
 
-    SAFE_RELEASE(g_pSceneColorSRV);
-    SAFE_RELEASE(g_pSceneColorRTV);
-    SAFE_RELEASE(g_pSceneColorTex);
+    g_RenderTargetPool.Release();
 
     SAFE_RELEASE(g_pViewProjBuffer);
+    SAFE_RELEASE(g_pSkyViewProjBuffer);
     SAFE_RELEASE(g_pSceneBuffer);
     SAFE_RELEASE(g_pTransparentBuffer);
     SAFE_RELEASE(g_pPostProcessBuffer);
-    SAFE_RELEASE(g_pInstanceBuffer);
-    SAFE_RELEASE(g_pVisibleIdsBuffer);
+    SAFE_RELEASE(g_pInstanceRingSRV);
+    SAFE_RELEASE(g_pInstanceRingBuffer);
+    g_InstanceRingCapacity = 0;
+    ReleaseConstantRing();
+    g_FrameFences.Release();
+    SAFE_RELEASE(g_pDrawParamsBuffer);
 
     SAFE_RELEASE(g_pInputLayout);
     SAFE_RELEASE(g_pVertexShader);
-    SAFE_RELEASE(g_pPixelShader);
+    for (UINT lod = 0; lod < LOD_COUNT; ++lod)
+        SAFE_RELEASE(g_pLodPixelShaders[lod]);
 
     SAFE_RELEASE(g_pSkyboxInputLayout);
     SAFE_RELEASE(g_pSkyboxVS);
@@ -2247,6 +11644,12 @@ void CleanupDirectX()
 
     SAFE_RELEASE(g_pTransparentInputLayout);
     SAFE_RELEASE(g_pTransparentVS);
+    SAFE_RELEASE(g_pTransparentBspInputLayout);
+    SAFE_RELEASE(g_pTransparentBspVS);
+    SAFE_RELEASE(g_pTransparentBspVB);
+    SAFE_RELEASE(g_pTransparentBspIB);
+    g_TransparentBspVertexCapacity = 0;
+    g_TransparentBspIndexCapacity = 0;
     SAFE_RELEASE(g_pTransparentPS);
 
     SAFE_RELEASE(g_pPostVS);
@@ -2262,6 +11665,10 @@ void CleanupDirectX()
     SAFE_RELEASE(g_pDepthStencilTexture);
     SAFE_RELEASE(g_pSwapChain);
 
+    // Everything is released by now but the device's own context
+    if (g_pNullDevice && g_pNullDevice->GetLiveObjectCount() > 1)
+        g_pNullDevice->ReportLiveObjects();
+
 #ifdef _DEBUG
     if (g_pDevice)
     {
@@ -2276,4 +11683,5 @@ void CleanupDirectX()
 
     SAFE_RELEASE(g_pDeviceContext);
     SAFE_RELEASE(g_pDevice);
+    g_pNullDevice = nullptr;
 }